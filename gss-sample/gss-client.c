@@ -60,7 +60,9 @@
 #include <netdb.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <fcntl.h>
+#include <pthread.h>
 #endif
 
 #include <gssapi/gssapi_generic.h>
@@ -73,6 +75,25 @@ static int spnego = 0;
 static gss_OID_desc gss_spnego_mechanism_oid_desc =
         {6, (void *)"\x2b\x06\x01\x05\x05\x02"};
 
+/*
+ * Handshake phases timed with -stats, as seen from the initiator.
+ */
+enum {
+    PHASE_SP_REQUEST = 0,   /* first token until the SP request arrives */
+    PHASE_IDP,              /* later init_sec_context calls (IdP exchange) */
+    PHASE_ACCEPTOR,         /* waiting for the acceptor to verify */
+    PHASE_TOTAL,
+    PHASE_MAX
+};
+
+static const char *phase_names[PHASE_MAX] = {
+    "sp-request", "idp", "acceptor-verify", "total"
+};
+
+struct handshake_times {
+    double usec[PHASE_MAX];
+};
+
 static void
 usage()
 {
@@ -80,9 +101,7 @@ usage()
             "[-spnego] [-d]\n");
     fprintf(stderr, "       [-seq] [-noreplay] [-nomutual] [-user user] "
             "[-pass pw]");
-#ifdef _WIN32
-    fprintf(stderr, " [-threads num]");
-#endif
+    fprintf(stderr, " [-threads num] [-stats] [-idp url]");
     fprintf(stderr, "\n");
     fprintf(stderr, "       [-f] [-q] [-ccount count] [-mcount count]\n");
     fprintf(stderr, "       [-v1] [-na] [-nw] [-nx] [-nm] host service msg\n");
@@ -151,6 +170,7 @@ connect_to_server(char *host, u_short port)
  *      oid                 (r) OID of the mechanism to use
  *      context         (w) the established GSS-API context
  *      ret_flags       (w) the returned flags from init_sec_context
+ *      times           (w) per-phase timings, or NULL
  *
  * Returns: 0 on success, -1 on failure
  *
@@ -170,13 +190,15 @@ static int
 client_establish_context(int s, char *service_name, OM_uint32 gss_flags,
                          int auth_flag, int v1_format, gss_OID oid,
                          char *username, char *password,
-                         gss_ctx_id_t *gss_context, OM_uint32 *ret_flags)
+                         gss_ctx_id_t *gss_context, OM_uint32 *ret_flags,
+                         struct handshake_times *times)
 {
     if (auth_flag) {
         gss_buffer_desc send_tok, recv_tok, *token_ptr;
         gss_name_t target_name;
         OM_uint32 maj_stat, min_stat, init_sec_min_stat;
-        int token_flags;
+        int token_flags, pass = 0;
+        double start = 0, t = 0;
         gss_cred_id_t cred = GSS_C_NO_CREDENTIAL;
         gss_name_t gss_username = GSS_C_NO_NAME;
         gss_OID_set_desc mechs, *mechsp = GSS_C_NO_OID_SET;
@@ -292,7 +314,14 @@ client_establish_context(int s, char *service_name, OM_uint32 gss_flags,
         token_ptr = GSS_C_NO_BUFFER;
         *gss_context = GSS_C_NO_CONTEXT;
 
+        if (times != NULL) {
+            memset(times, 0, sizeof(*times));
+            start = now_usec();
+        }
+
         do {
+            if (times != NULL)
+                t = now_usec();
             maj_stat = gss_init_sec_context(&init_sec_min_stat,
                                             cred, gss_context,
                                             target_name, mechs.elements,
@@ -305,6 +334,9 @@ client_establish_context(int s, char *service_name, OM_uint32 gss_flags,
                                             token_ptr, NULL, /* mech type */
                                             &send_tok, ret_flags,
                                             NULL);  /* time_rec */
+            if (times != NULL)
+                times->usec[pass == 0 ? PHASE_SP_REQUEST : PHASE_IDP] +=
+                    now_usec() - t;
 
             if (token_ptr != GSS_C_NO_BUFFER)
                 free(recv_tok.value);
@@ -336,16 +368,25 @@ client_establish_context(int s, char *service_name, OM_uint32 gss_flags,
             if (maj_stat == GSS_S_CONTINUE_NEEDED) {
                 if (verbose)
                     printf("continue needed...");
+                if (times != NULL)
+                    t = now_usec();
                 if (recv_token(s, &token_flags, &recv_tok) < 0) {
                     (void) gss_release_name(&min_stat, &target_name);
                     return -1;
                 }
+                if (times != NULL)
+                    times->usec[pass == 0 ? PHASE_SP_REQUEST : PHASE_ACCEPTOR]
+                        += now_usec() - t;
                 token_ptr = &recv_tok;
             }
             if (verbose)
                 printf("\n");
+            pass++;
         } while (maj_stat == GSS_S_CONTINUE_NEEDED);
 
+        if (times != NULL)
+            times->usec[PHASE_TOTAL] = now_usec() - start;
+
         (void) gss_release_cred(&min_stat, &cred);
         (void) gss_release_name(&min_stat, &target_name);
     } else {
@@ -417,6 +458,7 @@ read_file(file_name, in_buf)
  *      msg             (r) the message to have "signed"
  *      use_file        (r) whether to treat msg as an input file name
  *      mcount          (r) the number of times to send the message
+ *      times           (w) per-phase handshake timings, or NULL
  *
  * Returns: 0 on success, -1 on failure
  *
@@ -431,7 +473,7 @@ read_file(file_name, in_buf)
 static int
 call_server(host, port, oid, service_name, gss_flags, auth_flag,
             wrap_flag, encrypt_flag, mic_flag, v1_format, msg, use_file,
-            mcount, username, password)
+            mcount, username, password, times)
     char   *host;
     u_short port;
     gss_OID oid;
@@ -444,6 +486,7 @@ call_server(host, port, oid, service_name, gss_flags, auth_flag,
     int     mcount;
     char    *username;
     char    *password;
+    struct handshake_times *times;
 {
     gss_ctx_id_t context = GSS_C_NO_CONTEXT;
     gss_buffer_desc in_buf, out_buf;
@@ -470,7 +513,7 @@ call_server(host, port, oid, service_name, gss_flags, auth_flag,
     /* Establish context */
     if (client_establish_context(s, service_name, gss_flags, auth_flag,
                                  v1_format, oid, username, password,
-                                 &context, &ret_flags) < 0) {
+                                 &context, &ret_flags, times) < 0) {
         (void) close(s);
         return -1;
     }
@@ -686,6 +729,7 @@ parse_oid(char *mechanism, gss_OID * oid)
 }
 
 static int max_threads = 1;
+static int stats_flag = 0;
 
 #ifdef _WIN32
 static  thread_count = 0;
@@ -757,13 +801,87 @@ static int auth_flag, wrap_flag, encrypt_flag, mic_flag, v1_format;
 static char *username = NULL;
 static char *password = NULL;
 
+/*
+ * Latency samples for -stats, one slot per connection and phase.
+ */
+static double *phase_samples[PHASE_MAX];
+static int sample_count = 0;
+static int failure_count = 0;
+#ifndef _WIN32
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int next_conn = 0;
+#endif
+
+static void
+record_times(struct handshake_times *times)
+{
+    int i;
+
+#ifdef _WIN32
+    WaitForSingleObject(hMutex, INFINITE);
+#else
+    pthread_mutex_lock(&stats_mutex);
+#endif
+    for (i = 0; i < PHASE_MAX; i++)
+        phase_samples[i][sample_count] = times->usec[i];
+    sample_count++;
+#ifdef _WIN32
+    ReleaseMutex(hMutex);
+#else
+    pthread_mutex_unlock(&stats_mutex);
+#endif
+}
+
+static void
+record_failure(void)
+{
+#ifdef _WIN32
+    WaitForSingleObject(hMutex, INFINITE);
+#else
+    pthread_mutex_lock(&stats_mutex);
+#endif
+    failure_count++;
+#ifdef _WIN32
+    ReleaseMutex(hMutex);
+#else
+    pthread_mutex_unlock(&stats_mutex);
+#endif
+}
+
+static void
+report_stats(double elapsed)
+{
+    int i;
+
+    if (sample_count == 0)
+        return;
+
+    printf("%d handshakes in %.3f s, %.1f handshakes/sec\n",
+           sample_count, elapsed / 1000000.0,
+           sample_count * 1000000.0 / elapsed);
+    printf("%-16s %10s %10s %10s (ms)\n", "phase", "p50", "p99", "p999");
+    for (i = 0; i < PHASE_MAX; i++) {
+        qsort(phase_samples[i], sample_count, sizeof(double),
+              compare_samples);
+        printf("%-16s %10.2f %10.2f %10.2f\n", phase_names[i],
+               percentile(phase_samples[i], sample_count, 0.50) / 1000.0,
+               percentile(phase_samples[i], sample_count, 0.99) / 1000.0,
+               percentile(phase_samples[i], sample_count, 0.999) / 1000.0);
+    }
+}
+
 static void
 worker_bee(void *unused)
 {
+    struct handshake_times times;
+
     if (call_server(server_host, port, oid, service_name,
                     gss_flags, auth_flag, wrap_flag, encrypt_flag, mic_flag,
-                    v1_format, msg, use_file, mcount, username, password) < 0)
-        exit(1);
+                    v1_format, msg, use_file, mcount, username, password,
+                    stats_flag ? &times : NULL) < 0)
+        record_failure();
+    else if (stats_flag)
+        record_times(&times);
 
 #ifdef _WIN32
     if (max_threads > 1)
@@ -771,12 +889,43 @@ worker_bee(void *unused)
 #endif
 }
 
+#ifndef _WIN32
+/*
+ * Load generator: each thread keeps one initiator busy until ccount
+ * connections have been started in total. Failed connections are
+ * counted and left out of the latency samples. With -idp
+ * file:///path/idp-response.xml and a mechanism built with
+ * --enable-idp-replay the IdP leg is replayed from a recorded answer,
+ * so the run measures the initiator and acceptor rather than the IdP.
+ */
+static void *
+worker_thread(void *unused)
+{
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&stats_mutex);
+        i = next_conn++;
+        pthread_mutex_unlock(&stats_mutex);
+        if (i >= ccount)
+            break;
+        worker_bee(0);
+    }
+
+    return NULL;
+}
+#endif
+
 int
 main(argc, argv)
     int     argc;
     char  **argv;
 {
     int     i;
+    double  start;
+#ifndef _WIN32
+    pthread_t *threads;
+#endif
 
     display_file = stdout;
     auth_flag = wrap_flag = encrypt_flag = mic_flag = 1;
@@ -816,13 +965,23 @@ main(argc, argv)
             spnego = 1;
         } else if (strcmp(*argv, "-krb5") == 0) {
             mechanism = "{ 1 3 5 1 5 2 }";
-#ifdef _WIN32
         } else if (strcmp(*argv, "-threads") == 0) {
             argc--;
             argv++;
             if (!argc)
                 usage();
             max_threads = atoi(*argv);
+        } else if (strcmp(*argv, "-stats") == 0) {
+            stats_flag = 1;
+        } else if (strcmp(*argv, "-idp") == 0) {
+            argc--;
+            argv++;
+            if (!argc)
+                usage();
+#ifdef _WIN32
+            _putenv_s("SAML_EC_IDP", *argv);
+#else
+            setenv("SAML_EC_IDP", *argv, 1);
 #endif
         } else if (strcmp(*argv, "-d") == 0) {
             gss_flags |= GSS_C_DELEG_FLAG;
@@ -870,13 +1029,24 @@ main(argc, argv)
     if (argc != 3)
         usage();
 
-#ifdef _WIN32
     if (max_threads < 1) {
         fprintf(stderr, "warning: there must be at least one thread\n");
         max_threads = 1;
     }
+#ifdef _WIN32
+    InitHandles();
 #endif
 
+    if (stats_flag) {
+        for (i = 0; i < PHASE_MAX; i++) {
+            phase_samples[i] = calloc(ccount, sizeof(double));
+            if (phase_samples[i] == NULL) {
+                fprintf(stderr, "Couldn't allocate latency samples\n");
+                exit(1);
+            }
+        }
+    }
+
     server_host = *argv++;
     service_name = *argv++;
     msg = *argv++;
@@ -884,6 +1054,8 @@ main(argc, argv)
     if (mechanism)
         parse_oid(mechanism, &oid);
 
+    start = now_usec();
+
     if (max_threads == 1) {
         for (i = 0; i < ccount; i++) {
             worker_bee(0);
@@ -901,11 +1073,33 @@ main(argc, argv)
             }
         }
 #else
-        /* boom */
-        assert(max_threads == 1);
+        threads = calloc(max_threads, sizeof(pthread_t));
+        if (threads == NULL) {
+            fprintf(stderr, "Couldn't allocate worker threads\n");
+            exit(1);
+        }
+        for (i = 0; i < max_threads; i++) {
+            if (pthread_create(&threads[i], NULL, worker_thread, NULL) != 0) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        for (i = 0; i < max_threads; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
 #endif
     }
 
+    if (stats_flag) {
+        report_stats(now_usec() - start);
+        for (i = 0; i < PHASE_MAX; i++)
+            free(phase_samples[i]);
+    }
+
+    if (failure_count != 0)
+        fprintf(stderr, "%d of %d connections failed\n",
+                failure_count, ccount);
+
     if (oid != GSS_C_NULL_OID)
         (void) gss_release_oid(&min_stat, &oid);
 
@@ -913,5 +1107,5 @@ main(argc, argv)
     CleanupHandles();
 #endif
 
-    return 0;
+    return failure_count != 0;
 }
@@ -69,9 +69,8 @@ static char *rcsid = "$Header$";
 /* need struct timeval */
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
-#else
-#include <time.h>
 #endif
+#include <time.h>
 
 #include <gssapi/gssapi_generic.h>
 #include "gss-misc.h"
@@ -410,6 +409,61 @@ print_token(tok)
     fflush(display_file);
 }
 
+/*
+ * Function: now_usec
+ *
+ * Purpose: Returns a monotonic time in microseconds, for timing
+ * phases of a connection; only differences are meaningful
+ */
+double
+now_usec(void)
+{
+#ifdef _WIN32
+    return (double)GetTickCount() * 1000.0;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000000.0 + ts.tv_nsec / 1000.0;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec * 1000000.0 + tv.tv_usec;
+#endif
+}
+
+/*
+ * Function: compare_samples
+ *
+ * Purpose: qsort() comparator for an array of double samples
+ */
+int
+compare_samples(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x < y) ? -1 : (x > y);
+}
+
+/*
+ * Function: percentile
+ *
+ * Purpose: Returns the p-th percentile (0 < p <= 1) of n samples,
+ * which must already be sorted with compare_samples()
+ */
+double
+percentile(double *samples, int n, double p)
+{
+    int i = (int)(p * n + 0.999999) - 1;
+
+    if (i < 0)
+        i = 0;
+    if (i >= n)
+        i = n - 1;
+    return samples[i];
+}
+
 #ifdef _WIN32
 #include <sys\timeb.h>
 #include <time.h>
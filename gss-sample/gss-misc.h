@@ -39,6 +39,11 @@ void display_status(char *msg, OM_uint32 maj_stat, OM_uint32 min_stat);
 void display_ctx_flags(OM_uint32 flags);
 void print_token(gss_buffer_t tok);
 
+/* Latency statistics for -stats */
+double now_usec(void);
+int compare_samples(const void *a, const void *b);
+double percentile(double *samples, int n, double p);
+
 /* Token types */
 #define TOKEN_NOOP              (1<<0)
 #define TOKEN_CONTEXT           (1<<1)
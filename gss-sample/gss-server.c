@@ -50,11 +50,24 @@
 #include <winsock.h>
 #else
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
 #endif
+
+#include "config.h"
+
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#elif !defined(_WIN32)
+#include <poll.h>
+#endif
 #include <stdlib.h>
 #include <ctype.h>
 
@@ -73,17 +86,35 @@
 static OM_uint32
 enumerateAttributes(OM_uint32 *minor, gss_name_t name, int noisy);
 
+/*
+ * Per-connection timings collected with -stats.
+ */
+enum {
+    PHASE_HANDSHAKE = 0,    /* server_establish_context() */
+    PHASE_MESSAGES,         /* wrap/MIC exchange after the handshake */
+    PHASE_MAX
+};
+
+static const char *phase_names[PHASE_MAX] = {
+    "handshake", "messages"
+};
+
+struct server_times {
+    double usec[PHASE_MAX];
+};
+
 static void
 usage()
 {
     fprintf(stderr, "Usage: gss-server [-port port] [-verbose] [-once]");
-#ifdef _WIN32
     fprintf(stderr, " [-threads num]");
+#ifndef _WIN32
+    fprintf(stderr, " [-thread-creds]");
 #endif
     fprintf(stderr, "\n");
     fprintf(stderr,
             "       [-inetd] [-export] [-logfile file] [-keytab keytab]\n"
-            "       service_name\n");
+            "       [-stats] [-ccount count] service_name\n");
     exit(1);
 }
 
@@ -413,6 +444,7 @@ test_import_export_context(gss_ctx_id_t *context)
  *      service_name    (r) the ASCII name of the GSS-API service to
  *                      establish a context as
  *      export          (r) whether to test context exporting
+ *      times           (w) handshake and message timings, or NULL
  *
  * Returns: -1 on error
  *
@@ -428,7 +460,8 @@ test_import_export_context(gss_ctx_id_t *context)
  * If any error occurs, -1 is returned.
  */
 static int
-sign_server(int s, gss_cred_id_t server_creds, int export)
+sign_server(int s, gss_cred_id_t server_creds, int export,
+            struct server_times *times)
 {
     gss_buffer_desc client_name, xmit_buf, msg_buf;
     gss_ctx_id_t context;
@@ -437,12 +470,21 @@ sign_server(int s, gss_cred_id_t server_creds, int export)
     OM_uint32 ret_flags;
     char   *cp;
     int     token_flags;
+    double  t = 0;
+
+    if (times != NULL)
+        t = now_usec();
 
     /* Establish a context with the client */
     if (server_establish_context(s, server_creds, &context,
                                  &client_name, &ret_flags) < 0)
         return (-1);
 
+    if (times != NULL) {
+        times->usec[PHASE_HANDSHAKE] = now_usec() - t;
+        t = now_usec();
+    }
+
     if (context == GSS_C_NO_CONTEXT) {
         printf("Accepted unauthenticated connection.\n");
     } else {
@@ -569,10 +611,14 @@ sign_server(int s, gss_cred_id_t server_creds, int export)
     if (logfile)
         fflush(logfile);
 
+    if (times != NULL)
+        times->usec[PHASE_MESSAGES] = now_usec() - t;
+
     return (0);
 }
 
 static int max_threads = 1;
+static int stats_flag = 0;
 
 #ifdef _WIN32
 static  thread_count = 0;
@@ -632,6 +678,78 @@ DecrementAndSignalThreadCounter(void)
 }
 #endif
 
+/*
+ * Latency samples for -stats, appended as connections complete.
+ */
+static double *phase_samples[PHASE_MAX];
+static int sample_count = 0;
+static int sample_alloc = 0;
+static int failure_count = 0;
+#ifndef _WIN32
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void
+record_times(struct server_times *times)
+{
+    double *p;
+    int i, n;
+
+#ifdef _WIN32
+    WaitForSingleObject(hMutex, INFINITE);
+#else
+    pthread_mutex_lock(&stats_mutex);
+#endif
+    if (times == NULL) {
+        failure_count++;
+    } else {
+        if (sample_count == sample_alloc) {
+            n = sample_alloc ? 2 * sample_alloc : 1024;
+            for (i = 0; i < PHASE_MAX; i++) {
+                p = realloc(phase_samples[i], n * sizeof(double));
+                if (p == NULL) {
+                    fprintf(stderr, "Couldn't allocate latency samples\n");
+                    exit(1);
+                }
+                phase_samples[i] = p;
+            }
+            sample_alloc = n;
+        }
+        for (i = 0; i < PHASE_MAX; i++)
+            phase_samples[i][sample_count] = times->usec[i];
+        sample_count++;
+    }
+#ifdef _WIN32
+    ReleaseMutex(hMutex);
+#else
+    pthread_mutex_unlock(&stats_mutex);
+#endif
+}
+
+static void
+report_stats(double elapsed)
+{
+    int i;
+
+    fprintf(stderr, "%d connections (%d failed) in %.3f s, "
+            "%.1f handshakes/sec\n",
+            sample_count + failure_count, failure_count,
+            elapsed / 1000000.0, sample_count * 1000000.0 / elapsed);
+    if (sample_count == 0)
+        return;
+
+    fprintf(stderr, "%-16s %10s %10s %10s (ms)\n",
+            "phase", "p50", "p99", "p999");
+    for (i = 0; i < PHASE_MAX; i++) {
+        qsort(phase_samples[i], sample_count, sizeof(double),
+              compare_samples);
+        fprintf(stderr, "%-16s %10.2f %10.2f %10.2f\n", phase_names[i],
+                percentile(phase_samples[i], sample_count, 0.50) / 1000.0,
+                percentile(phase_samples[i], sample_count, 0.99) / 1000.0,
+                percentile(phase_samples[i], sample_count, 0.999) / 1000.0);
+    }
+}
+
 struct _work_plan
 {
     int     s;
@@ -643,11 +761,16 @@ static void
 worker_bee(void *param)
 {
     struct _work_plan *work = (struct _work_plan *) param;
+    struct server_times times;
+    int ret;
 
-    /* this return value is not checked, because there's
-     * not really anything to do if it fails
+    /* this return value is only used for -stats, because there's
+     * not really anything else to do if it fails
      */
-    sign_server(work->s, work->server_creds, work->export);
+    ret = sign_server(work->s, work->server_creds, work->export,
+                      stats_flag ? &times : NULL);
+    if (stats_flag)
+        record_times(ret == 0 ? &times : NULL);
 #ifdef _WIN32
     closesocket(work->s);
 #else
@@ -661,6 +784,279 @@ worker_bee(void *param)
 #endif
 }
 
+#ifndef _WIN32
+/*
+ * Worker pool: the main thread accepts connections and queues them,
+ * a fixed set of threads runs sign_server() on each.  By default all
+ * workers share one acceptor credential; -thread-creds gives each
+ * worker its own, to separate credential contention from the rest.
+ */
+#define WORK_QUEUE_SIZE     1024
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t  nonempty;
+    pthread_cond_t  nonfull;
+    int             fds[WORK_QUEUE_SIZE];
+    unsigned int    head;
+    unsigned int    tail;
+    int             done;
+} work_queue = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER
+};
+
+struct _pool_worker
+{
+    pthread_t thread;
+    gss_cred_id_t server_creds;
+    int     export;
+};
+
+static volatile sig_atomic_t stop_serving = 0;
+
+static void
+stop_handler(int sig)
+{
+    stop_serving = 1;
+}
+
+static void
+queue_push(int s)
+{
+    pthread_mutex_lock(&work_queue.mutex);
+    while (work_queue.tail - work_queue.head == WORK_QUEUE_SIZE)
+        pthread_cond_wait(&work_queue.nonfull, &work_queue.mutex);
+    work_queue.fds[work_queue.tail++ % WORK_QUEUE_SIZE] = s;
+    pthread_cond_signal(&work_queue.nonempty);
+    pthread_mutex_unlock(&work_queue.mutex);
+}
+
+/* Returns -1 once the queue has been closed and drained */
+static int
+queue_pop(void)
+{
+    int s = -1;
+
+    pthread_mutex_lock(&work_queue.mutex);
+    while (work_queue.head == work_queue.tail && !work_queue.done)
+        pthread_cond_wait(&work_queue.nonempty, &work_queue.mutex);
+    if (work_queue.head != work_queue.tail) {
+        s = work_queue.fds[work_queue.head++ % WORK_QUEUE_SIZE];
+        pthread_cond_signal(&work_queue.nonfull);
+    }
+    pthread_mutex_unlock(&work_queue.mutex);
+
+    return s;
+}
+
+static void
+queue_close(void)
+{
+    pthread_mutex_lock(&work_queue.mutex);
+    work_queue.done = 1;
+    pthread_cond_broadcast(&work_queue.nonempty);
+    pthread_mutex_unlock(&work_queue.mutex);
+}
+
+static void *
+pool_worker(void *param)
+{
+    struct _pool_worker *worker = (struct _pool_worker *) param;
+    struct _work_plan *work;
+    int s;
+
+    while ((s = queue_pop()) >= 0) {
+        work = malloc(sizeof(struct _work_plan));
+        if (work == NULL) {
+            fprintf(stderr, "fatal error: out of memory");
+            close(s);
+            continue;
+        }
+        work->s = s;
+        work->server_creds = worker->server_creds;
+        work->export = worker->export;
+        worker_bee((void *) work);
+    }
+
+    return NULL;
+}
+
+/*
+ * Function: accept_batch
+ *
+ * Purpose: accepts the connections pending on a non-blocking
+ * listening socket and queues them for the pool
+ *
+ * Arguments:
+ *
+ *      stmp            (r) the listening socket
+ *      accepted        (r) connections accepted so far
+ *      ccount          (r) stop after this many connections, or 0
+ *
+ * Returns: connections accepted so far, including these
+ */
+static int
+accept_batch(int stmp, int accepted, int ccount)
+{
+    int     s;
+
+    while (!stop_serving) {
+        if ((s = accept(stmp, NULL, 0)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                errno != EINTR && errno != ECONNABORTED)
+                perror("accepting connection");
+            break;
+        }
+        /* sign_server() expects blocking I/O */
+        fcntl(s, F_SETFL, fcntl(s, F_GETFL) & ~O_NONBLOCK);
+        queue_push(s);
+        if (ccount != 0 && ++accepted >= ccount)
+            stop_serving = 1;
+    }
+
+    return accepted;
+}
+
+/*
+ * Function: serve_pool
+ *
+ * Purpose: accepts connections on a listening socket and hands them
+ * to a pool of max_threads workers
+ *
+ * Arguments:
+ *
+ *      stmp            (r) the listening socket
+ *      service_name    (r) the service name, for -thread-creds
+ *      server_creds    (r) the shared acceptor credential
+ *      thread_creds    (r) whether each worker acquires its own credential
+ *      export          (r) whether to test context exporting
+ *      ccount          (r) stop after this many connections, or 0
+ *
+ * Returns: 0 on success, -1 on failure
+ *
+ * Effects:
+ *
+ * The listening socket is made non-blocking, and connections are
+ * accepted in batches as it becomes readable, waiting with epoll where
+ * available and poll otherwise.  Serving stops after ccount
+ * connections or on SIGINT/SIGTERM, once the workers have drained the
+ * queue.
+ */
+static int
+serve_pool(int stmp, char *service_name, gss_cred_id_t server_creds,
+           int thread_creds, int export, int ccount)
+{
+    struct _pool_worker *workers;
+    struct sigaction sa;
+    OM_uint32 min_stat;
+    int     accepted = 0, started = 0, ret = 0;
+    int     i;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+    int     ep;
+#else
+    struct pollfd pfd;
+#endif
+
+    workers = calloc(max_threads, sizeof(struct _pool_worker));
+    if (workers == NULL) {
+        fprintf(stderr, "Couldn't allocate worker threads\n");
+        return -1;
+    }
+
+    for (i = 0; i < max_threads; i++) {
+        workers[i].export = export;
+        workers[i].server_creds = server_creds;
+        if (thread_creds &&
+            server_acquire_creds(service_name, &workers[i].server_creds) < 0) {
+            workers[i].server_creds = GSS_C_NO_CREDENTIAL;
+            ret = -1;
+            goto cleanup;
+        }
+        if (pthread_create(&workers[i].thread, NULL, pool_worker,
+                           &workers[i]) != 0) {
+            perror("pthread_create");
+            ret = -1;
+            goto cleanup;
+        }
+        started++;
+    }
+
+    /* no SA_RESTART, so a blocked epoll_wait or poll returns EINTR */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+#ifdef HAVE_SYS_EPOLL_H
+    ep = epoll_create(1);
+    if (ep < 0) {
+        perror("epoll_create");
+        ret = -1;
+        goto cleanup;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = stmp;
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, stmp, &ev) < 0 ||
+        fcntl(stmp, F_SETFL, fcntl(stmp, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("registering listening socket");
+        close(ep);
+        ret = -1;
+        goto cleanup;
+    }
+
+    while (!stop_serving) {
+        if (epoll_wait(ep, &ev, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        accepted = accept_batch(stmp, accepted, ccount);
+    }
+
+    close(ep);
+#else
+    if (fcntl(stmp, F_SETFL, fcntl(stmp, F_GETFL) | O_NONBLOCK) < 0) {
+        perror("registering listening socket");
+        ret = -1;
+        goto cleanup;
+    }
+
+    pfd.fd = stmp;
+    pfd.events = POLLIN;
+
+    while (!stop_serving) {
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        accepted = accept_batch(stmp, accepted, ccount);
+    }
+#endif
+
+cleanup:
+    queue_close();
+    for (i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+    if (thread_creds) {
+        for (i = 0; i < max_threads; i++)
+            (void) gss_release_cred(&min_stat, &workers[i].server_creds);
+    }
+    free(workers);
+
+    return ret;
+}
+#endif /* !_WIN32 */
+
 int
 main(int argc, char **argv)
 {
@@ -671,6 +1067,10 @@ main(int argc, char **argv)
     int     once = 0;
     int     do_inetd = 0;
     int     export = 0;
+    int     thread_creds = 0;
+    int     ccount = 0;
+    int     i;
+    double  start;
 
     logfile = stdout;
     display_file = stdout;
@@ -683,17 +1083,27 @@ main(int argc, char **argv)
             if (!argc)
                 usage();
             port = atoi(*argv);
-        }
-#ifdef _WIN32
-        else if (strcmp(*argv, "-threads") == 0) {
+        } else if (strcmp(*argv, "-threads") == 0) {
             argc--;
             argv++;
             if (!argc)
                 usage();
             max_threads = atoi(*argv);
         }
+#ifndef _WIN32
+        else if (strcmp(*argv, "-thread-creds") == 0) {
+            thread_creds = 1;
+        }
 #endif
-        else if (strcmp(*argv, "-verbose") == 0) {
+        else if (strcmp(*argv, "-stats") == 0) {
+            stats_flag = 1;
+        } else if (strcmp(*argv, "-ccount") == 0) {
+            argc--;
+            argv++;
+            if (!argc)
+                usage();
+            ccount = atoi(*argv);
+        } else if (strcmp(*argv, "-verbose") == 0) {
             verbose = 1;
         } else if (strcmp(*argv, "-once") == 0) {
             once = 1;
@@ -740,7 +1150,6 @@ main(int argc, char **argv)
     if ((*argv)[0] == '-')
         usage();
 
-#ifdef _WIN32
     if (max_threads < 1) {
         fprintf(stderr, "warning: there must be at least one thread\n");
         max_threads = 1;
@@ -750,6 +1159,10 @@ main(int argc, char **argv)
         fprintf(stderr,
                 "warning: one thread may be used in conjunction with inetd\n");
 
+    if (once)
+        ccount = 1;
+
+#ifdef _WIN32
     InitHandles();
 #endif
 
@@ -758,20 +1171,28 @@ main(int argc, char **argv)
     if (server_acquire_creds(service_name, &server_creds) < 0)
         return -1;
 
+    start = now_usec();
+
     if (do_inetd) {
         close(1);
         close(2);
 
-        sign_server(0, server_creds, export);
+        sign_server(0, server_creds, export, NULL);
         close(0);
     } else {
         int     stmp;
 
         if ((stmp = create_socket(port)) >= 0) {
-            if (listen(stmp, max_threads == 1 ? 0 : max_threads) < 0)
+            if (listen(stmp, max_threads == 1 ? 0 : SOMAXCONN) < 0)
                 perror("listening on socket");
             fprintf(stderr, "starting...\n");
 
+#ifndef _WIN32
+            if (max_threads > 1) {
+                serve_pool(stmp, service_name, server_creds, thread_creds,
+                           export, ccount);
+            } else
+#endif
             do {
                 struct _work_plan *work = malloc(sizeof(struct _work_plan));
 
@@ -783,6 +1204,7 @@ main(int argc, char **argv)
                 /* Accept a TCP connection */
                 if ((work->s = accept(stmp, NULL, 0)) < 0) {
                     perror("accepting connection");
+                    free(work);
                     continue;
                 }
 
@@ -810,7 +1232,7 @@ main(int argc, char **argv)
                     }
                 }
 #endif
-            } while (!once);
+            } while (ccount == 0 || --ccount > 0);
 
 #ifdef _WIN32
             closesocket(stmp);
@@ -820,6 +1242,12 @@ main(int argc, char **argv)
         }
     }
 
+    if (stats_flag) {
+        report_stats(now_usec() - start);
+        for (i = 0; i < PHASE_MAX; i++)
+            free(phase_samples[i]);
+    }
+
     (void) gss_release_cred(&min_stat, &server_creds);
 
 #ifdef _WIN32
@@ -19,6 +19,7 @@
 #include <saml/saml2/metadata/Metadata.h>
 #include <saml/saml2/metadata/MetadataCredentialCriteria.h>
 #include <saml/saml2/metadata/MetadataProvider.h>
+#include <saml/saml2/metadata/ObservableMetadataProvider.h>
 #include <saml/signature/ContentReference.h>
 #include <saml/util/SAMLConstants.h>
 #include <xercesc/dom/DOM.hpp>
@@ -29,6 +30,7 @@
 #include <xmltooling/impl/AnyElement.h>
 #include <xmltooling/security/Credential.h>
 #include <xmltooling/security/CredentialResolver.h>
+#include <xmltooling/security/SecurityHelper.h>
 #include <xmltooling/security/SignatureTrustEngine.h>
 #include <xmltooling/signature/Signature.h>
 #include <xmltooling/util/ParserPool.h>
@@ -36,11 +38,22 @@
 #include <xmltooling/util/XMLConstants.h>
 #include <xmltooling/util/DateTime.h>
 #include <xmltooling/validation/ValidatorSuite.h>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
+#include <mutex>
 #include <sstream>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "util_log.h"
+#include "util_metrics.h"
+#include "util_strmap.h"
+#include "util_verifier.h"
 
 using namespace opensaml::saml2;
 using namespace opensaml::saml2p;
@@ -56,7 +69,256 @@ using namespace xmltooling::logging;
 using namespace xmltooling;
 using namespace std;
 
-static ResolutionContext* ctx = nullptr;
+// The attributes released by one verifySAMLResponse(), which the
+// acceptor keeps with the initiator name: the validated assertions,
+// with their NameID (pointing into them) and the issuer's entityID,
+// until getSAMLAttribute() or getSAMLAttributes() first needs them
+// resolved into ctx. Acceptors that never look at attributes skip the
+// resolver. The caller serializes access.
+struct gss_eap_saml_attrs {
+    vector<saml2::Assertion*> pendingAssertions;
+    const saml2::NameID* pendingNameID;
+    xstring pendingIssuer;
+
+    ResolutionContext* ctx;
+
+    // ctx's attribute aliases, mapped to the value getSAMLAttribute()
+    // returns for them; keys point into ctx.
+    gss_eap_string_map<string> attrIndex;
+
+    // What was released: see fingerprintAssertions(). Empty if the
+    // digest could not be had.
+    string fingerprint;
+
+    gss_eap_saml_attrs() : pendingNameID(nullptr), ctx(nullptr) {}
+
+    ~gss_eap_saml_attrs() {
+        attrIndex.clear();
+        delete ctx;
+        clearPendingAssertions();
+    }
+
+    void clearPendingAssertions() {
+        for_each(pendingAssertions.begin(), pendingAssertions.end(),
+                 xmltooling::cleanup<saml2::Assertion>());
+        pendingAssertions.clear();
+        pendingNameID = nullptr;
+        pendingIssuer.clear();
+    }
+};
+
+// A timed step for the metrics sink, recorded when end() is called or
+// the scope is left, so that a step cut short by an exception is still
+// reported.
+class MetricsSpan {
+public:
+    explicit MetricsSpan(enum gss_eap_metric metric)
+        : m_metric(metric), m_start(gssEapMetricsStart()) {}
+    ~MetricsSpan() { end(); }
+
+    void end() {
+        if (m_start != 0)
+            gssEapMetricsSpan(m_metric, m_start);
+        m_start = 0;
+    }
+
+private:
+    MetricsSpan(const MetricsSpan&);
+    MetricsSpan& operator=(const MetricsSpan&);
+
+    enum gss_eap_metric m_metric;
+    uint64_t m_start;
+};
+
+// Join each alias's values once, when the attributes are resolved,
+// rather than on every lookup.
+static void indexSAMLAttributes(gss_eap_saml_attrs* attrs)
+{
+    attrs->attrIndex.clear();
+
+    if (attrs->ctx == nullptr)
+        return;
+
+    for (vector<shibsp::Attribute*>::const_iterator a = attrs->ctx->getResolvedAttributes().begin();
+         a != attrs->ctx->getResolvedAttributes().end();
+         ++a) {
+        const vector<string>& values = (*a)->getSerializedValues();
+
+        for (vector<string>::const_iterator s = (*a)->getAliases().begin();
+             s != (*a)->getAliases().end();
+             ++s) {
+            string& localValue = attrs->attrIndex[gss_eap_string_key(s->data(), s->length())];
+
+            for (vector<string>::const_iterator v = values.begin(); v != values.end(); ++v) {
+                if (v != values.begin())
+                    localValue += ";";
+                localValue += *v;
+            }
+        }
+    }
+}
+
+// The initiator name for a NameID: its value, Format, NameQualifier,
+// SPNameQualifier and SPProvidedID joined by '!', written into a single
+// malloc()ed buffer that the acceptor keeps as the name's username.
+// ASCII parts, which is nearly all of them, are narrowed in place;
+// anything else goes through the local code page transcoder.
+static char* makeInitiatorName(const saml2::NameID* nameID)
+{
+    const XMLCh* parts[] = {
+        nameID->getName(),
+        nameID->getFormat() ? nameID->getFormat() : NameIDType::UNSPECIFIED,
+        nameID->getNameQualifier(),
+        nameID->getSPNameQualifier(),
+        nameID->getSPProvidedID(),
+    };
+    const size_t nparts = sizeof(parts) / sizeof(parts[0]);
+    char* transcoded[nparts] = { nullptr };
+    size_t lengths[nparts];
+    size_t length = nparts - 1;
+    char* name;
+
+    for (size_t i = 0; i < nparts; i++) {
+        const XMLCh* s = parts[i];
+
+        for (; s != nullptr && *s != 0 && *s < 0x80; s++)
+            ;
+        if (s != nullptr && *s != 0) {
+            transcoded[i] = XMLString::transcode(parts[i]);
+            lengths[i] = strlen(transcoded[i]);
+        } else {
+            lengths[i] = s - parts[i];
+        }
+        length += lengths[i];
+    }
+
+    name = (char*)malloc(length + 1);
+    if (name != nullptr) {
+        char* p = name;
+
+        for (size_t i = 0; i < nparts; i++) {
+            if (i != 0)
+                *p++ = '!';
+            if (transcoded[i] != nullptr)
+                memcpy(p, transcoded[i], lengths[i]);
+            else
+                for (size_t j = 0; j < lengths[i]; j++)
+                    p[j] = (char)parts[i][j];
+            p += lengths[i];
+        }
+        *p = '\0';
+    }
+
+    for (size_t i = 0; i < nparts; i++)
+        XMLString::release(&transcoded[i]);
+
+    return name;
+}
+
+// Append a field to a fingerprint's input, preceded by its length so
+// that different sequences of fields never encode alike.
+static void fingerprintField(string& in, const void* p, size_t length)
+{
+    uint32_t n = (uint32_t)length;
+
+    in.append((const char*)&n, sizeof(n));
+    in.append((const char*)p, length);
+}
+
+static void fingerprintString(string& in, const XMLCh* s)
+{
+    if (s == nullptr) {
+        uint32_t n = 0xFFFFFFFF;
+        in.append((const char*)&n, sizeof(n));
+    } else
+        fingerprintField(in, s, XMLString::stringLen(s) * sizeof(XMLCh));
+}
+
+// For what has no simple text form: complex attribute values, and
+// encrypted attributes, which are not decrypted just for this.
+static void fingerprintXML(string& in, XMLObject* o)
+{
+    string xml;
+    const DOMElement* dom = o->getDOM();
+
+    XMLHelper::serialize(dom != nullptr ? dom : o->marshall(), xml);
+    fingerprintField(in, xml.data(), xml.length());
+}
+
+// SHA-256 over the SP generation, the issuer and the name, format and
+// values of each attribute in the assertions' attribute statements: it
+// changes whenever the IdP releases different attributes, without
+// running the resolver to find out, and whenever the SP configuration
+// is reloaded. A collision would let one principal's new attributes
+// reuse the authorization its old ones got, so the digest has to be
+// collision resistant, and is kept whole. Empty if SHA-256 is not
+// available.
+static string fingerprintAssertions(unsigned long generation,
+                                    const XMLCh* issuer,
+                                    const vector<saml2::Assertion*>& assertions)
+{
+    string in;
+
+    fingerprintField(in, &generation, sizeof(generation));
+    fingerprintString(in, issuer);
+
+    for (size_t i = 0; i < assertions.size(); ++i) {
+        const vector<saml2::AttributeStatement*>& statements =
+            assertions[i]->getAttributeStatements();
+
+        for (size_t j = 0; j < statements.size(); ++j) {
+            const vector<saml2::Attribute*>& attributes = statements[j]->getAttributes();
+
+            for (size_t k = 0; k < attributes.size(); ++k) {
+                const vector<XMLObject*>& values = attributes[k]->getAttributeValues();
+                uint32_t count = (uint32_t)values.size();
+
+                fingerprintString(in, attributes[k]->getName());
+                fingerprintString(in, attributes[k]->getNameFormat());
+                in.append((const char*)&count, sizeof(count));
+                for (size_t v = 0; v < values.size(); ++v) {
+                    if (values[v]->hasChildren())
+                        fingerprintXML(in, values[v]);
+                    else
+                        fingerprintString(in, values[v]->getTextContent());
+                }
+            }
+
+            const vector<saml2::EncryptedAttribute*>& encrypted =
+                statements[j]->getEncryptedAttributes();
+            for (size_t k = 0; k < encrypted.size(); ++k)
+                fingerprintXML(in, encrypted[k]);
+        }
+    }
+
+    try {
+        return SecurityHelper::doHash("SHA256", in.data(), in.length(), false);
+    } catch (exception& ex) {
+        GSSEAP_LOG(GSSEAP_LOG_WARNING, "Unable to fingerprint attributes: %s", ex.what());
+        return string();
+    }
+}
+
+// Seconds since the epoch of a UTC DateTime (which parsing normalizes
+// to). DateTime::getEpoch() goes through timegm() or mktime(), which
+// take the libc timezone lock; this is plain arithmetic instead, per
+// the days-from-civil algorithm, so concurrent accepts never contend.
+static time_t utcEpoch(const xmltooling::DateTime* dt)
+{
+    long long y = dt->getYear();
+    unsigned m = dt->getMonth();
+    unsigned d = dt->getDay();
+
+    y -= m <= 2;
+    long long era = (y >= 0 ? y : y - 399) / 400;
+    unsigned yoe = (unsigned)(y - era * 400);
+    unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long long days = era * 146097 + (long long)doe - 719468;
+
+    return (time_t)(days * 86400 + dt->getHour() * 3600 +
+                    dt->getMinute() * 60 + dt->getSecond());
+}
 
 // Taken from http://stackoverflow.com/questions/504810/
 static string getfqdn()
@@ -123,6 +385,200 @@ SPConfig& getConf(void) {
     return conf;
 }
 
+// The SP runtime is initialised, and shibboleth2.xml with its metadata,
+// credentials and trust engine loaded, once per process. It used to be
+// init()ed, instantiate()d and term()ed around every request, which
+// re-parsed all of it on each handshake leg. Configuration changes are
+// still picked up by the SP's own reloading.
+//
+// Prefork servers call preforkSAMLServiceProvider() in the parent, so
+// children inherit the loaded SP copy-on-write. The SP's reload threads
+// do not survive fork(), so a child never reloads, nor can it tear down
+// (which joins those threads) the SP it inherited. It keeps serving
+// that SP and its generation until the server replaces it. The parent
+// bumps a generation counter in a shared page whenever its metadata is
+// reloaded, so staleSAMLServiceProvider() can tell a child it is behind
+// and the server when to recycle it; children forked afterwards inherit
+// the new SP. Outside prefork, metadata reloads bump the process's own
+// generation. Either way getSAMLGeneration() names the generation the
+// process actually serves, telling callers that cache what the SP
+// decided, such as the authorization cache, when to forget it.
+struct sp_shared_state {
+    volatile unsigned long generation;
+};
+
+static mutex spMutex;
+static pthread_rwlock_t spSwapLock = PTHREAD_RWLOCK_INITIALIZER;
+static ServiceProvider* spInstance = nullptr;
+static sp_shared_state* spShared = nullptr;
+static unsigned long spGeneration;
+static pid_t spOwner;
+
+// A prefork parent publishes to its children; any other process just
+// moves on to the next generation itself.
+static void publishGeneration(void)
+{
+    if (spShared == nullptr)
+        __sync_add_and_fetch(&spGeneration, 1);
+    else if (spOwner == getpid())
+        spGeneration = __sync_add_and_fetch(&spShared->generation, 1);
+}
+
+class GenerationObserver : public ObservableMetadataProvider::Observer
+{
+public:
+    void onEvent(const ObservableMetadataProvider&) const {
+        publishGeneration();
+    }
+};
+
+static GenerationObserver spObserver;
+
+// Publish a generation whenever sp's metadata is reloaded
+static void observeServiceProvider(ServiceProvider* sp)
+{
+    Locker locker(sp);
+    const Application* app = sp->getApplication("default");
+    ObservableMetadataProvider* m = app ?
+        dynamic_cast<ObservableMetadataProvider*>(app->getMetadataProvider(false)) : nullptr;
+
+    if (m)
+        m->addObserver(&spObserver);
+    else
+        GSSEAP_LOG(GSSEAP_LOG_WARNING, "Metadata provider cannot be observed; "
+                   "only explicit republications start a new SP generation.");
+}
+
+// Called with spMutex held. On failure any previous SP stays in place.
+static bool loadServiceProvider(void)
+{
+    SPConfig& conf = getConf();
+
+    if (spInstance == nullptr && !conf.init())
+        return false;
+
+    if (!conf.instantiate()) {
+        if (spInstance == nullptr)
+            conf.term();
+        return false;
+    }
+
+    spInstance = conf.getServiceProvider();
+    observeServiceProvider(spInstance);
+    return true;
+}
+
+static ServiceProvider* getServiceProvider(void)
+{
+    lock_guard<mutex> guard(spMutex);
+
+    if (spInstance == nullptr)
+        loadServiceProvider();
+
+    return spInstance;
+}
+
+// Prefork child: nonzero once the parent has published a generation
+// newer than the SP inherited, which stays in place; see above.
+extern "C" int staleSAMLServiceProvider(void)
+{
+    static volatile unsigned long spStaleNoted;
+
+    if (spShared == nullptr || spOwner == getpid())
+        return 0;
+
+    unsigned long generation = spShared->generation;
+    if (generation == spGeneration)
+        return 0;
+
+    if (__sync_lock_test_and_set(&spStaleNoted, generation) != generation)
+        GSSEAP_LOG(GSSEAP_LOG_WARNING, "SP generation %lu published; this process "
+                   "serves generation %lu until it is replaced", generation, spGeneration);
+    return 1;
+}
+
+// Returns the SP locked for reading; release with unlockServiceProvider()
+static ServiceProvider* lockServiceProvider(void)
+{
+    staleSAMLServiceProvider();
+
+    pthread_rwlock_rdlock(&spSwapLock);
+
+    ServiceProvider* sp = getServiceProvider();
+    if (sp == nullptr) {
+        pthread_rwlock_unlock(&spSwapLock);
+        return nullptr;
+    }
+
+    sp->lock();
+    return sp;
+}
+
+static void unlockServiceProvider(ServiceProvider* sp)
+{
+    sp->unlock();
+    pthread_rwlock_unlock(&spSwapLock);
+}
+
+static unsigned long loadGeneration(void)
+{
+    return __sync_fetch_and_add(&spGeneration, 0);
+}
+
+// The SP generation this process serves; see above
+extern "C" unsigned long getSAMLGeneration(void)
+{
+    return loadGeneration();
+}
+
+// What spAtForkPrepare() locked, in order
+static Lockable* spForkLocked[3];
+static size_t spForkLockedCount;
+
+// Keep the SP from being swapped or first loaded while fork() runs, and
+// wait out any reload thread holding the SP's, the metadata's or the
+// credentials' lock, so the child inherits none of them held.
+static void spAtForkPrepare(void)
+{
+    pthread_rwlock_wrlock(&spSwapLock);
+    spMutex.lock();
+
+    spForkLockedCount = 0;
+    if (spInstance == nullptr)
+        return;
+
+    spInstance->lock();
+    spForkLocked[spForkLockedCount++] = spInstance;
+
+    const Application* app = spInstance->getApplication("default");
+    if (app) {
+        MetadataProvider* m = app->getMetadataProvider(false);
+        if (m) {
+            m->lock();
+            spForkLocked[spForkLockedCount++] = m;
+        }
+        CredentialResolver* cr = app->getCredentialResolver();
+        if (cr) {
+            cr->lock();
+            spForkLocked[spForkLockedCount++] = cr;
+        }
+    }
+}
+
+static void spAtForkRelease(void)
+{
+    while (spForkLockedCount > 0)
+        spForkLocked[--spForkLockedCount]->unlock();
+
+    spMutex.unlock();
+    pthread_rwlock_unlock(&spSwapLock);
+}
+
+static void spRegisterAtFork(void)
+{
+    pthread_atfork(spAtForkPrepare, spAtForkRelease, spAtForkRelease);
+}
+
 // Taken from resolvertest.cpp
 // This is necessary since resolveAttributes is protected and thus cannot be called 
 // from a local instance of a Handler/AssertionConsumerService object.
@@ -167,16 +623,14 @@ extern "C" char* getSAMLRequest2(char *name, int name_len, int signatureRequeste
                                int deleg_requested, char *channel_bindings)
 {
     string retstr = "";
+    MetricsSpan span(GSSEAP_METRIC_SAML_REQUEST);
 
     // Initialization code taken from resolvertest.cpp::main()
-    SPConfig& conf = getConf();
-    if (conf.init()) {
-        if (conf.instantiate()) {
-            ServiceProvider* sp = conf.getServiceProvider();
-            sp->lock();
-            const Application* app = sp->getApplication("default");
-            if (app) {
-
+    ServiceProvider* sp = lockServiceProvider();
+    if (sp) {
+        const Application* app = sp->getApplication("default");
+        if (app) {
+            try {
                 // Taken from constructor SAML2SessionInitiator::SAML2SessionInitiator()
                 // BUT, e is "const DOMElement*" and I have no idea what
                 // actually calls the constructor, so no idea what 'e' is.
@@ -187,7 +641,7 @@ extern "C" char* getSAMLRequest2(char *name, int name_len, int signatureRequeste
                     delete encoder;
                 } catch (exception & ex) {
                 }
-                
+            
                 // Now in SAML2SessionInitiator::doRequest()
                 pair<const EntityDescriptor*,const RoleDescriptor*> entity = 
                     pair<const EntityDescriptor*,const RoleDescriptor*>(nullptr,nullptr);
@@ -211,8 +665,9 @@ extern "C" char* getSAMLRequest2(char *name, int name_len, int signatureRequeste
                     throw XMLToolingException("Unable to locate PAOS response endpoint.");
 
                 // Build up AuthnRequest section of the SOAP message
-                auto_ptr<AuthnRequest> request(AuthnRequestBuilder::buildAuthnRequest());
-                
+                auto_ptr<AuthnRequest> requestOwner(AuthnRequestBuilder::buildAuthnRequest());
+                AuthnRequest* request = requestOwner.get();
+            
                 // Taken from AbstractSPRequest::getHandlerURL()
                 string m_handlerURL;
                 string fqdn = getfqdn();
@@ -307,8 +762,6 @@ extern "C" char* getSAMLRequest2(char *name, int name_len, int signatureRequeste
                 cond->getAudienceRestrictions().push_back(audience_res);
                 request->setConditions(cond);
 
-                XMLObject* requestobj = request.get();
-
                 // Taken from AbstractHandler.cpp
                 // sendMessage(*encoder,requestobj,relayState.c_str(),dest.get()[=nullptr],
                 //             role[=nullptr],app,httpResponse,false);
@@ -344,19 +797,20 @@ extern "C" char* getSAMLRequest2(char *name, int name_len, int signatureRequeste
                 // Call into opensaml's SAML2ECPEncoder.cpp
                 // return encoder.encode(httpResponse,requestobj,dest.get()[=nullptr],
                 //                       entity2[=nullptr],relayState.c_str(),&app)
-                Envelope* env = EnvelopeBuilder::buildEnvelope();
+                auto_ptr<Envelope> env(EnvelopeBuilder::buildEnvelope());
                 Header* header = HeaderBuilder::buildHeader();
                 env->setHeader(header);
                 Body* body = BodyBuilder::buildBody();
                 env->setBody(body);
-                body->getUnknownXMLObjects().push_back(requestobj);
+                // The envelope owns the request from here on
+                body->getUnknownXMLObjects().push_back(requestOwner.release());
 
                 ElementProxy* hdrblock;
                 xmltooling::QName qMU(SOAP11ENV_NS, Header::MUSTUNDERSTAND_ATTRIB_NAME,
                                       SOAP11ENV_PREFIX);
                 xmltooling::QName qActor(SOAP11ENV_NS, Header::ACTOR_ATTRIB_NAME, 
                                          SOAP11ENV_PREFIX);
-                
+            
                 // Create paos:Request header.
                 AnyElementBuilder m_anyBuilder;
                 auto_ptr_XMLCh m_actor("http://schemas.xmlsoap.org/soap/actor/next");
@@ -442,7 +896,7 @@ extern "C" char* getSAMLRequest2(char *name, int name_len, int signatureRequeste
                                 cr->setDigestAlgorithm(digalg.second);
                             }
                         }
-                
+            
                         // Sign message while marshalling.
                         vector<Signature*> sigs(1,sig);
                         rootElement = env->marshall((DOMDocument*)nullptr,&sigs,cred);
@@ -455,27 +909,23 @@ extern "C" char* getSAMLRequest2(char *name, int name_len, int signatureRequeste
                     s << *rootElement;
 
                     retstr = s.str();
-                    
-                    // long ret = genericResponse.sendResponse(s);
                 
-                    // Cleanup by destroying XML.
-                    // NOTE THAT THIS CAUSES A CRASH RIGHT NOW!!!
-                    // *** glibc detected *** /home/tfleury/develop/github.com/mech_saml_ec/gss-sample/.libs/lt-gss-server: free(): invalid pointer: 0x0000000001295108 ***
-                    // delete env;
+                    // long ret = genericResponse.sendResponse(s);
                 }
                 catch (XMLToolingException&) {
                 }
-
+            } catch (exception& ex) {
+                GSSEAP_LOG(GSSEAP_LOG_ERROR, "Unable to build SAML request: %s", ex.what());
+                retstr.clear();
             }
-            sp->unlock();
-
-        } 
-        conf.term();
+        }
+        unlockServiceProvider(sp);
     }
 
-    char* cstr = strdup(retstr.c_str());
-    if (getenv("MECH_SAML_EC_DEBUG"))
-        fprintf(stdout,"--- GETSAMLREQUEST2() RETURNING XML: ---\n%s\n",cstr);
+    // An empty request, from any failure above, is no request
+    char* cstr = retstr.empty() ? nullptr : strdup(retstr.c_str());
+    GSSEAP_LOG(GSSEAP_LOG_DEBUG,"--- GETSAMLREQUEST2() RETURNING XML: ---\n%s",
+               cstr ? cstr : "(none)");
     return cstr; //  Must free() returned char*
 }
 
@@ -499,8 +949,8 @@ static vector<saml2::Assertion*> extractAssertions(const Response& resp,
         CredentialResolver* cr = app.getCredentialResolver();
         if ( ! cr )
             {
-            cerr << "Response contained encrypted assertion, "
-                 <<  "but no CredentialResolver available." << endl;
+            GSSEAP_LOG(GSSEAP_LOG_WARNING, "Response contained encrypted assertion, "
+                       "but no CredentialResolver available.");
             return retval;
             }
 
@@ -525,12 +975,12 @@ static vector<saml2::Assertion*> extractAssertions(const Response& resp,
 
                 if ( decassertion )
                     {
-                    cerr << "Decrypted assertion." << endl;
-                    if (getenv("MECH_SAML_EC_DEBUG")) {
+                    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "Decrypted assertion.");
+                    if (GSSEAP_LOG_ENABLED(GSSEAP_LOG_DEBUG)) {
                         DOMElement* assertionElement = decassertion->marshall();
                         stringstream s;
                         s << *assertionElement;
-                        cerr << s.str().c_str() << endl;
+                        GSSEAP_LOG(GSSEAP_LOG_DEBUG, "%s", s.str().c_str());
                     }
                     retval.push_back(decassertion->cloneAssertion());
                     delete decassertion;
@@ -538,12 +988,12 @@ static vector<saml2::Assertion*> extractAssertions(const Response& resp,
                     }
                 else
                     {
-                    cerr << "Encrpyted assertion not decrypted." << endl;
+                    GSSEAP_LOG(GSSEAP_LOG_WARNING, "Encrypted assertion not decrypted.");
                     }
                 }
             catch ( exception& ex )
                 {
-                cerr << "Failed to decrypt assertion: " << ex.what() << endl;
+                GSSEAP_LOG(GSSEAP_LOG_WARNING, "Failed to decrypt assertion: %s", ex.what());
                 }
             }
        }
@@ -572,7 +1022,7 @@ static vector<saml2::Assertion*> filterValidSignedAssertions(
         {
         invalid = assertions;
         assertions.clear();
-        cerr << "No XMLSigningRule's, all assertions deemed invalid" << endl;
+        GSSEAP_LOG(GSSEAP_LOG_WARNING, "No XMLSigningRule's, all assertions deemed invalid");
         return invalid;
         }
 
@@ -589,20 +1039,20 @@ static vector<saml2::Assertion*> filterValidSignedAssertions(
             catch ( exception& e )
                 {
                 is_valid = false;
-                cerr << "Assertion signature failed verification: "
-                     << e.what() << endl;
+                GSSEAP_LOG(GSSEAP_LOG_WARNING,
+                           "Assertion signature failed verification: %s", e.what());
                 }
             if ( ! is_valid ) break;
             }
 
         if ( is_valid )
             {
-            cerr << "Signature on assertion verified" << endl;
+            GSSEAP_LOG(GSSEAP_LOG_DEBUG, "Signature on assertion verified");
             valid.push_back(assertions[i]);
             }
         else
             {
-            cerr << "Filtered invalidly signed assertion" << endl;
+            GSSEAP_LOG(GSSEAP_LOG_WARNING, "Filtered invalidly signed assertion");
             invalid.push_back(assertions[i]);
             }
         }
@@ -611,334 +1061,341 @@ static vector<saml2::Assertion*> filterValidSignedAssertions(
     return invalid;
     }
 
+// If attributes is not NULL, it is set on success to what the response
+// released, which the caller frees with releaseSAMLAttributes().
 extern "C" int verifySAMLResponse(const char* saml, int len, char** initiator_name,
-                                  char ** session_expiry, char **generated_key,
-                                  char **delegated_assertions)
+                                  time_t* session_expiry, char **generated_key,
+                                  char **delegated_assertions,
+                                  gss_eap_saml_attrs** attributes)
 {
     int retbool = 1; // FIXME: Defaulting to successful verification is dangerous.
-    string initiatorName = "";
+    char* initiatorName = nullptr;
     stringstream deleg_assertion_str;
+    MetricsSpan verifySpan(GSSEAP_METRIC_VERIFY_RESPONSE);
+    gss_eap_saml_attrs* attrs = nullptr;
+
+    if (attributes != NULL)
+        *attributes = NULL;
 
-    XMLToolingConfig::getConfig().log_config("DEBUG");
+    if (session_expiry != NULL)
+        *session_expiry = 0;
+
+    // Reconfiguring log4shib is costly; only do it once, and only when
+    // debug output was asked for.
+    if (GSSEAP_LOG_ENABLED(GSSEAP_LOG_DEBUG)) {
+        static bool logConfigured =
+            XMLToolingConfig::getConfig().log_config("DEBUG");
+        (void)logConfigured;
+    }
     Category& log = Category::getInstance(SHIBSP_LOGCAT".verifySAMLResponse");
 
     string samlstr(saml, len);
-    if (getenv("MECH_SAML_EC_DEBUG"))
-        fprintf(stdout,"--- VERIFYSAMLRESPONSE() GOT XML: ---\n%s\n",samlstr.c_str());
+    GSSEAP_LOG(GSSEAP_LOG_DEBUG,"--- VERIFYSAMLRESPONSE() GOT XML: ---\n%s",samlstr.c_str());
 
     // Initialization code taken from resolvertest.cpp::main()
-    SPConfig& conf = getConf();
-    if (conf.init()) {
-        if (conf.instantiate()) {
-            ServiceProvider* sp = conf.getServiceProvider();
-            sp->lock();
-            const Application* app = sp->getApplication("default");
-            if (app) {
-                // Get the AssertionConsumerService
-                const Handler* ACS=nullptr;
-                ACS = app->getAssertionConsumerServiceByProtocol(SAML20P_NS,SAML20_BINDING_PAOS);
-                if (!ACS) {
-                    cerr << "Unable to locate PAOS response endpoint." << endl;
-                    retbool = 0;
-                }
+    ServiceProvider* sp = lockServiceProvider();
+    if (sp) {
+        const Application* app = sp->getApplication("default");
+        if (app) {
+            // Get the AssertionConsumerService
+            const Handler* ACS=nullptr;
+            ACS = app->getAssertionConsumerServiceByProtocol(SAML20P_NS,SAML20_BINDING_PAOS);
+            if (!ACS) {
+                GSSEAP_LOG(GSSEAP_LOG_ERROR, "Unable to locate PAOS response endpoint.");
+                retbool = 0;
+            }
 
-                if (retbool) {
-                    MetadataProvider* m = app->getMetadataProvider();
-                    Locker mlocker(m);
-                    TrustEngine* trust = app->getTrustEngine();
-                    xmltooling::QName idprole(samlconstants::SAML20MD_NS,IDPSSODescriptor::LOCAL_NAME);
-                    SecurityPolicy policy(m,&idprole,trust,false);
-                    // Create policy rule list, a combination of code from 
-                    // opensaml-2.5/samltest/binding.h setUp(), lines 86-88
-                    // shibboleth-2.5/shibsp/security/SecurityPolicy.cpp, lines 35-37
-                    // SAML2POSTTEST.h line 38
-                    vector<const SecurityPolicyRule*> rules =
-                        app->getServiceProvider().getPolicyRules(app->getString("policyId").second);
-                    rules.push_back(SAMLConfig::getConfig().SecurityPolicyRuleManager.newPlugin(BEARER_POLICY_RULE, nullptr));
-                    policy.getRules().assign(rules.begin(),rules.end());
-                    /*
-                    vector<const SecurityPolicyRule*>::iterator it;
-                    for (it = rules.begin(); it < rules.end(); it++) {
-                        cerr << "rule = " << (*it)->getType() << endl;
-                    }
-                    */
+            if (retbool) {
+                MetadataProvider* m = app->getMetadataProvider();
+                Locker mlocker(m);
+                TrustEngine* trust = app->getTrustEngine();
+                xmltooling::QName idprole(samlconstants::SAML20MD_NS,IDPSSODescriptor::LOCAL_NAME);
+                SecurityPolicy policy(m,&idprole,trust,false);
+                // Create policy rule list, a combination of code from 
+                // opensaml-2.5/samltest/binding.h setUp(), lines 86-88
+                // shibboleth-2.5/shibsp/security/SecurityPolicy.cpp, lines 35-37
+                // SAML2POSTTEST.h line 38
+                vector<const SecurityPolicyRule*> rules =
+                    app->getServiceProvider().getPolicyRules(app->getString("policyId").second);
+                rules.push_back(SAMLConfig::getConfig().SecurityPolicyRuleManager.newPlugin(BEARER_POLICY_RULE, nullptr));
+                policy.getRules().assign(rules.begin(),rules.end());
+                /*
+                vector<const SecurityPolicyRule*>::iterator it;
+                for (it = rules.begin(); it < rules.end(); it++) {
+                    cerr << "rule = " << (*it)->getType() << endl;
+                }
+                */
 
-                    // Taken from util/resolvertest.cpp and SAML2ECPDecoder::decode()
-                    try {
-                        istringstream samlstream(samlstr);
-                       
-                        // Taken from SAML2ECPDecoder::decode()
-                        cerr << "parsing samlstream..." << endl;
-                        DOMDocument* doc = XMLToolingConfig::getConfig().getParser().parse(samlstream);
-                        cerr << "samlstream parsing succeeded!" << endl;
-                        XercesJanitor<DOMDocument> docjan(doc);
-                        auto_ptr<XMLObject> token(XMLObjectBuilder::buildOneFromElement(doc->getDocumentElement(), true));
-                        docjan.release();
-
-                        Envelope* env = dynamic_cast<Envelope*>(token.get());
-                        if (env) {
-                            SchemaValidators.validate(env);
-
-                            Body* body = env->getBody();
-                            if (body && body->hasChildren()) {
-                                Response* response = dynamic_cast<Response*>(body->getUnknownXMLObjects().front());
-                                if (response) {
-                                    // Run through the policy at two layers.
-                                    /*
-                                    extractMessageDetails(*env, genericRequest, samlconstants::SAML20P_NS, policy);
-                                    policy.evaluate(*env, &genericRequest);
-                                    policy.reset(true);
-                                    extractMessageDetails(*response, genericRequest, samlconstants::SAML20P_NS, policy);
-                                    policy.evaluate(*response, &genericRequest);
-                                    */
-                                    // Don't bother with extractMessageDetails(*env,...) since env is not a SAML20P_NS
-                                    // Instead, call SAML2MessageDecoder::extractMessageDetails(*response,...)
-                                    const xmltooling::QName& q = response->getElementQName();
-                                    if (XMLString::equals(q.getNamespaceURI(), samlconstants::SAML20P_NS)) {
-                                        try {
-                                            const saml2::RootObject& samlRoot = dynamic_cast<const saml2::RootObject&>(*response);
-                                            vector<saml2::Assertion*> assertions =
-                                                extractAssertions(dynamic_cast<const Response&>(samlRoot), *app, policy);
-
-                                            policy.setMessageID(samlRoot.getID());
-                                            policy.setIssueInstant(samlRoot.getIssueInstantEpoch());
-
-                                            const Issuer* issuer = samlRoot.getIssuer();
-                                            if (issuer) {
-                                                policy.setIssuer(issuer);
-                                            } else if (XMLString::equals(q.getLocalPart(), Response::LOCAL_NAME)) {
-                                                // No issuer in the message, so we have to try the Response approach.
-                                                if (!assertions.empty()) {
-                                                    issuer = assertions.front()->getIssuer();
-                                                    if (issuer) {
-                                                        policy.setIssuer(issuer);
-                                                    }
+                // Taken from util/resolvertest.cpp and SAML2ECPDecoder::decode()
+                try {
+                    istringstream samlstream(samlstr);
+                   
+                    // Taken from SAML2ECPDecoder::decode()
+                    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "parsing samlstream...");
+                    MetricsSpan parseSpan(GSSEAP_METRIC_RESPONSE_PARSE);
+                    DOMDocument* doc = XMLToolingConfig::getConfig().getParser().parse(samlstream);
+                    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "samlstream parsing succeeded!");
+                    XercesJanitor<DOMDocument> docjan(doc);
+                    auto_ptr<XMLObject> token(XMLObjectBuilder::buildOneFromElement(doc->getDocumentElement(), true));
+                    docjan.release();
+                    parseSpan.end();
+
+                    Envelope* env = dynamic_cast<Envelope*>(token.get());
+                    if (env) {
+                        MetricsSpan schemaSpan(GSSEAP_METRIC_SCHEMA_VALIDATE);
+                        SchemaValidators.validate(env);
+                        schemaSpan.end();
+
+                        Body* body = env->getBody();
+                        if (body && body->hasChildren()) {
+                            Response* response = dynamic_cast<Response*>(body->getUnknownXMLObjects().front());
+                            if (response) {
+                                // Run through the policy at two layers.
+                                /*
+                                extractMessageDetails(*env, genericRequest, samlconstants::SAML20P_NS, policy);
+                                policy.evaluate(*env, &genericRequest);
+                                policy.reset(true);
+                                extractMessageDetails(*response, genericRequest, samlconstants::SAML20P_NS, policy);
+                                policy.evaluate(*response, &genericRequest);
+                                */
+                                // Don't bother with extractMessageDetails(*env,...) since env is not a SAML20P_NS
+                                // Instead, call SAML2MessageDecoder::extractMessageDetails(*response,...)
+                                const xmltooling::QName& q = response->getElementQName();
+                                if (XMLString::equals(q.getNamespaceURI(), samlconstants::SAML20P_NS)) {
+                                    try {
+                                        const saml2::RootObject& samlRoot = dynamic_cast<const saml2::RootObject&>(*response);
+                                        MetricsSpan decryptSpan(GSSEAP_METRIC_DECRYPT);
+                                        vector<saml2::Assertion*> assertions =
+                                            extractAssertions(dynamic_cast<const Response&>(samlRoot), *app, policy);
+                                        decryptSpan.end();
+
+                                        policy.setMessageID(samlRoot.getID());
+                                        policy.setIssueInstant(samlRoot.getIssueInstantEpoch());
+
+                                        const Issuer* issuer = samlRoot.getIssuer();
+                                        if (issuer) {
+                                            policy.setIssuer(issuer);
+                                        } else if (XMLString::equals(q.getLocalPart(), Response::LOCAL_NAME)) {
+                                            // No issuer in the message, so we have to try the Response approach.
+                                            if (!assertions.empty()) {
+                                                issuer = assertions.front()->getIssuer();
+                                                if (issuer) {
+                                                    policy.setIssuer(issuer);
                                                 }
                                             }
-                                            if (!issuer) {
-                                                cerr << "Issuer identity not extracted!" << endl;
-                                                retbool = 0;
-                                            }
+                                        }
+                                        if (!issuer) {
+                                            GSSEAP_LOG(GSSEAP_LOG_ERROR, "Issuer identity not extracted!");
+                                            retbool = 0;
+                                        }
 
-                                            if (retbool) {
-                                                auto_ptr_char iname(issuer->getName());
-                                                cout << "issuer = " << iname.get() << endl;
+                                        if (retbool) {
+                                            auto_ptr_char iname(issuer->getName());
+                                            GSSEAP_LOG(GSSEAP_LOG_INFO, "issuer = %s", iname.get());
+
+                                            if (policy.getIssuerMetadata()) {
+                                                GSSEAP_LOG(GSSEAP_LOG_DEBUG, "metadata for issuer already set, leaving in place.");
+                                                // return;
+                                            }
 
-                                                if (policy.getIssuerMetadata()) {
-                                                    cerr << "metadata for issuer already set, leaving in place." << endl;
+                                            if (policy.getMetadataProvider() && policy.getRole()) {
+                                                if (issuer->getFormat() && !XMLString::equals(issuer->getFormat(), 
+                                                                                              NameIDType::ENTITY)) {
+                                                    GSSEAP_LOG(GSSEAP_LOG_WARNING, "non-system entity issuer, skipping metadata lookup!");
                                                     // return;
                                                 }
 
-                                                if (policy.getMetadataProvider() && policy.getRole()) {
-                                                    if (issuer->getFormat() && !XMLString::equals(issuer->getFormat(), 
-                                                                                                  NameIDType::ENTITY)) {
-                                                        cerr << "non-system entity issuer, skipping metadata lookup!" << endl;
-                                                        // return;
-                                                    }
-
-                                                    cerr << "searching metadata for message issuer... ";
-                                                    MetadataProvider::Criteria& mc = policy.getMetadataProviderCriteria();
-                                                    mc.entityID_unicode = issuer->getName();
-                                                    mc.role = policy.getRole();
-                                                    mc.protocol = samlconstants::SAML20P_NS;
-                                                    pair<const EntityDescriptor*,const RoleDescriptor*> entity = 
-                                                        policy.getMetadataProvider()->getEntityDescriptor(mc);
-                                                    if (!entity.first) {
-                                                        auto_ptr_char temp(issuer->getName());
-                                                        cerr << "no metadata found, can't establish identity of issuer (" <<
-                                                                temp.get() << ")" << endl;
-                                                        retbool = 0;
-                                                    }
-                                                    else if (!entity.second) {
-                                                        cerr << "unable to find compatible role (" << 
-                                                                policy.getRole()->toString().c_str() << ") in metadata" << endl;
-                                                        retbool = 0;
-                                                    } else {
-                                                        policy.setIssuerMetadata(entity.second);
-                                                        cerr << "Done!" << endl;
-                                                    }
+                                                GSSEAP_LOG(GSSEAP_LOG_DEBUG, "searching metadata for message issuer...");
+                                                MetadataProvider::Criteria& mc = policy.getMetadataProviderCriteria();
+                                                mc.entityID_unicode = issuer->getName();
+                                                mc.role = policy.getRole();
+                                                mc.protocol = samlconstants::SAML20P_NS;
+                                                MetricsSpan metadataSpan(GSSEAP_METRIC_METADATA_LOOKUP);
+                                                pair<const EntityDescriptor*,const RoleDescriptor*> entity = 
+                                                    policy.getMetadataProvider()->getEntityDescriptor(mc);
+                                                metadataSpan.end();
+                                                if (!entity.first) {
+                                                    auto_ptr_char temp(issuer->getName());
+                                                    GSSEAP_LOG(GSSEAP_LOG_ERROR, "no metadata found, can't establish identity of issuer (%s)",
+                                                               temp.get());
+                                                    retbool = 0;
+                                                }
+                                                else if (!entity.second) {
+                                                    GSSEAP_LOG(GSSEAP_LOG_ERROR, "unable to find compatible role (%s) in metadata",
+                                                               policy.getRole()->toString().c_str());
+                                                    retbool = 0;
+                                                } else {
+                                                    policy.setIssuerMetadata(entity.second);
+                                                    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "found metadata for message issuer");
+                                                }
 
-                                                    vector<saml2::Assertion*> invalid_assertions =
-                                                        filterValidSignedAssertions(assertions, policy);
-                                                    for_each(invalid_assertions.begin(), invalid_assertions.end(), xmltooling::cleanup<saml2::Assertion>());
-
-                                                    // Attempt to extract local-login-user attribute
-                                                    // Taken from resolvertest.cpp
-                                                    if (retbool) {
-                                                        saml2::NameID* v2name = nullptr;
-                                                        const xmltooling::DateTime* session_not_on_or_after = nullptr;
-                                                        for (size_t i = 0; i < assertions.size(); ++i) {
-                                                            saml2::Assertion* a2 = assertions[i];
-                                                            int deleg_assertion = 0;
-                                                            saml2::Conditions* cond = a2->getConditions();
-                                                            if (cond != NULL) {
-                                                                for (size_t j = 0; j < cond->getAudienceRestrictions().size(); ++j) {
-                                                                    for (size_t k = 0; k < cond->getAudienceRestrictions()[j]->getAudiences().size(); ++k) {
-                                                                        if (XMLString::equals(issuer->getName(), cond->getAudienceRestrictions()[j]->getAudiences()[k]->getAudienceURI())) {
-                                                                            deleg_assertion = 1;
-                                                                            fprintf(stderr, "ASSERTION DELEGATED!\n");
-                                                                        }
+                                                MetricsSpan signatureSpan(GSSEAP_METRIC_SIGNATURE);
+                                                vector<saml2::Assertion*> invalid_assertions =
+                                                    filterValidSignedAssertions(assertions, policy);
+                                                signatureSpan.end();
+                                                for_each(invalid_assertions.begin(), invalid_assertions.end(), xmltooling::cleanup<saml2::Assertion>());
+
+                                                // Attempt to extract local-login-user attribute
+                                                // Taken from resolvertest.cpp
+                                                if (retbool) {
+                                                    saml2::NameID* v2name = nullptr;
+                                                    const xmltooling::DateTime* session_not_on_or_after = nullptr;
+                                                    for (size_t i = 0; i < assertions.size(); ++i) {
+                                                        saml2::Assertion* a2 = assertions[i];
+                                                        int deleg_assertion = 0;
+                                                        saml2::Conditions* cond = a2->getConditions();
+                                                        if (cond != NULL) {
+                                                            for (size_t j = 0; j < cond->getAudienceRestrictions().size(); ++j) {
+                                                                for (size_t k = 0; k < cond->getAudienceRestrictions()[j]->getAudiences().size(); ++k) {
+                                                                    if (XMLString::equals(issuer->getName(), cond->getAudienceRestrictions()[j]->getAudiences()[k]->getAudienceURI())) {
+                                                                        deleg_assertion = 1;
+                                                                        GSSEAP_LOG(GSSEAP_LOG_DEBUG, "ASSERTION DELEGATED!");
                                                                     }
                                                                 }
                                                             }
-                                                            if (deleg_assertion) {
-                                                                DOMElement* assertionElement = a2->marshall();
-                                                                deleg_assertion_str << *assertionElement;
-                                                            }
-                                                            for (size_t j = 0; j < a2->getAuthnStatements().size(); ++j) {
-                                                                saml2::AuthnStatement* authnst = (a2->getAuthnStatements())[j];
-                                                                if (authnst->getSessionNotOnOrAfter() != NULL) {
-                                                                    if (session_not_on_or_after == nullptr || xmltooling::DateTime().compareOrder(session_not_on_or_after, authnst->getSessionNotOnOrAfter()) > 0)
-                                                                        session_not_on_or_after = authnst->getSessionNotOnOrAfter();
-                                                                }
-                                                            }
-                                                            if (generated_key != NULL && (*generated_key) == NULL) {
-                                                            saml2::Advice* advice = a2->getAdvice();
-                                                            if (advice != nullptr) {
-                                                                // TODO VSY: Get GeneratedKey content and return it instead of whole Advice XML
-                                                                DOMElement* adviceElement = advice->marshall();
-                                                                stringstream s;
-                                                                s << *adviceElement;
-                                                                *generated_key = strdup(s.str().c_str());
-                                                            }
-                                                            }
-                                                            if (v2name == nullptr) {
-                                                                v2name = a2->getSubject()?a2->getSubject()->getNameID():nullptr;
+                                                        }
+                                                        if (deleg_assertion) {
+                                                            DOMElement* assertionElement = a2->marshall();
+                                                            deleg_assertion_str << *assertionElement;
+                                                        }
+                                                        for (size_t j = 0; j < a2->getAuthnStatements().size(); ++j) {
+                                                            saml2::AuthnStatement* authnst = (a2->getAuthnStatements())[j];
+                                                            if (authnst->getSessionNotOnOrAfter() != NULL) {
+                                                                if (session_not_on_or_after == nullptr || xmltooling::DateTime().compareOrder(session_not_on_or_after, authnst->getSessionNotOnOrAfter()) > 0)
+                                                                    session_not_on_or_after = authnst->getSessionNotOnOrAfter();
                                                             }
                                                         }
-                                                        if (assertions.empty()) {
-                                                            cerr << "no valid assertions available to inspect for attribute mapped to local-login-user" << endl;
-                                                            retbool = 0;
+                                                        if (generated_key != NULL && (*generated_key) == NULL) {
+                                                        saml2::Advice* advice = a2->getAdvice();
+                                                        if (advice != nullptr) {
+                                                            // TODO VSY: Get GeneratedKey content and return it instead of whole Advice XML
+                                                            DOMElement* adviceElement = advice->marshall();
+                                                            stringstream s;
+                                                            s << *adviceElement;
+                                                            *generated_key = strdup(s.str().c_str());
                                                         }
-                                                        const XMLCh* protocol = samlconstants::SAML20P_NS;
-                                                        vector<const opensaml::Assertion*> tokens;
-                                                        tokens.assign(assertions.begin(),assertions.end());
-
-                                                        LocalResolver lr(nullptr,nullptr);
-                                                        ctx = lr.resolveAttributes(
-                                                            *app,entity.second,protocol,nullptr,v2name,
-                                                                nullptr,nullptr,&tokens);
-                                                        // auto_ptr<ResolutionContext> wrapper(ctx); NOTE: ctx now static to enable later retrieval of attributes
-                                                        if (v2name != nullptr) {
-                                                            char *tmp;
-                                                            initiatorName += (tmp = xercesc::XMLString::transcode(v2name->getName()));
-                                                            xercesc::XMLString::release(&tmp);
-                                                            initiatorName += "!";
-                                                            tmp = NULL;
-                                                            initiatorName += v2name->getFormat()?(tmp = xercesc::XMLString::transcode(v2name->getFormat())):"urn:oasis:names:tc:SAML:1.1:nameid-format:unspecified";
-                                                            if (tmp != NULL)
-                                                            xercesc::XMLString::release(&tmp);
-                                                            initiatorName += "!";
-                                                            initiatorName += v2name->getNameQualifier()?(tmp = xercesc::XMLString::transcode(v2name->getNameQualifier())):"";
-                                                            xercesc::XMLString::release(&tmp);
-                                                            initiatorName += "!";
-                                                            initiatorName += v2name->getSPNameQualifier()?(tmp = xercesc::XMLString::transcode(v2name->getSPNameQualifier())):"";
-                                                            xercesc::XMLString::release(&tmp);
-                                                            initiatorName += "!";
-                                                            initiatorName += v2name->getSPProvidedID()?(tmp = xercesc::XMLString::transcode(v2name->getSPProvidedID())):"";
-                                                            xercesc::XMLString::release(&tmp);
                                                         }
-                                                        if (session_not_on_or_after != nullptr && session_expiry != NULL) {
-                                                            char *tmp = XMLString::transcode(session_not_on_or_after->getFormattedString());
-                                                            *session_expiry = strdup(tmp);
-fprintf(stderr, ">>>>>>>>>>>>>>SESSION NOT ON OR AFTER (%s)(%d)\n", tmp, session_not_on_or_after->getYear());
-                                                            XMLString::release(&tmp);
+                                                        if (v2name == nullptr) {
+                                                            v2name = a2->getSubject()?a2->getSubject()->getNameID():nullptr;
                                                         }
                                                     }
+                                                    if (assertions.empty()) {
+                                                        GSSEAP_LOG(GSSEAP_LOG_ERROR, "no valid assertions available to inspect for attribute mapped to local-login-user");
+                                                        retbool = 0;
+                                                    }
+                                                    if (attributes != NULL && attrs == nullptr) {
+                                                        attrs = new gss_eap_saml_attrs();
+                                                        attrs->fingerprint = fingerprintAssertions(loadGeneration(),
+                                                                                                   issuer->getName(), assertions);
+                                                        // Resolved on first use; see resolveSAMLAttributes().
+                                                        // Drop the DOMs, which are only needed to verify signatures.
+                                                        for (size_t i = 0; i < assertions.size(); ++i)
+                                                            assertions[i]->releaseThisAndChildrenDOM();
+                                                        attrs->pendingIssuer = issuer->getName();
+                                                        attrs->pendingNameID = v2name;
+                                                        attrs->pendingAssertions.swap(assertions);
+                                                    }
+                                                    if (v2name != nullptr)
+                                                        initiatorName = makeInitiatorName(v2name);
+                                                    if (session_not_on_or_after != nullptr && session_expiry != NULL) {
+                                                        *session_expiry = utcEpoch(session_not_on_or_after);
+                                                        GSSEAP_LOG(GSSEAP_LOG_DEBUG, "SessionNotOnOrAfter (%lld)",
+                                                                   (long long)*session_expiry);
+                                                    }
                                                 }
                                             }
-
-                                            for_each(assertions.begin(), assertions.end(), xmltooling::cleanup<saml2::Assertion>());
-                                        } catch (bad_cast&) {
-                                            cerr << "caught a bad_cast while extracting message details" << endl;
                                         }
-                                    } else { // Message is not SAML20P_NS - problem!
-                                        retbool = 0;
+
+                                        for_each(assertions.begin(), assertions.end(), xmltooling::cleanup<saml2::Assertion>());
+                                    } catch (bad_cast&) {
+                                        GSSEAP_LOG(GSSEAP_LOG_ERROR, "caught a bad_cast while extracting message details");
                                     }
-                                    // End SAML2MessageDecoder::extractMessageDetails(*response,...)
-
-                                    if (retbool) {
-                                        try {
-                                            cerr << "Evaluating SecurityPolicy rules on Response" << endl;
-                                            for ( size_t i = 0; i < policy.getRules().size(); ++i )
-                                                {
-                                                string rule_type = policy.getRules()[i]->getType();
-                                                if ( policy.getRules()[i]->evaluate(*response, nullptr, policy) )
-                                                    cerr << "SecurityPolicyRule '" << rule_type << "' passed." << endl;
-                                                else
-                                                    cerr << "SecurityPolicyRule '" << rule_type << "' ignored." << endl;
-                                                }
-                                        } catch (exception& ex) {
-                                            retbool = 0;
-                                            cerr << "Caught exception evaluating SecurityPolicy on Response:"<< ex.what() << endl;
-                                        }
+                                } else { // Message is not SAML20P_NS - problem!
+                                    retbool = 0;
+                                }
+                                // End SAML2MessageDecoder::extractMessageDetails(*response,...)
+
+                                if (retbool) {
+                                    try {
+                                        GSSEAP_LOG(GSSEAP_LOG_DEBUG, "Evaluating SecurityPolicy rules on Response");
+                                        for ( size_t i = 0; i < policy.getRules().size(); ++i )
+                                            {
+                                            string rule_type = policy.getRules()[i]->getType();
+                                            bool passed = policy.getRules()[i]->evaluate(*response, nullptr, policy);
+                                            GSSEAP_LOG(GSSEAP_LOG_DEBUG, "SecurityPolicyRule '%s' %s.",
+                                                       rule_type.c_str(), passed ? "passed" : "ignored");
+                                            }
+                                    } catch (exception& ex) {
+                                        retbool = 0;
+                                        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Caught exception evaluating SecurityPolicy on Response: %s", ex.what());
                                     }
+                                }
 
-                                    if (retbool) {
-                                        // Check destination URL.
-                                        auto_ptr_char dest(response->getDestination());
-                                        if (response->getSignature() && (!dest.get() || !*(dest.get()))) {
-                                            cerr << "Signed SAML message missing Destination attribute!" << endl;
-                                            // return 0;
-                                            retbool = 0;
-                                        }
+                                if (retbool) {
+                                    // Check destination URL.
+                                    auto_ptr_char dest(response->getDestination());
+                                    if (response->getSignature() && (!dest.get() || !*(dest.get()))) {
+                                        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Signed SAML message missing Destination attribute!");
+                                        // return 0;
+                                        retbool = 0;
                                     }
+                                }
 
-                                    // Check for RelayState header.
-                                    // Do we need to do something "useful" with the RelayState?
-                                    if ((retbool) && (env->getHeader())) {
-                                        string relayState;
-                                        static const XMLCh RelayState[] = UNICODE_LITERAL_10(R,e,l,a,y,S,t,a,t,e);
-                                        const vector<XMLObject*>& blocks = const_cast<const Header*>(env->getHeader())->getUnknownXMLObjects();
-                                        vector<XMLObject*>::const_iterator h =
-                                            find_if(blocks.begin(), blocks.end(), hasQName(xmltooling::QName(samlconstants::SAML20ECP_NS, RelayState)));
-                                        const ElementProxy* ep = dynamic_cast<const ElementProxy*>(h != blocks.end() ? *h : nullptr);
-                                        if (ep) {
-                                            auto_ptr_char rs(ep->getTextContent());
-                                            if (rs.get())
-                                                relayState = rs.get();
-                                        }
-                                        cout << "relayState = " << relayState << endl;
+                                // Check for RelayState header.
+                                // Do we need to do something "useful" with the RelayState?
+                                if ((retbool) && (env->getHeader())) {
+                                    string relayState;
+                                    static const XMLCh RelayState[] = UNICODE_LITERAL_10(R,e,l,a,y,S,t,a,t,e);
+                                    const vector<XMLObject*>& blocks = const_cast<const Header*>(env->getHeader())->getUnknownXMLObjects();
+                                    vector<XMLObject*>::const_iterator h =
+                                        find_if(blocks.begin(), blocks.end(), hasQName(xmltooling::QName(samlconstants::SAML20ECP_NS, RelayState)));
+                                    const ElementProxy* ep = dynamic_cast<const ElementProxy*>(h != blocks.end() ? *h : nullptr);
+                                    if (ep) {
+                                        auto_ptr_char rs(ep->getTextContent());
+                                        if (rs.get())
+                                            relayState = rs.get();
                                     }
-
-                                    token.release();
-                                    body->detach(); // frees Envelope
-                                    response->detach();   // frees Body
+                                    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "relayState = %s", relayState.c_str());
                                 }
+
+                                token.release();
+                                body->detach(); // frees Envelope
+                                response->detach();   // frees Body
                             }
-                        } else {
-                            cerr << "-----" << endl << "Decoded message was not a SOAP 1.1 Envelope" << endl << "-----" << endl;
                         }
+                    } else {
+                        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Decoded message was not a SOAP 1.1 Envelope");
+                    }
 
-                        /*
-                        DOMElement *elem = doc->getDocumentElement();
-                        stringstream s;
-                        s << *elem;
-                        cerr << "-----" << endl << "s = " << s << endl << "-----" << endl;
-                        */
-
+                    /*
+                    DOMElement *elem = doc->getDocumentElement();
+                    stringstream s;
+                    s << *elem;
+                    cerr << "-----" << endl << "s = " << s << endl << "-----" << endl;
+                    */
 
-                    } catch (exception & ex) {
-                        retbool = 0;
-                        cerr << "Caught exception: " << ex.what() << endl;
-                    }
 
-                // XXX This is here to force a cleanup of any role the
-                // SecurityPolicy object allocated, which really seems
-                // like a bug in the SAML library's implementation of
-                // the SecurityPolicy destructor for not cleaning it up.
-                policy.setRole(nullptr);
+                } catch (exception & ex) {
+                    retbool = 0;
+                    GSSEAP_LOG(GSSEAP_LOG_ERROR, "Caught exception: %s", ex.what());
                 }
-            }
-            sp->unlock();
 
-        } 
-        conf.term();
+            // XXX This is here to force a cleanup of any role the
+            // SecurityPolicy object allocated, which really seems
+            // like a bug in the SAML library's implementation of
+            // the SecurityPolicy destructor for not cleaning it up.
+            policy.setRole(nullptr);
+            }
+        }
+        unlockServiceProvider(sp);
     }
 
-    if (!initiatorName.empty()) {
-      *initiator_name = strdup(initiatorName.c_str());
-    }
+    if (retbool && attributes != NULL)
+        *attributes = attrs;
+    else
+        delete attrs;
+
+    *initiator_name = initiatorName;
 
     if (!deleg_assertion_str.str().empty())
         *delegated_assertions = strdup(deleg_assertion_str.str().c_str());
@@ -946,38 +1403,209 @@ fprintf(stderr, ">>>>>>>>>>>>>>SESSION NOT ON OR AFTER (%s)(%d)\n", tmp, session
     return retbool;
 }
 
-// 1 on success; 0 on not found
-extern "C" int getSAMLAttribute(const char* attrib, char** value)
+// Load everything lazily initialised on the first handshake: the SP
+// runtime, metadata, credentials, trust engine, the PAOS endpoint, the
+// security policy rules and a parser. 1 on success; 0 on failure.
+extern "C" int warmSAMLServiceProvider(void)
 {
-    string localValue = "";
+    int retbool = 0;
 
-    *value = NULL;
+    ServiceProvider* sp = lockServiceProvider();
+    if (sp == nullptr) {
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Unable to initialize the Shibboleth SP runtime.");
+        return 0;
+    }
+
+    const Application* app = sp->getApplication("default");
+    if (app) {
+        try {
+            MetadataProvider* m = app->getMetadataProvider();
+            if (m) {
+                Locker mlocker(m);
+            }
+
+            CredentialResolver* cr = app->getCredentialResolver();
+            if (cr) {
+                Locker clocker(cr);
+            }
+            app->getTrustEngine();
+            app->getAssertionConsumerServiceByProtocol(SAML20P_NS, SAML20_BINDING_PAOS);
+            app->getServiceProvider().getPolicyRules(app->getString("policyId").second);
+
+            istringstream s("<warm/>");
+            DOMDocument* doc = XMLToolingConfig::getConfig().getParser().parse(s);
+            doc->release();
+
+            retbool = 1;
+        } catch (exception& ex) {
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "Warm-up failed: %s", ex.what());
+        }
+    } else {
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "No default application in SP configuration.");
+    }
+    unlockServiceProvider(sp);
 
-    if (ctx == nullptr)
+    return retbool;
+}
+
+// Load the SP in a prefork parent and share it with future children;
+// see staleSAMLServiceProvider(). Metadata reloads in the parent publish
+// a new generation automatically. Calling this again in the parent
+// instantiates the SP afresh and publishes it too, which covers changes
+// the metadata observer cannot see. 1 on success; 0 on failure.
+extern "C" int preforkSAMLServiceProvider(void)
+{
+    static pthread_once_t atForkOnce = PTHREAD_ONCE_INIT;
+    bool republish = false;
+
+    if (spShared == nullptr) {
+        void* p = mmap(nullptr, sizeof(*spShared), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "Unable to map shared SP state: %s", strerror(errno));
+            return 0;
+        }
+        spShared = static_cast<sp_shared_state*>(p);
+        spShared->generation = spGeneration;
+        spOwner = getpid();
+        pthread_once(&atForkOnce, spRegisterAtFork);
+    } else if (spOwner == getpid()) {
+        republish = true;
+    } else {
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Prefork SP state can only be published by its parent.");
         return 0;
+    }
 
-    for (vector<shibsp::Attribute*>::const_iterator a = ctx->getResolvedAttributes().begin(); 
-         a != ctx->getResolvedAttributes().end(); 
-         ++a) {
-        for (vector<string>::const_iterator s = (*a)->getAliases().begin(); 
-             s != (*a)->getAliases().end(); 
-             ++s) {
-            if (s->compare(attrib) == 0) {
-                for (vector<string>::const_iterator v=(*a)->getSerializedValues().begin();
-                     v != (*a)->getSerializedValues().end(); 
-                     ++v) {
-                    if (v != (*a)->getSerializedValues().begin())
-                        localValue += ";";
-                    localValue += *v;
+    if (republish) {
+        bool loaded;
+
+        pthread_rwlock_wrlock(&spSwapLock);
+        {
+            lock_guard<mutex> guard(spMutex);
+            loaded = loadServiceProvider();
+        }
+        pthread_rwlock_unlock(&spSwapLock);
+
+        if (!loaded)
+            return 0;
+    }
+
+    if (!warmSAMLServiceProvider())
+        return 0;
+
+    if (republish)
+        publishGeneration();
+
+    return 1;
+}
+
+// Run the attribute resolver over the assertions verifySAMLResponse()
+// left pending in attrs, filling in its ctx and attrIndex. They stay
+// empty if it fails; the failure is logged.
+static void resolveSAMLAttributes(gss_eap_saml_attrs* attrs)
+{
+    if (attrs->pendingAssertions.empty())
+        return;
+
+    MetricsSpan span(GSSEAP_METRIC_ATTRIBUTE_RESOLVE);
+
+    ServiceProvider* sp = lockServiceProvider();
+    if (sp) {
+        const Application* app = sp->getApplication("default");
+        if (app) {
+            try {
+                MetadataProvider* m = app->getMetadataProvider();
+                Locker mlocker(m);
+                xmltooling::QName idprole(samlconstants::SAML20MD_NS,IDPSSODescriptor::LOCAL_NAME);
+                MetadataProviderCriteria mc(*app, attrs->pendingIssuer.c_str(), &idprole,
+                                            samlconstants::SAML20P_NS);
+                pair<const EntityDescriptor*,const RoleDescriptor*> entity =
+                    m->getEntityDescriptor(mc);
+
+                // The metadata may have been reloaded since verification
+                if (entity.second) {
+                    vector<const opensaml::Assertion*> tokens;
+                    tokens.assign(attrs->pendingAssertions.begin(), attrs->pendingAssertions.end());
+
+                    LocalResolver lr(nullptr,nullptr);
+                    attrs->ctx = lr.resolveAttributes(
+                        *app,entity.second,samlconstants::SAML20P_NS,nullptr,attrs->pendingNameID,
+                            nullptr,nullptr,&tokens);
+                    indexSAMLAttributes(attrs);
+                } else {
+                    auto_ptr_char temp(attrs->pendingIssuer.c_str());
+                    GSSEAP_LOG(GSSEAP_LOG_ERROR, "no metadata found for issuer (%s), can't resolve attributes",
+                               temp.get());
                 }
+            } catch (exception& ex) {
+                GSSEAP_LOG(GSSEAP_LOG_ERROR, "Caught exception resolving attributes: %s", ex.what());
             }
         }
+        unlockServiceProvider(sp);
     }
 
-    if (localValue.empty())
+    attrs->clearPendingAssertions();
+}
+
+extern "C" void releaseSAMLAttributes(gss_eap_saml_attrs* attrs)
+{
+    delete attrs;
+}
+
+// The fingerprint of what attrs' response released, for keying
+// authorization caches (util_authz.c).
+// 1 on success; 0 on none
+extern "C" int getSAMLFingerprint(gss_eap_saml_attrs* attrs,
+                                  unsigned char value[SAML_FINGERPRINT_LENGTH])
+{
+    if (attrs == nullptr || attrs->fingerprint.length() != SAML_FINGERPRINT_LENGTH)
+        return 0;
+
+    memcpy(value, attrs->fingerprint.data(), SAML_FINGERPRINT_LENGTH);
+    return 1;
+}
+
+// 1 on success; 0 on not found
+extern "C" int getSAMLAttribute(gss_eap_saml_attrs* attrs, const char* attrib, char** value)
+{
+    *value = NULL;
+
+    if (attrs == nullptr)
+        return 0;
+
+    resolveSAMLAttributes(attrs);
+
+    gss_eap_string_map<string>::const_iterator i =
+        attrs->attrIndex.find(gss_eap_string_key(attrib));
+    if (i == attrs->attrIndex.end() || i->second.empty())
         return 0;
 
     // TODO: check for allocation failure here and elsewhere.
-    *value = strdup(localValue.c_str());
+    *value = strdup(i->second.c_str());
+    return 1;
+}
+
+// Pass every attribute alias with the value getSAMLAttribute() would
+// return for it to callback, stopping early if that returns 0. Used by
+// saml_verifierd to ship the attributes back to its client.
+// 1 on success; 0 on stopped early
+extern "C" int getSAMLAttributes(gss_eap_saml_attrs* attrs,
+                                 int (*callback)(void*, const char*, const char*),
+                                 void* data)
+{
+    if (attrs == nullptr)
+        return 1;
+
+    resolveSAMLAttributes(attrs);
+
+    for (gss_eap_string_map<string>::const_iterator i = attrs->attrIndex.begin();
+         i != attrs->attrIndex.end();
+         ++i) {
+        // Aliases are std::strings, so the key is NUL-terminated
+        if (!i->second.empty() &&
+            !callback(data, i->first.data, i->second.c_str()))
+            return 0;
+    }
+
     return 1;
 }
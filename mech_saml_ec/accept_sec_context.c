@@ -39,12 +39,14 @@
 
 #include <libxml/xmlreader.h>
 
-char* getSAMLRequest2(char *, int, int, int, char*);
-int verifySAMLResponse(const char*,int,char**,char**,char**,char**);
-int getSAMLAttribute(const char* attrib, char** value);
+int warmSAMLServiceProvider(void);
+int preforkSAMLServiceProvider(void);
 
-static xmlChar *gl_generated_key = NULL;
-static xmlChar *gl_encryption_type = NULL;
+static void
+freeXmlDoc(void *doc)
+{
+    xmlFreeDoc((xmlDocPtr)doc);
+}
 
 /*
  * Mark an acceptor context as ready for cryptographic operations
@@ -63,7 +65,8 @@ acceptReadyEap(OM_uint32 *minor, gss_ctx_id_t ctx, gss_cred_id_t cred)
                                &ctx->encryptionType);
 #else
     /* Cache encryption type specified by IdP */
-    major = krbStringToEnctype(gl_encryption_type, &ctx->encryptionType);
+    major = krbStringToEnctype((char *)ctx->acceptorCtx.encryptionType.value,
+                               &ctx->encryptionType);
 #endif
     if (GSS_ERROR(major))
         return major;
@@ -102,8 +105,8 @@ acceptReadyEap(OM_uint32 *minor, gss_ctx_id_t ctx, gss_cred_id_t cred)
                                    &ctx->rfc3961Key);
 #else
     major = gssEapDeriveRfc3961Key(minor,
-                                   gl_generated_key,
-                                   strlen(gl_generated_key),
+                                   ctx->acceptorCtx.generatedKey.value,
+                                   ctx->acceptorCtx.generatedKey.length,
                                    ctx->encryptionType,
                                    &ctx->rfc3961Key);
 #endif
@@ -189,9 +192,8 @@ eapGssSmAcceptVendorInfo(OM_uint32 *minor,
                          gss_buffer_t outputToken GSSEAP_UNUSED,
                          OM_uint32 *smFlags GSSEAP_UNUSED)
 {
-    if (MECH_SAML_EC_DEBUG)
-        fprintf(stdout, "GSS-EAP: vendor: %.*s\n",
-            (int)inputToken->length, (char *)inputToken->value);
+    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "GSS-EAP: vendor: %.*s",
+        (int)inputToken->length, (char *)inputToken->value);
 
     *minor = 0;
     return GSS_S_CONTINUE_NEEDED;
@@ -256,12 +258,11 @@ eapGssSmAcceptIdentity(OM_uint32 *minor,
 
     wpabuf_free(reqData);
 #else
-    saml_req = getSAMLRequest2(NULL, 0, ctx->gssFlags & GSS_C_MUTUAL_FLAG,
-                                ctx->gssFlags & GSS_C_DELEG_FLAG, NULL);
+    saml_req = gssEapSAMLRequest(NULL, 0, ctx->gssFlags & GSS_C_MUTUAL_FLAG,
+                                 ctx->gssFlags & GSS_C_DELEG_FLAG, NULL);
     major = makeStringBuffer(minor, saml_req?:"", outputToken);
-    if (MECH_SAML_EC_DEBUG)
-        fprintf(stdout, "--- SENDING SAML_AUTHREQUEST: ---\n%s\n", 
-           (char *)outputToken->value);
+    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "--- SENDING SAML_AUTHREQUEST: ---\n%s", 
+       (char *)outputToken->value);
     free(saml_req);
     saml_req = NULL;
 #endif
@@ -838,30 +839,6 @@ static struct gss_eap_sm eapGssAcceptorSm[] = {
 };
 
 
-/* Per timegm(3):
- * For a portable version of timegm(), set the TZ  environment
- * variable  to  UTC,  call mktime(3) and restore the value of
- * TZ.  Something like:
- */
-time_t
-my_timegm(struct tm *tm)
-{
-    time_t ret;
-    char *tz;
-
-    tz = getenv("TZ");
-    setenv("TZ", "", 1);
-    tzset();
-    ret = mktime(tm);
-    if (tz)
-        setenv("TZ", tz, 1);
-    else
-        unsetenv("TZ");
-    tzset();
-    return ret;
-}
-
-
 OM_uint32
 gssEapAcceptSecContext(OM_uint32 *minor,
                        gss_ctx_id_t ctx,
@@ -899,8 +876,8 @@ gssEapAcceptSecContext(OM_uint32 *minor,
         cred = ctx->cred;
     }
     else if (cred->name && MECH_SAML_EC_DEBUG)
-        fprintf(stdout, "CRED NAME IS: %.*s\n", cred->name->username.length,
-                   cred->name->username.value);
+        GSSEAP_LOG(GSSEAP_LOG_DEBUG, "CRED NAME IS: %.*s", (int)cred->name->username.length,
+                   (char *)cred->name->username.value);
 
     /*
      * Previously we acquired the credential mutex here, but it should not be
@@ -947,7 +924,7 @@ gssEapAcceptSecContext(OM_uint32 *minor,
 
         /* should see comma now */
         if (innerToken.length <= 0 || ((char *)innerToken.value)[0] != ',') {
-            fprintf(stderr, "ERROR: unexpected token content\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "unexpected token content");
             *minor = GSSEAP_WRONG_SIZE;
             major = GSS_S_DEFECTIVE_TOKEN;
             goto cleanup;
@@ -959,8 +936,7 @@ gssEapAcceptSecContext(OM_uint32 *minor,
         if (innerToken.length >= strlen(MECH_SAML_EC_MUTUAL_AUTH) &&
             strncmp(MECH_SAML_EC_MUTUAL_AUTH, innerToken.value,
                           strlen(MECH_SAML_EC_MUTUAL_AUTH)) == 0) {
-            if (MECH_SAML_EC_DEBUG)
-                fprintf(stdout, "NOTE: Mutual Authentication requested\n");
+            GSSEAP_LOG(GSSEAP_LOG_DEBUG, "Mutual Authentication requested");
             ctx->gssFlags |= GSS_C_MUTUAL_FLAG;
             innerToken.value += strlen(MECH_SAML_EC_MUTUAL_AUTH);
             innerToken.length -= strlen(MECH_SAML_EC_MUTUAL_AUTH);
@@ -968,7 +944,7 @@ gssEapAcceptSecContext(OM_uint32 *minor,
 
         /* should see comma now */
         if (innerToken.length <= 0 || ((char *)innerToken.value)[0] != ',') {
-            fprintf(stderr, "ERROR: unexpected token content\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "unexpected token content");
             *minor = GSSEAP_WRONG_SIZE;
             major = GSS_S_DEFECTIVE_TOKEN;
             goto cleanup;
@@ -980,16 +956,14 @@ gssEapAcceptSecContext(OM_uint32 *minor,
         if (innerToken.length >= strlen(MECH_SAML_EC_DELEG_REQ) &&
             strncmp(MECH_SAML_EC_DELEG_REQ, innerToken.value,
                           strlen(MECH_SAML_EC_DELEG_REQ)) == 0) {
-            if (MECH_SAML_EC_DEBUG)
-                fprintf(stdout, "NOTE: Credential Delegation requested\n");
-                fprintf(stderr, ">>>>>>>>>>>>>>>>>>>>>>>>NOTE: Credential Delegation requested\n");
+            GSSEAP_LOG(GSSEAP_LOG_INFO, "NOTE: Credential Delegation requested");
             ctx->gssFlags |= GSS_C_DELEG_FLAG;
             innerToken.value += strlen(MECH_SAML_EC_DELEG_REQ);
             innerToken.length -= strlen(MECH_SAML_EC_DELEG_REQ);
         }
 
         if (innerToken.length) {
-            fprintf(stderr, "ERROR: unexpected token content\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "unexpected token content");
             *minor = GSSEAP_WRONG_SIZE;
             major = GSS_S_DEFECTIVE_TOKEN;
             goto cleanup;
@@ -997,30 +971,33 @@ gssEapAcceptSecContext(OM_uint32 *minor,
 
         char *cb_data = NULL;
         if (input_chan_bindings != GSS_C_NO_CHANNEL_BINDINGS &&
-            input_chan_bindings->application_data.length != 0)
-            base64Encode(input_chan_bindings->application_data.value,
-                input_chan_bindings->application_data.length, &cb_data);
+            input_chan_bindings->application_data.length != 0) {
+            size_t cb_length = input_chan_bindings->application_data.length;
+
+            cb_data = gssEapArenaAlloc(&ctx->arena, BASE64_EXPAND(cb_length));
+            if (cb_data != NULL &&
+                base64EncodeTo(input_chan_bindings->application_data.value,
+                               (int)cb_length, cb_data) < 0)
+                cb_data = NULL;
+        }
 
         if (cb_data != NULL) {
             major = readChannelBindingsType(&tmpMinor, &cb_type);
             if (major != GSS_S_COMPLETE) {
-                fprintf(stderr, "ERROR: Couldn't find Channel Bindings Type\n");
+                GSSEAP_LOG(GSSEAP_LOG_ERROR, "Couldn't find Channel Bindings Type");
                 goto cleanup;
             }
         }
 
         if (cred->name)
-            saml_req = getSAMLRequest2(cred->name->username.value,
+            saml_req = gssEapSAMLRequest(cred->name->username.value,
                                 cred->name->username.length,
                                 ctx->gssFlags & GSS_C_MUTUAL_FLAG,
                                 ctx->gssFlags & GSS_C_DELEG_FLAG, cb_data);
         else
-            saml_req = getSAMLRequest2(NULL, 0,
+            saml_req = gssEapSAMLRequest(NULL, 0,
                                 ctx->gssFlags & GSS_C_MUTUAL_FLAG,
                                 ctx->gssFlags & GSS_C_DELEG_FLAG, cb_data);
-        if (cb_data != NULL) {
-            GSSEAP_FREE(cb_data); cb_data = NULL;
-        }
         if (saml_req != NULL) {
             major = makeStringBuffer(minor, saml_req?:"", output_token);
             free(saml_req); saml_req = NULL;
@@ -1028,80 +1005,80 @@ gssEapAcceptSecContext(OM_uint32 *minor,
             major = GSS_S_FAILURE;
 
         if (!GSS_ERROR(major)) {
-            if (MECH_SAML_EC_DEBUG)
-                fprintf(stdout, "--- SENDING SAML_AUTHREQUEST: ---\n%s\n", 
-                   (char *)output_token->value);
+            GSSEAP_LOG(GSSEAP_LOG_DEBUG, "--- SENDING SAML_AUTHREQUEST: ---\n%s", 
+               (char *)output_token->value);
                 major = GSS_S_CONTINUE_NEEDED;
                 ctx->state = GSSEAP_STATE_AUTHENTICATE;
         }
     } else {
 
-        // TODO: have verifySAMLResponse return any value found in
-        // SessionNotOnOrAfter in AuthnStatement and set ctx->expiryTime
-        // to that value.
         char* initiator_name = NULL;
-        char* session_not_on_or_after = NULL;
+        time_t session_not_on_or_after = 0;
         char* delegated_assertions = NULL;
-        if (gl_generated_key != NULL) {
-            free(gl_generated_key); gl_generated_key = NULL;
+        char* advice = NULL;
+        struct gss_eap_saml_attr_ctx *saml_attrs = NULL;
+        int result = gssEapSAMLVerify((char*)input_token->value,
+                                      (int)input_token->length,
+                                      &initiator_name, &session_not_on_or_after,
+                                      &advice, &delegated_assertions,
+                                      &saml_attrs);
+
+        /*
+         * The SAML layer's strings go with the rest of the handshake state,
+         * except for the initiator name, which becomes ctx->initiatorName.
+         */
+        OM_uint32 adoptMajor;
+        adoptMajor  = gssEapArenaAdopt(&tmpMinor, &ctx->arena, advice, free);
+        adoptMajor |= gssEapArenaAdopt(&tmpMinor, &ctx->arena, delegated_assertions, free);
+        if (GSS_ERROR(adoptMajor)) {
+            free(initiator_name);
+            gssEapSAMLReleaseAttributes(&saml_attrs);
+            major = GSS_S_FAILURE;
+            *minor = ENOMEM;
+            goto cleanup;
         }
-        int result = verifySAMLResponse((char*)input_token->value,
-                                        (int)input_token->length,
-                                        &initiator_name, &session_not_on_or_after,
-                                        &gl_generated_key, &delegated_assertions);
 
         if (result) {
             xmlDocPtr doc_from_client = xmlReadMemory(input_token->value, input_token->length, "FROMCLIENT", NULL, 0);
             xmlNode *elem = NULL;
             xmlNode *session_key = NULL;
             xmlNode *enc_type = NULL;
+            xmlChar *content;
+
+            major = gssEapArenaAdopt(minor, &ctx->arena, doc_from_client,
+                                     freeXmlDoc);
+            if (GSS_ERROR(major))
+                goto verify_cleanup;
 
             if (initiator_name) {
-                gss_buffer_desc buf = {0, NULL};
-                if (MECH_SAML_EC_DEBUG)
-                    fprintf(stdout,"initiator name = '%s'\n",initiator_name);
-                major = makeStringBuffer(minor, initiator_name, &buf);
-                if (major == GSS_S_COMPLETE)
-                    major = gssEapImportName(minor, &buf, GSS_C_NT_USER_NAME,
-					 GSS_C_NO_OID, &ctx->initiatorName);
-                major = GSS_S_COMPLETE;
+                GSSEAP_LOG(GSSEAP_LOG_DEBUG, "initiator name = '%s'",initiator_name);
+                gssEapReleaseName(&tmpMinor, &ctx->initiatorName);
+                /* Freed by gssEapAdoptUserName() on failure too */
+                major = gssEapAdoptUserName(minor, initiator_name,
+                                            &ctx->initiatorName);
+                initiator_name = NULL;
+                if (GSS_ERROR(major))
+                    goto verify_cleanup;
                 ctx->state = GSSEAP_STATE_ESTABLISHED;
             } else {
-                fprintf(stderr, "ERROR: initiator name not available\n");
+                GSSEAP_LOG(GSSEAP_LOG_ERROR, "initiator name not available");
                 major = GSS_S_BAD_NAME;
                 *minor = GSSEAP_BAD_INITIATOR_NAME;
                 goto verify_cleanup;
             }
 
-            if (session_not_on_or_after) {
-                struct tm session_tm;
-                memset(&session_tm, 0, sizeof(session_tm));
-                sscanf(session_not_on_or_after, "%d-%d-%dT%d:%d:%d.",
-                              &session_tm.tm_year, &session_tm.tm_mon,
-                              &session_tm.tm_mday, &session_tm.tm_hour,
-                              &session_tm.tm_min, &session_tm.tm_sec);
-                /* TODO VSY: check sscanf succeeded */
-                session_tm.tm_year -= 1900; /* tm_year is number of years since 1900 */
-                session_tm.tm_mon -= 1; /* month value should be 0 thru 11 */
-                session_tm.tm_isdst = -1; /* DST not known */
-                ctx->expiryTime = my_timegm(&session_tm);
-                printf("CONTEXT VALID FOR (%d) SECONDS!\n", ctx->expiryTime - time(NULL));
-                if (MECH_SAML_EC_DEBUG)
-                    fprintf(stdout, "session_not_on_or_after is (%s);"
-                              " (%d)(%d)(%d)T(%d)(%d)(%d)\n",
-                              session_not_on_or_after,
-                              session_tm.tm_year, session_tm.tm_mon,
-                              session_tm.tm_mday, session_tm.tm_hour,
-                              session_tm.tm_min, session_tm.tm_sec);
+            if (session_not_on_or_after != 0) {
+                ctx->expiryTime = session_not_on_or_after;
+                GSSEAP_LOG(GSSEAP_LOG_INFO, "CONTEXT VALID FOR (%ld) SECONDS",
+                           (long)(ctx->expiryTime - time(NULL)));
             } else {
-                fprintf(stderr, "WARNING: SessionNotOnOrAfter not available;"
-                                " defaulting to indefinite context validity.\n");
+                GSSEAP_LOG(GSSEAP_LOG_WARNING, "WARNING: SessionNotOnOrAfter not available;"
+                           " defaulting to indefinite context validity.");
             }
 
             if (delegated_assertions != NULL && delegated_cred_handle != NULL) {
                 
-                if (MECH_SAML_EC_DEBUG)
-                    printf("NOTE: Delegated Assertion(s): (%s)", delegated_assertions);
+                GSSEAP_LOG(GSSEAP_LOG_DEBUG, "Delegated Assertion(s): (%s)", delegated_assertions);
 
                 major = gssEapAcquireCred(minor, ctx->initiatorName,
                                       GSS_C_INDEFINITE /* timeReq TODO: ENABLE THIS in gssEapAcquireCred*/,
@@ -1109,24 +1086,20 @@ gssEapAcceptSecContext(OM_uint32 *minor,
                                       GSS_C_INITIATE, delegated_cred_handle,
                                       NULL, NULL);
                 if (GSS_ERROR(major)) {
-                    fprintf(stderr, "ERROR: gssEapAcquireCred failed for delegated "
-                                    "credential\n");
+                    GSSEAP_LOG(GSSEAP_LOG_ERROR, "gssEapAcquireCred failed for delegated "
+                                    "credential");
                     goto verify_cleanup;
                 }
 
-                gss_buffer_desc buf = {0, NULL};
-                major = makeStringBuffer(minor, delegated_assertions,
-                                    &buf);
-                if (GSS_ERROR(major)) {
-                    fprintf(stderr, "ERROR: makeStringBuffer failed for delegated "
-                                    "credential\n");
-                    goto verify_cleanup;
-                }
+                /* gssEapSetCredDelegAssertions() makes its own copy */
+                gss_buffer_desc buf;
+                buf.value = delegated_assertions;
+                buf.length = strlen(delegated_assertions);
 
                 major = gssEapSetCredDelegAssertions(minor, delegated_cred_handle, &buf);
                 if (GSS_ERROR(major)) {
-                    fprintf(stderr, "ERROR: gssEapSetCredDelegAssertions failed for delegated "
-                                    "credential\n");
+                    GSSEAP_LOG(GSSEAP_LOG_ERROR, "gssEapSetCredDelegAssertions failed for delegated "
+                                    "credential");
                     goto verify_cleanup;
                 }
 
@@ -1137,49 +1110,96 @@ gssEapAcceptSecContext(OM_uint32 *minor,
             // is able to return the actual key instead of the whole Advice XML
             xmlDocPtr advice_from_idp = NULL;
             xmlNode *gen_key = NULL;
-            if (gl_generated_key == NULL ||
-                (advice_from_idp = xmlReadMemory(gl_generated_key,
-                            strlen(gl_generated_key), "ADVICE", NULL, 0)) == NULL ||
+            /* Per context: concurrent accepts each have their own key */
+            gss_release_buffer(&tmpMinor, &ctx->acceptorCtx.generatedKey);
+            gss_release_buffer(&tmpMinor, &ctx->acceptorCtx.encryptionType);
+            if (advice == NULL ||
+                (advice_from_idp = xmlReadMemory(advice,
+                            strlen(advice), "ADVICE", NULL, 0)) == NULL ||
+                GSS_ERROR(gssEapArenaAdopt(&tmpMinor, &ctx->arena,
+                                           advice_from_idp, freeXmlDoc)) ||
                 (gen_key = getXmlElement(xmlDocGetRootElement(advice_from_idp),
                  "GeneratedKey", MECH_SAML_EC_SAMLEC_NS)) == NULL) {
                 if (getenv("MECH_SAML_EC_FORCE_SAMPLE_KEY")) {
-                    fprintf(stderr, "WARNING: No GeneratedKey in SAML Response from IdP; "
-                            "Since MECH_SAML_EC_FORCE_SAMPLE_KEY is set in the "
-                            "environment, forcing use of a sample key!\n");
-
-                    gl_generated_key = strdup("3w1wSBKUosRLsU69xGK7dg==");
+                    GSSEAP_LOG(GSSEAP_LOG_WARNING, "WARNING: No GeneratedKey in SAML Response from IdP; "
+                               "Since MECH_SAML_EC_FORCE_SAMPLE_KEY is set in the "
+                               "environment, forcing use of a sample key!");
+
+                    major = makeStringBuffer(minor, "3w1wSBKUosRLsU69xGK7dg==",
+                                             &ctx->acceptorCtx.generatedKey);
+                    if (GSS_ERROR(major))
+                        goto verify_cleanup;
                 } else {
-                    fprintf(stderr, "ERROR: No GeneratedKey in SAML assertion from IdP; "
+                    GSSEAP_LOG(GSSEAP_LOG_ERROR, "No GeneratedKey in SAML assertion from IdP; "
                         "To force use of a sample key set "
                         "MECH_SAML_EC_FORCE_SAMPLE_KEY in the "
-                        "environment!\n");
+                        "environment!");
                     *minor = GSSEAP_KEY_UNAVAILABLE;
                     major = GSS_S_FAILURE;
                     goto verify_cleanup;
                 }
-            } else
-                gl_generated_key = xmlNodeGetContent(gen_key);
-
-            if (MECH_SAML_EC_DEBUG)
-                fprintf(stdout, "GeneratedKey (%s)\n", gl_generated_key);
+            } else {
+                content = xmlNodeGetContent(gen_key);
+                major = makeStringBuffer(minor, (char *)content,
+                                         &ctx->acceptorCtx.generatedKey);
+                xmlFree(content);
+                if (GSS_ERROR(major))
+                    goto verify_cleanup;
+            }
 
             if ((session_key = getXmlElement(xmlDocGetRootElement(doc_from_client), "SessionKey", MECH_SAML_EC_SAMLEC_NS)) != NULL &&
                 (enc_type = getXmlElement(session_key->children, "EncType", MECH_SAML_EC_SAMLEC_NS)) != NULL) {
-                gl_encryption_type = xmlNodeGetContent(enc_type);
+                content = xmlNodeGetContent(enc_type);
+                major = makeStringBuffer(minor, (char *)content,
+                                         &ctx->acceptorCtx.encryptionType);
+                xmlFree(content);
+                if (GSS_ERROR(major))
+                    goto verify_cleanup;
             } else {
-                fprintf(stderr, "ERROR: SessionKey/EncType not sent by initiator(client)\n");
+                GSSEAP_LOG(GSSEAP_LOG_ERROR, "SessionKey/EncType not sent by initiator(client)");
                 major = GSS_S_FAILURE;
                 *minor = GSSEAP_KEY_UNAVAILABLE;
                 goto verify_cleanup;
             }
 
+            /*
+             * The name keeps the attributes of this verification, which
+             * are resolved when first asked for. Looking local-login-user
+             * up resolves all of them, so a principal that logged in
+             * recently with the same attributes gets it from the
+             * authorization cache instead. Either way the name keeps it,
+             * for gss_userok().
+             */
+            gssEapSAMLReleaseAttributes(&ctx->initiatorName->samlAttrs);
+            ctx->initiatorName->samlAttrs = saml_attrs;
+            saml_attrs = NULL;
+
             char *local_login = NULL;
-            if (getSAMLAttribute("local-login-user", &local_login) == 1)
+            unsigned char fingerprint[SAML_FINGERPRINT_LENGTH];
+            int haveFingerprint =
+                gssEapSAMLFingerprint(ctx->initiatorName->samlAttrs, fingerprint);
+            if (haveFingerprint &&
+                gssEapAuthzCacheLookup(ctx->initiatorName, fingerprint,
+                                       &ctx->initiatorName->localName))
             {
-                fprintf(stdout, "local-login-user is (%s)\n", local_login);
-                free(local_login); local_login = NULL;
+                GSSEAP_LOG(GSSEAP_LOG_INFO, "local-login-user is (%.*s), from the cache",
+                           (int)ctx->initiatorName->localName.length,
+                           (char *)ctx->initiatorName->localName.value);
+            } else if (gssEapSAMLAttribute(ctx->initiatorName->samlAttrs,
+                                           MECH_SAML_EC_LOCAL_LOGIN_ATTR,
+                                           &local_login) == 1)
+            {
+                GSSEAP_LOG(GSSEAP_LOG_INFO, "local-login-user is (%s)", local_login);
+                /* Adopted: from malloc(), like the name's other buffers */
+                ctx->initiatorName->localName.value = local_login;
+                ctx->initiatorName->localName.length = strlen(local_login);
+                local_login = NULL;
+                if (haveFingerprint)
+                    gssEapAuthzCacheStore(ctx->initiatorName, fingerprint,
+                                          &ctx->initiatorName->localName,
+                                          ctx->expiryTime);
             } else {
-                fprintf(stderr, "ERROR: local-login-user not available\n");
+                GSSEAP_LOG(GSSEAP_LOG_ERROR, "local-login-user not available");
                 major = GSS_S_BAD_NAME;
                 *minor = GSSEAP_BAD_INITIATOR_NAME;
                 goto verify_cleanup;
@@ -1192,8 +1212,9 @@ gssEapAcceptSecContext(OM_uint32 *minor,
         }
 
 verify_cleanup:
-        free(initiator_name); initiator_name = NULL;
-        free(session_not_on_or_after); session_not_on_or_after = NULL;
+        /* Other SAML strings and documents are released with ctx->arena */
+        free(initiator_name);
+        gssEapSAMLReleaseAttributes(&saml_attrs);
     }
 #endif
     if (GSS_ERROR(major))
@@ -1219,10 +1240,9 @@ verify_cleanup:
             major = gssEapDuplicateName(&tmpMinor, ctx->initiatorName, src_name);
             if (GSS_ERROR(major))
                 goto cleanup;
-            if (MECH_SAML_EC_DEBUG)
-                fprintf(stdout, "SOURCE NAME IS (%.*s)\n",
-                                   ctx->initiatorName->username.length,
-                                   (char *)(ctx->initiatorName->username.value));
+            GSSEAP_LOG(GSSEAP_LOG_DEBUG, "SOURCE NAME IS (%.*s)",
+                               (int)ctx->initiatorName->username.length,
+                               (char *)(ctx->initiatorName->username.value));
         }
         if (time_rec != NULL) {
             major = gssEapContextTime(&tmpMinor, ctx, time_rec);
@@ -1237,6 +1257,45 @@ cleanup:
     return major;
 }
 
+/*
+ * Do the one-time work the first handshake would otherwise stall on:
+ * the Kerberos context of the calling thread, libxml2, the attribute
+ * providers and the Shibboleth SP runtime with its metadata,
+ * credentials and trust engine, unless saml_verifierd owns the latter.
+ * Reached through the GSS_EAP_CRED_SET_WARM_UP credential option, or
+ * GSS_EAP_CRED_SET_PREFORK when prefork is set, in which case the SP is
+ * also shared with the processes subsequently forked from this one.
+ */
+OM_uint32
+gssEapWarmUpAcceptor(OM_uint32 *minor, int prefork)
+{
+    int warmed;
+    OM_uint32 major;
+    krb5_context krbContext;
+
+    GSSEAP_KRB_INIT(&krbContext);
+
+    xmlInitParser();
+
+    major = gssEapAttrProvidersInit(minor);
+    if (GSS_ERROR(major))
+        return major;
+
+    if (gssEapVerifierEnabled())
+        warmed = 1;     /* saml_verifierd owns the SP */
+    else if (prefork)
+        warmed = preforkSAMLServiceProvider();
+    else
+        warmed = warmSAMLServiceProvider();
+    if (!warmed) {
+        *minor = GSSEAP_SHIB_INIT_FAILURE;
+        return GSS_S_FAILURE;
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
 OM_uint32 GSSAPI_CALLCONV
 gss_accept_sec_context(OM_uint32 *minor,
                        gss_ctx_id_t *context_handle,
@@ -1266,10 +1325,14 @@ gss_accept_sec_context(OM_uint32 *minor,
         return GSS_S_DEFECTIVE_TOKEN;
     }
 
+    GSSEAP_ALLOC_SCOPE_ENTER(GSSEAP_ALLOC_SCOPE_HANDSHAKE);
+
     if (ctx == GSS_C_NO_CONTEXT) {
         major = gssEapAllocContext(minor, &ctx);
-        if (GSS_ERROR(major))
+        if (GSS_ERROR(major)) {
+            GSSEAP_ALLOC_SCOPE_LEAVE(FALSE);
             return major;
+        }
 
         *context_handle = ctx;
     }
@@ -1288,10 +1351,17 @@ gss_accept_sec_context(OM_uint32 *minor,
                                    time_rec,
                                    delegated_cred_handle);
 
+    if (major == GSS_S_COMPLETE)
+        gssEapArenaRelease(&ctx->arena);
+
     GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
 
+    gssEapMetricsOutcome(FALSE, major, *minor);
+
     if (GSS_ERROR(major))
         gssEapReleaseContext(&tmpMinor, context_handle);
 
+    GSSEAP_ALLOC_SCOPE_LEAVE(major == GSS_S_COMPLETE);
+
     return major;
 }
@@ -38,10 +38,28 @@
 
 OM_uint32 GSSAPI_CALLCONV
 gssspi_authorize_localname(OM_uint32 *minor,
-                           const gss_name_t name GSSEAP_UNUSED,
-                           gss_const_buffer_t local_user GSSEAP_UNUSED,
-                           gss_const_OID local_nametype GSSEAP_UNUSED)
+                           const gss_name_t name,
+                           gss_const_buffer_t local_user,
+                           gss_const_OID local_nametype)
 {
+#ifdef GSSEAP_ENABLE_ACCEPTOR
+    /*
+     * The acceptor records the local account that local-login-user
+     * named, either from the attribute or from the authorization cache,
+     * so the decision needs no attribute lookup.
+     */
+    if (name != GSS_C_NO_NAME && name->localName.value != NULL &&
+        (local_nametype == GSS_C_NO_OID ||
+         oidEqual(local_nametype, GSS_C_NT_USER_NAME))) {
+        *minor = 0;
+        if (local_user->length == name->localName.length &&
+            memcmp(local_user->value, name->localName.value,
+                   local_user->length) == 0)
+            return GSS_S_COMPLETE;
+        return GSS_S_UNAUTHORIZED;
+    }
+#endif
+
     /*
      * The MIT mechglue will fallback to comparing names in the absence
      * of a mechanism implementation of gss_userok. To avoid this and
@@ -0,0 +1,292 @@
+#!/bin/sh
+#
+# Regenerate the SAML-EC replay corpus used by saml_replay.
+#
+# Every case directory holds the three documents of one exchange:
+#
+#   sp-request.xml    PAOS AuthnRequest as sent by the acceptor (SP)
+#   idp-response.xml  ECP response as returned by the IdP
+#   sp-token.xml      the IdP response as forwarded by the initiator
+#
+# The keys under keys/ are checked in and all names, IDs, timestamps
+# and session keys are fixed, so signatures only change if the keys
+# do.  Needs openssl, xmllint and xxd.
+#
+
+set -e
+
+cd "`dirname "$0"`"
+
+IDP="https://idp.example.org/idp/shibboleth"
+IDP_ECP="https://idp.example.org/idp/profile/SAML2/SOAP/ECP"
+SP="https://sp.example.org/shibboleth"
+ACS="https://sp.example.org/Shibboleth.sso/SAML2/ECP"
+ISSUE="2026-01-01T00:00:00Z"
+EXPIRE="2099-01-01T00:00:00Z"
+RELAY="cookie:0a1b2c3d4e"
+GENKEY="3w1wSBKUosRLsU69xGK7dg=="
+ENCTYPE="aes128-cts-hmac-sha1-96"
+
+SOAP="http://schemas.xmlsoap.org/soap/envelope/"
+ACTOR="http://schemas.xmlsoap.org/soap/actor/next"
+PAOS="urn:liberty:paos:2003-08"
+ECP="urn:oasis:names:tc:SAML:2.0:profiles:SSO:ecp"
+SAML="urn:oasis:names:tc:SAML:2.0:assertion"
+SAMLP="urn:oasis:names:tc:SAML:2.0:protocol"
+SAMLEC="urn:ietf:params:xml:ns:samlec"
+DS="http://www.w3.org/2000/09/xmldsig#"
+XENC="http://www.w3.org/2001/04/xmlenc#"
+EXC_C14N="http://www.w3.org/2001/10/xml-exc-c14n#"
+DELEGATION="urn:oasis:names:tc:SAML:2.0:conditions:delegation"
+
+HDR="S:actor=\"$ACTOR\" S:mustUnderstand=\"1\""
+
+#
+# Keys
+#
+for who in idp sp; do
+    if [ ! -f keys/$who-key.pem ]; then
+        openssl req -x509 -newkey rsa:2048 -nodes -sha256 -days 27000 \
+            -subj "/CN=$who.example.org" \
+            -keyout keys/$who-key.pem -out keys/$who-cert.pem 2>/dev/null
+    fi
+done
+
+certb64() {
+    sed -e '/-----/d' "$1" | tr -d '\n'
+}
+
+IDP_CERT=`certb64 keys/idp-cert.pem`
+SP_CERT=`certb64 keys/sp-cert.pem`
+
+#
+# sign KEY CERT: read an element containing <!--SIGNATURE--> where its
+# enveloped ds:Signature belongs, and write it out signed with
+# RSA-SHA256 over the exclusive canonical form.
+#
+sign() {
+    tmp=`mktemp`
+    cat > $tmp
+    id=`sed -n -e 's/^<[^>]* ID="\([^"]*\)".*/\1/p' $tmp`
+    digest=`sed -e 's/<!--SIGNATURE-->//' $tmp | xmllint --exc-c14n - |
+            openssl dgst -sha256 -binary | openssl base64 -A`
+    si="<ds:CanonicalizationMethod Algorithm=\"$EXC_C14N\"/>"
+    si="$si<ds:SignatureMethod Algorithm=\"http://www.w3.org/2001/04/xmldsig-more#rsa-sha256\"/>"
+    si="$si<ds:Reference URI=\"#$id\"><ds:Transforms>"
+    si="$si<ds:Transform Algorithm=\"http://www.w3.org/2000/09/xmldsig#enveloped-signature\"/>"
+    si="$si<ds:Transform Algorithm=\"$EXC_C14N\"/></ds:Transforms>"
+    si="$si<ds:DigestMethod Algorithm=\"http://www.w3.org/2001/04/xmlenc#sha256\"/>"
+    si="$si<ds:DigestValue>$digest</ds:DigestValue></ds:Reference>"
+    sigval=`echo "<ds:SignedInfo xmlns:ds=\"$DS\">$si</ds:SignedInfo>" |
+            xmllint --exc-c14n - |
+            openssl dgst -sha256 -sign "$1" | openssl base64 -A`
+    sig="<ds:Signature xmlns:ds=\"$DS\"><ds:SignedInfo>$si</ds:SignedInfo>"
+    sig="$sig<ds:SignatureValue>$sigval</ds:SignatureValue>"
+    sig="$sig<ds:KeyInfo><ds:X509Data><ds:X509Certificate>`certb64 "$2"`"
+    sig="$sig</ds:X509Certificate></ds:X509Data></ds:KeyInfo></ds:Signature>"
+    sed -e "s|<!--SIGNATURE-->|$sig|" $tmp
+    rm -f $tmp
+}
+
+idpsign() {
+    sign keys/idp-key.pem keys/idp-cert.pem
+}
+
+nosign() {
+    sed -e 's/<!--SIGNATURE-->//'
+}
+
+#
+# encrypt NAME: read an element and write it out as an EncryptedAssertion
+# for the SP, AES-128-CBC under a key and IV derived from NAME.
+#
+encrypt() {
+    key=`printf '%s' "key:$1" | openssl dgst -md5 -r | cut -c1-32`
+    iv=`printf '%s' "iv:$1" | openssl dgst -md5 -r | cut -c1-32`
+    ct=`( printf '%s' $iv | xxd -r -p;
+          openssl enc -aes-128-cbc -K $key -iv $iv ) | openssl base64 -A`
+    ek=`printf '%s' $key | xxd -r -p |
+        openssl pkeyutl -encrypt -certin -inkey keys/sp-cert.pem \
+            -pkeyopt rsa_padding_mode:oaep | openssl base64 -A`
+    printf '%s' "<saml:EncryptedAssertion xmlns:saml=\"$SAML\">"
+    printf '%s' "<xenc:EncryptedData xmlns:xenc=\"$XENC\" Type=\"${XENC}Element\">"
+    printf '%s' "<xenc:EncryptionMethod Algorithm=\"${XENC}aes128-cbc\"/>"
+    printf '%s' "<ds:KeyInfo xmlns:ds=\"$DS\"><xenc:EncryptedKey>"
+    printf '%s' "<xenc:EncryptionMethod Algorithm=\"${XENC}rsa-oaep-mgf1p\">"
+    printf '%s' "<ds:DigestMethod Algorithm=\"${DS}sha1\"/></xenc:EncryptionMethod>"
+    printf '%s' "<ds:KeyInfo><ds:X509Data><ds:X509Certificate>$SP_CERT"
+    printf '%s' "</ds:X509Certificate></ds:X509Data></ds:KeyInfo>"
+    printf '%s' "<xenc:CipherData><xenc:CipherValue>$ek</xenc:CipherValue>"
+    printf '%s' "</xenc:CipherData></xenc:EncryptedKey></ds:KeyInfo>"
+    printf '%s' "<xenc:CipherData><xenc:CipherValue>$ct</xenc:CipherValue>"
+    printf '%s' "</xenc:CipherData></xenc:EncryptedData></saml:EncryptedAssertion>"
+}
+
+attribute() {
+    printf '%s' "<saml:Attribute Name=\"$1\" NameFormat=\"urn:oasis:names:tc:SAML:2.0:attrname-format:uri\">"
+    shift
+    for v in "$@"; do
+        printf '%s' "<saml:AttributeValue>$v</saml:AttributeValue>"
+    done
+    printf '%s' "</saml:Attribute>"
+}
+
+# assertion CASE N USER AUDIENCES ATTRIBUTES
+assertion() {
+    printf '%s' "<saml:Assertion xmlns:saml=\"$SAML\" ID=\"_a-$1-$2\" IssueInstant=\"$ISSUE\" Version=\"2.0\">"
+    printf '%s' "<saml:Issuer>$IDP</saml:Issuer><!--SIGNATURE-->"
+    printf '%s' "<saml:Subject><saml:NameID Format=\"urn:oasis:names:tc:SAML:2.0:nameid-format:transient\""
+    printf '%s' " NameQualifier=\"$IDP\" SPNameQualifier=\"$SP\">_nameid-$1</saml:NameID>"
+    printf '%s' "<saml:SubjectConfirmation Method=\"urn:oasis:names:tc:SAML:2.0:cm:bearer\">"
+    printf '%s' "<saml:SubjectConfirmationData InResponseTo=\"_req-$1\" NotOnOrAfter=\"$EXPIRE\" Recipient=\"$ACS\"/>"
+    printf '%s' "</saml:SubjectConfirmation></saml:Subject>"
+    printf '%s' "<saml:Conditions NotBefore=\"$ISSUE\" NotOnOrAfter=\"$EXPIRE\"><saml:AudienceRestriction>"
+    for a in $4; do
+        printf '%s' "<saml:Audience>$a</saml:Audience>"
+    done
+    printf '%s' "</saml:AudienceRestriction></saml:Conditions>"
+    printf '%s' "<saml:Advice><samlec:GeneratedKey xmlns:samlec=\"$SAMLEC\">$GENKEY</samlec:GeneratedKey></saml:Advice>"
+    printf '%s' "<saml:AuthnStatement AuthnInstant=\"$ISSUE\" SessionIndex=\"_s-$1\" SessionNotOnOrAfter=\"$EXPIRE\">"
+    printf '%s' "<saml:AuthnContext><saml:AuthnContextClassRef>"
+    printf '%s' "urn:oasis:names:tc:SAML:2.0:ac:classes:PasswordProtectedTransport"
+    printf '%s' "</saml:AuthnContextClassRef></saml:AuthnContext></saml:AuthnStatement>"
+    printf '%s' "<saml:AttributeStatement>"
+    attribute "urn:oid:0.9.2342.19200300.100.1.1" "$3"
+    printf '%s' "$5"
+    printf '%s' "</saml:AttributeStatement></saml:Assertion>"
+}
+
+# request CASE SIGNED
+request() {
+    printf '%s' "<S:Envelope xmlns:S=\"$SOAP\"><S:Header>"
+    printf '%s' "<paos:Request xmlns:paos=\"$PAOS\" $HDR responseConsumerURL=\"$ACS\" service=\"$ECP\"/>"
+    printf '%s' "<samlec:SessionKey xmlns:samlec=\"$SAMLEC\" $HDR><samlec:EncType>$ENCTYPE</samlec:EncType></samlec:SessionKey>"
+    printf '%s' "<ecp:Request xmlns:ecp=\"$ECP\" $HDR IsPassive=\"0\"><saml:Issuer xmlns:saml=\"$SAML\">$SP</saml:Issuer></ecp:Request>"
+    printf '%s' "<ecp:RelayState xmlns:ecp=\"$ECP\" $HDR>$RELAY</ecp:RelayState>"
+    printf '%s' "</S:Header><S:Body>"
+    {
+        printf '%s' "<samlp:AuthnRequest xmlns:samlp=\"$SAMLP\" xmlns:saml=\"$SAML\""
+        printf '%s' " AssertionConsumerServiceURL=\"$ACS\" ID=\"_req-$1\" IssueInstant=\"$ISSUE\""
+        printf '%s' " ProtocolBinding=\"urn:oasis:names:tc:SAML:2.0:bindings:PAOS\" Version=\"2.0\">"
+        printf '%s' "<saml:Issuer>$SP</saml:Issuer><!--SIGNATURE--><samlp:NameIDPolicy AllowCreate=\"1\"/>"
+        printf '%s' "<saml:Conditions><saml:AudienceRestriction><saml:Audience>$DELEGATION"
+        printf '%s\n' "</saml:Audience></saml:AudienceRestriction></saml:Conditions></samlp:AuthnRequest>"
+    } | if [ "$2" = signed ]; then
+        sign keys/sp-key.pem keys/sp-cert.pem
+    else
+        nosign
+    fi | tr -d '\n'
+    printf '%s\n' "</S:Body></S:Envelope>"
+}
+
+# response CASE SIGNED ASSERTIONS
+response() {
+    {
+        printf '%s' "<samlp:Response xmlns:samlp=\"$SAMLP\" xmlns:saml=\"$SAML\" ID=\"_resp-$1\""
+        printf '%s' " InResponseTo=\"_req-$1\" IssueInstant=\"$ISSUE\" Version=\"2.0\" Destination=\"$ACS\">"
+        printf '%s' "<saml:Issuer>$IDP</saml:Issuer><!--SIGNATURE-->"
+        printf '%s' "<samlp:Status><samlp:StatusCode Value=\"urn:oasis:names:tc:SAML:2.0:status:Success\"/></samlp:Status>"
+        printf '%s' "$3"
+        printf '%s\n' "</samlp:Response>"
+    } | if [ "$2" = signed ]; then
+        sign keys/idp-key.pem keys/idp-cert.pem
+    else
+        nosign
+    fi | tr -d '\n'
+}
+
+# envelope HEADER BODY
+envelope() {
+    printf '%s%s%s%s%s\n' "<S:Envelope xmlns:S=\"$SOAP\"><S:Header>" "$1" \
+        "</S:Header><S:Body>" "$2" "</S:Body></S:Envelope>"
+}
+
+# exchange CASE REQUEST-SIGNED RESPONSE-SIGNED DELEGATED ASSERTIONS
+exchange() {
+    mkdir -p $1
+    request $1 $2 > $1/sp-request.xml
+
+    body=`response $1 $3 "$5"`
+    head="<ecp:Response xmlns:ecp=\"$ECP\" $HDR AssertionConsumerServiceURL=\"$ACS\"/>"
+    if [ "$2" = signed ]; then
+        head="$head<ecp:RequestAuthenticated xmlns:ecp=\"$ECP\" S:actor=\"$ACTOR\"/>"
+    fi
+    deleg=
+    if [ "$4" = delegated ]; then
+        deleg="<samlec:Delegated xmlns:samlec=\"$SAMLEC\" $HDR/>"
+    fi
+
+    envelope "$head<samlec:GeneratedKey xmlns:samlec=\"$SAMLEC\" $HDR>$GENKEY</samlec:GeneratedKey>$deleg" \
+        "$body" > $1/idp-response.xml
+
+    # What processSAMLRequest() forwards: GeneratedKey replaced by the
+    # negotiated SessionKey, RelayState copied from the SP request.
+    envelope "$head<samlec:SessionKey xmlns:samlec=\"$SAMLEC\"><samlec:EncType>$ENCTYPE</samlec:EncType></samlec:SessionKey>$deleg<ecp:RelayState xmlns:ecp=\"$ECP\" $HDR>$RELAY</ecp:RelayState>" \
+        "$body" > $1/sp-token.xml
+}
+
+#
+# Cases
+#
+# Plain exchange: one signed assertion, a handful of attributes
+attrs="$(attribute "urn:oid:1.3.6.1.4.1.5923.1.1.1.6" "user0001@example.org")"
+attrs="$attrs$(attribute "urn:oid:0.9.2342.19200300.100.1.3" "user0001@example.org")"
+a1="$(assertion basic 1 user0001 "$SP" "$attrs" | idpsign)"
+exchange basic unsigned unsigned none "$a1"
+
+# Signed AuthnRequest, signed Response as well as assertion
+a1="$(assertion signed-request 1 user0002 "$SP" "$attrs" | idpsign)"
+exchange signed-request signed signed none "$a1"
+
+# Signed assertion encrypted for the SP
+a1="$(assertion encrypted 1 user0003 "$SP" "$attrs" | idpsign | encrypt encrypted)"
+exchange encrypted unsigned unsigned none "$a1"
+
+# Three assertions, one of them delegated (audience is the IdP)
+a1="$(assertion multi-assertion 1 user0004 "$SP" "$attrs" | idpsign)"
+a2="$(assertion multi-assertion 2 user0004 "$SP" "" | idpsign)"
+a3="$(assertion multi-assertion 3 user0004 "$SP $IDP" "" | idpsign)"
+exchange multi-assertion unsigned signed delegated "$a1$a2$a3"
+
+# Large attribute statement: 200 entitlement values plus 50 attributes
+values=
+i=1
+while [ $i -le 200 ]; do
+    values="$values urn:example:entitlement:$(printf %04d $i)"
+    i=$(expr $i + 1)
+done
+attrs="$(attribute "urn:oid:1.3.6.1.4.1.5923.1.1.1.7" $values)"
+i=1
+while [ $i -le 50 ]; do
+    attrs="$attrs$(attribute "urn:example:attribute:$i" "value-$i-a" "value-$i-b")"
+    i=$(expr $i + 1)
+done
+a1="$(assertion large-attributes 1 user0005 "$SP" "$attrs" | idpsign)"
+exchange large-attributes unsigned unsigned none "$a1"
+
+#
+# Metadata for both parties
+#
+cat > metadata.xml <<EOF
+<md:EntitiesDescriptor xmlns:md="urn:oasis:names:tc:SAML:2.0:metadata"
+    xmlns:ds="$DS" Name="urn:example:saml-ec-corpus">
+  <md:EntityDescriptor entityID="$IDP">
+    <md:IDPSSODescriptor protocolSupportEnumeration="$SAMLP">
+      <md:KeyDescriptor use="signing">
+        <ds:KeyInfo><ds:X509Data><ds:X509Certificate>$IDP_CERT</ds:X509Certificate></ds:X509Data></ds:KeyInfo>
+      </md:KeyDescriptor>
+      <md:SingleSignOnService Binding="urn:oasis:names:tc:SAML:2.0:bindings:SOAP"
+          Location="$IDP_ECP"/>
+    </md:IDPSSODescriptor>
+  </md:EntityDescriptor>
+  <md:EntityDescriptor entityID="$SP">
+    <md:SPSSODescriptor protocolSupportEnumeration="$SAMLP">
+      <md:KeyDescriptor>
+        <ds:KeyInfo><ds:X509Data><ds:X509Certificate>$SP_CERT</ds:X509Certificate></ds:X509Data></ds:KeyInfo>
+      </md:KeyDescriptor>
+      <md:AssertionConsumerService Binding="urn:oasis:names:tc:SAML:2.0:bindings:PAOS"
+          Location="$ACS" index="1"/>
+    </md:SPSSODescriptor>
+  </md:EntityDescriptor>
+</md:EntitiesDescriptor>
+EOF
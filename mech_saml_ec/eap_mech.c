@@ -60,6 +60,8 @@ gssEapFinalize(void)
 #ifdef MECH_EAP
     eap_peer_unregister_methods();
 #endif
+
+    gssEapLogFlush();
 }
 
 #ifdef GSSEAP_CONSTRUCTOR
@@ -119,18 +119,26 @@ gssEapExportSecContext(OM_uint32 *minor,
         return GSS_S_NO_CONTEXT;
     }
 
+    /*
+     * Exporting an imported name may read its unparsed attribute
+     * context, so lock the names as well as the context.
+     */
     if (ctx->initiatorName != GSS_C_NO_NAME) {
+        GSSEAP_MUTEX_LOCK(&ctx->initiatorName->mutex);
         major = gssEapExportNameInternal(minor, ctx->initiatorName,
                                          &initiatorName,
                                          EXPORT_NAME_FLAG_COMPOSITE);
+        GSSEAP_MUTEX_UNLOCK(&ctx->initiatorName->mutex);
         if (GSS_ERROR(major))
             goto cleanup;
     }
 
     if (ctx->acceptorName != GSS_C_NO_NAME) {
+        GSSEAP_MUTEX_LOCK(&ctx->acceptorName->mutex);
         major = gssEapExportNameInternal(minor, ctx->acceptorName,
                                          &acceptorName,
                                          EXPORT_NAME_FLAG_COMPOSITE);
+        GSSEAP_MUTEX_UNLOCK(&ctx->acceptorName->mutex);
         if (GSS_ERROR(major))
             goto cleanup;
     }
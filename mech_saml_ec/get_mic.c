@@ -36,6 +36,100 @@
 
 #include "gssapiP_eap.h"
 
+/*
+ * Make a MIC token directly, rather than through the iov machinery.
+ * If message_token->value is non-NULL, it must have room for
+ * message_token->length bytes and the token is written there;
+ * otherwise a buffer of the exact size is allocated.
+ */
+OM_uint32
+gssEapGetMIC(OM_uint32 *minor,
+             gss_ctx_id_t ctx,
+             const gss_buffer_t message_buffer,
+             gss_buffer_t message_token)
+{
+    krb5_error_code code;
+    krb5_context krbContext;
+    size_t cksumLength, tokenLength;
+    unsigned char *p;
+    int keyUsage;
+#ifdef HAVE_HEIMDAL_VERSION
+    krb5_crypto krbCrypto;
+#else
+    krb5_key krbKey;
+#endif
+
+    if (ctx->encryptionType == ENCTYPE_NULL) {
+        *minor = GSSEAP_KEY_UNAVAILABLE;
+        return GSS_S_UNAVAILABLE;
+    }
+
+    GSSEAP_KRB_INIT(&krbContext);
+
+#ifdef HAVE_HEIMDAL_VERSION
+    code = krbContextCrypto(krbContext, ctx, &krbCrypto);
+#else
+    code = krbContextCrypto(krbContext, ctx, &krbKey);
+#endif
+    if (code != 0)
+        goto cleanup;
+
+    code = krbCryptoLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
+                           KRB5_CRYPTO_TYPE_CHECKSUM, &cksumLength);
+    if (code != 0)
+        goto cleanup;
+
+    tokenLength = 16 + cksumLength;
+
+    if (message_token->value == NULL) {
+        message_token->value = GSSEAP_MALLOC(tokenLength);
+        if (message_token->value == NULL) {
+            code = ENOMEM;
+            goto cleanup;
+        }
+    } else if (message_token->length < tokenLength) {
+        code = GSSEAP_WRONG_SIZE;
+        goto cleanup;
+    }
+    message_token->length = tokenLength;
+
+    keyUsage = CTX_IS_INITIATOR(ctx)
+               ? KEY_USAGE_INITIATOR_SIGN
+               : KEY_USAGE_ACCEPTOR_SIGN;
+
+    p = (unsigned char *)message_token->value;
+
+    /* TOK_ID */
+    store_uint16_be(TOK_TYPE_MIC, p);
+    /* flags */
+    p[2] = rfc4121Flags(ctx, FALSE);
+    /* filler */
+    p[3] = 0xFF;
+    /* MIC stores 0xFF in EC and RRC */
+    store_uint16_be(0xFFFF, p + 4);
+    store_uint16_be(0xFFFF, p + 6);
+    store_uint64_be(ctx->sendSeq, p + 8);
+
+#ifdef HAVE_HEIMDAL_VERSION
+    code = gssEapChecksumMIC(krbContext, ctx->checksumType, krbCrypto,
+                             keyUsage, message_buffer, p, cksumLength,
+                             FALSE, NULL);
+#else
+    code = gssEapChecksumMIC(krbContext, ctx->checksumType, krbKey,
+                             keyUsage, message_buffer, p, cksumLength,
+                             FALSE, NULL);
+#endif
+    if (code != 0)
+        goto cleanup;
+
+    ctx->sendSeq++;
+
+cleanup:
+    *minor = code;
+
+    return (code == 0) ? GSS_S_COMPLETE : GSS_S_FAILURE;
+}
+
 OM_uint32 GSSAPI_CALLCONV
 gss_get_mic(OM_uint32 *minor,
             gss_ctx_id_t ctx,
@@ -43,8 +137,7 @@ gss_get_mic(OM_uint32 *minor,
             gss_buffer_t message_buffer,
             gss_buffer_t message_token)
 {
-    OM_uint32 major;
-    gss_iov_buffer_desc iov[2];
+    OM_uint32 major, tmpMinor;
 
     if (ctx == GSS_C_NO_CONTEXT) {
         *minor = EINVAL;
@@ -61,6 +154,8 @@ gss_get_mic(OM_uint32 *minor,
     message_token->value = NULL;
     message_token->length = 0;
 
+    GSSEAP_ALLOC_SCOPE_ENTER(GSSEAP_ALLOC_SCOPE_WRAP);
+
     GSSEAP_MUTEX_LOCK(&ctx->mutex);
 
     if (!CTX_IS_ESTABLISHED(ctx)) {
@@ -69,26 +164,17 @@ gss_get_mic(OM_uint32 *minor,
         goto cleanup;
     }
 
-    iov[0].type = GSS_IOV_BUFFER_TYPE_DATA;
-    iov[0].buffer = *message_buffer;
-
-    iov[1].type = GSS_IOV_BUFFER_TYPE_HEADER | GSS_IOV_BUFFER_FLAG_ALLOCATE;
-    iov[1].buffer.value = NULL;
-    iov[1].buffer.length = 0;
-
-    major = gssEapWrapOrGetMIC(minor, ctx, FALSE, NULL, iov, 2, TOK_TYPE_MIC);
-    if (GSS_ERROR(major))
+    major = gssEapGetMIC(minor, ctx, message_buffer, message_token);
+    if (GSS_ERROR(major)) {
+        gss_release_buffer(&tmpMinor, message_token);
         goto cleanup;
-
-    *message_token = iov[1].buffer;
-
-    if (MECH_SAML_EC_DEBUG) {
-        fprintf(stdout, "MIC TOKEN GENERATED IS: \n");
-        printBuffer(stdout, message_token);
     }
 
+    logBuffer("MIC TOKEN GENERATED IS", message_token);
+
 cleanup:
     GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
+    GSSEAP_ALLOC_SCOPE_LEAVE(!GSS_ERROR(major));
 
     return major;
 }
@@ -36,8 +36,104 @@
  * Wrapper for retrieving a naming attribute.
  */
 
+/*
+ * GSS_EAP_NAME_HASH_ATTR, which every name has whatever its other
+ * attributes.
+ */
+static OM_uint32
+getNameHashAttribute(OM_uint32 *minor,
+                     gss_name_t name,
+                     int *authenticated,
+                     int *complete,
+                     gss_buffer_t value,
+                     gss_buffer_t display_value,
+                     int *more)
+{
+    OM_uint32 major, tmpMinor;
+    unsigned char hash[4];
+    char hex[9];
+    gss_buffer_desc buf;
+
+    if (more != NULL && *more > 0)
+        return GSS_S_UNAVAILABLE;
+
+    store_uint32_be(name->hash, hash);
+    snprintf(hex, sizeof(hex), "%08x", name->hash);
+
+    if (value != GSS_C_NO_BUFFER) {
+        buf.value = hash;
+        buf.length = sizeof(hash);
+
+        major = duplicateBuffer(minor, &buf, value);
+        if (GSS_ERROR(major))
+            return major;
+    }
+
+    if (display_value != GSS_C_NO_BUFFER) {
+        major = makeStringBuffer(minor, hex, display_value);
+        if (GSS_ERROR(major)) {
+            if (value != GSS_C_NO_BUFFER)
+                gss_release_buffer(&tmpMinor, value);
+            return major;
+        }
+    }
+
+    /* Derived from the name, not asserted by anyone */
+    if (authenticated != NULL)
+        *authenticated = 0;
+    if (complete != NULL)
+        *complete = 1;
+    if (more != NULL)
+        *more = 0;
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
 #ifndef MECH_EAP
-int getSAMLAttribute(const char* attrib, char** value);
+/*
+ * MECH_SAML_EC_LOCAL_LOGIN_ATTR, set by the acceptor, perhaps from the
+ * authorization cache. Called with the name locked.
+ */
+static OM_uint32
+getLocalLoginAttribute(OM_uint32 *minor,
+                       gss_name_t name,
+                       int *authenticated,
+                       int *complete,
+                       gss_buffer_t value,
+                       gss_buffer_t display_value,
+                       int *more)
+{
+    OM_uint32 major, tmpMinor;
+
+    if (more != NULL && *more > 0)
+        return GSS_S_UNAVAILABLE;
+
+    if (value != GSS_C_NO_BUFFER) {
+        major = duplicateBuffer(minor, &name->localName, value);
+        if (GSS_ERROR(major))
+            return major;
+    }
+
+    if (display_value != GSS_C_NO_BUFFER) {
+        major = duplicateBuffer(minor, &name->localName, display_value);
+        if (GSS_ERROR(major)) {
+            if (value != GSS_C_NO_BUFFER)
+                gss_release_buffer(&tmpMinor, value);
+            return major;
+        }
+    }
+
+    if (authenticated != NULL)
+        *authenticated = 1;
+    if (complete != NULL)
+        *complete = 1;
+    if (more != NULL)
+        *more = 0;
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
 #endif
 
 OM_uint32 GSSAPI_CALLCONV
@@ -59,6 +155,12 @@ gss_get_name_attribute(OM_uint32 *minor,
         return GSS_S_CALL_INACCESSIBLE_READ | GSS_S_BAD_NAME;
     }
 
+    if (attr != GSS_C_NO_BUFFER &&
+        attr->length == sizeof(GSS_EAP_NAME_HASH_ATTR) - 1 &&
+        memcmp(attr->value, GSS_EAP_NAME_HASH_ATTR, attr->length) == 0)
+        return getNameHashAttribute(minor, name, authenticated, complete,
+                                    value, display_value, more);
+
 #ifdef MECH_EAP
     GSSEAP_MUTEX_LOCK(&name->mutex);
 
@@ -68,26 +170,56 @@ gss_get_name_attribute(OM_uint32 *minor,
 
     GSSEAP_MUTEX_UNLOCK(&name->mutex);
 #else
+    if (attr == GSS_C_NO_BUFFER) {
+        *minor = EINVAL;
+        return GSS_S_CALL_INACCESSIBLE_READ | GSS_S_UNAVAILABLE;
+    }
+
+    GSSEAP_MUTEX_LOCK(&name->mutex);
+
+    if (name->localName.value != NULL &&
+        attr->length == sizeof(MECH_SAML_EC_LOCAL_LOGIN_ATTR) - 1 &&
+        memcmp(attr->value, MECH_SAML_EC_LOCAL_LOGIN_ATTR, attr->length) == 0) {
+        major = getLocalLoginAttribute(minor, name, authenticated, complete,
+                                       value, display_value, more);
+        GSSEAP_MUTEX_UNLOCK(&name->mutex);
+        return major;
+    }
+
     char *attr_str = NULL;
     major = bufferToString(minor, attr, &attr_str);
     if (major == GSS_S_COMPLETE) {
-        if (getSAMLAttribute(attr_str, &value->value) == 1) {
-            if (MECH_SAML_EC_DEBUG)
-                fprintf(stdout, "gss_get_name_attribute():"
-                            " attribute (%s) has value (%s)\n",
-                            attr_str, value->value);
-            value->length = strlen(value->value);
-            if (authenticated != NULL)
-                *authenticated = 1;
-            if (complete != NULL)
-                *complete = 1;
-            if (more != NULL)
-                *more = 0;
-            major = duplicateBuffer(minor, value, display_value);
+        char *saml_value = NULL;
+        gss_buffer_desc buf;
+
+        /* The attributes of the verification that produced this name */
+        if (gssEapSAMLAttribute(name->samlAttrs, attr_str, &saml_value) == 1) {
+            GSSEAP_LOG(GSSEAP_LOG_DEBUG, "gss_get_name_attribute():"
+                        " attribute (%s) has value (%s)",
+                        attr_str, saml_value);
+            buf.value = saml_value;
+            buf.length = strlen(saml_value);
+            if (display_value != GSS_C_NO_BUFFER)
+                major = duplicateBuffer(minor, &buf, display_value);
+            /* Adopted by value, if it is wanted and all went well */
+            if (GSS_ERROR(major) || value == GSS_C_NO_BUFFER)
+                free(saml_value);
+            else
+                *value = buf;
+            if (!GSS_ERROR(major)) {
+                if (authenticated != NULL)
+                    *authenticated = 1;
+                if (complete != NULL)
+                    *complete = 1;
+                if (more != NULL)
+                    *more = 0;
+            }
         } else
             major = GSS_S_UNAVAILABLE;
         free(attr_str); attr_str = NULL;
     }
+
+    GSSEAP_MUTEX_UNLOCK(&name->mutex);
 #endif
 
     return major;
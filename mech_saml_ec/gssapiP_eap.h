@@ -125,8 +125,13 @@ struct gss_name_struct
     OM_uint32 flags;
     gss_OID mechanismUsed; /* this is immutable */
     gss_buffer_desc username;
+    uint32_t hash; /* of username; set with it, see gssEapCompareName() */
+    struct gss_eap_shared_buffer *borrowed; /* if set, username is in it */
 #ifdef GSSEAP_ENABLE_ACCEPTOR
     struct gss_eap_attr_ctx *attrCtx;
+    gss_buffer_desc attrSnapshot; /* exported attrCtx in borrowed, if any */
+    gss_buffer_desc localName; /* authorized local account, if known */
+    struct gss_eap_saml_attr_ctx *samlAttrs; /* released with the name */
 #endif
 };
 
@@ -183,6 +188,9 @@ struct gss_cred_id_struct
 struct gss_eap_initiator_ctx {
     unsigned int idleWhile;
     struct eap_sm *eap;
+#ifndef MECH_EAP
+    gss_buffer_desc generatedKey;       /* from the IdP, for rfc3961Key */
+#endif
 };
 
 #ifdef GSSEAP_ENABLE_ACCEPTOR
@@ -193,6 +201,9 @@ struct gss_eap_acceptor_ctx {
     gss_buffer_desc state;
 #ifdef MECH_EAP
     VALUE_PAIR *vps;
+#else
+    gss_buffer_desc generatedKey;       /* from the IdP, for rfc3961Key */
+    gss_buffer_desc encryptionType;     /* of rfc3961Key, from initiator */
 #endif
 };
 #endif
@@ -211,6 +222,12 @@ struct gss_ctx_id_struct
     krb5_cksumtype checksumType;
     krb5_enctype encryptionType;
     krb5_keyblock rfc3961Key;
+#ifdef HAVE_HEIMDAL_VERSION
+    krb5_crypto rfc3961Crypto;      /* from rfc3961Key, created on first use */
+#else
+    krb5_key rfc3961Crypto;         /* from rfc3961Key, created on first use */
+#endif
+    size_t prfLength;               /* cached krb5_c_prf_length() */
     gss_name_t initiatorName;
     gss_name_t acceptorName;
     time_t expiryTime;
@@ -227,6 +244,9 @@ struct gss_ctx_id_struct
     } ctxU;
     const struct gss_eap_token_buffer_set *inputTokens;
     const struct gss_eap_token_buffer_set *outputTokens;
+    size_t wrapChunkSize;           /* 0 if chunked wrap is disabled */
+    OM_uint32 wrapChunkThreads;     /* 0 for one per online CPU */
+    struct gss_eap_arena arena;     /* released once established */
 };
 
 #define TOK_FLAG_SENDER_IS_ACCEPTOR         0x01
@@ -252,6 +272,16 @@ gssEapAcceptSecContext(OM_uint32 *minor,
                        OM_uint32 *time_rec,
                        gss_cred_id_t *delegated_cred_handle);
 
+OM_uint32
+gssEapWarmUpAcceptor(OM_uint32 *minor, int prefork);
+
+/* get_mic.c */
+OM_uint32
+gssEapGetMIC(OM_uint32 *minor,
+             gss_ctx_id_t ctx,
+             const gss_buffer_t message_buffer,
+             gss_buffer_t message_token);
+
 /* init_sec_context.c */
 OM_uint32
 gssEapInitSecContext(OM_uint32 *minor,
@@ -268,6 +298,14 @@ gssEapInitSecContext(OM_uint32 *minor,
                      OM_uint32 *ret_flags,
                      OM_uint32 *time_rec);
 
+/* verify_mic.c */
+OM_uint32
+gssEapVerifyMIC(OM_uint32 *minor,
+                gss_ctx_id_t ctx,
+                const gss_buffer_t message_buffer,
+                const gss_buffer_t message_token,
+                gss_qop_t *qop_state);
+
 /* wrap_iov.c */
 OM_uint32
 gssEapWrapOrGetMIC(OM_uint32 *minor,
@@ -278,6 +316,16 @@ gssEapWrapOrGetMIC(OM_uint32 *minor,
                    int iov_count,
                    enum gss_eap_token_type toktype);
 
+OM_uint32
+gssEapWrapOrGetMICWithSeq(OM_uint32 *minor,
+                          gss_ctx_id_t ctx,
+                          uint64_t seqnum,
+                          int conf_req_flag,
+                          int *conf_state,
+                          gss_iov_buffer_desc *iov,
+                          int iov_count,
+                          enum gss_eap_token_type toktype);
+
 OM_uint32
 gssEapUnwrapOrVerifyMIC(OM_uint32 *minor_status,
                         gss_ctx_id_t ctx,
@@ -287,6 +335,16 @@ gssEapUnwrapOrVerifyMIC(OM_uint32 *minor_status,
                         int iov_count,
                         enum gss_eap_token_type toktype);
 
+OM_uint32
+gssEapUnwrapOrVerifyMICWithSeq(OM_uint32 *minor,
+                               gss_ctx_id_t ctx,
+                               int *conf_state,
+                               gss_qop_t *qop_state,
+                               gss_iov_buffer_desc *iov,
+                               int iov_count,
+                               enum gss_eap_token_type toktype,
+                               uint64_t *pSeqnum);
+
 OM_uint32
 gssEapWrapIovLength(OM_uint32 *minor,
                     gss_ctx_id_t ctx,
@@ -307,6 +365,26 @@ gssEapWrap(OM_uint32 *minor,
 unsigned char
 rfc4121Flags(gss_ctx_id_t ctx, int receiving);
 
+/* wrap_chunked.c */
+#define WRAP_CHUNKED_HEADER_LENGTH          8   /* TOK_ID | 0 | count */
+
+OM_uint32
+gssEapWrapChunked(OM_uint32 *minor,
+                  gss_ctx_id_t ctx,
+                  int conf_req_flag,
+                  gss_qop_t qop_req,
+                  gss_buffer_t input_message_buffer,
+                  int *conf_state,
+                  gss_buffer_t output_message_buffer);
+
+OM_uint32
+gssEapUnwrapChunked(OM_uint32 *minor,
+                    gss_ctx_id_t ctx,
+                    gss_buffer_t input_message_buffer,
+                    gss_buffer_t output_message_buffer,
+                    int *conf_state,
+                    gss_qop_t *qop_state);
+
 /* display_status.c */
 void
 gssEapSaveStatusInfo(OM_uint32 minor, const char *format, ...);
@@ -349,6 +427,14 @@ gssEapImportContext(OM_uint32 *minor,
 #define NEGOEX_ACCEPTOR_SALT_LEN   (sizeof(NEGOEX_ACCEPTOR_SALT) - 1)
 
 /* pseudo_random.c */
+OM_uint32
+gssEapPseudoRandomInto(OM_uint32 *minor,
+                       gss_ctx_id_t ctx,
+                       int prf_key,
+                       const gss_buffer_t prf_in,
+                       size_t desired_output_len,
+                       unsigned char *prf_out);
+
 OM_uint32
 gssEapPseudoRandom(OM_uint32 *minor,
                    gss_ctx_id_t ctx,
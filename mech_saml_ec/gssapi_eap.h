@@ -77,6 +77,73 @@ extern gss_OID GSS_EAP_CRED_SET_CRED_FLAG;
  */
 extern gss_OID GSS_EAP_CRED_SET_CRED_PASSWORD;
 
+/*
+ * Acceptor warm-up; the value is ignored. Initializes the SAML and
+ * Shibboleth runtime and loads the SP configuration, metadata,
+ * credentials and trust anchors, so that the first
+ * gss_accept_sec_context() does not pay for it. Call it on an
+ * acceptor credential before listening for connections.
+ */
+extern gss_OID GSS_EAP_CRED_SET_WARM_UP;
+
+/*
+ * Prefork acceptor setup; the value is ignored. Warms up like
+ * GSS_EAP_CRED_SET_WARM_UP and shares the loaded SP with processes
+ * forked afterwards. Call it in the parent before forking workers;
+ * calling it again there reloads the SP configuration for children
+ * forked from then on. Children never reload: they serve the SP they
+ * inherited until they exit, even after the parent's metadata changes.
+ * Use GSS_EAP_MECH_INQUIRE_STALE_SP in a child to find out when it
+ * should be replaced.
+ */
+extern gss_OID GSS_EAP_CRED_SET_PREFORK;
+
+/*
+ * Chunked wrap for large messages: the chunk size as a 32-bit
+ * integer in network byte order, optionally followed by the
+ * maximum number of worker threads, also as a 32-bit integer.
+ * Messages larger than the chunk size are wrapped as a sequence
+ * of RFC 4121 tokens that are protected in parallel. Both peers
+ * must enable this; a chunk size of zero disables it.
+ */
+extern gss_OID GSS_EAP_CTX_SET_WRAP_CHUNKING;
+
+/*
+ * Handshake metrics sink, for gssspi_mech_invoke(). The value is a
+ * buffer holding a struct gss_eap_metrics_sink; the sink is process
+ * wide. The span callback receives the duration of each timed
+ * handshake step in microseconds, the outcome callback is told about
+ * every completed or failed context establishment. Callbacks may be
+ * invoked concurrently from several threads. An empty buffer removes
+ * the sink.
+ */
+extern gss_OID GSS_EAP_MECH_SET_METRICS_SINK;
+
+struct gss_eap_metrics_sink {
+    void (*span)(void *data, const char *name, OM_uint32 usec);
+    void (*outcome)(void *data, int initiator,
+                    OM_uint32 major, OM_uint32 minor);
+    void *data;
+};
+
+/*
+ * Prefork child staleness, for gssspi_mech_invoke(). On return the
+ * value holds a 32-bit integer in network byte order, to be released
+ * with gss_release_buffer(): nonzero if the parent set up with
+ * GSS_EAP_CRED_SET_PREFORK has reloaded its SP since this process was
+ * forked, and so the server should recycle it; zero otherwise.
+ */
+extern gss_OID GSS_EAP_MECH_INQUIRE_STALE_SP;
+
+/*
+ * Naming attribute, for gss_get_name_attribute(), whose value is a hash
+ * of the name as a 32-bit integer in network byte order; the display
+ * value is the same in hex. Names that compare equal have equal hashes,
+ * and the hash is stable across processes, so applications can key
+ * hash tables on it without exporting the name.
+ */
+#define GSS_EAP_NAME_HASH_ATTR              "urn:ietf:params:gss-eap:name-hash"
+
 /*
  * Credentials flag indicating the local attributes
  * processing should be skipped.
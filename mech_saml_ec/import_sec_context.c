@@ -148,6 +148,7 @@ importMechanismOid(OM_uint32 *minor,
 
 static OM_uint32
 importName(OM_uint32 *minor,
+           struct gss_eap_shared_buffer *shared,
            unsigned char **pBuf,
            size_t *pRemain,
            gss_name_t *pName)
@@ -171,8 +172,8 @@ importName(OM_uint32 *minor,
 
         tmp.value = p + 4;
 
-        major = gssEapImportNameInternal(minor, &tmp, pName,
-                                         EXPORT_NAME_FLAG_COMPOSITE);
+        major = gssEapImportNameShared(minor, shared, &tmp, pName,
+                                       EXPORT_NAME_FLAG_COMPOSITE);
         if (GSS_ERROR(major))
             return major;
     }
@@ -184,10 +185,11 @@ importName(OM_uint32 *minor,
     return GSS_S_COMPLETE;
 }
 
-OM_uint32
-gssEapImportContext(OM_uint32 *minor,
-                    gss_buffer_t token,
-                    gss_ctx_id_t ctx)
+static OM_uint32
+importContext(OM_uint32 *minor,
+              struct gss_eap_shared_buffer *shared,
+              gss_buffer_t token,
+              gss_ctx_id_t ctx)
 {
     OM_uint32 major;
     unsigned char *p = (unsigned char *)token->value;
@@ -220,11 +222,11 @@ gssEapImportContext(OM_uint32 *minor,
     if (GSS_ERROR(major))
         return major;
 
-    major = importName(minor, &p, &remain, &ctx->initiatorName);
+    major = importName(minor, shared, &p, &remain, &ctx->initiatorName);
     if (GSS_ERROR(major))
         return major;
 
-    major = importName(minor, &p, &remain, &ctx->acceptorName);
+    major = importName(minor, shared, &p, &remain, &ctx->acceptorName);
     if (GSS_ERROR(major))
         return major;
 
@@ -272,6 +274,33 @@ gssEapImportContext(OM_uint32 *minor,
     return major;
 }
 
+/*
+ * The token is copied once, and the names borrow their usernames and
+ * attribute contexts from the copy rather than each being copied out
+ * of it; the mechanism OID is already interned. What a context may
+ * change, such as its sequence state, is still copied.
+ */
+OM_uint32
+gssEapImportContext(OM_uint32 *minor,
+                    gss_buffer_t token,
+                    gss_ctx_id_t ctx)
+{
+    OM_uint32 major;
+    struct gss_eap_shared_buffer *shared;
+    gss_buffer_desc copy;
+
+    major = gssEapSharedBufferCreate(minor, token, &shared, &copy);
+    if (GSS_ERROR(major))
+        return major;
+
+    major = importContext(minor, shared, &copy, ctx);
+
+    /* The names that borrow from it hold their own references */
+    gssEapSharedBufferRelease(&shared);
+
+    return major;
+}
+
 OM_uint32 GSSAPI_CALLCONV
 gss_import_sec_context(OM_uint32 *minor,
                        gss_buffer_t interprocess_token,
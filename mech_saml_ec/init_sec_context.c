@@ -46,6 +46,9 @@
 #define SAML_EC_IDP		"SAML_EC_IDP"
 #define SAML_EC_USER_CERT	"SAML_EC_USER_CERT"
 #define SAML_EC_USER_KEY	"SAML_EC_USER_KEY"
+#ifdef GSSEAP_IDP_REPLAY
+#define SAML_EC_IDP_FILE	"file://"
+#endif
 
 #define SOAP_FAULT_MSG "<?xml version='1.0' encoding='UTF-8'?>" \
 		"<S:Envelope xmlns:S=\"http://schemas.xmlsoap.org/soap/envelope/\">" \
@@ -58,8 +61,6 @@
 		"  </S:Body>" \
 		"</S:Envelope>"
 
-static xmlChar *gl_generated_key = NULL;
-
 #ifdef MECH_EAP
 
 static OM_uint32
@@ -354,8 +355,8 @@ initReady(OM_uint32 *minor, gss_ctx_id_t ctx, OM_uint32 reqFlags)
                                    &ctx->rfc3961Key);
 #else
     major = gssEapDeriveRfc3961Key(minor,
-                                   gl_generated_key,
-                                   strlen(gl_generated_key),
+                                   ctx->initiatorCtx.generatedKey.value,
+                                   ctx->initiatorCtx.generatedKey.length,
                                    ctx->encryptionType,
                                    &ctx->rfc3961Key);
 #endif
@@ -422,9 +423,8 @@ initBegin(OM_uint32 *minor,
             GSSEAP_MUTEX_UNLOCK(&target->mutex);
             return major;
         }
-        if (MECH_SAML_EC_DEBUG)
-            fprintf(stdout, "TARGET NAME IS (%.*s)\n",
-                    target->username.length,  (char *)(target->username.value));
+        GSSEAP_LOG(GSSEAP_LOG_DEBUG, "TARGET NAME IS (%.*s)",
+                (int)target->username.length,  (char *)(target->username.value));
 
         GSSEAP_MUTEX_UNLOCK(&target->mutex);
     }
@@ -579,6 +579,20 @@ eapGssSmInitIdentity(OM_uint32 *minor,
     return GSS_S_CONTINUE_NEEDED;
 }
 
+static void
+logXmlDoc(const char *label, xmlDocPtr doc)
+{
+    xmlChar *mem = NULL;
+    int size = 0;
+
+    if (!GSSEAP_LOG_ENABLED(GSSEAP_LOG_DEBUG))
+        return;
+
+    xmlDocDumpMemory(doc, &mem, &size);
+    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "%s:\n%.*s", label, size, (char *)mem);
+    xmlFree(mem);
+}
+
 static void
 freeChildren(xmlNode *a_node)
 {
@@ -606,6 +620,45 @@ write_data(void *buffer, size_t size, size_t nmemb, void *userp)
 
 char curl_err_msg[CURL_ERROR_SIZE+1];
 
+#ifdef GSSEAP_IDP_REPLAY
+/*
+ * Replay a recorded IdP response instead of contacting the IdP, for
+ * SAML_EC_IDP=file:///path. This lets the initiator be exercised and
+ * profiled offline against a fixed corpus. Test builds only: saml_replay
+ * and --enable-idp-replay.
+ */
+static OM_uint32
+readIdPResponse(OM_uint32 *minor, const char *path, gss_buffer_t response)
+{
+    FILE *fp;
+    char buf[4096];
+    size_t n;
+    OM_uint32 major = GSS_S_COMPLETE;
+
+    fp = fopen(path, "r");
+    if (fp == NULL) {
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Couldn't open recorded IdP response (%s)",
+                path);
+        *minor = errno;
+        return GSS_S_FAILURE;
+    }
+
+    while ((n = fread(buf, 1, sizeof(buf), fp)) != 0) {
+        major = addToStringBuffer(minor, buf, n, response);
+        if (GSS_ERROR(major))
+            break;
+    }
+    if (major == GSS_S_COMPLETE && ferror(fp)) {
+        *minor = GSSEAP_IDENTITY_SERVICE_UNKNOWN_ERROR;
+        major = GSS_S_FAILURE;
+    }
+
+    fclose(fp);
+
+    return major;
+}
+#endif /* GSSEAP_IDP_REPLAY */
+
 OM_uint32
 sendToIdP(OM_uint32 *minor, xmlDocPtr doc, char *idp,
           gss_cred_id_t cred, gss_buffer_t response)
@@ -614,63 +667,75 @@ sendToIdP(OM_uint32 *minor, xmlDocPtr doc, char *idp,
     CURLcode res = 0;
     xmlChar *mem = NULL;
     int size = 0;
-    char *user = cred->name->username.value;
-    char *password = cred->password.value;
+    char *user = NULL;
+    char *password = NULL;
     char *certfile = getenv(SAML_EC_USER_CERT);
     char *keyfile = getenv(SAML_EC_USER_KEY);
     OM_uint32 major = GSS_S_COMPLETE;
+    uint64_t metricsStart = gssEapMetricsStart();
+
+#ifdef GSSEAP_IDP_REPLAY
+    if (strncmp(idp, SAML_EC_IDP_FILE, strlen(SAML_EC_IDP_FILE)) == 0) {
+        major = readIdPResponse(minor, idp + strlen(SAML_EC_IDP_FILE),
+                                response);
+        gssEapMetricsSpan(GSSEAP_METRIC_IDP_TOTAL, metricsStart);
+        return major;
+    }
+#endif
 
-    if (MECH_SAML_EC_DEBUG)
-        fprintf(stdout, "USER IS (%s)\n", user?:"");
+    user = cred->name->username.value;
+    password = cred->password.value;
+
+    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "USER IS (%s)", user?:"");
 
     if ((certfile && !keyfile) || (keyfile && !certfile)) {
-        fprintf(stderr, "NOTICE: One of either SAML_EC_USER_CERT or "
+        GSSEAP_LOG(GSSEAP_LOG_NOTICE, "One of either SAML_EC_USER_CERT or "
                         "SAML_EC_USER_KEY is not set. Unable to use "
-                        "certificate authentication.\n");
+                        "certificate authentication.");
         certfile = keyfile = NULL;
     }
 
     if ((user && !password) || (password && !user)) {
-        fprintf(stderr, "NOTICE: One of either username or "
+        GSSEAP_LOG(GSSEAP_LOG_NOTICE, "One of either username or "
                         "password is NULL. Unable to use username/password "
-                        "for authentication.\n");
+                        "for authentication.");
         user = password = NULL;
     }
 
     if (certfile && keyfile) {
-        if (MECH_SAML_EC_DEBUG)
-            fprintf(stdout, "DOING HTTPS POST to IdP (%s) using Cert Auth cert"
-                    " (%s) key (%s)\n", idp, certfile, keyfile);
+        GSSEAP_LOG(GSSEAP_LOG_DEBUG, "DOING HTTPS POST to IdP (%s) using Cert Auth cert"
+                " (%s) key (%s)", idp, certfile, keyfile);
     }
     if (user && password) {
-        if (MECH_SAML_EC_DEBUG)
-            fprintf(stdout, "DOING HTTPS POST to IdP (%s) using Basic Auth user"
-                    " (%s)\n", idp, user);
+        GSSEAP_LOG(GSSEAP_LOG_DEBUG, "DOING HTTPS POST to IdP (%s) using Basic Auth user"
+                " (%s)", idp, user);
     }
     if (!user && !password && !certfile && !keyfile) {
-        fprintf(stderr, "ERROR: NO user/password info in credential; "
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "NO user/password info in credential; "
                         "please supply a credential acquired with "
                         "gss_acquire_cred_with_password() or variants;\n"
                         "You can also alternatively specify client cert/key "
                         "files by setting env vars SAML_EC_USER_CERT and "
                         "SAML_EC_USER_KEY. Client certificate will be used "
-                        "if set instead of username/password.\n");
+                        "if set instead of username/password.");
         *minor = GSSEAP_BAD_CRED_OPTION;
-        return GSS_S_FAILURE;
+        major = GSS_S_FAILURE;
+        goto cleanup;
     }
 
     xmlDocDumpFormatMemory(doc, &mem, &size, 0);
     if (mem == NULL || size == 0) {
-        fprintf(stderr, "ERROR: xmlDocDumpFormatMemory failed to parse "
-                        "the XML doc to be sent to IdP\n");
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "xmlDocDumpFormatMemory failed to parse "
+                        "the XML doc to be sent to IdP");
         *minor = GSSEAP_BAD_CONTEXT_TOKEN;
-        return GSS_S_FAILURE;
+        major = GSS_S_FAILURE;
+        goto cleanup;
     }
 
     curl = curl_easy_init();
 
     if (!curl) {
-        fprintf(stderr, "ERROR: curl_easy_init failed\n");
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "curl_easy_init failed");
         *minor = GSSEAP_BAD_USAGE;
         major = GSS_S_FAILURE;
     }
@@ -698,14 +763,15 @@ sendToIdP(OM_uint32 *minor, xmlDocPtr doc, char *idp,
         (keyfile && ((res = curl_easy_setopt(curl, CURLOPT_SSLKEY, keyfile)) != CURLE_OK ||
                       (res = curl_easy_setopt(curl, CURLOPT_SSLKEYTYPE, "PEM")) != CURLE_OK ||
                       (res = curl_easy_setopt(curl, CURLOPT_KEYPASSWD, "")) != CURLE_OK)) ||
-        (res = curl_easy_setopt(curl, CURLOPT_VERBOSE, 1)) != CURLE_OK ||
+        (res = curl_easy_setopt(curl, CURLOPT_VERBOSE,
+                                   MECH_SAML_EC_DEBUG ? 1L : 0L)) != CURLE_OK ||
         (res = curl_easy_setopt(curl, CURLOPT_POST, 1)) != CURLE_OK ||
         (res = curl_easy_setopt(curl, CURLOPT_HTTPHEADER, content_header)) != CURLE_OK ||
         (res = curl_easy_setopt(curl, CURLOPT_POSTFIELDS, mem)) != CURLE_OK ||
         (res = curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, size)) != CURLE_OK ||
         (res = curl_easy_setopt(curl, CURLOPT_WRITEDATA, response)) != CURLE_OK ||
         (res = curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data)) != CURLE_OK) {
-        fprintf(stderr, "ERROR: curl_easy_setopt failure; %s\n", curl_easy_strerror(res));
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "curl_easy_setopt failure; %s", curl_easy_strerror(res));
         *minor = GSSEAP_BAD_USAGE;
         major = GSS_S_FAILURE;
         goto cleanup;
@@ -713,24 +779,41 @@ sendToIdP(OM_uint32 *minor, xmlDocPtr doc, char *idp,
 
     res = curl_easy_perform(curl);
     if (res) {
-        fprintf(stderr, "ERROR: curl_easy_perform failed with return code "
-                        "(%d) and error (%s)\n", res, curl_err_msg);
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "curl_easy_perform failed with return code "
+                        "(%d) and error (%s)", res, curl_err_msg);
         *minor = GSSEAP_BAD_USAGE;
         major = GSS_S_FAILURE;
         goto cleanup;
     }
 
+    if (metricsStart != 0) {
+        double connect = 0, appconnect = 0, total = 0;
+
+        /* Timings are cumulative from the start of the transfer */
+        curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &connect);
+        curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &appconnect);
+        curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &total);
+        if (appconnect < connect)
+            appconnect = connect;
+        gssEapMetricsAddSpan(GSSEAP_METRIC_IDP_CONNECT,
+                             (OM_uint32)(connect * 1000000));
+        gssEapMetricsAddSpan(GSSEAP_METRIC_IDP_TLS,
+                             (OM_uint32)((appconnect - connect) * 1000000));
+        gssEapMetricsAddSpan(GSSEAP_METRIC_IDP_TRANSFER,
+                             (OM_uint32)((total - appconnect) * 1000000));
+    }
+
     long http_code = 0;
     res = curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
     if (res != CURLE_OK) {
-        fprintf(stderr, "ERROR: curl_easy_getinfo failed with return code "
-                        "(%d) and error (%s)\n", res, curl_err_msg);
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "curl_easy_getinfo failed with return code "
+                        "(%d) and error (%s)", res, curl_err_msg);
         *minor = GSSEAP_BAD_USAGE;
         major = GSS_S_FAILURE;
         goto cleanup;
     }
     if (http_code != 200) {
-        fprintf(stderr, "ERROR: HTTPS failed with status code (%d)\n",
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "HTTPS failed with status code (%ld)",
                                  http_code);
         *minor = GSSEAP_BAD_USAGE;
         major = GSS_S_FAILURE;
@@ -740,22 +823,21 @@ sendToIdP(OM_uint32 *minor, xmlDocPtr doc, char *idp,
     char *content_type = NULL;
     res = curl_easy_getinfo(curl, CURLINFO_CONTENT_TYPE, &content_type);
     if (res != CURLE_OK) {
-        fprintf(stderr, "ERROR: curl_easy_getinfo failed with return code "
-                        "(%d) and error (%s)\n", res, curl_err_msg);
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "curl_easy_getinfo failed with return code "
+                        "(%d) and error (%s)", res, curl_err_msg);
         *minor = GSSEAP_BAD_USAGE;
         major = GSS_S_FAILURE;
         goto cleanup;
     }
     if (content_type == NULL) {
-        fprintf(stderr, "ERROR: IdP DID NOT SEND A CONTENT TYPE IN HEADER.\n");
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "IdP DID NOT SEND A CONTENT TYPE IN HEADER.");
         *minor = GSSEAP_BAD_USAGE;
         major = GSS_S_FAILURE;
         goto cleanup;
     } else {
-        if (MECH_SAML_EC_DEBUG)
-            fprintf(stdout, "CONTENT TYPE FROM IDP IS: %s", content_type);
+        GSSEAP_LOG(GSSEAP_LOG_DEBUG, "CONTENT TYPE FROM IDP IS: %s", content_type);
         if (!strcasestr(content_type, "xml")) {
-            fprintf(stderr, "ERROR: IdP DID NOT SEND XML DOCUMENT BACK.\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "IdP DID NOT SEND XML DOCUMENT BACK.");
             *minor = GSSEAP_BAD_USAGE;
             major = GSS_S_FAILURE;
             goto cleanup;
@@ -773,6 +855,8 @@ cleanup:
         curl_easy_cleanup(curl);
     curl = NULL;
 
+    gssEapMetricsSpan(GSSEAP_METRIC_IDP_TOTAL, metricsStart);
+
     return major;
 }
 
@@ -796,26 +880,25 @@ processSAMLRequest(OM_uint32 *minor, gss_ctx_id_t ctx, OM_uint32 req_flags,
     gss_buffer_desc response_from_idp = {0, NULL};
     OM_uint32 major = GSS_S_COMPLETE;
     OM_uint32 tmpMinor = 0;
+    uint64_t metricsStart;
 
-    if (MECH_SAML_EC_DEBUG)
-        fprintf(stdout, "IdP IS (%s)\n", idp?:"");
+    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "IdP IS (%s)", idp?:"");
 
     if (idp == NULL) {
-        fprintf(stderr, "ERROR: NO IDP specified; please specify an IdP"
-                " using the environment variable (%s)\n", SAML_EC_IDP);
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "NO IDP specified; please specify an IdP"
+                " using the environment variable (%s)", SAML_EC_IDP);
         *minor = GSSEAP_BAD_SERVICE_NAME;
         return GSS_S_FAILURE;
     }
 
+    metricsStart = gssEapMetricsStart();
     doc_from_sp = xmlReadMemory(request->value, request->length, "FROMSP", NULL, 0);
+    gssEapMetricsSpan(GSSEAP_METRIC_SP_REQUEST_PARSE, metricsStart);
     if (doc_from_sp != NULL) {
-        if (MECH_SAML_EC_DEBUG) {
-            fprintf(stdout, "\n\nREQUEST FROM SP AS SEEN BY XML:\n");
-            xmlDocDump(stdout, doc_from_sp);
-        }
+        logXmlDoc("REQUEST FROM SP AS SEEN BY XML", doc_from_sp);
     } else {
-        fprintf(stderr, "ERROR: Failure parsing document from SP:\n%.*s\n",
-                        request->length, request->value);
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Failure parsing document from SP:\n%.*s",
+                        (int)request->length, (char *)request->value);
         *minor = GSSEAP_BAD_CONTEXT_TOKEN;
         return GSS_S_FAILURE;
     }
@@ -823,7 +906,7 @@ processSAMLRequest(OM_uint32 *minor, gss_ctx_id_t ctx, OM_uint32 req_flags,
     /* Exclude header */
     header_from_sp = getXmlElement(xmlDocGetRootElement(doc_from_sp), "Header", MECH_SAML_EC_SOAP11_NS);
     if (header_from_sp == NULL) {
-        fprintf(stderr, "ERROR: No Header in SAML Request from SP\n");
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "No Header in SAML Request from SP");
         *minor = GSSEAP_BAD_TOK_HEADER;
         major = GSS_S_FAILURE;
         goto cleanup;
@@ -835,13 +918,15 @@ processSAMLRequest(OM_uint32 *minor, gss_ctx_id_t ctx, OM_uint32 req_flags,
 
     if (input_chan_bindings != GSS_C_NO_CHANNEL_BINDINGS &&
         input_chan_bindings->application_data.length != 0 &&
-        base64Encode(input_chan_bindings->application_data.value,
-            input_chan_bindings->application_data.length, &cb_data) != -1) {
+        (cb_data = gssEapArenaAlloc(&ctx->arena,
+            BASE64_EXPAND(input_chan_bindings->application_data.length))) != NULL &&
+        base64EncodeTo(input_chan_bindings->application_data.value,
+            input_chan_bindings->application_data.length, cb_data) != -1) {
         char *cb_type = NULL;
 
         major = readChannelBindingsType(&tmpMinor, &cb_type);
         if (major != GSS_S_COMPLETE) {
-            fprintf(stderr, "ERROR: Couldn't find Channel Bindings Type\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "Couldn't find Channel Bindings Type");
             goto cleanup;
         }
 
@@ -855,9 +940,6 @@ processSAMLRequest(OM_uint32 *minor, gss_ctx_id_t ctx, OM_uint32 req_flags,
         xmlSetNsProp(cb_elem, header_to_idp->ns, "actor", "http://schemas.xmlsoap.org/soap/actor/next");
         xmlSetNsProp(cb_elem, header_to_idp->ns, "mustUnderstand", "1");
         xmlNodeSetContent(cb_elem, cb_data);
-        if (cb_data != NULL) {
-            GSSEAP_FREE(cb_data); cb_data = NULL;
-        }
         free(cb_type); cb_type = NULL;
     }
 
@@ -865,7 +947,7 @@ processSAMLRequest(OM_uint32 *minor, gss_ctx_id_t ctx, OM_uint32 req_flags,
         char *algorithm = xmlGetNsProp(session_key, "EncType", MECH_SAML_EC_SAMLEC_NS);
         
         if (algorithm != NULL) {
-            fprintf(stderr, "ERROR: Algorithm (%s) NOT supported\n", algorithm);
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "Algorithm (%s) NOT supported", algorithm);
             *minor = GSSEAP_BAD_TOK_HEADER;
             major = GSS_S_FAILURE;
             goto cleanup;
@@ -877,7 +959,7 @@ processSAMLRequest(OM_uint32 *minor, gss_ctx_id_t ctx, OM_uint32 req_flags,
             char *tmp = xmlNodeGetContent(encryption_type);
 
             if (tmp == NULL) {
-                fprintf(stderr, "ERROR: Failure of xmlNodeGetContent for "
+                GSSEAP_LOG(GSSEAP_LOG_ERROR, "Failure of xmlNodeGetContent for "
                                 "EncType in SessionKey.");
                 *minor = GSSEAP_BAD_TOK_HEADER;
                 major = GSS_S_FAILURE;
@@ -889,14 +971,14 @@ processSAMLRequest(OM_uint32 *minor, gss_ctx_id_t ctx, OM_uint32 req_flags,
         }
 
         if (ctx->encryptionType == ENCTYPE_NULL) {
-            fprintf(stderr, "ERROR: EncType is non-existent in SessionKey or is empty.");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "EncType is non-existent in SessionKey or is empty.");
             *minor = GSSEAP_BAD_TOK_HEADER;
             major = GSS_S_FAILURE;
             goto cleanup;
         }
     } else {
-        fprintf(stderr, "ERROR: Authentication Request from Service Provider"
-                " doesn't contain SessionKey header block\n");
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Authentication Request from Service Provider"
+                " doesn't contain SessionKey header block");
         *minor = GSSEAP_BAD_TOK_HEADER;
         major = GSS_S_FAILURE;
         goto cleanup;
@@ -911,35 +993,31 @@ xmlNodeSetContent(signature_value, val);
 }
 */
 
-    if (MECH_SAML_EC_DEBUG) {
-        fprintf(stdout, "\nSENDING TO IDP:\n");
-        xmlDocDump(stdout, doc_from_sp);
-    }
+    logXmlDoc("SENDING TO IDP", doc_from_sp);
 
     /* Send doc to IdP */
     /* TODO: Error checking here and elsewhere */
     major = sendToIdP(minor, doc_from_sp, idp, ctx->cred, &response_from_idp);
     if (major != GSS_S_COMPLETE) {
-        fprintf(stderr, "ERROR: Failure communicating with IdP\n");
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Failure communicating with IdP");
         goto cleanup;
     }
 
     if (response_from_idp.value == NULL) {
-        fprintf(stderr, "ERROR: No response from IdP\n");
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "No response from IdP");
         *minor = GSSEAP_IDENTITY_SERVICE_UNKNOWN_ERROR;
         major = GSS_S_FAILURE;
         goto cleanup;
     }
 
-    if (MECH_SAML_EC_DEBUG)
-        fprintf(stdout, "\n\nRECEIVED FROM IDP:\n%s\n", (char *) response_from_idp.value);
+    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "RECEIVED FROM IDP:\n%s", (char *) response_from_idp.value);
 
     /* Empty the header from IdP and populate with RelayState from
      *     header received from SP */
     doc_from_idp = xmlReadMemory(response_from_idp.value,
                   response_from_idp.length, "FROMIDP", NULL, 0);
     if (doc_from_idp == NULL) {
-        fprintf(stderr, "ERROR: No response from IdP\n");
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "No response from IdP");
         *minor = GSSEAP_IDENTITY_SERVICE_UNKNOWN_ERROR;
         major = GSS_S_FAILURE;
         goto cleanup;
@@ -951,16 +1029,13 @@ xmlNodeSetContent(signature_value, val);
         char *responseConsumerURL = NULL;
         char *AssertionConsumerServiceURL = NULL;
 
-        if (MECH_SAML_EC_DEBUG) {
-            fprintf(stdout, "AS SEEN BY XML:\n");
-            xmlDocDump(stdout, doc_from_idp);
-        }
+        logXmlDoc("AS SEEN BY XML", doc_from_idp);
 
         /* Compare responseConsumerURL from original request with
          * AssertionConsumerServiceURL from response from IdP */
         request_from_sp = getXmlElement(header_from_sp, "Request", MECH_SAML_EC_PAOS_NS);
         if (request_from_sp == NULL) {
-            fprintf(stderr, "ERROR: No Request element in SAML Request Header from SP\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "No Request element in SAML Request Header from SP");
             *minor = GSSEAP_BAD_TOK_HEADER;
             major = GSS_S_FAILURE;
             goto cleanup;
@@ -968,7 +1043,7 @@ xmlNodeSetContent(signature_value, val);
 
         responseConsumerURL = xmlGetProp(request_from_sp, "responseConsumerURL");
         if (responseConsumerURL == NULL) {
-            fprintf(stderr, "ERROR: No responseConsumerURL attribute in SAML Request Header from SP\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "No responseConsumerURL attribute in SAML Request Header from SP");
             *minor = GSSEAP_BAD_TOK_HEADER;
             major = GSS_S_FAILURE;
             goto cleanup;
@@ -976,7 +1051,7 @@ xmlNodeSetContent(signature_value, val);
 
         response_from_idp = getXmlElement(xmlDocGetRootElement(doc_from_idp), "Response", MECH_SAML_EC_ECP_NS);
         if (response_from_idp == NULL) {
-            fprintf(stderr, "ERROR: No Response element in SAML Response from IdP\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "No Response element in SAML Response from IdP");
             *minor = GSSEAP_BAD_TOK_HEADER;
             major = GSS_S_FAILURE;
             goto cleanup;
@@ -984,62 +1059,61 @@ xmlNodeSetContent(signature_value, val);
 
         AssertionConsumerServiceURL = xmlGetProp(response_from_idp, "AssertionConsumerServiceURL");
         if (AssertionConsumerServiceURL == NULL) {
-            fprintf(stderr, "ERROR: No AssertionConsumerServiceURL attribute in SAML Response from IdP\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "No AssertionConsumerServiceURL attribute in SAML Response from IdP");
             *minor = GSSEAP_BAD_TOK_HEADER;
             major = GSS_S_FAILURE;
             goto cleanup;
         }
 
         if(strcmp(responseConsumerURL, AssertionConsumerServiceURL)) {
-            fprintf(stderr, "ERROR: responseConsumerURL (%s) and "
-                    "AssertionConsumerServiceURL (%s) do not match\n",
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "responseConsumerURL (%s) and "
+                    "AssertionConsumerServiceURL (%s) do not match",
                     responseConsumerURL, AssertionConsumerServiceURL);
             *minor = GSSEAP_PEER_AUTH_FAILURE;
             major = GSS_S_FAILURE;
             goto cleanup;
         } else if (MECH_SAML_EC_DEBUG)
-            fprintf(stdout, "NOTE: responseConsumerURL (%s) and "
-                    "AssertionConsumerServiceURL (%s) match\n",
+            GSSEAP_LOG(GSSEAP_LOG_DEBUG, "responseConsumerURL (%s) and "
+                    "AssertionConsumerServiceURL (%s) match",
                     responseConsumerURL, AssertionConsumerServiceURL);
 
         if(strlen(AssertionConsumerServiceURL) != ctx->acceptorName->username.length
            ||
            strncmp(AssertionConsumerServiceURL, ctx->acceptorName->username.value,
                    ctx->acceptorName->username.length)) {
-            fprintf(stderr, "ERROR: Target name (%.*s) and "
-                    "AssertionConsumerServiceURL (%s) do not match\n",
-                    ctx->acceptorName->username.length,
-                    ctx->acceptorName->username.value, AssertionConsumerServiceURL);
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "Target name (%.*s) and "
+                    "AssertionConsumerServiceURL (%s) do not match",
+                    (int)ctx->acceptorName->username.length,
+                    (char *)ctx->acceptorName->username.value, AssertionConsumerServiceURL);
             *minor = GSSEAP_PEER_AUTH_FAILURE;
             major = GSS_S_FAILURE;
             goto cleanup;
         } else if (MECH_SAML_EC_DEBUG)
-            fprintf(stdout, "NOTE: Target name (%.*s) and "
-                    "AssertionConsumerServiceURL (%s) match\n",
-                    ctx->acceptorName->username.length,
-                    ctx->acceptorName->username.value, AssertionConsumerServiceURL);
+            GSSEAP_LOG(GSSEAP_LOG_DEBUG, "Target name (%.*s) and "
+                    "AssertionConsumerServiceURL (%s) match",
+                    (int)ctx->acceptorName->username.length,
+                    (char *)ctx->acceptorName->username.value, AssertionConsumerServiceURL);
 
         mutual_auth = getXmlElement(xmlDocGetRootElement(doc_from_idp), "RequestAuthenticated", MECH_SAML_EC_ECP_NS);
         if (mutual_auth != NULL) {
-            if (MECH_SAML_EC_DEBUG)
-                fprintf(stdout, "NOTE: IdP has reported ecp:RequestAuthenticated\n");
+            GSSEAP_LOG(GSSEAP_LOG_DEBUG, "IdP has reported ecp:RequestAuthenticated");
             ctx->gssFlags |= GSS_C_MUTUAL_FLAG;
         } else if (signature_value != NULL) { // SP did send a signature across
             /* VSY TODO: ecp:RequestAuthenticated not yet supported by most
                IdPs, so assume mutual auth succeeded if we are forced */
             if (getenv("MECH_SAML_EC_FORCE_MUTUAL_AUTH_FLAG")) {
-                fprintf(stderr, "WARNING: IdP did NOT report ecp:RequestAuthenticated"
+                GSSEAP_LOG(GSSEAP_LOG_WARNING, "IdP did NOT report ecp:RequestAuthenticated"
                             " but server did send a sign request and "
                             "MECH_SAML_EC_FORCE_MUTUAL_AUTH_FLAG is set in "
                             "environment so force-setting GSS_C_MUTUAL_FLAG assuming "
                             " IdP has checked signature but has not implemented "
-                            "ecp:RequestAuthenticated yet!!!\n");
+                            "ecp:RequestAuthenticated yet!!!");
                 ctx->gssFlags |= GSS_C_MUTUAL_FLAG;
             } else {
-                fprintf(stderr, "ERROR: IdP did NOT report ecp:RequestAuthenticated"
+                GSSEAP_LOG(GSSEAP_LOG_ERROR, "IdP did NOT report ecp:RequestAuthenticated"
                             " but server did sign the request. To force-set GSS_C_MUTUAL_FLAG assuming "
                             " IdP has checked the signature set "
-                            "MECH_SAML_EC_FORCE_MUTUAL_AUTH_FLAG in environment!!!\n");
+                            "MECH_SAML_EC_FORCE_MUTUAL_AUTH_FLAG in environment!!!");
                 *minor = GSSEAP_PEER_AUTH_FAILURE;
                 major = GSS_S_FAILURE;
                 goto cleanup;
@@ -1049,9 +1123,9 @@ xmlNodeSetContent(signature_value, val);
         /* TODO VSY: DELETE THIS GeneratedKey ADDED FOR TEST PURPOSES!!! */
         if ((elem = getXmlElement(xmlDocGetRootElement(doc_from_idp), "GeneratedKey", MECH_SAML_EC_SAMLEC_NS)) == NULL && getenv("MECH_SAML_EC_FORCE_SAMPLE_KEY")) {
             xmlNsPtr samlec_ns;
-            fprintf(stderr, "WARNING: No GeneratedKey in SAML Response from IdP; "
+            GSSEAP_LOG(GSSEAP_LOG_WARNING, "No GeneratedKey in SAML Response from IdP; "
                             "Since MECH_SAML_EC_FORCE_SAMPLE_KEY is set in the "
-                            "environment, forcing use of a sample key!\n");
+                            "environment, forcing use of a sample key!");
             elem = getXmlElement(xmlDocGetRootElement(doc_from_idp), "Response", MECH_SAML_EC_ECP_NS);
             gen_key = xmlNewNode(NULL, "GeneratedKey");
             // Check if this NS already exists?
@@ -1062,7 +1136,19 @@ xmlNodeSetContent(signature_value, val);
         }
 
         if ((gen_key = getXmlElement(xmlDocGetRootElement(doc_from_idp), "GeneratedKey", MECH_SAML_EC_SAMLEC_NS)) != NULL) {
-            gl_generated_key = xmlNodeGetContent(gen_key);
+            xmlChar *key = xmlNodeGetContent(gen_key);
+
+            if (key == NULL) {
+                *minor = GSSEAP_KEY_UNAVAILABLE;
+                major = GSS_S_FAILURE;
+                goto cleanup;
+            }
+            gss_release_buffer(&tmpMinor, &ctx->initiatorCtx.generatedKey);
+            major = makeStringBuffer(minor, (char *)key,
+                                     &ctx->initiatorCtx.generatedKey);
+            xmlFree(key);
+            if (GSS_ERROR(major))
+                goto cleanup;
 
             /* Add SessionKey/EncType as sibling of gen_key */
             session_key = xmlNewNode(NULL, "SessionKey");
@@ -1075,15 +1161,14 @@ xmlNodeSetContent(signature_value, val);
             GSSEAP_KRB_INIT(&krbContext);
             if  (krbEnctypeToString(krbContext, ctx->encryptionType, "", &buffer) != 0 ||
                  bufferToString(&tmpMinor, &buffer, &tmp) != GSS_S_COMPLETE) {
-                fprintf(stderr, "ERROR: Failed to convert context's encryption type to string\n");
+                GSSEAP_LOG(GSSEAP_LOG_ERROR, "Failed to convert context's encryption type to string");
                 *minor = GSSEAP_KEY_UNAVAILABLE;
                 major = GSS_S_FAILURE;
                 goto cleanup;
             }
             encryption_type = xmlNewNode(samlec_ns, "EncType");
             xmlNodeSetContent(encryption_type, tmp);
-            if (MECH_SAML_EC_DEBUG)
-                fprintf(stdout, "NOTE: Encryption Type for session key is (%s)\n", tmp);
+            GSSEAP_LOG(GSSEAP_LOG_DEBUG, "Encryption Type for session key is (%s)", tmp);
             GSSEAP_FREE(buffer.value); buffer.value = NULL;
             free(tmp); tmp = NULL;
             xmlAddChild(session_key, encryption_type);
@@ -1095,10 +1180,10 @@ xmlNodeSetContent(signature_value, val);
             xmlUnlinkNode(gen_key);
             xmlFreeNode(gen_key); gen_key = NULL;
         } else { // RFC requires support for GSS_C_CONF_FLAG, GSS_C_INTEG_FLAG
-            fprintf(stderr, "ERROR: No GeneratedKey in SAML header block from IdP; "
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "No GeneratedKey in SAML header block from IdP; "
                             "To force use of a sample key set "
                             "MECH_SAML_EC_FORCE_SAMPLE_KEY in the "
-                            "environment!\n");
+                            "environment!");
             *minor = GSSEAP_KEY_UNAVAILABLE;
             major = GSS_S_FAILURE;
             goto cleanup;
@@ -1108,12 +1193,11 @@ xmlNodeSetContent(signature_value, val);
                                           MECH_SAML_EC_SAMLEC_NS) != NULL)
             if (req_flags & GSS_C_DELEG_FLAG) {
                 ctx->gssFlags |= GSS_C_DELEG_FLAG;
-                if (MECH_SAML_EC_DEBUG)
-                    fprintf(stdout, "NOTE: Credential being delegated to acceptor\n");
+                GSSEAP_LOG(GSSEAP_LOG_DEBUG, "Credential being delegated to acceptor");
             } else {
-                fprintf(stderr, "ERROR: Credential Delegation was NOT requested "
+                GSSEAP_LOG(GSSEAP_LOG_ERROR, "Credential Delegation was NOT requested "
                             "but IdP has delegated a credential possibly at  "
-                            "the request of the server. \n");
+                            "the request of the server. ");
                 *minor = GSSEAP_BAD_CONTEXT_OPTION;
                 major = GSS_S_FAILURE;
                 goto cleanup;
@@ -1121,7 +1205,7 @@ xmlNodeSetContent(signature_value, val);
 
         header_from_idp = getXmlElement(xmlDocGetRootElement(doc_from_idp), "Header", MECH_SAML_EC_SOAP11_NS);
         if (header_from_idp == NULL) {
-            fprintf(stderr, "ERROR: No Header element in SAML Response from IdP\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "No Header element in SAML Response from IdP");
             *minor = GSSEAP_BAD_TOK_HEADER;
             major = GSS_S_FAILURE;
             goto cleanup;
@@ -1131,23 +1215,20 @@ xmlNodeSetContent(signature_value, val);
         /* freeChildren(header_from_idp); */
         relay_state = getXmlElement(header_from_sp, "RelayState", MECH_SAML_EC_ECP_NS);
         if (relay_state == NULL) {
-            fprintf(stderr, "ERROR: No RelayState element in SAML Request from SP\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "No RelayState element in SAML Request from SP");
             *minor = GSSEAP_BAD_TOK_HEADER;
             major = GSS_S_FAILURE;
             goto cleanup;
         }
 
         if (xmlAddChild(header_from_idp, xmlCopyNode(relay_state, 1)) == NULL) {
-            fprintf(stderr, "ERROR: Failure adding RelayState to Header from IdP\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "Failure adding RelayState to Header from IdP");
             *minor = GSSEAP_BAD_TOK_HEADER;
             major = GSS_S_FAILURE;
             goto cleanup;
         }
 
-        if (MECH_SAML_EC_DEBUG) {
-            fprintf(stdout, "SENDING TO SP >>>>>>>>>>>>>>>>>>>\n");
-            xmlDocDump(stdout, doc_from_idp);
-        }
+        logXmlDoc("SENDING TO SP >>>>>>>>>>>>>>>>>>>", doc_from_idp);
 
         xmlDocDumpMemory(doc_from_idp, (char *)&response->value,
                   (int *)&response->length);
@@ -1541,7 +1622,7 @@ gssEapInitSecContext(OM_uint32 *minor,
         major = processSAMLRequest(minor, ctx, req_flags, input_chan_bindings,
                                      input_token, output_token);
         if (major != GSS_S_COMPLETE) {
-            fprintf(stderr, "ERROR: SOAP FAULT RESPONSE BEING SENT>>>>>>>>>>>>>>>\n");
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "SOAP FAULT RESPONSE BEING SENT>>>>>>>>>>>>>>>");
             makeStringBuffer(&tmpMinor, SOAP_FAULT_MSG, output_token);
         } else {
             ctx->state = GSSEAP_STATE_ESTABLISHED;
@@ -1601,15 +1682,20 @@ gss_init_sec_context(OM_uint32 *minor,
     output_token->length = 0;
     output_token->value = NULL;
 
-    if (ctx == GSS_C_NO_CONTEXT) {
-        if (input_token != GSS_C_NO_BUFFER && input_token->length != 0) {
-            *minor = GSSEAP_WRONG_SIZE;
-            return GSS_S_DEFECTIVE_TOKEN;
-        }
+    if (ctx == GSS_C_NO_CONTEXT &&
+        input_token != GSS_C_NO_BUFFER && input_token->length != 0) {
+        *minor = GSSEAP_WRONG_SIZE;
+        return GSS_S_DEFECTIVE_TOKEN;
+    }
+
+    GSSEAP_ALLOC_SCOPE_ENTER(GSSEAP_ALLOC_SCOPE_HANDSHAKE);
 
+    if (ctx == GSS_C_NO_CONTEXT) {
         major = gssEapAllocContext(minor, &ctx);
-        if (GSS_ERROR(major))
+        if (GSS_ERROR(major)) {
+            GSSEAP_ALLOC_SCOPE_LEAVE(FALSE);
             return major;
+        }
 
         ctx->flags |= CTX_FLAG_INITIATOR;
 
@@ -1632,14 +1718,21 @@ gss_init_sec_context(OM_uint32 *minor,
                                  ret_flags,
                                  time_rec);
 
+    if (major == GSS_S_COMPLETE)
+        gssEapArenaRelease(&ctx->arena);
+
     GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
 
+    gssEapMetricsOutcome(TRUE, major, *minor);
+
     if (GSS_ERROR(major))
         gssEapReleaseContext(&tmpMinor, context_handle);
 #ifndef MECH_EAP
-    else if (MECH_SAML_EC_DEBUG)
-        printBuffer(stdout, output_token);
+    else
+        logBuffer("OUTPUT TOKEN", output_token);
 #endif
 
+    GSSEAP_ALLOC_SCOPE_LEAVE(major == GSS_S_COMPLETE);
+
     return major;
 }
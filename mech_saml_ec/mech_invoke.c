@@ -32,13 +32,89 @@
 
 #include "gssapiP_eap.h"
 
+static OM_uint32
+invokeMetricsSink(OM_uint32 *minor,
+                  const gss_OID oid GSSEAP_UNUSED,
+                  gss_buffer_t buffer)
+{
+    if (buffer == GSS_C_NO_BUFFER || buffer->length == 0)
+        return gssEapMetricsSetSink(minor, NULL);
+
+    if (buffer->length != sizeof(struct gss_eap_metrics_sink)) {
+        *minor = GSSEAP_WRONG_SIZE;
+        return GSS_S_FAILURE;
+    }
+
+    return gssEapMetricsSetSink(minor,
+                                (struct gss_eap_metrics_sink *)buffer->value);
+}
+
+static OM_uint32
+invokeStaleSP(OM_uint32 *minor,
+              const gss_OID oid GSSEAP_UNUSED,
+              gss_buffer_t buffer)
+{
+    if (buffer == GSS_C_NO_BUFFER) {
+        *minor = EINVAL;
+        return GSS_S_CALL_INACCESSIBLE_WRITE;
+    }
+
+    buffer->value = GSSEAP_MALLOC(4);
+    if (buffer->value == NULL) {
+        buffer->length = 0;
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+    buffer->length = 4;
+
+    store_uint32_be(staleSAMLServiceProvider() ? 1 : 0, buffer->value);
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+static struct {
+    gss_OID_desc oid;
+    OM_uint32 (*invoke)(OM_uint32 *, const gss_OID, gss_buffer_t);
+} mechInvokeOps[] = {
+    /* 1.3.6.1.4.1.5322.22.3.5.1 */
+    {
+        { 11, "\x2B\x06\x01\x04\x01\xA9\x4A\x16\x03\x05\x01" },
+        invokeMetricsSink,
+    },
+    /* 1.3.6.1.4.1.5322.22.3.5.2 */
+    {
+        { 11, "\x2B\x06\x01\x04\x01\xA9\x4A\x16\x03\x05\x02" },
+        invokeStaleSP,
+    },
+};
+
+gss_OID GSS_EAP_MECH_SET_METRICS_SINK           = &mechInvokeOps[0].oid;
+gss_OID GSS_EAP_MECH_INQUIRE_STALE_SP           = &mechInvokeOps[1].oid;
+
 OM_uint32 GSSAPI_CALLCONV
 gssspi_mech_invoke(OM_uint32 *minor,
                    const gss_OID desired_mech,
                    const gss_OID desired_object,
                    gss_buffer_t value)
 {
+    OM_uint32 major;
+    int i;
+
+    if (desired_mech != GSS_C_NO_OID && !gssEapIsMechanismOid(desired_mech)) {
+        *minor = GSSEAP_WRONG_MECH;
+        return GSS_S_BAD_MECH;
+    }
+
+    major = GSS_S_UNAVAILABLE;
     *minor = GSSEAP_BAD_INVOCATION;
 
-    return GSS_S_UNAVAILABLE;
+    for (i = 0; i < sizeof(mechInvokeOps) / sizeof(mechInvokeOps[0]); i++) {
+        if (oidEqual(&mechInvokeOps[i].oid, desired_object)) {
+            major = (*mechInvokeOps[i].invoke)(minor, desired_object, value);
+            break;
+        }
+    }
+
+    return major;
 }
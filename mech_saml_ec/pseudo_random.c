@@ -59,24 +59,35 @@
 
 #include "gssapiP_eap.h"
 
+#define PRF_STACK_INPUT_LENGTH              256
+#define PRF_MAX_OUTPUT_LENGTH               64
+
+/*
+ * Compute desired_output_len bytes of PRF output into caller supplied
+ * memory. The PRF output length and key schedule are cached on the
+ * context, and whole PRF blocks are written straight into the output,
+ * so on MIT Kerberos no memory is allocated for typical inputs.
+ */
 OM_uint32
-gssEapPseudoRandom(OM_uint32 *minor,
-                   gss_ctx_id_t ctx,
-                   int prf_key,
-                   const gss_buffer_t prf_in,
-                   ssize_t desired_output_len,
-                   gss_buffer_t prf_out)
+gssEapPseudoRandomInto(OM_uint32 *minor,
+                       gss_ctx_id_t ctx,
+                       int prf_key,
+                       const gss_buffer_t prf_in,
+                       size_t desired_output_len,
+                       unsigned char *prf_out)
 {
     krb5_error_code code;
-    int i;
-    OM_uint32 tmpMinor;
-    size_t prflen;
+    uint32_t i;
     krb5_data t, ns;
+    unsigned char nsBuf[4 + PRF_STACK_INPUT_LENGTH];
     unsigned char *p;
     krb5_context krbContext;
-
-    prf_out->length = 0;
-    prf_out->value = NULL;
+#ifdef HAVE_HEIMDAL_VERSION
+    krb5_crypto krbCrypto;
+#else
+    krb5_key krbKey;
+    unsigned char tBuf[PRF_MAX_OUTPUT_LENGTH];
+#endif
 
     *minor = 0;
 
@@ -91,67 +102,81 @@ gssEapPseudoRandom(OM_uint32 *minor,
         goto cleanup;
     }
 
-    prf_out->value = GSSEAP_MALLOC(desired_output_len);
-    if (prf_out->value == NULL) {
-        code = ENOMEM;
-        goto cleanup;
+    if (ctx->prfLength == 0) {
+        code = krb5_c_prf_length(krbContext,
+                                 ctx->encryptionType,
+                                 &ctx->prfLength);
+        if (code != 0) {
+            ctx->prfLength = 0;
+            goto cleanup;
+        }
     }
-    prf_out->length = desired_output_len;
 
-    code = krb5_c_prf_length(krbContext,
-                             ctx->encryptionType,
-                             &prflen);
+#ifdef HAVE_HEIMDAL_VERSION
+    code = krbContextCrypto(krbContext, ctx, &krbCrypto);
+#else
+    code = krbContextCrypto(krbContext, ctx, &krbKey);
+#endif
     if (code != 0)
         goto cleanup;
 
     ns.length = 4 + prf_in->length;
-    ns.data = GSSEAP_MALLOC(ns.length);
-    if (ns.data == NULL) {
-        code = ENOMEM;
-        goto cleanup;
-    }
-
-#ifndef HAVE_HEIMDAL_VERSION
-    /* Same API, but different allocation rules, unfortunately. */
-    t.length = prflen;
-    t.data = GSSEAP_MALLOC(t.length);
-    if (t.data == NULL) {
-        code = ENOMEM;
-        goto cleanup;
+    if (prf_in->length <= PRF_STACK_INPUT_LENGTH) {
+        ns.data = (char *)nsBuf;
+    } else {
+        ns.data = GSSEAP_MALLOC(ns.length);
+        if (ns.data == NULL) {
+            code = ENOMEM;
+            goto cleanup;
+        }
     }
-#endif
 
     memcpy((unsigned char *)ns.data + 4, prf_in->value, prf_in->length);
-    i = 0;
-    p = (unsigned char *)prf_out->value;
-    while (desired_output_len > 0) {
+
+    for (i = 0, p = prf_out; desired_output_len > 0; i++) {
+        size_t n = MIN(ctx->prfLength, desired_output_len);
+
         store_uint32_be(i, ns.data);
 
-        code = krb5_c_prf(krbContext, &ctx->rfc3961Key, &ns, &t);
+#ifdef HAVE_HEIMDAL_VERSION
+        /* Heimdal allocates the output itself */
+        code = krb5_crypto_prf(krbContext, krbCrypto, &ns, &t);
         if (code != 0)
             goto cleanup;
 
-        memcpy(p, t.data, MIN(t.length, desired_output_len));
+        memcpy(p, t.data, MIN(t.length, n));
+        krb5_free_data_contents(krbContext, &t);
+#else
+        t.length = ctx->prfLength;
+        if (n == ctx->prfLength) {
+            t.data = (char *)p;
+        } else if (t.length <= sizeof(tBuf)) {
+            t.data = (char *)tBuf;
+        } else {
+            code = KRB5_BAD_MSIZE;
+            goto cleanup;
+        }
 
-        p += t.length;
-        desired_output_len -= t.length;
-        i++;
+        code = krb5_k_prf(krbContext, krbKey, &ns, &t);
+        if (code != 0)
+            goto cleanup;
+
+        if (t.data != (char *)p)
+            memcpy(p, t.data, n);
+#endif
+
+        p += n;
+        desired_output_len -= n;
     }
 
 cleanup:
-    if (code != 0)
-        gss_release_buffer(&tmpMinor, prf_out);
     if (ns.data != NULL) {
         memset(ns.data, 0, ns.length);
-        GSSEAP_FREE(ns.data);
-    }
-#ifdef HAVE_HEIMDAL_VERSION
-    krb5_free_data_contents(krbContext, &t);
-#else
-    if (t.data != NULL) {
-        memset(t.data, 0, t.length);
-        GSSEAP_FREE(t.data);
+        if (ns.data != (char *)nsBuf)
+            GSSEAP_FREE(ns.data);
     }
+#ifndef HAVE_HEIMDAL_VERSION
+    memset(tBuf, 0, sizeof(tBuf));
 #endif
 
     *minor = code;
@@ -159,6 +184,42 @@ cleanup:
     return (code == 0) ? GSS_S_COMPLETE : GSS_S_FAILURE;
 }
 
+OM_uint32
+gssEapPseudoRandom(OM_uint32 *minor,
+                   gss_ctx_id_t ctx,
+                   int prf_key,
+                   const gss_buffer_t prf_in,
+                   ssize_t desired_output_len,
+                   gss_buffer_t prf_out)
+{
+    OM_uint32 major, tmpMinor;
+
+    prf_out->length = 0;
+    prf_out->value = NULL;
+
+    if (desired_output_len < 0) {
+        *minor = GSSEAP_WRONG_SIZE;
+        return GSS_S_FAILURE;
+    }
+
+    if (desired_output_len > 0) {
+        prf_out->value = GSSEAP_MALLOC(desired_output_len);
+        if (prf_out->value == NULL) {
+            *minor = ENOMEM;
+            return GSS_S_FAILURE;
+        }
+        prf_out->length = desired_output_len;
+    }
+
+    major = gssEapPseudoRandomInto(minor, ctx, prf_key, prf_in,
+                                   (size_t)desired_output_len,
+                                   (unsigned char *)prf_out->value);
+    if (GSS_ERROR(major))
+        gss_release_buffer(&tmpMinor, prf_out);
+
+    return major;
+}
+
 OM_uint32 GSSAPI_CALLCONV
 gss_pseudo_random(OM_uint32 *minor,
                   gss_ctx_id_t ctx,
@@ -0,0 +1,457 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Replay recorded SAML-EC exchanges from corpus/ through both legs of
+ * the handshake without a network. For each case directory the
+ * initiator processes sp-request.xml with the IdP answer taken from
+ * idp-response.xml (SAML_EC_IDP=file://...), and the acceptor verifies
+ * sp-token.xml with the corpus SP configuration. Per-phase costs come
+ * from the metrics sink; allocation counts and peak live bytes from
+ * the mechanism's allocation tracking, so memory allocated directly by
+ * libxml2, OpenSAML or the SP is not included. Not built by default;
+ * use "make saml_replay".
+ *
+ * Usage: saml_replay [-n iterations] casedir...
+ */
+
+#include "gssapiP_eap.h"
+
+#include <limits.h>
+#include <time.h>
+
+#include <libxml/parser.h>
+
+#ifndef GSSEAP_IDP_REPLAY
+#error saml_replay needs the mechanism built with GSSEAP_IDP_REPLAY
+#endif
+
+#ifndef GSSEAP_ALLOC_TRACKING
+#error saml_replay needs the mechanism built with GSSEAP_ALLOC_TRACKING
+#endif
+
+#define REPLAY_SP_REQUEST       "sp-request.xml"
+#define REPLAY_IDP_RESPONSE     "idp-response.xml"
+#define REPLAY_SP_TOKEN         "sp-token.xml"
+
+#define SHIBSP_CONFIG           "SHIBSP_CONFIG"
+#define SHIBSP_CFGDIR           "SHIBSP_CFGDIR"
+#define SAML_EC_IDP             "SAML_EC_IDP"
+
+extern OM_uint32
+processSAMLRequest(OM_uint32 *minor, gss_ctx_id_t ctx, OM_uint32 req_flags,
+                   gss_channel_bindings_t input_chan_bindings,
+                   gss_buffer_t request, gss_buffer_t response);
+
+extern xmlNode *getXmlElement(xmlNode *a_node, char *name, char *ns);
+
+struct replay_span {
+    const char *name;
+    uint64_t sumUsec;
+    uint64_t count;
+};
+
+struct replay_stats {
+    uint64_t initNs;
+    uint64_t acceptNs;
+    struct gss_eap_alloc_totals allocs;
+    struct replay_span spans[GSSEAP_METRIC_MAX];
+};
+
+static uint64_t
+replayNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+replaySpan(void *data, const char *name, OM_uint32 usec)
+{
+    struct replay_stats *stats = (struct replay_stats *)data;
+    size_t i;
+
+    for (i = 0; i < GSSEAP_METRIC_MAX; i++) {
+        struct replay_span *span = &stats->spans[i];
+
+        if (span->name == NULL)
+            span->name = name;
+        if (strcmp(span->name, name) == 0) {
+            span->sumUsec += usec;
+            span->count++;
+            break;
+        }
+    }
+}
+
+static OM_uint32
+readReplayFile(OM_uint32 *minor,
+               const char *dir,
+               const char *file,
+               gss_buffer_t buffer)
+{
+    char path[PATH_MAX];
+    unsigned char *p;
+    FILE *fp;
+    long size;
+
+    buffer->length = 0;
+    buffer->value = NULL;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+
+    fp = fopen(path, "rb");
+    if (fp == NULL) {
+        *minor = errno;
+        return GSS_S_FAILURE;
+    }
+
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ||
+        fseek(fp, 0, SEEK_SET) != 0) {
+        *minor = errno;
+        fclose(fp);
+        return GSS_S_FAILURE;
+    }
+
+    /* NUL terminated, as the acceptor hands the token to C++ as a string */
+    p = GSSEAP_MALLOC(size + 1);
+    if (p == NULL) {
+        *minor = ENOMEM;
+        fclose(fp);
+        return GSS_S_FAILURE;
+    }
+
+    if (fread(p, 1, size, fp) != (size_t)size) {
+        *minor = GSSEAP_TOK_TRUNC;
+        GSSEAP_FREE(p);
+        fclose(fp);
+        return GSS_S_FAILURE;
+    }
+    p[size] = '\0';
+
+    fclose(fp);
+
+    buffer->length = size;
+    buffer->value = p;
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+/*
+ * The initiator checks the target name against the ACS URL the IdP
+ * returned, so the acceptor name is taken from the recorded response.
+ */
+static OM_uint32
+importReplayAcceptor(OM_uint32 *minor,
+                     gss_buffer_t idpResponse,
+                     gss_name_t *pName)
+{
+    OM_uint32 major;
+    xmlDocPtr doc;
+    xmlNode *elem;
+    xmlChar *acs = NULL;
+    gss_buffer_desc nameBuf;
+
+    doc = xmlReadMemory(idpResponse->value, idpResponse->length,
+                        REPLAY_IDP_RESPONSE, NULL, 0);
+    if (doc == NULL) {
+        *minor = GSSEAP_BAD_CONTEXT_TOKEN;
+        return GSS_S_DEFECTIVE_TOKEN;
+    }
+
+    elem = getXmlElement(xmlDocGetRootElement(doc), "Response",
+                         MECH_SAML_EC_ECP_NS);
+    if (elem != NULL)
+        acs = xmlGetProp(elem, (const xmlChar *)"AssertionConsumerServiceURL");
+    if (acs == NULL) {
+        xmlFreeDoc(doc);
+        *minor = GSSEAP_BAD_CONTEXT_TOKEN;
+        return GSS_S_DEFECTIVE_TOKEN;
+    }
+
+    nameBuf.value = acs;
+    nameBuf.length = xmlStrlen(acs);
+
+    major = gssEapImportName(minor, &nameBuf, GSS_C_NT_USER_NAME,
+                             GSS_SAMLEC_MECHANISM, pName);
+
+    xmlFree(acs);
+    xmlFreeDoc(doc);
+
+    return major;
+}
+
+static OM_uint32
+replayInitiator(OM_uint32 *minor,
+                gss_name_t acceptorName,
+                gss_buffer_t request)
+{
+    OM_uint32 major, tmpMinor;
+    gss_ctx_id_t ctx = GSS_C_NO_CONTEXT;
+    gss_buffer_desc response = GSS_C_EMPTY_BUFFER;
+
+    major = gssEapAllocContext(minor, &ctx);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    ctx->flags |= CTX_FLAG_INITIATOR;
+
+    major = gssEapDuplicateName(minor, acceptorName, &ctx->acceptorName);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    major = processSAMLRequest(minor, ctx,
+                               GSS_C_MUTUAL_FLAG | GSS_C_DELEG_FLAG,
+                               GSS_C_NO_CHANNEL_BINDINGS,
+                               request, &response);
+
+cleanup:
+    if (response.value != NULL)
+        xmlFree(response.value);
+    gssEapReleaseContext(&tmpMinor, &ctx);
+
+    return major;
+}
+
+static OM_uint32
+replayAcceptor(OM_uint32 *minor, gss_buffer_t token)
+{
+    char *initiatorName = NULL;
+    time_t sessionNotOnOrAfter = 0;
+    char *generatedKey = NULL;
+    char *delegatedAssertions = NULL;
+    int result;
+
+    result = verifySAMLResponse((char *)token->value, (int)token->length,
+                                &initiatorName, &sessionNotOnOrAfter,
+                                &generatedKey, &delegatedAssertions, NULL);
+    if (initiatorName == NULL)
+        result = 0;
+
+    free(initiatorName);
+    free(generatedKey);
+    free(delegatedAssertions);
+
+    if (!result) {
+        *minor = GSSEAP_PEER_AUTH_FAILURE;
+        return GSS_S_DEFECTIVE_CREDENTIAL;
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+static void
+reportReplay(const char *dir, size_t iterations, struct replay_stats *stats)
+{
+    size_t i;
+
+    if (iterations == 0)
+        return;
+
+    printf("%s: %lu iterations\n", dir, (unsigned long)iterations);
+    printf("  %-20s %12.1f us\n", "initiator",
+           stats->initNs / 1e3 / iterations);
+    printf("  %-20s %12.1f us\n", "acceptor",
+           stats->acceptNs / 1e3 / iterations);
+
+    for (i = 0; i < GSSEAP_METRIC_MAX && stats->spans[i].name != NULL; i++) {
+        struct replay_span *span = &stats->spans[i];
+
+        if (span->count == 0)
+            continue;
+
+        printf("  %-20s %12.1f us\n", span->name,
+               (double)span->sumUsec / span->count);
+    }
+
+    printf("  %-20s %12.1f KB\n", "peak live",
+           stats->allocs.peakBytes / 1024.0);
+    printf("  %-20s %12.1f\n", "allocs/iteration",
+           (double)stats->allocs.count / iterations);
+    printf("  %-20s %12.1f\n", "bytes/iteration",
+           (double)stats->allocs.bytes / iterations);
+}
+
+static OM_uint32
+runReplay(OM_uint32 *minor, const char *dir, size_t iterations)
+{
+    OM_uint32 major, tmpMinor;
+    gss_buffer_desc request = GSS_C_EMPTY_BUFFER;
+    gss_buffer_desc idpResponse = GSS_C_EMPTY_BUFFER;
+    gss_buffer_desc token = GSS_C_EMPTY_BUFFER;
+    gss_name_t acceptorName = GSS_C_NO_NAME;
+    struct gss_eap_metrics_sink sink;
+    struct replay_stats stats;
+    struct gss_eap_alloc_totals baseline;
+    char path[PATH_MAX], idp[PATH_MAX + sizeof("file://")];
+    uint64_t start;
+    size_t i;
+
+    memset(&stats, 0, sizeof(stats));
+
+    if (realpath(dir, path) == NULL) {
+        *minor = errno;
+        return GSS_S_FAILURE;
+    }
+
+    snprintf(idp, sizeof(idp), "file://%s/%s", path, REPLAY_IDP_RESPONSE);
+    setenv(SAML_EC_IDP, idp, 1);
+
+    major = readReplayFile(minor, path, REPLAY_SP_REQUEST, &request);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    major = readReplayFile(minor, path, REPLAY_IDP_RESPONSE, &idpResponse);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    major = readReplayFile(minor, path, REPLAY_SP_TOKEN, &token);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    major = importReplayAcceptor(minor, &idpResponse, &acceptorName);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    sink.span = replaySpan;
+    sink.outcome = NULL;
+    sink.data = &stats;
+
+    major = gssEapMetricsSetSink(minor, &sink);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    gssEapAllocReset();
+    gssEapAllocGetTotals(&baseline);
+
+    for (i = 0; i < iterations; i++) {
+        start = replayNow();
+        major = replayInitiator(minor, acceptorName, &request);
+        stats.initNs += replayNow() - start;
+        if (GSS_ERROR(major))
+            break;
+
+        start = replayNow();
+        major = replayAcceptor(minor, &token);
+        stats.acceptNs += replayNow() - start;
+        if (GSS_ERROR(major))
+            break;
+    }
+
+    /* Report the peak above what was live when the case started */
+    gssEapAllocGetTotals(&stats.allocs);
+    stats.allocs.peakBytes -= baseline.liveBytes;
+
+    gssEapMetricsSetSink(&tmpMinor, NULL);
+
+    if (!GSS_ERROR(major))
+        reportReplay(dir, iterations, &stats);
+
+cleanup:
+    gssEapReleaseName(&tmpMinor, &acceptorName);
+    gss_release_buffer(&tmpMinor, &request);
+    gss_release_buffer(&tmpMinor, &idpResponse);
+    gss_release_buffer(&tmpMinor, &token);
+
+    return major;
+}
+
+/*
+ * Point the SP at the corpus configuration unless the caller chose
+ * another one; the corpus lives next to the first case directory.
+ */
+static void
+setReplayConfig(const char *caseDir)
+{
+    char path[PATH_MAX], cfg[PATH_MAX + sizeof("/shibboleth2.xml")];
+
+    if (getenv(SHIBSP_CFGDIR) != NULL || realpath(caseDir, path) == NULL)
+        return;
+
+    if (strrchr(path, '/') != NULL)
+        *strrchr(path, '/') = '\0';
+
+    snprintf(cfg, sizeof(cfg), "%s/shibboleth2.xml", path);
+
+    setenv(SHIBSP_CFGDIR, path, 0);
+    setenv(SHIBSP_CONFIG, cfg, 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    OM_uint32 major, minor;
+    size_t iterations = 100;
+    char *end;
+    int c, i, status = 0;
+
+    while ((c = getopt(argc, argv, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            errno = 0;
+            iterations = strtoul(optarg, &end, 10);
+            if (errno != 0 || end == optarg || *end != '\0' ||
+                optarg[0] == '-' || iterations == 0) {
+                fprintf(stderr, "%s: -n must be a positive number\n", argv[0]);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] casedir...\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind == argc) {
+        fprintf(stderr, "Usage: %s [-n iterations] casedir...\n", argv[0]);
+        return 1;
+    }
+
+    setReplayConfig(argv[optind]);
+
+    for (i = optind; i < argc; i++) {
+        major = runReplay(&minor, argv[i], iterations);
+        if (GSS_ERROR(major)) {
+            fprintf(stderr, "%s: major %08x minor %u\n",
+                    argv[i], major, minor);
+            status = 1;
+        }
+    }
+
+    return status;
+}
@@ -0,0 +1,531 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Out-of-process SAML engine. Acceptors that set
+ * SAML_EC_VERIFIER_SOCKET send their SAML request generation and
+ * response verification here instead of loading the Shibboleth SP
+ * themselves, so that many small processes share one warm SP with its
+ * metadata, caches and replay store. See util_verifier.h for the wire
+ * protocol.
+ *
+ * Each connection has a reader thread that queues requests for a pool
+ * of workers; replies are written as they complete, so requests
+ * pipelined on one connection run concurrently. Not built by default;
+ * use "make saml_verifierd".
+ *
+ * Only clients running as the -u uid, by default the daemon's own, are
+ * served: anyone else could use it to decrypt assertions.
+ *
+ * Usage: saml_verifierd [-t threads] [-u uid] socket
+ */
+
+#include "gssapiP_eap.h"
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define VERIFIERD_DEFAULT_THREADS       8
+#define VERIFIERD_QUEUE_SLOTS           256
+#define VERIFIERD_MAX_ATTRS             1024
+
+extern int warmSAMLServiceProvider(void);
+
+struct verifierd_conn {
+    int fd;
+    GSSEAP_MUTEX mutex;                 /* serialises replies, protects refs */
+    int refs;                           /* reader plus queued requests */
+};
+
+struct verifierd_job {
+    struct verifierd_conn *conn;
+    struct gss_eap_verifier_msg request;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t nonempty;
+    pthread_cond_t nonfull;
+    struct verifierd_job jobs[VERIFIERD_QUEUE_SLOTS];
+    unsigned int head;
+    unsigned int count;
+} queue = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+};
+
+static volatile sig_atomic_t stopping;
+
+static void
+connHold(struct verifierd_conn *conn)
+{
+    GSSEAP_MUTEX_LOCK(&conn->mutex);
+    conn->refs++;
+    GSSEAP_MUTEX_UNLOCK(&conn->mutex);
+}
+
+static void
+connRelease(struct verifierd_conn *conn)
+{
+    int refs;
+
+    GSSEAP_MUTEX_LOCK(&conn->mutex);
+    refs = --conn->refs;
+    GSSEAP_MUTEX_UNLOCK(&conn->mutex);
+
+    if (refs == 0) {
+        close(conn->fd);
+        GSSEAP_MUTEX_DESTROY(&conn->mutex);
+        GSSEAP_FREE(conn);
+    }
+}
+
+static void
+enqueueJob(const struct verifierd_job *job)
+{
+    pthread_mutex_lock(&queue.mutex);
+    while (queue.count == VERIFIERD_QUEUE_SLOTS)
+        pthread_cond_wait(&queue.nonfull, &queue.mutex);
+    queue.jobs[(queue.head + queue.count) % VERIFIERD_QUEUE_SLOTS] = *job;
+    queue.count++;
+    pthread_cond_signal(&queue.nonempty);
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+static void
+dequeueJob(struct verifierd_job *job)
+{
+    pthread_mutex_lock(&queue.mutex);
+    while (queue.count == 0)
+        pthread_cond_wait(&queue.nonempty, &queue.mutex);
+    *job = queue.jobs[queue.head];
+    queue.head = (queue.head + 1) % VERIFIERD_QUEUE_SLOTS;
+    queue.count--;
+    pthread_cond_signal(&queue.nonfull);
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+/*
+ * Reply fields; strings owned by the reply are released with it.
+ */
+struct verifierd_reply {
+    struct gss_eap_verifier_msg msg;
+    char **owned;
+    uint16_t nowned;
+    uint16_t alloc;
+};
+
+static int
+addField(struct verifierd_reply *reply, char *value)
+{
+    uint16_t alloc;
+    void *p;
+
+    if (reply->msg.count == reply->alloc) {
+        if (reply->alloc >= VERIFIER_VERIFY_FIELDS + 2 * VERIFIERD_MAX_ATTRS)
+            return 0;
+        alloc = reply->alloc ? 2 * reply->alloc : 8;
+        p = GSSEAP_REALLOC(reply->msg.fields, alloc * sizeof(*reply->msg.fields));
+        if (p == NULL)
+            return 0;
+        reply->msg.fields = p;
+        p = GSSEAP_REALLOC(reply->owned, alloc * sizeof(*reply->owned));
+        if (p == NULL)
+            return 0;
+        reply->owned = p;
+        reply->alloc = alloc;
+    }
+
+    reply->msg.fields[reply->msg.count].value = value;
+    reply->msg.fields[reply->msg.count].length = value ? strlen(value) : 0;
+    reply->msg.count++;
+    reply->owned[reply->nowned++] = value;
+
+    return 1;
+}
+
+static void
+releaseReply(struct verifierd_reply *reply)
+{
+    uint16_t i;
+
+    for (i = 0; i < reply->nowned; i++)
+        free(reply->owned[i]);
+    GSSEAP_FREE(reply->owned);
+    GSSEAP_FREE(reply->msg.fields);
+}
+
+static int
+addAttribute(void *data, const char *name, const char *value)
+{
+    struct verifierd_reply *reply = data;
+    char *n = strdup(name), *v = strdup(value);
+
+    if (n == NULL || v == NULL || !addField(reply, n)) {
+        free(n);
+        free(v);
+        return 0;
+    }
+    if (!addField(reply, v)) {
+        free(v);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void
+samlRequest(const struct gss_eap_verifier_msg *request,
+            struct verifierd_reply *reply)
+{
+    char *samlReq;
+
+    if (request->count < 2) {
+        reply->msg.arg = 0;
+        return;
+    }
+
+    samlReq = getSAMLRequest2((char *)request->fields[0].value,
+                              (int)request->fields[0].length,
+                              (request->arg & VERIFIER_FLAG_SIGNATURE) != 0,
+                              (request->arg & VERIFIER_FLAG_DELEGATION) != 0,
+                              (char *)request->fields[1].value);
+
+    reply->msg.arg = (samlReq != NULL);
+    if (!addField(reply, samlReq)) {
+        free(samlReq);
+        reply->msg.arg = 0;
+    }
+}
+
+static void
+verifyResponse(const struct gss_eap_verifier_msg *request,
+               struct verifierd_reply *reply)
+{
+    char *out[VERIFIER_VERIFY_FIELDS] = { NULL };
+    struct gss_eap_saml_attrs *attributes = NULL;
+    unsigned char fingerprint[SAML_FINGERPRINT_LENGTH];
+    time_t expiry = 0;
+    int result, i;
+
+    if (request->count < 1 || request->fields[0].value == NULL) {
+        reply->msg.arg = 0;
+        return;
+    }
+
+    result = verifySAMLResponse(request->fields[0].value,
+                                (int)request->fields[0].length,
+                                &out[0], &expiry, &out[2], &out[3],
+                                &attributes);
+
+    if (expiry != 0) {
+        out[1] = malloc(24);
+        if (out[1] != NULL)
+            snprintf(out[1], 24, "%lld", (long long)expiry);
+    }
+
+    /* Absent if it could not be had; the client then just does not cache */
+    if (result && getSAMLFingerprint(attributes, fingerprint)) {
+        out[4] = malloc(2 * SAML_FINGERPRINT_LENGTH + 1);
+        if (out[4] != NULL) {
+            for (i = 0; i < SAML_FINGERPRINT_LENGTH; i++)
+                snprintf(out[4] + 2 * i, 3, "%02x", fingerprint[i]);
+        }
+    }
+
+    for (i = 0; i < VERIFIER_VERIFY_FIELDS; i++) {
+        if (!addField(reply, out[i])) {
+            for (; i < VERIFIER_VERIFY_FIELDS; i++)
+                free(out[i]);
+            releaseSAMLAttributes(attributes);
+            reply->msg.arg = 0;
+            return;
+        }
+    }
+
+    /* The client resolves nothing itself, so send every attribute */
+    if (result && !getSAMLAttributes(attributes, addAttribute, reply))
+        result = 0;
+
+    releaseSAMLAttributes(attributes);
+
+    reply->msg.arg = result;
+}
+
+static void
+handleJob(struct verifierd_job *job)
+{
+    OM_uint32 major, minor;
+    struct verifierd_reply reply;
+
+    memset(&reply, 0, sizeof(reply));
+    reply.msg.id = job->request.id;
+    reply.msg.op = job->request.op;
+
+    switch (job->request.op) {
+    case VERIFIER_OP_SAML_REQUEST:
+        samlRequest(&job->request, &reply);
+        break;
+    case VERIFIER_OP_VERIFY_RESPONSE:
+        verifyResponse(&job->request, &reply);
+        break;
+    default:
+        GSSEAP_LOG(GSSEAP_LOG_WARNING, "Unknown verifier operation %u",
+                   job->request.op);
+        break;
+    }
+
+    GSSEAP_MUTEX_LOCK(&job->conn->mutex);
+    major = gssEapVerifierWriteMsg(&minor, job->conn->fd, &reply.msg);
+    if (GSS_ERROR(major) && (minor == GSSEAP_WRONG_SIZE || minor == ENOMEM)) {
+        /*
+         * Nothing was written, say because an attribute-heavy reply
+         * outgrew VERIFIER_MAX_MESSAGE: fail the call rather than leave
+         * the client waiting for its timeout.
+         */
+        struct gss_eap_verifier_msg failure;
+        OM_uint32 tmpMinor;
+
+        GSSEAP_LOG(GSSEAP_LOG_WARNING, "Unable to send verifier reply %u (%u); "
+                   "failing it instead", reply.msg.id, minor);
+
+        memset(&failure, 0, sizeof(failure));
+        failure.id = reply.msg.id;
+        failure.op = reply.msg.op;
+        major = gssEapVerifierWriteMsg(&tmpMinor, job->conn->fd, &failure);
+        if (GSS_ERROR(major))
+            minor = tmpMinor;
+    }
+    GSSEAP_MUTEX_UNLOCK(&job->conn->mutex);
+    if (GSS_ERROR(major))
+        GSSEAP_LOG(GSSEAP_LOG_WARNING, "Unable to send verifier reply %u (%u)",
+                   reply.msg.id, minor);
+
+    releaseReply(&reply);
+}
+
+static void *
+worker(void *param GSSEAP_UNUSED)
+{
+    struct verifierd_job job;
+
+    for (;;) {
+        dequeueJob(&job);
+        handleJob(&job);
+        gssEapVerifierReleaseMsg(&job.request);
+        connRelease(job.conn);
+    }
+
+    return NULL;
+}
+
+static void *
+connReader(void *param)
+{
+    struct verifierd_conn *conn = param;
+    struct verifierd_job job;
+    OM_uint32 major, minor;
+
+    job.conn = conn;
+
+    for (;;) {
+        major = gssEapVerifierReadMsg(&minor, conn->fd, &job.request);
+        if (GSS_ERROR(major))
+            break;
+        connHold(conn);
+        enqueueJob(&job);
+    }
+
+    if (minor != GSSEAP_TOK_TRUNC)
+        GSSEAP_LOG(GSSEAP_LOG_INFO, "Dropping verifier client (%u)", minor);
+
+    connRelease(conn);
+
+    return NULL;
+}
+
+static void
+onSignal(int sig GSSEAP_UNUSED)
+{
+    stopping = 1;
+}
+
+static int
+listenOn(const char *path)
+{
+    struct sockaddr_un sun;
+    mode_t mask;
+    int fd;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    unlink(path);
+
+    /* Access is then governed by the group and the socket's directory */
+    mask = umask(007);
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        perror(path);
+        umask(mask);
+        close(fd);
+        return -1;
+    }
+    umask(mask);
+
+    if (listen(fd, SOMAXCONN) != 0) {
+        perror("listen");
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+
+    return fd;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct verifierd_conn *conn;
+    struct sigaction sa;
+    pthread_t thread;
+    OM_uint32 minor;
+    uid_t uid = geteuid();
+    int c, i, fd, lfd, nthreads = VERIFIERD_DEFAULT_THREADS;
+
+    while ((c = getopt(argc, argv, "t:u:")) != -1) {
+        switch (c) {
+        case 't':
+            nthreads = atoi(optarg);
+            break;
+        case 'u':
+            if (!gssEapVerifierParseUid(optarg, &uid)) {
+                fprintf(stderr, "%s: invalid uid %s\n", argv[0], optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-u uid] socket\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-t threads] [-u uid] socket\n", argv[0]);
+        return 1;
+    }
+
+    if (nthreads < 1)
+        nthreads = 1;
+
+    /* This process is the verifier, whatever its environment says */
+    unsetenv(SAML_EC_VERIFIER_SOCKET);
+
+    if (!warmSAMLServiceProvider()) {
+        fprintf(stderr, "%s: unable to load the SP configuration\n", argv[0]);
+        return 1;
+    }
+
+    lfd = listenOn(argv[optind]);
+    if (lfd < 0)
+        return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* No SA_RESTART, so that accept() returns on a signal */
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = onSignal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&thread, NULL, worker, NULL) != 0) {
+            perror("pthread_create");
+            unlink(argv[optind]);
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+
+    while (!stopping) {
+        fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED)
+                perror("accept");
+            continue;
+        }
+
+        if (GSS_ERROR(gssEapVerifierCheckPeer(&minor, fd, uid))) {
+            GSSEAP_LOG(GSSEAP_LOG_WARNING, "Refusing verifier client: %s",
+                       strerror(minor));
+            close(fd);
+            continue;
+        }
+
+        conn = GSSEAP_CALLOC(1, sizeof(*conn));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->refs = 1;
+        GSSEAP_MUTEX_INIT(&conn->mutex);
+
+        if (pthread_create(&thread, NULL, connReader, conn) != 0) {
+            perror("pthread_create");
+            connRelease(conn);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(lfd);
+    unlink(argv[optind]);
+
+    return 0;
+}
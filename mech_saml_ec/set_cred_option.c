@@ -121,6 +121,36 @@ setCredPassword(OM_uint32 *minor,
     return gssEapSetCredPassword(minor, cred, buffer);
 }
 
+static OM_uint32
+setCredWarmUp(OM_uint32 *minor,
+              gss_cred_id_t cred,
+              const gss_OID oid GSSEAP_UNUSED,
+              const gss_buffer_t buffer GSSEAP_UNUSED)
+{
+#ifdef GSSEAP_ENABLE_ACCEPTOR
+    if (cred->flags & CRED_FLAG_ACCEPT)
+        return gssEapWarmUpAcceptor(minor, 0);
+#endif
+
+    *minor = GSSEAP_BAD_USAGE;
+    return GSS_S_UNAVAILABLE;
+}
+
+static OM_uint32
+setCredPrefork(OM_uint32 *minor,
+               gss_cred_id_t cred,
+               const gss_OID oid GSSEAP_UNUSED,
+               const gss_buffer_t buffer GSSEAP_UNUSED)
+{
+#ifdef GSSEAP_ENABLE_ACCEPTOR
+    if (cred->flags & CRED_FLAG_ACCEPT)
+        return gssEapWarmUpAcceptor(minor, 1);
+#endif
+
+    *minor = GSSEAP_BAD_USAGE;
+    return GSS_S_UNAVAILABLE;
+}
+
 static struct {
     gss_OID_desc oid;
     OM_uint32 (*setOption)(OM_uint32 *, gss_cred_id_t cred,
@@ -146,12 +176,24 @@ static struct {
         { 11, "\x2B\x06\x01\x04\x01\xA9\x4A\x16\x03\x03\x04" },
         setCredPassword,
     },
+    /* 1.3.6.1.4.1.5322.22.3.3.5 */
+    {
+        { 11, "\x2B\x06\x01\x04\x01\xA9\x4A\x16\x03\x03\x05" },
+        setCredWarmUp,
+    },
+    /* 1.3.6.1.4.1.5322.22.3.3.6 */
+    {
+        { 11, "\x2B\x06\x01\x04\x01\xA9\x4A\x16\x03\x03\x06" },
+        setCredPrefork,
+    },
 };
 
 gss_OID GSS_EAP_CRED_SET_RADIUS_CONFIG_FILE     = &setCredOps[0].oid;
 gss_OID GSS_EAP_CRED_SET_RADIUS_CONFIG_STANZA   = &setCredOps[1].oid;
 gss_OID GSS_EAP_CRED_SET_CRED_FLAG              = &setCredOps[2].oid;
 gss_OID GSS_EAP_CRED_SET_CRED_PASSWORD          = &setCredOps[3].oid;
+gss_OID GSS_EAP_CRED_SET_WARM_UP                = &setCredOps[4].oid;
+gss_OID GSS_EAP_CRED_SET_PREFORK                = &setCredOps[5].oid;
 
 OM_uint32 GSSAPI_CALLCONV
 gssspi_set_cred_option(OM_uint32 *minor,
@@ -36,26 +36,63 @@
 
 #include "gssapiP_eap.h"
 
-#if 0
+static OM_uint32
+setCtxWrapChunking(OM_uint32 *minor,
+                   gss_ctx_id_t *pCtx,
+                   const gss_OID oid GSSEAP_UNUSED,
+                   const gss_buffer_t buffer)
+{
+    gss_ctx_id_t ctx = *pCtx;
+    unsigned char *p;
+
+    if (ctx == GSS_C_NO_CONTEXT) {
+        *minor = EINVAL;
+        return GSS_S_CALL_INACCESSIBLE_READ | GSS_S_NO_CONTEXT;
+    }
+
+    if (buffer == GSS_C_NO_BUFFER) {
+        *minor = EINVAL;
+        return GSS_S_CALL_INACCESSIBLE_READ | GSS_S_FAILURE;
+    }
+
+    if (buffer->length < 4) {
+        *minor = GSSEAP_WRONG_SIZE;
+        return GSS_S_FAILURE;
+    }
+
+    p = (unsigned char *)buffer->value;
+
+    ctx->wrapChunkSize = load_uint32_be(p);
+    if (buffer->length >= 8)
+        ctx->wrapChunkThreads = load_uint32_be(p + 4);
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
 static struct {
     gss_OID_desc oid;
     OM_uint32 (*setOption)(OM_uint32 *, gss_ctx_id_t *pCtx,
                            const gss_OID, const gss_buffer_t);
 } setCtxOps[] = {
+    /* 1.3.6.1.4.1.5322.22.3.4.1 */
+    {
+        { 11, "\x2B\x06\x01\x04\x01\xA9\x4A\x16\x03\x04\x01" },
+        setCtxWrapChunking,
+    },
 };
-#endif
+
+gss_OID GSS_EAP_CTX_SET_WRAP_CHUNKING           = &setCtxOps[0].oid;
 
 OM_uint32 GSSAPI_CALLCONV
 gss_set_sec_context_option(OM_uint32 *minor,
                            gss_ctx_id_t *pCtx,
-                           const gss_OID desired_object GSSEAP_UNUSED,
-                           const gss_buffer_t value GSSEAP_UNUSED)
+                           const gss_OID desired_object,
+                           const gss_buffer_t value)
 {
     OM_uint32 major;
     gss_ctx_id_t ctx;
-#if 0
     int i;
-#endif
 
     major = GSS_S_UNAVAILABLE;
     *minor = GSSEAP_BAD_CONTEXT_OPTION;
@@ -68,7 +105,6 @@ gss_set_sec_context_option(OM_uint32 *minor,
     if (ctx != GSS_C_NO_CONTEXT)
         GSSEAP_MUTEX_LOCK(&ctx->mutex);
 
-#if 0
     for (i = 0; i < sizeof(setCtxOps) / sizeof(setCtxOps[0]); i++) {
         if (oidEqual(&setCtxOps[i].oid, desired_object)) {
             major = (*setCtxOps[i].setOption)(minor, &ctx,
@@ -76,7 +112,6 @@ gss_set_sec_context_option(OM_uint32 *minor,
             break;
         }
     }
-#endif
 
     if (pCtx != NULL && *pCtx == NULL)
         *pCtx = ctx;
@@ -54,6 +54,8 @@ gss_unwrap(OM_uint32 *minor,
 
     *minor = 0;
 
+    GSSEAP_ALLOC_SCOPE_ENTER(GSSEAP_ALLOC_SCOPE_UNWRAP);
+
     GSSEAP_MUTEX_LOCK(&ctx->mutex);
 
     if (!CTX_IS_ESTABLISHED(ctx)) {
@@ -62,6 +64,15 @@ gss_unwrap(OM_uint32 *minor,
         goto cleanup;
     }
 
+    if (ctx->wrapChunkSize != 0 &&
+        input_message_buffer->length >= WRAP_CHUNKED_HEADER_LENGTH &&
+        load_uint16_be(input_message_buffer->value) == TOK_TYPE_WRAP_CHUNKED) {
+        major = gssEapUnwrapChunked(minor, ctx, input_message_buffer,
+                                    output_message_buffer,
+                                    conf_state, qop_state);
+        goto cleanup;
+    }
+
     iov[0].type = GSS_IOV_BUFFER_TYPE_STREAM;
     iov[0].buffer = *input_message_buffer;
 
@@ -80,6 +91,7 @@ gss_unwrap(OM_uint32 *minor,
 
 cleanup:
     GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
+    GSSEAP_ALLOC_SCOPE_LEAVE(!GSS_ERROR(major));
 
     return major;
 }
@@ -63,8 +63,11 @@
  * Caller must provide TOKEN | DATA | PADDING | TRAILER, except
  * for DCE in which case it can just provide TOKEN | DATA (must
  * guarantee that DATA is padded)
+ *
+ * If pSeqnum is non-NULL, the sequence number is returned and the
+ * caller is responsible for sequence checking.
  */
-OM_uint32
+static OM_uint32
 unwrapToken(OM_uint32 *minor,
             gss_ctx_id_t ctx,
 #ifdef HAVE_HEIMDAL_VERSION
@@ -76,7 +79,8 @@ unwrapToken(OM_uint32 *minor,
             gss_qop_t *qop_state,
             gss_iov_buffer_desc *iov,
             int iov_count,
-            enum gss_eap_token_type toktype)
+            enum gss_eap_token_type toktype,
+            uint64_t *pSeqnum)
 {
     OM_uint32 major = GSS_S_FAILURE, code;
     gss_iov_buffer_t header;
@@ -233,7 +237,10 @@ unwrapToken(OM_uint32 *minor,
             }
         }
 
-        code = sequenceCheck(minor, &ctx->seqState, seqnum);
+        if (pSeqnum != NULL)
+            *pSeqnum = seqnum;
+        else
+            code = sequenceCheck(minor, &ctx->seqState, seqnum);
     } else if (toktype == TOK_TYPE_MIC) {
         if (load_uint16_be(ptr) != toktype)
             goto defective;
@@ -257,7 +264,10 @@ unwrapToken(OM_uint32 *minor,
             major = GSS_S_BAD_SIG;
             goto cleanup;
         }
-        code = sequenceCheck(minor, &ctx->seqState, seqnum);
+        if (pSeqnum != NULL)
+            *pSeqnum = seqnum;
+        else
+            code = sequenceCheck(minor, &ctx->seqState, seqnum);
     } else if (toktype == TOK_TYPE_DELETE_CONTEXT) {
         if (load_uint16_be(ptr) != TOK_TYPE_DELETE_CONTEXT)
             goto defective;
@@ -287,27 +297,40 @@ cleanup:
     return major;
 }
 
-int
+static void
+reverseBytes(unsigned char *p, size_t len)
+{
+    unsigned char *q;
+
+    if (len < 2)
+        return;
+
+    for (q = p + len - 1; p < q; ) {
+        unsigned char c = *p;
+
+        *p++ = *q;
+        *q-- = c;
+    }
+}
+
+/*
+ * Rotate in place by reversing both halves and then the whole
+ * buffer, so that stream unwrap never needs a temporary copy.
+ */
+static void
 rotateLeft(void *ptr, size_t bufsiz, size_t rc)
 {
-    void *tbuf;
+    unsigned char *p = (unsigned char *)ptr;
 
     if (bufsiz == 0)
-        return 0;
+        return;
     rc = rc % bufsiz;
     if (rc == 0)
-        return 0;
-
-    tbuf = GSSEAP_MALLOC(rc);
-    if (tbuf == NULL)
-        return ENOMEM;
-
-    memcpy(tbuf, ptr, rc);
-    memmove(ptr, (char *)ptr + rc, bufsiz - rc);
-    memcpy((char *)ptr + bufsiz - rc, tbuf, rc);
-    GSSEAP_FREE(tbuf);
+        return;
 
-    return 0;
+    reverseBytes(p, rc);
+    reverseBytes(p + rc, bufsiz - rc);
+    reverseBytes(p, bufsiz);
 }
 
 /*
@@ -321,7 +344,8 @@ unwrapStream(OM_uint32 *minor,
              gss_qop_t *qop_state,
              gss_iov_buffer_desc *iov,
              int iov_count,
-             enum gss_eap_token_type toktype)
+             enum gss_eap_token_type toktype,
+             uint64_t *pSeqnum)
 {
     unsigned char *ptr;
     OM_uint32 code = 0, major = GSS_S_FAILURE;
@@ -331,6 +355,7 @@ unwrapStream(OM_uint32 *minor,
     gss_iov_buffer_desc *tiov = NULL;
     gss_iov_buffer_t stream, data = NULL;
     gss_iov_buffer_t theader, tdata = NULL, tpadding, ttrailer;
+    size_t ttrailerLen = 0;
 #ifdef HAVE_HEIMDAL_VERSION
     krb5_crypto krbCrypto = NULL;
 #endif
@@ -393,15 +418,12 @@ unwrapStream(OM_uint32 *minor,
         goto cleanup;
     }
 
-    /* PADDING | TRAILER */
+    /* PADDING */
     tpadding = &tiov[i++];
     tpadding->type = GSS_IOV_BUFFER_TYPE_PADDING;
     tpadding->buffer.length = 0;
     tpadding->buffer.value = NULL;
 
-    ttrailer = &tiov[i++];
-    ttrailer->type = GSS_IOV_BUFFER_TYPE_TRAILER;
-
 #ifdef HAVE_HEIMDAL_VERSION
     code = krb5_crypto_init(krbContext, &ctx->rfc3961Key, ETYPE_NULL, &krbCrypto);
     if (code != 0)
@@ -412,19 +434,12 @@ unwrapStream(OM_uint32 *minor,
         size_t ec, rrc;
         size_t krbHeaderLen = 0;
         size_t krbTrailerLen = 0;
+        size_t gssTrailerLen;
 
         conf_req_flag = ((ptr[0] & TOK_FLAG_WRAP_CONFIDENTIAL) != 0);
         ec = conf_req_flag ? load_uint16_be(ptr + 2) : 0;
         rrc = load_uint16_be(ptr + 4);
 
-        if (rrc != 0) {
-            code = rotateLeft((unsigned char *)stream->buffer.value + 16,
-                              stream->buffer.length - 16, rrc);
-            if (code != 0)
-                goto cleanup;
-            store_uint16_be(0, ptr + 4); /* set RRC to zero */
-        }
-
         if (conf_req_flag) {
             code = krbCryptoLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
                                     KRB5_CRYPTO_TYPE_HEADER, &krbHeaderLen);
@@ -442,10 +457,33 @@ unwrapStream(OM_uint32 *minor,
         if (code != 0)
             goto cleanup;
 
-        ttrailer->buffer.length = ec + (conf_req_flag ? 16 : 0 /* E(Header) */) +
-                                  krbTrailerLen;
-        ttrailer->buffer.value = (unsigned char *)stream->buffer.value +
-            stream->buffer.length - ttrailer->buffer.length;
+        gssTrailerLen = ec + (conf_req_flag ? 16 : 0 /* E(Header) */) +
+                        krbTrailerLen;
+
+        if (rrc != 0 &&
+            rrc + ((ctx->gssFlags & GSS_C_DCE_STYLE) ? ec : 0) == gssTrailerLen) {
+            /*
+             * The trailer was rotated to directly follow the header, which
+             * is the layout produced by wrapping without a TRAILER buffer.
+             * unwrapToken() can decrypt that in place, so leave the token
+             * alone and treat the rotated trailer as part of the header.
+             */
+            theader->buffer.length += gssTrailerLen;
+            ttrailer = NULL;
+        } else {
+            if (rrc != 0) {
+                rotateLeft((unsigned char *)stream->buffer.value + 16,
+                           stream->buffer.length - 16, rrc);
+                store_uint16_be(0, ptr + 4); /* set RRC to zero */
+            }
+
+            /* TRAILER */
+            ttrailer = &tiov[i++];
+            ttrailer->type = GSS_IOV_BUFFER_TYPE_TRAILER;
+            ttrailer->buffer.length = gssTrailerLen;
+            ttrailer->buffer.value = (unsigned char *)stream->buffer.value +
+                stream->buffer.length - ttrailer->buffer.length;
+        }
     }
 
     /* IOV: -----------0-------------+---1---+--2--+----------------3--------------*/
@@ -453,16 +491,18 @@ unwrapStream(OM_uint32 *minor,
     /* GSS: -------GSS-HEADER--------+-DATA--+-PAD-+----------GSS-TRAILER----------*/
 
     /* validate lengths */
+    if (ttrailer != NULL)
+        ttrailerLen = ttrailer->buffer.length;
     if (stream->buffer.length < theader->buffer.length +
         tpadding->buffer.length +
-        ttrailer->buffer.length) {
+        ttrailerLen) {
         major = GSS_S_DEFECTIVE_TOKEN;
         code = GSSEAP_TOK_TRUNC;
         goto cleanup;
     }
 
     /* setup data */
-    tdata->buffer.length = stream->buffer.length - ttrailer->buffer.length -
+    tdata->buffer.length = stream->buffer.length - ttrailerLen -
         tpadding->buffer.length - theader->buffer.length;
 
     GSSEAP_ASSERT(data != NULL);
@@ -483,7 +523,7 @@ unwrapStream(OM_uint32 *minor,
     GSSEAP_ASSERT(i <= iov_count + 2);
 
     major = unwrapToken(&code, ctx, KRB_CRYPTO_CONTEXT(ctx),
-                        conf_state, qop_state, tiov, i, toktype);
+                        conf_state, qop_state, tiov, i, toktype, pSeqnum);
     if (major == GSS_S_COMPLETE) {
         *data = *tdata;
     } else if (tdata->type & GSS_IOV_BUFFER_FLAG_ALLOCATED) {
@@ -507,13 +547,14 @@ cleanup:
 }
 
 OM_uint32
-gssEapUnwrapOrVerifyMIC(OM_uint32 *minor,
-                        gss_ctx_id_t ctx,
-                        int *conf_state,
-                        gss_qop_t *qop_state,
-                        gss_iov_buffer_desc *iov,
-                        int iov_count,
-                        enum gss_eap_token_type toktype)
+gssEapUnwrapOrVerifyMICWithSeq(OM_uint32 *minor,
+                               gss_ctx_id_t ctx,
+                               int *conf_state,
+                               gss_qop_t *qop_state,
+                               gss_iov_buffer_desc *iov,
+                               int iov_count,
+                               enum gss_eap_token_type toktype,
+                               uint64_t *pSeqnum)
 {
     OM_uint32 major;
 
@@ -524,17 +565,30 @@ gssEapUnwrapOrVerifyMIC(OM_uint32 *minor,
 
     if (gssEapLocateIov(iov, iov_count, GSS_IOV_BUFFER_TYPE_STREAM) != NULL) {
         major = unwrapStream(minor, ctx, conf_state, qop_state,
-                             iov, iov_count, toktype);
+                             iov, iov_count, toktype, pSeqnum);
     } else {
         major = unwrapToken(minor, ctx,
                             NULL, /* krbCrypto */
                             conf_state, qop_state,
-                            iov, iov_count, toktype);
+                            iov, iov_count, toktype, pSeqnum);
     }
 
     return major;
 }
 
+OM_uint32
+gssEapUnwrapOrVerifyMIC(OM_uint32 *minor,
+                        gss_ctx_id_t ctx,
+                        int *conf_state,
+                        gss_qop_t *qop_state,
+                        gss_iov_buffer_desc *iov,
+                        int iov_count,
+                        enum gss_eap_token_type toktype)
+{
+    return gssEapUnwrapOrVerifyMICWithSeq(minor, ctx, conf_state, qop_state,
+                                          iov, iov_count, toktype, NULL);
+}
+
 OM_uint32 GSSAPI_CALLCONV
 gss_unwrap_iov(OM_uint32 *minor,
                gss_ctx_id_t ctx,
@@ -552,6 +606,8 @@ gss_unwrap_iov(OM_uint32 *minor,
 
     *minor = 0;
 
+    GSSEAP_ALLOC_SCOPE_ENTER(GSSEAP_ALLOC_SCOPE_UNWRAP);
+
     GSSEAP_MUTEX_LOCK(&ctx->mutex);
 
     if (!CTX_IS_ESTABLISHED(ctx)) {
@@ -567,6 +623,7 @@ gss_unwrap_iov(OM_uint32 *minor,
 
 cleanup:
     GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
+    GSSEAP_ALLOC_SCOPE_LEAVE(!GSS_ERROR(major));
 
     return major;
 }
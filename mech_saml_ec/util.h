@@ -95,6 +95,35 @@ extern "C" {
 #define GSSEAP_UNUSED
 #endif
 
+/* util_arena.c */
+struct gss_eap_arena_chunk;
+struct gss_eap_arena_cleanup;
+
+/*
+ * Handshake-scoped allocations; zero-initialised storage is an empty
+ * arena. Anything that must outlive the handshake (names, keys,
+ * output tokens) is copied out with the usual heap helpers.
+ */
+struct gss_eap_arena {
+    struct gss_eap_arena_chunk *chunks;
+    unsigned char *next;
+    unsigned char *end;
+    struct gss_eap_arena_cleanup *cleanups;
+};
+
+void *
+gssEapArenaAlloc(struct gss_eap_arena *arena, size_t size);
+
+/* Run destroy(ptr) on release; on failure it is run immediately */
+OM_uint32
+gssEapArenaAdopt(OM_uint32 *minor,
+                 struct gss_eap_arena *arena,
+                 void *ptr,
+                 void (*destroy)(void *));
+
+void
+gssEapArenaRelease(struct gss_eap_arena *arena);
+
 /* util_buffer.c */
 OM_uint32
 makeStringBuffer(OM_uint32 *minor,
@@ -125,7 +154,21 @@ duplicateBuffer(OM_uint32 *minor,
                 gss_buffer_t dst);
 
 void
-printBuffer(FILE *stream, const gss_buffer_t src);
+logBuffer(const char *label, const gss_buffer_t src);
+
+struct gss_eap_shared_buffer;
+
+OM_uint32
+gssEapSharedBufferCreate(OM_uint32 *minor,
+                         const gss_buffer_t src,
+                         struct gss_eap_shared_buffer **pShared,
+                         gss_buffer_t data);
+
+struct gss_eap_shared_buffer *
+gssEapSharedBufferRef(struct gss_eap_shared_buffer *shared);
+
+void
+gssEapSharedBufferRelease(struct gss_eap_shared_buffer **pShared);
 
 #define duplicateBufferOrCleanup(src, dst)              \
     do {                                                \
@@ -180,6 +223,21 @@ gssEapVerify(krb5_context context,
              int iov_count,
              int *valid);
 
+int
+gssEapChecksumMIC(krb5_context context,
+                  krb5_cksumtype type,
+#ifdef HAVE_HEIMDAL_VERSION
+                  krb5_crypto crypto,
+#else
+                  krb5_key key,
+#endif
+                  krb5_keyusage sign_usage,
+                  const gss_buffer_t message,
+                  unsigned char *token,
+                  size_t cksumLength,
+                  int verify,
+                  int *valid);
+
 #if 0
 OM_uint32
 gssEapEncodeGssChannelBindings(OM_uint32 *minor,
@@ -194,6 +252,7 @@ enum gss_eap_token_type {
     TOK_TYPE_NONE                    = 0x0000,  /* no token */
     TOK_TYPE_MIC                     = 0x0404,  /* RFC 4121 MIC token */
     TOK_TYPE_WRAP                    = 0x0504,  /* RFC 4121 wrap token */
+    TOK_TYPE_WRAP_CHUNKED            = 0x0505,  /* sequence of wrap tokens */
     TOK_TYPE_EXPORT_NAME             = 0x0401,  /* RFC 2743 exported name */
     TOK_TYPE_EXPORT_NAME_COMPOSITE   = 0x0402,  /* exported composite name */
     TOK_TYPE_DELETE_CONTEXT          = 0x0405,  /* RFC 2743 delete context */
@@ -473,6 +532,19 @@ krbBlockSize(krb5_context krbContext,
 #endif
                  size_t *blockSize);
 
+krb5_error_code
+krbContextCrypto(krb5_context krbContext,
+                 gss_ctx_id_t ctx,
+#ifdef HAVE_HEIMDAL_VERSION
+                 krb5_crypto *pCrypto
+#else
+                 krb5_key *pKey
+#endif
+                 );
+
+void
+krbReleaseContextCrypto(gss_ctx_id_t ctx);
+
 krb5_error_code
 krbEnctypeToString(krb5_context krbContext,
                    krb5_enctype enctype,
@@ -594,6 +666,14 @@ OM_uint32 gssEapImportNameInternal(OM_uint32 *minor,
                                    const gss_buffer_t input_name_buffer,
                                    gss_name_t *output_name,
                                    OM_uint32 flags);
+OM_uint32 gssEapImportNameShared(OM_uint32 *minor,
+                                 struct gss_eap_shared_buffer *shared,
+                                 const gss_buffer_t input_name_buffer,
+                                 gss_name_t *output_name,
+                                 OM_uint32 flags);
+OM_uint32 gssEapAdoptUserName(OM_uint32 *minor,
+                              char *username,
+                              gss_name_t *output_name);
 OM_uint32
 gssEapDuplicateName(OM_uint32 *minor,
                     const gss_name_t input_name,
@@ -797,6 +877,8 @@ verifyTokenHeader(OM_uint32 *minor,
 
 /* Helper macros */
 
+#include "util_alloc.h"
+
 #ifndef GSSEAP_MALLOC
 #define GSSEAP_CALLOC                   calloc
 #define GSSEAP_MALLOC                   malloc
@@ -1021,6 +1103,20 @@ gssBufferToKrbData(gss_buffer_t buffer, krb5_data *data)
     data->length = buffer->length;
 }
 
+#ifdef GSSEAP_ENABLE_ACCEPTOR
+/* util_authz.c */
+int
+gssEapAuthzCacheLookup(const gss_name_t name,
+                       const unsigned char *fingerprint,
+                       gss_buffer_t localName);
+
+void
+gssEapAuthzCacheStore(const gss_name_t name,
+                      const unsigned char *fingerprint,
+                      const gss_buffer_t localName,
+                      time_t expiry);
+#endif
+
 /* util_tld.c */
 struct gss_eap_status_info;
 
@@ -1038,12 +1134,10 @@ gssEapDestroyStatusInfo(struct gss_eap_status_info *status);
 void
 gssEapDestroyKrbContext(krb5_context context);
 
-extern
-int mech_saml_ec_debug;
+#define MECH_SAML_EC_DEBUG      GSSEAP_LOG_ENABLED(GSSEAP_LOG_DEBUG)
 
-#define MECH_SAML_EC_DEBUG ((mech_saml_ec_debug == -1)? \
-                            (mech_saml_ec_debug = (getenv("MECH_SAML_EC_DEBUG")?1:0)) : \
-                            (mech_saml_ec_debug))
+/* The attribute naming the initiator's local account */
+#define MECH_SAML_EC_LOCAL_LOGIN_ATTR "local-login-user"
 
 #define MECH_SAML_EC_MUTUAL_AUTH "urn:oasis:names:tc:SAML:2.0:profiles:SSO:ecp:2.0:WantAuthnRequestsSigned"
 
@@ -1066,12 +1160,16 @@ int mech_saml_ec_debug;
 }
 #endif
 
+#include "util_log.h"
+#include "util_metrics.h"
+#include "util_base64.h"
+
 #ifdef GSSEAP_ENABLE_ACCEPTOR
 #ifdef MECH_EAP
 #include "util_json.h"
 #endif
 #include "util_attr.h"
-#include "util_base64.h"
+#include "util_verifier.h"
 #endif /* GSSEAP_ENABLE_ACCEPTOR */
 
 #endif /* _UTIL_H_ */
@@ -0,0 +1,574 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Allocation tracking. GSSEAP_MALLOC and friends are routed here when
+ * built with GSSEAP_ALLOC_TRACKING; every live block is recorded in a
+ * pointer table together with its call site and scope, so that frees
+ * can be charged back without a header in front of the block. Blocks
+ * released by the mechglue with plain free() are not seen and stay
+ * live until their address is handed out again.
+ */
+
+#include "gssapiP_eap.h"
+
+#ifdef GSSEAP_ALLOC_TRACKING
+
+#define MECH_SAML_EC_ALLOC_DUMP         "MECH_SAML_EC_ALLOC_DUMP"
+
+#define ALLOC_MAX_SITES                 1024    /* power of two */
+#define ALLOC_OVERFLOW_SITE             0
+#define ALLOC_MIN_BLOCKS                4096    /* power of two */
+
+#ifdef WIN32
+#define ALLOC_THREAD_LOCAL              __declspec(thread)
+#else
+#define ALLOC_THREAD_LOCAL              __thread
+#endif
+
+static const char *allocScopeNames[GSSEAP_ALLOC_SCOPE_MAX] = {
+    "other",
+    "handshake",
+    "wrap",
+    "unwrap",
+};
+
+struct alloc_counters {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t live;
+    uint64_t liveBytes;
+};
+
+struct alloc_site {
+    const char *file;
+    int line;
+    struct alloc_counters scopes[GSSEAP_ALLOC_SCOPE_MAX];
+};
+
+struct alloc_block {
+    void *ptr;
+    size_t size;
+    unsigned short site;
+    unsigned char scope;
+};
+
+static struct {
+    GSSEAP_MUTEX mutex;
+    struct gss_eap_allocator allocator;
+    uint64_t operations[GSSEAP_ALLOC_SCOPE_MAX];
+    struct alloc_site sites[ALLOC_MAX_SITES];
+    struct gss_eap_alloc_totals totals;
+    struct alloc_block *blocks;
+    size_t blockSlots;
+    size_t blockCount;
+    char *dumpFile;
+} allocState;
+
+static GSSEAP_THREAD_ONCE allocInitOnce = GSSEAP_ONCE_INITIALIZER;
+
+static ALLOC_THREAD_LOCAL int allocScope;
+
+static void *
+libcMalloc(void *data GSSEAP_UNUSED, size_t size)
+{
+    return malloc(size);
+}
+
+static void *
+libcCalloc(void *data GSSEAP_UNUSED, size_t nmemb, size_t size)
+{
+    return calloc(nmemb, size);
+}
+
+static void *
+libcRealloc(void *data GSSEAP_UNUSED, void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
+
+static void
+libcFree(void *data GSSEAP_UNUSED, void *ptr)
+{
+    free(ptr);
+}
+
+static const struct gss_eap_allocator libcAllocator = {
+    libcMalloc, libcCalloc, libcRealloc, libcFree, NULL
+};
+
+static void
+dumpAllocAtExit(void)
+{
+    FILE *fp;
+
+    if (strcmp(allocState.dumpFile, "-") == 0) {
+        gssEapAllocDump(stderr);
+        return;
+    }
+
+    fp = fopen(allocState.dumpFile, "w");
+    if (fp != NULL) {
+        gssEapAllocDump(fp);
+        fclose(fp);
+    }
+}
+
+#ifndef WIN32
+static void
+allocAtForkPrepare(void)
+{
+    GSSEAP_MUTEX_LOCK(&allocState.mutex);
+}
+
+static void
+allocAtForkParent(void)
+{
+    GSSEAP_MUTEX_UNLOCK(&allocState.mutex);
+}
+#endif
+
+static GSSEAP_ONCE_CALLBACK(initAlloc)
+{
+    char *s;
+
+    GSSEAP_MUTEX_INIT(&allocState.mutex);
+    allocState.allocator = libcAllocator;
+    allocState.sites[ALLOC_OVERFLOW_SITE].file = "(other sites)";
+
+#ifndef WIN32
+    pthread_atfork(allocAtForkPrepare, allocAtForkParent, allocAtForkParent);
+#endif
+
+    s = getenv(MECH_SAML_EC_ALLOC_DUMP);
+    if (s != NULL && s[0] != '\0') {
+        allocState.dumpFile = strdup(s);
+        if (allocState.dumpFile != NULL)
+            atexit(dumpAllocAtExit);
+    }
+
+    GSSEAP_ONCE_LEAVE;
+}
+
+static size_t
+hashPointer(const void *ptr)
+{
+    return (size_t)(((uintptr_t)ptr >> 4) * 0x9E3779B1u);
+}
+
+/* Called with allocState.mutex held */
+static unsigned short
+findSite(const char *file, int line)
+{
+    size_t i, n;
+
+    i = (hashPointer(file) + (size_t)line * 31) & (ALLOC_MAX_SITES - 1);
+
+    for (n = 0; n < ALLOC_MAX_SITES; n++) {
+        struct alloc_site *site = &allocState.sites[i];
+
+        if (i != ALLOC_OVERFLOW_SITE) {
+            if (site->file == NULL) {
+                site->file = file;
+                site->line = line;
+                return (unsigned short)i;
+            } else if (site->file == file && site->line == line) {
+                return (unsigned short)i;
+            }
+        }
+
+        i = (i + 1) & (ALLOC_MAX_SITES - 1);
+    }
+
+    return ALLOC_OVERFLOW_SITE;
+}
+
+/* Called with allocState.mutex held */
+static void
+releaseBlock(const struct alloc_block *block)
+{
+    struct alloc_counters *c;
+
+    c = &allocState.sites[block->site].scopes[block->scope];
+    c->live--;
+    c->liveBytes -= block->size;
+
+    allocState.totals.liveBytes -= block->size;
+}
+
+/* Called with allocState.mutex held */
+static struct alloc_block *
+findBlockSlot(struct alloc_block *blocks, size_t slots, const void *ptr)
+{
+    size_t i = hashPointer(ptr) & (slots - 1);
+
+    while (blocks[i].ptr != NULL && blocks[i].ptr != ptr)
+        i = (i + 1) & (slots - 1);
+
+    return &blocks[i];
+}
+
+/* Called with allocState.mutex held */
+static int
+growBlocks(void)
+{
+    struct alloc_block *blocks, *slot;
+    size_t slots, i;
+
+    slots = allocState.blockSlots ? allocState.blockSlots * 2
+                                  : ALLOC_MIN_BLOCKS;
+
+    blocks = calloc(slots, sizeof(*blocks));
+    if (blocks == NULL)
+        return ENOMEM;
+
+    for (i = 0; i < allocState.blockSlots; i++) {
+        if (allocState.blocks[i].ptr == NULL)
+            continue;
+        slot = findBlockSlot(blocks, slots, allocState.blocks[i].ptr);
+        *slot = allocState.blocks[i];
+    }
+
+    free(allocState.blocks);
+    allocState.blocks = blocks;
+    allocState.blockSlots = slots;
+
+    return 0;
+}
+
+/* Called with allocState.mutex held */
+static void
+trackBlock(void *ptr, size_t size, const char *file, int line)
+{
+    struct alloc_block *slot;
+    struct alloc_counters *c;
+    unsigned short site;
+
+    site = findSite(file, line);
+    c = &allocState.sites[site].scopes[allocScope];
+    c->count++;
+    c->bytes += size;
+
+    allocState.totals.count++;
+    allocState.totals.bytes += size;
+
+    if (allocState.blockCount * 2 >= allocState.blockSlots &&
+        growBlocks() != 0)
+        return;
+
+    slot = findBlockSlot(allocState.blocks, allocState.blockSlots, ptr);
+    if (slot->ptr != NULL) {
+        /* Stale entry for a block freed outside the mechanism */
+        releaseBlock(slot);
+    } else {
+        allocState.blockCount++;
+    }
+
+    slot->ptr = ptr;
+    slot->size = size;
+    slot->site = site;
+    slot->scope = (unsigned char)allocScope;
+
+    c->live++;
+    c->liveBytes += size;
+
+    allocState.totals.liveBytes += size;
+    if (allocState.totals.liveBytes > allocState.totals.peakBytes)
+        allocState.totals.peakBytes = allocState.totals.liveBytes;
+}
+
+/* Called with allocState.mutex held */
+static void
+untrackBlock(void *ptr)
+{
+    struct alloc_block *slot, *next;
+    size_t i, j, home;
+
+    if (allocState.blockSlots == 0)
+        return;
+
+    slot = findBlockSlot(allocState.blocks, allocState.blockSlots, ptr);
+    if (slot->ptr == NULL)
+        return;
+
+    releaseBlock(slot);
+    allocState.blockCount--;
+
+    /* Backward shift deletion keeps probe sequences intact */
+    i = slot - allocState.blocks;
+    j = i;
+    for (;;) {
+        j = (j + 1) & (allocState.blockSlots - 1);
+        next = &allocState.blocks[j];
+        if (next->ptr == NULL)
+            break;
+
+        home = hashPointer(next->ptr) & (allocState.blockSlots - 1);
+        if ((j > i && (home <= i || home > j)) ||
+            (j < i && (home <= i && home > j))) {
+            allocState.blocks[i] = *next;
+            i = j;
+        }
+    }
+
+    allocState.blocks[i].ptr = NULL;
+}
+
+void *
+gssEapTrackedMalloc(size_t size, const char *file, int line)
+{
+    void *ptr;
+
+    GSSEAP_ONCE(&allocInitOnce, initAlloc);
+
+    ptr = allocState.allocator.malloc(allocState.allocator.data, size);
+    if (ptr != NULL) {
+        GSSEAP_MUTEX_LOCK(&allocState.mutex);
+        trackBlock(ptr, size, file, line);
+        GSSEAP_MUTEX_UNLOCK(&allocState.mutex);
+    }
+
+    return ptr;
+}
+
+void *
+gssEapTrackedCalloc(size_t nmemb, size_t size, const char *file, int line)
+{
+    void *ptr;
+
+    GSSEAP_ONCE(&allocInitOnce, initAlloc);
+
+    ptr = allocState.allocator.calloc(allocState.allocator.data, nmemb, size);
+    if (ptr != NULL) {
+        GSSEAP_MUTEX_LOCK(&allocState.mutex);
+        trackBlock(ptr, nmemb * size, file, line);
+        GSSEAP_MUTEX_UNLOCK(&allocState.mutex);
+    }
+
+    return ptr;
+}
+
+void *
+gssEapTrackedRealloc(void *ptr, size_t size, const char *file, int line)
+{
+    void *newPtr;
+
+    GSSEAP_ONCE(&allocInitOnce, initAlloc);
+
+    newPtr = allocState.allocator.realloc(allocState.allocator.data,
+                                          ptr, size);
+    if (newPtr != NULL || size == 0) {
+        GSSEAP_MUTEX_LOCK(&allocState.mutex);
+        if (ptr != NULL)
+            untrackBlock(ptr);
+        if (newPtr != NULL)
+            trackBlock(newPtr, size, file, line);
+        GSSEAP_MUTEX_UNLOCK(&allocState.mutex);
+    }
+
+    return newPtr;
+}
+
+void
+gssEapTrackedFree(void *ptr)
+{
+    if (ptr == NULL)
+        return;
+
+    GSSEAP_ONCE(&allocInitOnce, initAlloc);
+
+    GSSEAP_MUTEX_LOCK(&allocState.mutex);
+    untrackBlock(ptr);
+    GSSEAP_MUTEX_UNLOCK(&allocState.mutex);
+
+    allocState.allocator.free(allocState.allocator.data, ptr);
+}
+
+void
+gssEapAllocSetAllocator(const struct gss_eap_allocator *allocator)
+{
+    GSSEAP_ONCE(&allocInitOnce, initAlloc);
+
+    GSSEAP_MUTEX_LOCK(&allocState.mutex);
+    allocState.allocator = allocator ? *allocator : libcAllocator;
+    GSSEAP_MUTEX_UNLOCK(&allocState.mutex);
+}
+
+int
+gssEapAllocEnterScope(enum gss_eap_alloc_scope scope)
+{
+    int savedScope = allocScope;
+
+    if (savedScope == GSSEAP_ALLOC_SCOPE_NONE)
+        allocScope = scope;
+
+    return savedScope;
+}
+
+void
+gssEapAllocLeaveScope(int savedScope, int completed)
+{
+    if (savedScope != GSSEAP_ALLOC_SCOPE_NONE)
+        return;
+
+    if (completed) {
+        GSSEAP_ONCE(&allocInitOnce, initAlloc);
+
+        GSSEAP_MUTEX_LOCK(&allocState.mutex);
+        allocState.operations[allocScope]++;
+        GSSEAP_MUTEX_UNLOCK(&allocState.mutex);
+    }
+
+    allocScope = GSSEAP_ALLOC_SCOPE_NONE;
+}
+
+static int dumpScope;
+
+static int
+compareSites(const void *a, const void *b)
+{
+    const struct alloc_counters *ca, *cb;
+
+    ca = &allocState.sites[*(const unsigned short *)a].scopes[dumpScope];
+    cb = &allocState.sites[*(const unsigned short *)b].scopes[dumpScope];
+
+    if (ca->count != cb->count)
+        return ca->count > cb->count ? -1 : 1;
+
+    return 0;
+}
+
+static const char *
+baseName(const char *file)
+{
+    const char *p = strrchr(file, '/');
+
+    return p != NULL ? p + 1 : file;
+}
+
+void
+gssEapAllocDump(FILE *fp)
+{
+    unsigned short order[ALLOC_MAX_SITES];
+    size_t i, n;
+    uint64_t ops;
+    char site[64];
+
+    GSSEAP_ONCE(&allocInitOnce, initAlloc);
+
+    GSSEAP_MUTEX_LOCK(&allocState.mutex);
+
+    for (dumpScope = 0; dumpScope < GSSEAP_ALLOC_SCOPE_MAX; dumpScope++) {
+        for (i = 0, n = 0; i < ALLOC_MAX_SITES; i++) {
+            const struct alloc_counters *c;
+
+            c = &allocState.sites[i].scopes[dumpScope];
+            if (c->count != 0 || c->live != 0)
+                order[n++] = (unsigned short)i;
+        }
+        if (n == 0)
+            continue;
+
+        qsort(order, n, sizeof(order[0]), compareSites);
+
+        ops = allocState.operations[dumpScope];
+
+        fprintf(fp, "# scope %s: %llu operations\n",
+                allocScopeNames[dumpScope], (unsigned long long)ops);
+        fprintf(fp, "# %-30s %10s %12s %8s %12s %10s %10s\n",
+                "site", "allocs", "bytes", "live", "live bytes",
+                "allocs/op", "bytes/op");
+
+        for (i = 0; i < n; i++) {
+            const struct alloc_site *s = &allocState.sites[order[i]];
+            const struct alloc_counters *c = &s->scopes[dumpScope];
+
+            if (order[i] == ALLOC_OVERFLOW_SITE)
+                snprintf(site, sizeof(site), "%s", s->file);
+            else
+                snprintf(site, sizeof(site), "%s:%d",
+                         baseName(s->file), s->line);
+
+            fprintf(fp, "  %-30s %10llu %12llu %8llu %12llu",
+                    site,
+                    (unsigned long long)c->count,
+                    (unsigned long long)c->bytes,
+                    (unsigned long long)c->live,
+                    (unsigned long long)c->liveBytes);
+            if (ops != 0)
+                fprintf(fp, " %10.2f %10.1f\n",
+                        (double)c->count / ops, (double)c->bytes / ops);
+            else
+                fprintf(fp, " %10s %10s\n", "-", "-");
+        }
+    }
+
+    GSSEAP_MUTEX_UNLOCK(&allocState.mutex);
+}
+
+void
+gssEapAllocReset(void)
+{
+    size_t i;
+    int scope;
+
+    GSSEAP_ONCE(&allocInitOnce, initAlloc);
+
+    GSSEAP_MUTEX_LOCK(&allocState.mutex);
+
+    memset(allocState.operations, 0, sizeof(allocState.operations));
+
+    for (i = 0; i < ALLOC_MAX_SITES; i++) {
+        for (scope = 0; scope < GSSEAP_ALLOC_SCOPE_MAX; scope++) {
+            allocState.sites[i].scopes[scope].count = 0;
+            allocState.sites[i].scopes[scope].bytes = 0;
+        }
+    }
+
+    allocState.totals.count = 0;
+    allocState.totals.bytes = 0;
+    allocState.totals.peakBytes = allocState.totals.liveBytes;
+
+    GSSEAP_MUTEX_UNLOCK(&allocState.mutex);
+}
+
+void
+gssEapAllocGetTotals(struct gss_eap_alloc_totals *totals)
+{
+    GSSEAP_ONCE(&allocInitOnce, initAlloc);
+
+    GSSEAP_MUTEX_LOCK(&allocState.mutex);
+    *totals = allocState.totals;
+    GSSEAP_MUTEX_UNLOCK(&allocState.mutex);
+}
+
+#endif /* GSSEAP_ALLOC_TRACKING */
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Allocation tracking, enabled with --enable-alloc-tracking.
+ */
+
+#ifndef _UTIL_ALLOC_H_
+#define _UTIL_ALLOC_H_ 1
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum gss_eap_alloc_scope {
+    GSSEAP_ALLOC_SCOPE_NONE = 0,
+    GSSEAP_ALLOC_SCOPE_HANDSHAKE,       /* init/accept_sec_context */
+    GSSEAP_ALLOC_SCOPE_WRAP,            /* wrap, wrap_iov, get_mic */
+    GSSEAP_ALLOC_SCOPE_UNWRAP,          /* unwrap, unwrap_iov, verify_mic */
+    GSSEAP_ALLOC_SCOPE_MAX
+};
+
+#ifdef GSSEAP_ALLOC_TRACKING
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * Backing allocator. It must be compatible with free(), because
+ * buffers handed to the application are released by the mechglue.
+ */
+struct gss_eap_allocator {
+    void *(*malloc)(void *data, size_t size);
+    void *(*calloc)(void *data, size_t nmemb, size_t size);
+    void *(*realloc)(void *data, void *ptr, size_t size);
+    void (*free)(void *data, void *ptr);
+    void *data;
+};
+
+#define GSSEAP_MALLOC(size)                                             \
+    gssEapTrackedMalloc((size), __FILE__, __LINE__)
+#define GSSEAP_CALLOC(nmemb, size)                                      \
+    gssEapTrackedCalloc((nmemb), (size), __FILE__, __LINE__)
+#define GSSEAP_REALLOC(ptr, size)                                       \
+    gssEapTrackedRealloc((ptr), (size), __FILE__, __LINE__)
+#define GSSEAP_FREE(ptr)                gssEapTrackedFree((ptr))
+
+void *
+gssEapTrackedMalloc(size_t size, const char *file, int line);
+
+void *
+gssEapTrackedCalloc(size_t nmemb, size_t size, const char *file, int line);
+
+void *
+gssEapTrackedRealloc(void *ptr, size_t size, const char *file, int line);
+
+void
+gssEapTrackedFree(void *ptr);
+
+/*
+ * Install before the mechanism allocates anything; NULL restores
+ * the C library allocator.
+ */
+void
+gssEapAllocSetAllocator(const struct gss_eap_allocator *allocator);
+
+/*
+ * Allocations are charged to the call site and to the outermost
+ * scope of the calling thread. A scope counts one operation each
+ * time it is left with completed set, so the dump can report costs
+ * per handshake rather than per init/accept_sec_context call.
+ */
+int
+gssEapAllocEnterScope(enum gss_eap_alloc_scope scope);
+
+void
+gssEapAllocLeaveScope(int savedScope, int completed);
+
+#define GSSEAP_ALLOC_SCOPE_ENTER(scope)                                 \
+    int gssEapAllocSavedScope = gssEapAllocEnterScope(scope)
+#define GSSEAP_ALLOC_SCOPE_LEAVE(completed)                             \
+    gssEapAllocLeaveScope(gssEapAllocSavedScope, (completed))
+
+/*
+ * Write per-site counts, bytes and live objects for each scope.
+ * If MECH_SAML_EC_ALLOC_DUMP names a file ("-" for stderr), this
+ * is also done at process exit.
+ */
+void
+gssEapAllocDump(FILE *fp);
+
+/* Clear the counters; live objects remain tracked */
+void
+gssEapAllocReset(void);
+
+/*
+ * Totals over all sites and scopes. The peak is the most live bytes
+ * seen since the last reset, which starts it from the current live
+ * total.
+ */
+struct gss_eap_alloc_totals {
+    uint64_t count;
+    uint64_t bytes;
+    uint64_t liveBytes;
+    uint64_t peakBytes;
+};
+
+void
+gssEapAllocGetTotals(struct gss_eap_alloc_totals *totals);
+
+#else
+
+#define GSSEAP_ALLOC_SCOPE_ENTER(scope)
+#define GSSEAP_ALLOC_SCOPE_LEAVE(completed)
+
+#endif /* GSSEAP_ALLOC_TRACKING */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UTIL_ALLOC_H_ */
@@ -0,0 +1,144 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Bump arena for allocations that live only as long as a context
+ * handshake. Memory is carved from chunks and never freed piecemeal;
+ * heap objects owned by other allocators (strdup'd strings from the
+ * SAML layer, libxml2 documents) can be attached with a destructor.
+ * Everything goes in one gssEapArenaRelease() call, made once the
+ * context is established or when it is released.
+ */
+
+#include "gssapiP_eap.h"
+
+#define ARENA_CHUNK_SIZE                4096
+#define ARENA_ALIGN                     16
+
+struct gss_eap_arena_chunk {
+    struct gss_eap_arena_chunk *next;
+    size_t size;
+};
+
+struct gss_eap_arena_cleanup {
+    struct gss_eap_arena_cleanup *next;
+    void (*destroy)(void *);
+    void *ptr;
+};
+
+#define ARENA_ROUND(n)          (((n) + ARENA_ALIGN - 1) & ~((size_t)ARENA_ALIGN - 1))
+#define ARENA_CHUNK_HEADER      ARENA_ROUND(sizeof(struct gss_eap_arena_chunk))
+
+void *
+gssEapArenaAlloc(struct gss_eap_arena *arena, size_t size)
+{
+    struct gss_eap_arena_chunk *chunk;
+    size_t chunkSize;
+    unsigned char *p;
+
+    size = ARENA_ROUND(size ? size : 1);
+
+    if (size <= (size_t)(arena->end - arena->next)) {
+        p = arena->next;
+        arena->next += size;
+        return p;
+    }
+
+    /* Large requests get a chunk of their own; keep bumping the current one */
+    chunkSize = size > ARENA_CHUNK_SIZE / 4 ? size : ARENA_CHUNK_SIZE;
+
+    chunk = GSSEAP_MALLOC(ARENA_CHUNK_HEADER + chunkSize);
+    if (chunk == NULL)
+        return NULL;
+
+    chunk->size = chunkSize;
+    p = (unsigned char *)chunk + ARENA_CHUNK_HEADER;
+
+    if (chunkSize == size && arena->chunks != NULL) {
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+    } else {
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        arena->next = p + size;
+        arena->end = p + chunkSize;
+    }
+
+    return p;
+}
+
+OM_uint32
+gssEapArenaAdopt(OM_uint32 *minor,
+                 struct gss_eap_arena *arena,
+                 void *ptr,
+                 void (*destroy)(void *))
+{
+    struct gss_eap_arena_cleanup *cleanup;
+
+    if (ptr == NULL) {
+        *minor = 0;
+        return GSS_S_COMPLETE;
+    }
+
+    cleanup = gssEapArenaAlloc(arena, sizeof(*cleanup));
+    if (cleanup == NULL) {
+        destroy(ptr);
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+
+    cleanup->destroy = destroy;
+    cleanup->ptr = ptr;
+    cleanup->next = arena->cleanups;
+    arena->cleanups = cleanup;
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+void
+gssEapArenaRelease(struct gss_eap_arena *arena)
+{
+    struct gss_eap_arena_cleanup *cleanup;
+    struct gss_eap_arena_chunk *chunk, *next;
+
+    /* Destructors run in reverse order of adoption */
+    for (cleanup = arena->cleanups; cleanup != NULL; cleanup = cleanup->next)
+        cleanup->destroy(cleanup->ptr);
+
+    for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        GSSEAP_FREE(chunk);
+    }
+
+    memset(arena, 0, sizeof(*arena));
+}
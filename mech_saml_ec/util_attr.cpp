@@ -42,10 +42,16 @@
 #include <exception>
 #include <new>
 
+#include "util_strmap.h"
+
+#define MECH_SAML_EC_EXPORT_JSON    "MECH_SAML_EC_EXPORT_JSON"
+
 /* lazy initialisation */
 static GSSEAP_THREAD_ONCE gssEapAttrProvidersInitOnce = GSSEAP_ONCE_INITIALIZER;
 static OM_uint32 gssEapAttrProvidersInitStatus = GSS_S_UNAVAILABLE;
 
+static void gssEapAttrPrefixesInit(void);
+
 GSSEAP_ONCE_CALLBACK(gssEapAttrProvidersInitInternal)
 {
     OM_uint32 major, minor;
@@ -71,6 +77,13 @@ GSSEAP_ONCE_CALLBACK(gssEapAttrProvidersInitInternal)
     gssEapLocalAttrProviderInit(&minor);
 #endif
 
+    try {
+        gssEapAttrPrefixesInit();
+        major = GSS_S_COMPLETE;
+    } catch (std::exception &e) {
+        major = GSS_S_FAILURE;
+    }
+
 cleanup:
 #ifdef GSSEAP_DEBUG
     GSSEAP_ASSERT(major == GSS_S_COMPLETE);
@@ -81,7 +94,7 @@ cleanup:
     GSSEAP_ONCE_LEAVE;
 }
 
-static OM_uint32
+OM_uint32
 gssEapAttrProvidersInit(OM_uint32 *minor)
 {
     GSSEAP_ONCE(&gssEapAttrProvidersInitOnce, gssEapAttrProvidersInitInternal);
@@ -114,6 +127,71 @@ gssEapAttrProvidersFinalize(OM_uint32 *minor)
 
 static gss_eap_attr_create_provider gssEapAttrFactories[ATTR_TYPE_MAX + 1];
 
+/*
+ * Prefixes of the registered providers, and a perfect hash of them:
+ * each prefix has a slot to itself, so mapping an attribute name to its
+ * provider takes one hash, computed while looking for the end of the
+ * prefix, and one comparison. Slots hold the type plus one; 0 is empty.
+ */
+#define ATTR_PREFIX_HASH_MAX        64
+
+static gss_buffer_desc gssEapAttrPrefixes[ATTR_TYPE_MAX + 1];
+static unsigned char gssEapAttrPrefixHash[ATTR_PREFIX_HASH_MAX];
+static size_t gssEapAttrPrefixMask;
+
+static void
+gssEapAttrPrefixesInit(void)
+{
+    size_t size;
+    unsigned int i;
+
+    for (i = ATTR_TYPE_MIN; i < ATTR_TYPE_MAX; i++) {
+        gss_eap_attr_provider *provider;
+
+        gssEapAttrPrefixes[i].length = 0;
+        gssEapAttrPrefixes[i].value = NULL;
+
+        if (gssEapAttrFactories[i] == NULL)
+            continue;
+
+        /* Prefixes are string constants, so outlive the provider */
+        provider = (gssEapAttrFactories[i])();
+        gssEapAttrPrefixes[i].value = (void *)provider->prefix();
+        delete provider;
+
+        if (gssEapAttrPrefixes[i].value != NULL)
+            gssEapAttrPrefixes[i].length = strlen((char *)gssEapAttrPrefixes[i].value);
+    }
+
+    /* Find the smallest table in which no two prefixes collide */
+    for (size = 4; size <= ATTR_PREFIX_HASH_MAX; size *= 2) {
+        memset(gssEapAttrPrefixHash, 0, sizeof(gssEapAttrPrefixHash));
+
+        for (i = ATTR_TYPE_MIN; i < ATTR_TYPE_MAX; i++) {
+            gss_eap_string_key key((char *)gssEapAttrPrefixes[i].value,
+                                   gssEapAttrPrefixes[i].length);
+            size_t slot;
+
+            if (key.length == 0)
+                continue;
+
+            slot = gss_eap_string_key_hash()(key) & (size - 1);
+            if (gssEapAttrPrefixHash[slot] != 0)
+                break;
+
+            gssEapAttrPrefixHash[slot] = i + 1;
+        }
+
+        if (i == ATTR_TYPE_MAX) {
+            gssEapAttrPrefixMask = size - 1;
+            return;
+        }
+    }
+
+    /* attributePrefixToType() then compares against each prefix */
+    gssEapAttrPrefixMask = 0;
+}
+
 /*
  * Register a provider for a particular type and prefix
  */
@@ -145,6 +223,7 @@ gss_eap_attr_ctx::unregisterProvider(unsigned int type)
 gss_eap_attr_ctx::gss_eap_attr_ctx(void)
 {
     m_flags = 0;
+    m_refs = 1;
 
     for (unsigned int i = ATTR_TYPE_MIN; i <= ATTR_TYPE_MAX; i++) {
         gss_eap_attr_provider *provider;
@@ -160,25 +239,31 @@ gss_eap_attr_ctx::gss_eap_attr_ctx(void)
 }
 
 /*
- * Convert an attribute prefix to a type
+ * Convert an attribute prefix, with its hash, to a type
  */
 unsigned int
-gss_eap_attr_ctx::attributePrefixToType(const gss_buffer_t prefix) const
+gss_eap_attr_ctx::attributePrefixToType(const gss_buffer_t prefix,
+                                        size_t hash) const
 {
     unsigned int i;
 
-    for (i = ATTR_TYPE_MIN; i < ATTR_TYPE_MAX; i++) {
-        const char *pprefix;
-
-        if (!providerEnabled(i))
-            continue;
+    if (gssEapAttrPrefixMask != 0) {
+        i = gssEapAttrPrefixHash[hash & gssEapAttrPrefixMask];
+        if (i-- == 0)
+            return ATTR_TYPE_LOCAL;
+        if (gssEapAttrPrefixes[i].length == prefix->length &&
+            memcmp(gssEapAttrPrefixes[i].value, prefix->value, prefix->length) == 0 &&
+            providerEnabled(i))
+            return i;
+        return ATTR_TYPE_LOCAL;
+    }
 
-        pprefix = m_providers[i]->prefix();
-        if (pprefix == NULL)
+    for (i = ATTR_TYPE_MIN; i < ATTR_TYPE_MAX; i++) {
+        if (!providerEnabled(i) || gssEapAttrPrefixes[i].length == 0)
             continue;
 
-        if (strlen(pprefix) == prefix->length &&
-            memcmp(pprefix, prefix->value, prefix->length) == 0)
+        if (gssEapAttrPrefixes[i].length == prefix->length &&
+            memcmp(gssEapAttrPrefixes[i].value, prefix->value, prefix->length) == 0)
             return i;
     }
 
@@ -199,11 +284,7 @@ gss_eap_attr_ctx::attributeTypeToPrefix(unsigned int type) const
     if (!providerEnabled(type))
         return prefix;
 
-    prefix.value = (void *)m_providers[type]->prefix();
-    if (prefix.value != NULL)
-        prefix.length = strlen((char *)prefix.value);
-
-    return prefix;
+    return gssEapAttrPrefixes[type];
 }
 
 bool
@@ -386,8 +467,345 @@ gss_eap_attr_ctx::jsonRepresentation(void) const
 }
 #endif
 
+void
+gss_eap_attr_writer::putUint32(uint32_t value)
+{
+    unsigned char p[4];
+
+    store_uint32_be(value, p);
+    m_body.append((const char *)p, sizeof(p));
+}
+
+void
+gss_eap_attr_writer::putUint64(uint64_t value)
+{
+    unsigned char p[8];
+
+    store_uint64_be(value, p);
+    m_body.append((const char *)p, sizeof(p));
+}
+
+void
+gss_eap_attr_writer::putString(const char *value, size_t length)
+{
+    putUint32(length);
+    m_body.append(value, length);
+    m_body.push_back('\0');
+}
+
+void
+gss_eap_attr_writer::putName(const char *name)
+{
+    unsigned char p[4];
+    uint32_t offset;
+
+    if (name == NULL) {
+        putUint32(ATTR_BINARY_NO_NAME);
+        return;
+    }
+
+    std::string key(name);
+    std::unordered_map<std::string, uint32_t>::const_iterator i =
+        m_nameOffsets.find(key);
+
+    if (i != m_nameOffsets.end()) {
+        offset = i->second;
+    } else {
+        offset = m_names.length();
+        store_uint32_be(key.length(), p);
+        m_names.append((const char *)p, sizeof(p));
+        m_names.append(key);
+        m_names.push_back('\0');
+        m_nameOffsets[key] = offset;
+    }
+
+    putUint32(offset);
+}
+
+size_t
+gss_eap_attr_writer::reserveUint32(void)
+{
+    size_t offset = m_body.length();
+
+    putUint32(0);
+
+    return offset;
+}
+
+void
+gss_eap_attr_writer::patchUint32(size_t offset, uint32_t value)
+{
+    GSSEAP_ASSERT(offset + 4 <= m_body.length());
+
+    store_uint32_be(value, &m_body[offset]);
+}
+
+void
+gss_eap_attr_writer::truncate(size_t length)
+{
+    m_body.resize(length);
+}
+
 /*
- * Initialize a context from an exported context or name token
+ * Token: magic, version, flags, name table length, name table, then
+ * the body.
+ */
+void
+gss_eap_attr_writer::finish(uint32_t flags, gss_buffer_t buffer) const
+{
+    unsigned char *p;
+
+    buffer->length = ATTR_BINARY_MAGIC_LENGTH + 12 +
+                     m_names.length() + m_body.length();
+    buffer->value = GSSEAP_MALLOC(buffer->length);
+    if (buffer->value == NULL)
+        throw std::bad_alloc();
+
+    p = (unsigned char *)buffer->value;
+    memcpy(p, ATTR_BINARY_MAGIC, ATTR_BINARY_MAGIC_LENGTH);
+    p += ATTR_BINARY_MAGIC_LENGTH;
+    store_uint32_be(ATTR_BINARY_VERSION, p);
+    store_uint32_be(flags, p + 4);
+    store_uint32_be(m_names.length(), p + 8);
+    p += 12;
+    memcpy(p, m_names.data(), m_names.length());
+    p += m_names.length();
+    memcpy(p, m_body.data(), m_body.length());
+}
+
+bool
+gss_eap_attr_reader::getUint8(unsigned char *value)
+{
+    if (m_end - m_p < 1)
+        return false;
+
+    *value = *m_p++;
+    return true;
+}
+
+bool
+gss_eap_attr_reader::getUint32(uint32_t *value)
+{
+    if (m_end - m_p < 4)
+        return false;
+
+    *value = load_uint32_be(m_p);
+    m_p += 4;
+    return true;
+}
+
+bool
+gss_eap_attr_reader::getUint64(uint64_t *value)
+{
+    if (m_end - m_p < 8)
+        return false;
+
+    *value = load_uint64_be(m_p);
+    m_p += 8;
+    return true;
+}
+
+bool
+gss_eap_attr_reader::getString(const char **value, size_t *length)
+{
+    uint32_t len;
+
+    if (!getUint32(&len) || (size_t)(m_end - m_p) < (size_t)len + 1 ||
+        m_p[len] != '\0')
+        return false;
+
+    *value = (const char *)m_p;
+    *length = len;
+    m_p += len + 1;
+    return true;
+}
+
+bool
+gss_eap_attr_reader::getName(const char **name)
+{
+    uint32_t offset, len;
+
+    if (!getUint32(&offset))
+        return false;
+
+    if (offset == ATTR_BINARY_NO_NAME) {
+        *name = NULL;
+        return true;
+    }
+
+    if (m_namesLength < 4 || offset > m_namesLength - 4)
+        return false;
+
+    len = load_uint32_be(m_names + offset);
+    if ((size_t)len + 1 > m_namesLength - offset - 4 ||
+        m_names[offset + 4 + len] != '\0')
+        return false;
+
+    *name = (const char *)m_names + offset + 4;
+    return true;
+}
+
+bool
+gss_eap_attr_reader::getSection(size_t length, gss_eap_attr_reader &section)
+{
+    if ((size_t)(m_end - m_p) < length)
+        return false;
+
+    section = gss_eap_attr_reader(m_p, length, m_names, m_namesLength);
+    m_p += length;
+    return true;
+}
+
+/*
+ * Each provider with state has a section: its name, the section
+ * length and what its binaryRepresentation() wrote. Importers skip
+ * sections of providers they do not have.
+ */
+void
+gss_eap_attr_ctx::binaryRepresentation(gss_buffer_t buffer) const
+{
+    gss_eap_attr_writer writer;
+    unsigned int i;
+
+    for (i = ATTR_TYPE_MIN; i <= ATTR_TYPE_MAX; i++) {
+        gss_eap_attr_provider *provider;
+        const char *key;
+        size_t start, lengthOffset;
+
+        provider = m_providers[i];
+        if (provider == NULL)
+            continue; /* provider not initialised */
+
+        key = provider->name();
+        if (key == NULL)
+            continue; /* provider does not have state */
+
+        start = writer.length();
+        writer.putName(key);
+        lengthOffset = writer.reserveUint32();
+
+        if (provider->binaryRepresentation(writer))
+            writer.patchUint32(lengthOffset,
+                               writer.length() - lengthOffset - 4);
+        else
+            writer.truncate(start);
+    }
+
+    writer.finish(m_flags, buffer);
+}
+
+/*
+ * Check the header of the binary encoding and return a reader for the
+ * body, along with the context flags
+ */
+static bool
+readBinaryHeader(const gss_buffer_t buffer,
+                 uint32_t *flags,
+                 gss_eap_attr_reader &reader)
+{
+    const unsigned char *p = (const unsigned char *)buffer->value;
+    size_t length = buffer->length;
+    uint32_t version, namesLength;
+
+    if (length < ATTR_BINARY_MAGIC_LENGTH + 12 ||
+        memcmp(p, ATTR_BINARY_MAGIC, ATTR_BINARY_MAGIC_LENGTH) != 0)
+        return false;
+
+    p += ATTR_BINARY_MAGIC_LENGTH;
+    version = load_uint32_be(p);
+    *flags = load_uint32_be(p + 4);
+    namesLength = load_uint32_be(p + 8);
+    p += 12;
+    length -= ATTR_BINARY_MAGIC_LENGTH + 12;
+
+    if (version != ATTR_BINARY_VERSION || namesLength > length)
+        return false;
+
+    reader = gss_eap_attr_reader(p + namesLength, length - namesLength,
+                                 p, namesLength);
+    return true;
+}
+
+/*
+ * Read the name and length of the next provider section
+ */
+static bool
+readBinarySection(gss_eap_attr_reader &reader,
+                  const char **key,
+                  gss_eap_attr_reader &section)
+{
+    uint32_t sectionLength;
+
+    return reader.getName(key) && *key != NULL &&
+           reader.getUint32(&sectionLength) &&
+           reader.getSection(sectionLength, section);
+}
+
+bool
+gss_eap_attr_ctx::initWithBinary(const gss_buffer_t buffer)
+{
+    gss_eap_attr_reader reader(NULL, 0, NULL, 0);
+    bool foundSource[ATTR_TYPE_MAX + 1];
+    unsigned int type;
+
+    if (!readBinaryHeader(buffer, &m_flags, reader))
+        return false;
+
+    for (type = ATTR_TYPE_MIN; type <= ATTR_TYPE_MAX; type++) {
+        foundSource[type] = false;
+        if (!providerEnabled(type))
+            releaseProvider(type);
+    }
+
+    /* Initialize providers from serialized state */
+    while (!reader.atEnd()) {
+        gss_eap_attr_reader section = reader;
+        const char *key;
+
+        if (!readBinarySection(reader, &key, section))
+            return false;
+
+        for (type = ATTR_TYPE_MIN; type <= ATTR_TYPE_MAX; type++) {
+            gss_eap_attr_provider *provider = m_providers[type];
+
+            if (provider == NULL || provider->name() == NULL ||
+                strcmp(provider->name(), key) != 0)
+                continue;
+
+            if (foundSource[type] ||
+                !provider->initWithBinary(this, section)) {
+                releaseProvider(type);
+                return false;
+            }
+
+            foundSource[type] = true;
+            break;
+        }
+    }
+
+    /* Initialize remaining providers from initialized providers */
+    for (type = ATTR_TYPE_MIN; type <= ATTR_TYPE_MAX; type++) {
+        gss_eap_attr_provider *provider;
+
+        if (foundSource[type] || !providerEnabled(type))
+            continue;
+
+        provider = m_providers[type];
+
+        if (!provider->initWithGssContext(this,
+                                          GSS_C_NO_CREDENTIAL,
+                                          GSS_C_NO_CONTEXT)) {
+            releaseProvider(type);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Initialize a context from an exported context or name token, in
+ * either the binary or (for tokens from older peers) JSON encoding
  */
 bool
 gss_eap_attr_ctx::initWithBuffer(const gss_buffer_t buffer)
@@ -399,6 +817,10 @@ gss_eap_attr_ctx::initWithBuffer(const gss_buffer_t buffer)
     json_error_t error;
 #endif
 
+    if (buffer->length >= ATTR_BINARY_MAGIC_LENGTH &&
+        memcmp(buffer->value, ATTR_BINARY_MAGIC, ATTR_BINARY_MAGIC_LENGTH) == 0)
+        return initWithBinary(buffer);
+
     major = bufferToString(&minor, buffer, &s);
     if (GSS_ERROR(major))
         return false;
@@ -641,30 +1063,30 @@ gss_eap_attr_ctx::releaseAnyNameMapping(gss_buffer_t type_id,
 }
 
 /*
- * Export attribute context to buffer
+ * Export attribute context to buffer. The binary encoding is used
+ * unless MECH_SAML_EC_EXPORT_JSON is set, for peers that only read JSON.
  */
 void
 gss_eap_attr_ctx::exportToBuffer(gss_buffer_t buffer) const
 {
-    OM_uint32 minor;
 #ifdef MECH_EAP
-    char *s;
+    static const bool exportJson = (getenv(MECH_SAML_EC_EXPORT_JSON) != NULL);
 
-    JSONObject obj = jsonRepresentation();
-#else
-    char *s = strdup("REPLACE_FOR_ECP");
-#endif
+    if (exportJson) {
+        OM_uint32 minor;
+        char *s;
 
-#if 0
-    obj.dump(stdout);
-#endif
+        JSONObject obj = jsonRepresentation();
 
-#ifdef MECH_EAP
-    s = obj.dump(JSON_COMPACT);
+        s = obj.dump(JSON_COMPACT);
+
+        if (GSS_ERROR(makeStringBuffer(&minor, s, buffer)))
+            throw std::bad_alloc();
+        return;
+    }
 #endif
 
-    if (GSS_ERROR(makeStringBuffer(&minor, s, buffer)))
-        throw std::bad_alloc();
+    binaryRepresentation(buffer);
 }
 
 /*
@@ -779,10 +1201,27 @@ gss_eap_attr_ctx::decomposeAttributeName(const gss_buffer_t attribute,
                                          unsigned int *type,
                                          gss_buffer_t suffix) const
 {
-    gss_buffer_desc prefix = GSS_C_EMPTY_BUFFER;
+    gss_buffer_desc prefix;
+    const char *s = (const char *)attribute->value;
+    size_t hash = GSSEAP_STRING_HASH_INIT;
+    size_t i;
 
-    decomposeAttributeName(attribute, &prefix, suffix);
-    *type = attributePrefixToType(&prefix);
+    /* As above, hashing the prefix on the way */
+    for (i = 0; i < attribute->length && s[i] != ' '; i++)
+        hash = gssEapStringHashStep(hash, s[i]);
+
+    prefix.value = attribute->value;
+    prefix.length = i;
+
+    if (i + 1 < attribute->length && s[i + 1] != '\0') {
+        suffix->length = attribute->length - 1 - prefix.length;
+        suffix->value = (void *)&s[i + 1];
+    } else {
+        suffix->length = 0;
+        suffix->value = NULL;
+    }
+
+    *type = attributePrefixToType(&prefix, hash);
 }
 
 /*
@@ -827,14 +1266,32 @@ gss_eap_attr_ctx::composeAttributeName(const gss_buffer_t prefix,
                                        const gss_buffer_t suffix,
                                        gss_buffer_t attribute)
 {
-    std::string str = composeAttributeName(prefix, suffix);
+    size_t length;
+    char *p;
 
-    if (str.length() != 0) {
-        return duplicateBuffer(str, attribute);
-    } else {
-        attribute->length = 0;
-        attribute->value = NULL;
+    attribute->length = 0;
+    attribute->value = NULL;
+
+    if (prefix == GSS_C_NO_BUFFER || prefix->length == 0)
+        return;
+
+    length = prefix->length;
+    if (suffix != GSS_C_NO_BUFFER)
+        length += 1 + suffix->length;
+
+    p = (char *)GSSEAP_MALLOC(length + 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+
+    memcpy(p, prefix->value, prefix->length);
+    if (suffix != GSS_C_NO_BUFFER) {
+        p[prefix->length] = ' ';
+        memcpy(p + prefix->length + 1, suffix->value, suffix->length);
     }
+    p[length] = '\0';
+
+    attribute->value = p;
+    attribute->length = length;
 }
 
 /*
@@ -853,6 +1310,30 @@ gss_eap_attr_ctx::composeAttributeName(unsigned int type,
 /*
  * C wrappers
  */
+
+/*
+ * Names imported from a context token are left pointing at their
+ * exported attribute context (see gssEapImportNameShared()); parse it
+ * once something wants it. Call with the name mutex held.
+ */
+static OM_uint32
+materializeAttrContext(OM_uint32 *minor, gss_name_t name)
+{
+    OM_uint32 major;
+
+    if (name->attrCtx != NULL || name->attrSnapshot.length == 0)
+        return GSS_S_COMPLETE;
+
+    major = gssEapImportAttrContext(minor, &name->attrSnapshot, name);
+    if (GSS_ERROR(major))
+        return major;
+
+    name->attrSnapshot.length = 0;
+    name->attrSnapshot.value = NULL;
+
+    return GSS_S_COMPLETE;
+}
+
 OM_uint32
 gssEapInquireName(OM_uint32 *minor,
                   gss_name_t name,
@@ -872,6 +1353,10 @@ gssEapInquireName(OM_uint32 *minor,
             return major;
     }
 
+    major = materializeAttrContext(minor, name);
+    if (GSS_ERROR(major))
+        return major;
+
     if (name->attrCtx == NULL) {
         *minor = GSSEAP_NO_ATTR_CONTEXT;
         return GSS_S_UNAVAILABLE;
@@ -903,6 +1388,8 @@ gssEapGetNameAttribute(OM_uint32 *minor,
                        gss_buffer_t display_value,
                        int *more)
 {
+    OM_uint32 major;
+
     if (authenticated != NULL)
         *authenticated = 0;
     if (complete != NULL)
@@ -918,6 +1405,10 @@ gssEapGetNameAttribute(OM_uint32 *minor,
         display_value->value = NULL;
     }
 
+    major = materializeAttrContext(minor, name);
+    if (GSS_ERROR(major))
+        return major;
+
     if (name->attrCtx == NULL) {
         *minor = GSSEAP_NO_ATTR_CONTEXT;
         return GSS_S_UNAVAILABLE;
@@ -942,11 +1433,44 @@ gssEapGetNameAttribute(OM_uint32 *minor,
     return GSS_S_COMPLETE;
 }
 
+/*
+ * Give name a context of its own if it shares one with duplicates of
+ * it, so that it can be changed. Call with the name mutex held and
+ * from within a try block.
+ */
+static OM_uint32
+unshareAttrContext(OM_uint32 *minor, gss_name_t name)
+{
+    gss_eap_attr_ctx *ctx;
+
+    if (!name->attrCtx->shared())
+        return GSS_S_COMPLETE;
+
+    ctx = new gss_eap_attr_ctx();
+
+    if (!ctx->initWithExistingContext(name->attrCtx)) {
+        delete ctx;
+        *minor = GSSEAP_ATTR_CONTEXT_FAILURE;
+        return GSS_S_FAILURE;
+    }
+
+    name->attrCtx->release();
+    name->attrCtx = ctx;
+
+    return GSS_S_COMPLETE;
+}
+
 OM_uint32
 gssEapDeleteNameAttribute(OM_uint32 *minor,
                           gss_name_t name,
                           gss_buffer_t attr)
 {
+    OM_uint32 major;
+
+    major = materializeAttrContext(minor, name);
+    if (GSS_ERROR(major))
+        return major;
+
     if (name->attrCtx == NULL) {
         *minor = GSSEAP_NO_ATTR_CONTEXT;
         return GSS_S_UNAVAILABLE;
@@ -956,6 +1480,10 @@ gssEapDeleteNameAttribute(OM_uint32 *minor,
         return GSS_S_UNAVAILABLE;
 
     try {
+        major = unshareAttrContext(minor, name);
+        if (GSS_ERROR(major))
+            return major;
+
         if (!name->attrCtx->deleteAttribute(attr)) {
             *minor = GSSEAP_NO_SUCH_ATTR;
             gssEapSaveStatusInfo(*minor, "Unknown naming attribute %.*s",
@@ -976,6 +1504,12 @@ gssEapSetNameAttribute(OM_uint32 *minor,
                        gss_buffer_t attr,
                        gss_buffer_t value)
 {
+    OM_uint32 major;
+
+    major = materializeAttrContext(minor, name);
+    if (GSS_ERROR(major))
+        return major;
+
     if (name->attrCtx == NULL) {
         *minor = GSSEAP_NO_ATTR_CONTEXT;
         return GSS_S_UNAVAILABLE;
@@ -985,6 +1519,10 @@ gssEapSetNameAttribute(OM_uint32 *minor,
         return GSS_S_UNAVAILABLE;
 
     try {
+        major = unshareAttrContext(minor, name);
+        if (GSS_ERROR(major))
+            return major;
+
         if (!name->attrCtx->setAttribute(complete, attr, value)) {
              *minor = GSSEAP_NO_SUCH_ATTR;
             gssEapSaveStatusInfo(*minor, "Unknown naming attribute %.*s",
@@ -998,12 +1536,20 @@ gssEapSetNameAttribute(OM_uint32 *minor,
     return GSS_S_COMPLETE;
 }
 
+/*
+ * Call with the name mutex held: materializeAttrContext() may be
+ * replacing the snapshot with a parsed context under it.
+ */
 OM_uint32
 gssEapExportAttrContext(OM_uint32 *minor,
                         gss_name_t name,
                         gss_buffer_t buffer)
 {
     if (name->attrCtx == NULL) {
+        /* Still as it was imported, so no need to parse it */
+        if (name->attrSnapshot.length != 0)
+            return duplicateBuffer(minor, &name->attrSnapshot, buffer);
+
         buffer->length = 0;
         buffer->value = NULL;
 
@@ -1022,6 +1568,45 @@ gssEapExportAttrContext(OM_uint32 *minor,
     return GSS_S_COMPLETE;
 }
 
+/*
+ * Check the framing of an exported attribute context without handing
+ * it to the providers, for imports that leave that until first use
+ * (see materializeAttrContext()), so that a corrupt one is still
+ * rejected on import. Only the binary encoding can be checked thus;
+ * GSS_S_UNAVAILABLE for anything else, which the caller must parse.
+ */
+OM_uint32
+gssEapCheckAttrContext(OM_uint32 *minor,
+                       const gss_buffer_t buffer)
+{
+    gss_eap_attr_reader reader(NULL, 0, NULL, 0);
+    uint32_t flags;
+
+    if (buffer->length < ATTR_BINARY_MAGIC_LENGTH ||
+        memcmp(buffer->value, ATTR_BINARY_MAGIC, ATTR_BINARY_MAGIC_LENGTH) != 0) {
+        *minor = 0;
+        return GSS_S_UNAVAILABLE;
+    }
+
+    if (!readBinaryHeader(buffer, &flags, reader))
+        goto fail;
+
+    while (!reader.atEnd()) {
+        gss_eap_attr_reader section = reader;
+        const char *key;
+
+        if (!readBinarySection(reader, &key, section))
+            goto fail;
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+
+fail:
+    *minor = GSSEAP_ATTR_CONTEXT_FAILURE;
+    return GSS_S_BAD_NAME;
+}
+
 OM_uint32
 gssEapImportAttrContext(OM_uint32 *minor,
                         gss_buffer_t buffer,
@@ -1062,44 +1647,21 @@ gssEapImportAttrContext(OM_uint32 *minor,
     return major;
 }
 
+/*
+ * The duplicate shares the context; it is copied only if one of the
+ * names sharing it has its attributes changed.
+ */
 OM_uint32
 gssEapDuplicateAttrContext(OM_uint32 *minor,
                            gss_name_t in,
                            gss_name_t out)
 {
-    gss_eap_attr_ctx *ctx = NULL;
-    OM_uint32 major = GSS_S_FAILURE;
-
     GSSEAP_ASSERT(out->attrCtx == NULL);
 
-    if (in->attrCtx == NULL) {
-        *minor = 0;
-        return GSS_S_COMPLETE;
-    }
-
-    if (GSS_ERROR(gssEapAttrProvidersInit(minor)))
-        return GSS_S_UNAVAILABLE;
-
-    try {
-        ctx = new gss_eap_attr_ctx();
-
-        if (ctx->initWithExistingContext(in->attrCtx)) {
-            out->attrCtx = ctx;
-            major = GSS_S_COMPLETE;
-            *minor = 0;
-        } else {
-            major = GSS_S_FAILURE;
-            *minor = GSSEAP_ATTR_CONTEXT_FAILURE;
-        }
-    } catch (std::exception &e) {
-        major = in->attrCtx->mapException(minor, e);
-    }
-
-    GSSEAP_ASSERT(major == GSS_S_COMPLETE || out->attrCtx == NULL);
-
-    if (GSS_ERROR(major))
-        delete ctx;
+    if (in->attrCtx != NULL)
+        out->attrCtx = in->attrCtx->addRef();
 
+    *minor = 0;
     return GSS_S_COMPLETE;
 }
 
@@ -1110,6 +1672,12 @@ gssEapMapNameToAny(OM_uint32 *minor,
                    gss_buffer_t type_id,
                    gss_any_t *output)
 {
+    OM_uint32 major;
+
+    major = materializeAttrContext(minor, name);
+    if (GSS_ERROR(major))
+        return major;
+
     if (name->attrCtx == NULL) {
         *minor = GSSEAP_NO_ATTR_CONTEXT;
         return GSS_S_UNAVAILABLE;
@@ -1133,6 +1701,12 @@ gssEapReleaseAnyNameMapping(OM_uint32 *minor,
                             gss_buffer_t type_id,
                             gss_any_t *input)
 {
+    OM_uint32 major;
+
+    major = materializeAttrContext(minor, name);
+    if (GSS_ERROR(major))
+        return major;
+
     if (name->attrCtx == NULL) {
         *minor = GSSEAP_NO_ATTR_CONTEXT;
         return GSS_S_UNAVAILABLE;
@@ -1157,7 +1731,7 @@ gssEapReleaseAttrContext(OM_uint32 *minor,
                          gss_name_t name)
 {
     if (name->attrCtx != NULL)
-        delete name->attrCtx;
+        name->attrCtx->release();
 
     *minor = 0;
     return GSS_S_COMPLETE;
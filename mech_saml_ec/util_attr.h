@@ -38,8 +38,10 @@
 #define _UTIL_ATTR_H_ 1
 
 #ifdef __cplusplus
+#include <atomic>
 #include <string>
 #include <new>
+#include <unordered_map>
 
 #ifdef MECH_EAP
 using namespace gss_eap_util;
@@ -65,6 +67,72 @@ typedef bool
 
 #define ATTR_FLAG_DISABLE_LOCAL     0x00000001
 
+/*
+ * Binary attribute context tokens, see gss_eap_attr_ctx::exportToBuffer().
+ * Strings are written as a length, the bytes and a NUL, so that they
+ * can be used in place; names (attribute and provider names and the
+ * like) are written once to a table and referred to by their offset.
+ */
+#define ATTR_BINARY_MAGIC           "\0GEA"
+#define ATTR_BINARY_MAGIC_LENGTH    4
+#define ATTR_BINARY_VERSION         1
+#define ATTR_BINARY_NO_NAME         0xFFFFFFFFU
+
+class gss_eap_attr_writer
+{
+public:
+    gss_eap_attr_writer(void) {}
+
+    void putUint8(unsigned char value) { m_body.push_back((char)value); }
+    void putUint32(uint32_t value);
+    void putUint64(uint64_t value);
+    void putString(const char *value, size_t length);
+    void putString(const char *value) { putString(value, strlen(value)); }
+    void putName(const char *name);     /* NULL allowed */
+
+    /* Write a length or count now that will only be known later */
+    size_t reserveUint32(void);
+    void patchUint32(size_t offset, uint32_t value);
+    size_t length(void) const { return m_body.length(); }
+    void truncate(size_t length);
+
+    void finish(uint32_t flags, gss_buffer_t buffer) const;
+
+private:
+    std::string m_body;
+    std::string m_names;
+    std::unordered_map<std::string, uint32_t> m_nameOffsets;
+};
+
+/*
+ * Reads a token written by gss_eap_attr_writer without copying it;
+ * strings and names returned point into the token.
+ */
+class gss_eap_attr_reader
+{
+public:
+    gss_eap_attr_reader(const unsigned char *body, size_t length,
+                        const unsigned char *names, size_t namesLength)
+        : m_p(body), m_end(body + length),
+          m_names(names), m_namesLength(namesLength) {}
+
+    bool getUint8(unsigned char *value);
+    bool getUint32(uint32_t *value);
+    bool getUint64(uint64_t *value);
+    bool getString(const char **value, size_t *length);
+    bool getName(const char **name);    /* NULL if none was written */
+
+    /* A reader for the next length bytes, which this one skips */
+    bool getSection(size_t length, gss_eap_attr_reader &section);
+    bool atEnd(void) const { return m_p == m_end; }
+
+private:
+    const unsigned char *m_p;
+    const unsigned char *m_end;
+    const unsigned char *m_names;
+    size_t m_namesLength;
+};
+
 /*
  * Attribute provider: this represents a source of attributes derived
  * from the security context.
@@ -159,6 +227,18 @@ public:
     }
 #endif
 
+    virtual bool initWithBinary(const gss_eap_attr_ctx *manager,
+                                gss_eap_attr_reader &reader GSSEAP_UNUSED)
+    {
+        return initWithManager(manager);
+    }
+
+    /* false if there is no state to export */
+    virtual bool binaryRepresentation(gss_eap_attr_writer &writer GSSEAP_UNUSED) const
+    {
+        return false;
+    }
+
     virtual time_t getExpiryTime(void) const { return 0; }
 
     virtual OM_uint32 mapException(OM_uint32 *minor GSSEAP_UNUSED,
@@ -185,7 +265,9 @@ typedef gss_eap_attr_provider *(*gss_eap_attr_create_provider)(void);
 
 /*
  * Attribute context: this manages a set of providers for a given
- * security context.
+ * security context. Duplicated names share one reference-counted
+ * context, which must then be treated as immutable; names copy it
+ * before changing it (see gssEapSetNameAttribute()).
  */
 struct gss_eap_attr_ctx
 {
@@ -193,6 +275,10 @@ public:
     gss_eap_attr_ctx(void);
     ~gss_eap_attr_ctx(void);
 
+    gss_eap_attr_ctx *addRef(void) { m_refs++; return this; }
+    void release(void) { if (--m_refs == 0) delete this; }
+    bool shared(void) const { return m_refs > 1; }
+
     bool initWithExistingContext(const gss_eap_attr_ctx *manager);
     bool initWithGssContext(const gss_cred_id_t cred,
                             const gss_ctx_id_t ctx);
@@ -257,13 +343,16 @@ private:
     bool providerEnabled(unsigned int type) const;
     void releaseProvider(unsigned int type);
 
-    unsigned int attributePrefixToType(const gss_buffer_t prefix) const;
+    unsigned int attributePrefixToType(const gss_buffer_t prefix,
+                                       size_t hash) const;
     gss_buffer_desc attributeTypeToPrefix(unsigned int type) const;
 
 #ifdef MECH_EAP
     bool initWithJsonObject(JSONObject &object);
     JSONObject jsonRepresentation(void) const;
 #endif
+    bool initWithBinary(const gss_buffer_t buffer);
+    void binaryRepresentation(gss_buffer_t buffer) const;
 
     gss_eap_attr_provider *getPrimaryProvider(void) const;
 
@@ -273,6 +362,7 @@ private:
 
     uint32_t m_flags;
     gss_eap_attr_provider *m_providers[ATTR_TYPE_MAX + 1];
+    std::atomic<unsigned int> m_refs;
 };
 
 #endif /* __cplusplus */
@@ -365,6 +455,10 @@ gssEapImportAttrContext(OM_uint32 *minor,
                         gss_buffer_t buffer,
                         gss_name_t name);
 
+OM_uint32
+gssEapCheckAttrContext(OM_uint32 *minor,
+                       const gss_buffer_t buffer);
+
 OM_uint32
 gssEapDuplicateAttrContext(OM_uint32 *minor,
                            gss_name_t in,
@@ -387,6 +481,9 @@ OM_uint32
 gssEapReleaseAttrContext(OM_uint32 *minor,
                          gss_name_t name);
 
+OM_uint32
+gssEapAttrProvidersInit(OM_uint32 *minor);
+
 OM_uint32
 gssEapAttrProvidersFinalize(OM_uint32 *minor);
 
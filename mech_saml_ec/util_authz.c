@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Authorization cache: remembers the local account that a principal's
+ * local-login-user attribute mapped to, so that its next logins within
+ * the TTL (and its session) need neither the attribute resolver nor the
+ * attribute filter policy.
+ *
+ * Entries are keyed on the initiator name, which includes the NameID
+ * and its qualifiers, and on a SHA-256 fingerprint of the IdP and the
+ * attributes it released (see getSAMLFingerprint()). Different
+ * attributes therefore mean a miss. The table is direct mapped, so memory use is bounded: a
+ * new entry simply replaces whatever shared its slot.
+ *
+ * Reloading the SP configuration may change what the attribute policy
+ * maps to, so the cache is emptied whenever getSAMLGeneration() moves
+ * on. With saml_verifierd the fingerprint includes the verifier's own
+ * generation, so its reloads cause misses instead.
+ */
+
+#include "gssapiP_eap.h"
+
+#define SAML_EC_AUTHZ_CACHE_TTL         "SAML_EC_AUTHZ_CACHE_TTL"
+
+#define AUTHZ_CACHE_DEFAULT_TTL         300
+#define AUTHZ_CACHE_MAX_TTL             86400
+#define AUTHZ_CACHE_SLOTS               1024    /* a power of two */
+
+struct gss_eap_authz_entry {
+    gss_buffer_desc username;
+    unsigned char fingerprint[SAML_FINGERPRINT_LENGTH];
+    gss_buffer_desc localName;
+    time_t expiry;
+};
+
+static struct {
+    GSSEAP_MUTEX mutex;
+    time_t ttl;                         /* 0 if disabled */
+    unsigned long generation;           /* of the SP the entries are from */
+    struct gss_eap_authz_entry entries[AUTHZ_CACHE_SLOTS];
+} authzCache;
+
+static GSSEAP_THREAD_ONCE authzCacheOnce = GSSEAP_ONCE_INITIALIZER;
+
+static GSSEAP_ONCE_CALLBACK(initAuthzCache)
+{
+    char *s, *end;
+    long ttl = AUTHZ_CACHE_DEFAULT_TTL;
+
+    GSSEAP_MUTEX_INIT(&authzCache.mutex);
+
+    s = getenv(SAML_EC_AUTHZ_CACHE_TTL);
+    if (s != NULL) {
+        errno = 0;
+        ttl = strtol(s, &end, 10);
+        if (errno != 0 || end == s || *end != '\0' ||
+            ttl < 0 || ttl > AUTHZ_CACHE_MAX_TTL) {
+            GSSEAP_LOG(GSSEAP_LOG_WARNING, "%s must be between 0 and %d "
+                       "seconds, not (%s); authorization cache disabled",
+                       SAML_EC_AUTHZ_CACHE_TTL, AUTHZ_CACHE_MAX_TTL, s);
+            ttl = 0;
+        }
+    }
+    authzCache.ttl = ttl;
+
+    GSSEAP_ONCE_LEAVE;
+}
+
+/*
+ * Called with the cache locked: empty it if the SP configuration was
+ * reloaded since it was filled.
+ */
+static void
+checkAuthzCacheGeneration(unsigned long generation)
+{
+    OM_uint32 minor;
+    size_t i;
+
+    if (generation == authzCache.generation)
+        return;
+
+    for (i = 0; i < AUTHZ_CACHE_SLOTS; i++) {
+        struct gss_eap_authz_entry *entry = &authzCache.entries[i];
+
+        gss_release_buffer(&minor, &entry->username);
+        gss_release_buffer(&minor, &entry->localName);
+        memset(entry->fingerprint, 0, sizeof(entry->fingerprint));
+        entry->expiry = 0;
+    }
+
+    authzCache.generation = generation;
+}
+
+static struct gss_eap_authz_entry *
+authzCacheSlot(const gss_name_t name, const unsigned char *fingerprint)
+{
+    uint32_t h = name->hash ^ load_uint32_be(fingerprint);
+
+    return &authzCache.entries[h & (AUTHZ_CACHE_SLOTS - 1)];
+}
+
+/*
+ * Set localName to a copy of the cached local account for name with
+ * these attributes. 1 on a hit; 0 on a miss, or if out of memory.
+ */
+int
+gssEapAuthzCacheLookup(const gss_name_t name,
+                       const unsigned char *fingerprint,
+                       gss_buffer_t localName)
+{
+    struct gss_eap_authz_entry *entry;
+    OM_uint32 major = GSS_S_UNAVAILABLE, minor;
+    unsigned long generation;
+
+    GSSEAP_ONCE(&authzCacheOnce, initAuthzCache);
+
+    if (authzCache.ttl == 0)
+        return 0;
+
+    generation = getSAMLGeneration();
+
+    GSSEAP_MUTEX_LOCK(&authzCache.mutex);
+
+    checkAuthzCacheGeneration(generation);
+
+    entry = authzCacheSlot(name, fingerprint);
+    if (memcmp(entry->fingerprint, fingerprint, SAML_FINGERPRINT_LENGTH) == 0 &&
+        entry->expiry > time(NULL) &&
+        entry->username.length == name->username.length &&
+        memcmp(entry->username.value, name->username.value,
+               name->username.length) == 0)
+        major = duplicateBuffer(&minor, &entry->localName, localName);
+
+    GSSEAP_MUTEX_UNLOCK(&authzCache.mutex);
+
+    return major == GSS_S_COMPLETE;
+}
+
+/*
+ * Remember that name, with these attributes, maps to localName, until
+ * the TTL runs out or the session expires (if expiry is not 0).
+ */
+void
+gssEapAuthzCacheStore(const gss_name_t name,
+                      const unsigned char *fingerprint,
+                      const gss_buffer_t localName,
+                      time_t expiry)
+{
+    struct gss_eap_authz_entry *entry, update, old;
+    OM_uint32 minor;
+    unsigned long generation;
+    time_t now;
+
+    GSSEAP_ONCE(&authzCacheOnce, initAuthzCache);
+
+    if (authzCache.ttl == 0)
+        return;
+
+    now = time(NULL);
+    if (expiry == 0 || expiry > now + authzCache.ttl)
+        expiry = now + authzCache.ttl;
+
+    /* Copy outside the lock; the old entry is released after it */
+    if (GSS_ERROR(duplicateBuffer(&minor, &name->username, &update.username)))
+        return;
+    if (GSS_ERROR(duplicateBuffer(&minor, localName, &update.localName))) {
+        gss_release_buffer(&minor, &update.username);
+        return;
+    }
+    memcpy(update.fingerprint, fingerprint, SAML_FINGERPRINT_LENGTH);
+    update.expiry = expiry;
+
+    generation = getSAMLGeneration();
+
+    GSSEAP_MUTEX_LOCK(&authzCache.mutex);
+
+    checkAuthzCacheGeneration(generation);
+
+    entry = authzCacheSlot(name, fingerprint);
+    old = *entry;
+    *entry = update;
+
+    GSSEAP_MUTEX_UNLOCK(&authzCache.mutex);
+
+    gss_release_buffer(&minor, &old.username);
+    gss_release_buffer(&minor, &old.localName);
+}
@@ -49,21 +49,37 @@ pos(char c)
 ssize_t
 base64Encode(const void *data, int size, char **str)
 {
-    char *s, *p;
-    int i;
-    int c;
-    const unsigned char *q;
+    char *s;
+    ssize_t len;
 
     if (size > INT_MAX/4 || size < 0) {
 	*str = NULL;
 	return -1;
     }
 
-    p = s = (char *)GSSEAP_MALLOC(BASE64_EXPAND(size));
-    if (p == NULL) {
+    s = (char *)GSSEAP_MALLOC(BASE64_EXPAND(size));
+    if (s == NULL) {
         *str = NULL;
 	return -1;
     }
+
+    len = base64EncodeTo(data, size, s);
+    *str = s;
+    return len;
+}
+
+/* str must hold BASE64_EXPAND(size) bytes */
+ssize_t
+base64EncodeTo(const void *data, int size, char *str)
+{
+    char *p = str;
+    int i;
+    int c;
+    const unsigned char *q;
+
+    if (size > INT_MAX/4 || size < 0)
+	return -1;
+
     q = (const unsigned char *) data;
 
     for (i = 0; i < size;) {
@@ -87,8 +103,7 @@ base64Encode(const void *data, int size, char **str)
 	p += 4;
     }
     *p = 0;
-    *str = s;
-    return strlen(s);
+    return p - str;
 }
 
 #define DECODE_ERROR 0xffffffff
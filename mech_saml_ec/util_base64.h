@@ -43,13 +43,16 @@ extern "C" {
 ssize_t
 base64Encode(const void *, int, char **);
 
+ssize_t
+base64EncodeTo(const void *, int, char *);
+
 ssize_t
 base64Decode(const char *, void *);
 
 int
 base64Valid(const char *str);
 
-#define BASE64_EXPAND(n)        (n * 4 / 3 + 4)
+#define BASE64_EXPAND(n)        ((n) * 4 / 3 + 4)
 
 #ifdef __cplusplus
 }
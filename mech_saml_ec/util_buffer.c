@@ -36,8 +36,6 @@
 
 #include "gssapiP_eap.h"
 
-int mech_saml_ec_debug = -1;
-
 OM_uint32
 makeStringBuffer(OM_uint32 *minor,
                  const char *string,
@@ -124,17 +122,107 @@ duplicateBuffer(OM_uint32 *minor,
 }
 
 void
-printBuffer(FILE *stream, const gss_buffer_t src)
+logBuffer(const char *label, const gss_buffer_t src)
 {
-    int i = 0;
+    static const char hex[] = "0123456789abcdef";
+    char *p, *s;
+    size_t i;
 
-    if (src == GSS_C_NO_BUFFER)
+    if (src == GSS_C_NO_BUFFER || !GSSEAP_LOG_ENABLED(GSSEAP_LOG_DEBUG))
+        return;
+
+    s = GSSEAP_MALLOC(3 * src->length + 1);
+    if (s == NULL)
+        return;
+
+    for (i = 0, p = s; i < src->length; i++) {
+        unsigned char c = ((unsigned char *)src->value)[i];
+
+        *p++ = hex[c >> 4];
+        *p++ = hex[c & 0xf];
+        *p++ = ' ';
+    }
+    *p = '\0';
+
+    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "%s: BYTES IN TOKEN ARE: (%s)", label, s);
+
+    GSSEAP_FREE(s);
+}
+
+/*
+ * A reference-counted private copy of a token. Objects imported from
+ * it may point into the copy instead of copying what they need out of
+ * it, taking a reference, so that the copy lives as long as they do.
+ */
+struct gss_eap_shared_buffer {
+    GSSEAP_MUTEX mutex;
+    unsigned int refs;
+    /* followed by the data */
+};
+
+OM_uint32
+gssEapSharedBufferCreate(OM_uint32 *minor,
+                         const gss_buffer_t src,
+                         struct gss_eap_shared_buffer **pShared,
+                         gss_buffer_t data)
+{
+    struct gss_eap_shared_buffer *shared;
+
+    *pShared = NULL;
+    data->length = 0;
+    data->value = NULL;
+
+    shared = GSSEAP_MALLOC(sizeof(*shared) + src->length);
+    if (shared == NULL) {
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+
+    if (GSSEAP_MUTEX_INIT(&shared->mutex) != 0) {
+        *minor = GSSEAP_GET_LAST_ERROR();
+        GSSEAP_FREE(shared);
+        return GSS_S_FAILURE;
+    }
+
+    shared->refs = 1;
+
+    data->length = src->length;
+    data->value = shared + 1;
+    memcpy(data->value, src->value, src->length);
+
+    *pShared = shared;
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+struct gss_eap_shared_buffer *
+gssEapSharedBufferRef(struct gss_eap_shared_buffer *shared)
+{
+    GSSEAP_MUTEX_LOCK(&shared->mutex);
+    shared->refs++;
+    GSSEAP_MUTEX_UNLOCK(&shared->mutex);
+
+    return shared;
+}
+
+void
+gssEapSharedBufferRelease(struct gss_eap_shared_buffer **pShared)
+{
+    struct gss_eap_shared_buffer *shared = *pShared;
+    unsigned int refs;
+
+    if (shared == NULL)
         return;
 
-    fprintf(stream, "BYTES IN TOKEN ARE: (");
-    for (i = 0; i < src->length; i++)
-    {
-        fprintf(stream, "%x ", ((unsigned char *)src->value)[i]);
+    GSSEAP_MUTEX_LOCK(&shared->mutex);
+    refs = --shared->refs;
+    GSSEAP_MUTEX_UNLOCK(&shared->mutex);
+
+    if (refs == 0) {
+        GSSEAP_MUTEX_DESTROY(&shared->mutex);
+        GSSEAP_FREE(shared);
     }
-    fprintf(stream, ")\n");
+
+    *pShared = NULL;
 }
@@ -196,6 +196,73 @@ gssEapVerify(krb5_context context,
                           sign_usage, iov, iov_count, 1, valid);
 }
 
+/*
+ * Checksum over ( Message | Header ) for a MIC token laid out as
+ * Header | Checksum. Unlike gssEapSign()/gssEapVerify() this needs no
+ * iov array of its own and uses the context's cached key schedule.
+ */
+int
+gssEapChecksumMIC(krb5_context context,
+                  krb5_cksumtype type,
+#ifdef HAVE_HEIMDAL_VERSION
+                  krb5_crypto crypto,
+#else
+                  krb5_key key,
+#endif
+                  krb5_keyusage sign_usage,
+                  const gss_buffer_t message,
+                  unsigned char *token,
+                  size_t cksumLength,
+                  int verify,
+                  int *valid)
+{
+    krb5_error_code code;
+    krb5_crypto_iov kiov[3];
+
+    if (verify)
+        *valid = FALSE;
+
+    /* Message */
+    kiov[0].flags = KRB5_CRYPTO_TYPE_DATA;
+    kiov[0].data.length = message->length;
+    kiov[0].data.data = (char *)message->value;
+
+    /* Header */
+    kiov[1].flags = KRB5_CRYPTO_TYPE_SIGN_ONLY;
+    kiov[1].data.length = 16;
+    kiov[1].data.data = (char *)token;
+
+    /* Checksum */
+    kiov[2].flags = KRB5_CRYPTO_TYPE_CHECKSUM;
+    kiov[2].data.length = cksumLength;
+    kiov[2].data.data = (char *)token + 16;
+
+#ifdef HAVE_HEIMDAL_VERSION
+    if (verify) {
+        code = krb5_verify_checksum_iov(context, crypto, sign_usage,
+                                        kiov, 3, &type);
+        *valid = (code == 0);
+    } else {
+        code = krb5_create_checksum_iov(context, crypto, sign_usage,
+                                        kiov, 3, &type);
+    }
+#else
+    if (verify) {
+        krb5_boolean kvalid = FALSE;
+
+        code = krb5_k_verify_checksum_iov(context, type, key,
+                                          sign_usage, kiov, 3, &kvalid);
+
+        *valid = kvalid;
+    } else {
+        code = krb5_k_make_checksum_iov(context, type, key,
+                                        sign_usage, kiov, 3);
+    }
+#endif /* HAVE_HEIMDAL_VERSION */
+
+    return code;
+}
+
 #if 0
 OM_uint32
 gssEapEncodeGssChannelBindings(OM_uint32 *minor,
@@ -90,6 +90,10 @@ releaseInitiatorContext(struct gss_eap_initiator_ctx *ctx)
 {
 #ifdef MECH_EAP
     eap_peer_sm_deinit(ctx->eap);
+#else
+    OM_uint32 tmpMinor;
+
+    gss_release_buffer(&tmpMinor, &ctx->generatedKey);
 #endif
 }
 
@@ -110,7 +114,10 @@ releaseAcceptorContext(struct gss_eap_acceptor_ctx *ctx)
     if (ctx->vps != NULL)
         gssEapRadiusFreeAvps(&tmpMinor, &ctx->vps);
 #else
-    ctx = ctx;
+    OM_uint32 tmpMinor;
+
+    gss_release_buffer(&tmpMinor, &ctx->generatedKey);
+    gss_release_buffer(&tmpMinor, &ctx->encryptionType);
 #endif
 }
 #endif /* GSSEAP_ENABLE_ACCEPTOR */
@@ -126,6 +133,8 @@ gssEapReleaseContext(OM_uint32 *minor,
         return GSS_S_COMPLETE;
     }
 
+    gssEapArenaRelease(&ctx->arena);
+
     if (CTX_IS_INITIATOR(ctx)) {
         releaseInitiatorContext(&ctx->initiatorCtx);
     }
@@ -140,6 +149,7 @@ gssEapReleaseContext(OM_uint32 *minor,
     gssEapReleaseOid(&tmpMinor, &ctx->mechanismUsed);
     sequenceFree(&tmpMinor, &ctx->seqState);
     gssEapReleaseCred(&tmpMinor, &ctx->cred);
+    krbReleaseContextCrypto(ctx);
 
     GSSEAP_MUTEX_DESTROY(&ctx->mutex);
 
@@ -158,14 +158,13 @@ readChannelBindingsType(OM_uint32 *minor, char **cb_type)
         ccacheName = buf;
     }
 
-    if (MECH_SAML_EC_DEBUG)
-        printf("Looking for Channel Bindings Type in (%s)\n", ccacheName);
+    GSSEAP_LOG(GSSEAP_LOG_DEBUG, "Looking for Channel Bindings Type in (%s)", ccacheName);
 
     fp = fopen(ccacheName, "r");
     if (fp == NULL) {
-        fprintf(stderr, "ERROR: Channel Bindings Type not specified in (%s) nor"
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Channel Bindings Type not specified in (%s) nor"
                   " in a file pointed to by the environment variable: "
-                  " GSS_SAML_EC_CB_TYPE_FILE\n", ccacheName);
+                  " GSS_SAML_EC_CB_TYPE_FILE", ccacheName);
         major = GSS_S_BAD_BINDINGS;
         *minor = GSSEAP_SAML_BINDING_FAILURE;
         goto cleanup;
@@ -180,7 +179,7 @@ readChannelBindingsType(OM_uint32 *minor, char **cb_type)
     }
 
     if (*cb_type == NULL || strlen(*cb_type) == 0) {
-        fprintf(stderr, "ERROR: Channel Bindings Type not specified\n");
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Channel Bindings Type not specified");
         major = GSS_S_BAD_BINDINGS;
         *minor = GSSEAP_SAML_BINDING_FAILURE;
         goto cleanup;
@@ -662,7 +661,9 @@ gssEapSetCredService(OM_uint32 *minor,
     }
 
     if (target != GSS_C_NO_NAME) {
+        GSSEAP_MUTEX_LOCK(&target->mutex);
         major = gssEapDuplicateName(minor, target, &newTarget);
+        GSSEAP_MUTEX_UNLOCK(&target->mutex);
         if (GSS_ERROR(major))
             goto cleanup;
 
@@ -130,6 +130,7 @@ gssEapDeriveRfc3961Key(OM_uint32 *minor,
     size_t randomLength, keyLength, prfLength;
     unsigned char constant[4 + sizeof("rfc4121-gss-eap") - 1], *p;
     ssize_t i, remain;
+    uint64_t metricsStart = gssEapMetricsStart();
 
     GSSEAP_KRB_INIT(&krbContext);
     GSSEAP_ASSERT(encryptionType != ENCTYPE_NULL);
@@ -241,6 +242,8 @@ cleanup:
         GSSEAP_FREE(derivedKeyData.data);
     }
 
+    gssEapMetricsSpan(GSSEAP_METRIC_DERIVE_KEY, metricsStart);
+
     *minor = code;
 
     return (code == 0) ? GSS_S_COMPLETE : GSS_S_FAILURE;
@@ -383,6 +386,64 @@ krbBlockSize(krb5_context krbContext,
 #endif
 }
 
+/*
+ * Return the key schedule for the context's RFC 3961 key, creating it
+ * on first use. This lets the krb5 library cache derived keys across
+ * per-message calls; the caller must hold the context mutex.
+ */
+krb5_error_code
+krbContextCrypto(krb5_context krbContext,
+                 gss_ctx_id_t ctx,
+#ifdef HAVE_HEIMDAL_VERSION
+                 krb5_crypto *pCrypto
+#else
+                 krb5_key *pKey
+#endif
+                 )
+{
+    krb5_error_code code = 0;
+
+    if (ctx->rfc3961Crypto == NULL) {
+#ifdef HAVE_HEIMDAL_VERSION
+        code = krb5_crypto_init(krbContext, &ctx->rfc3961Key,
+                                ETYPE_NULL, &ctx->rfc3961Crypto);
+#else
+        code = krb5_k_create_key(krbContext, &ctx->rfc3961Key,
+                                 &ctx->rfc3961Crypto);
+#endif
+        if (code != 0)
+            ctx->rfc3961Crypto = NULL;
+    }
+
+#ifdef HAVE_HEIMDAL_VERSION
+    *pCrypto = ctx->rfc3961Crypto;
+#else
+    *pKey = ctx->rfc3961Crypto;
+#endif
+
+    return code;
+}
+
+void
+krbReleaseContextCrypto(gss_ctx_id_t ctx)
+{
+    OM_uint32 tmpMinor;
+    krb5_context krbContext;
+
+    if (ctx->rfc3961Crypto == NULL)
+        return;
+
+    if (!GSS_ERROR(gssEapKerberosInit(&tmpMinor, &krbContext))) {
+#ifdef HAVE_HEIMDAL_VERSION
+        krb5_crypto_destroy(krbContext, ctx->rfc3961Crypto);
+#else
+        krb5_k_free_key(krbContext, ctx->rfc3961Crypto);
+#endif
+    }
+
+    ctx->rfc3961Crypto = NULL;
+}
+
 krb5_error_code
 krbEnctypeToString(
 #ifdef HAVE_HEIMDAL_VERSION
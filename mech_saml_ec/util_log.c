@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Leveled diagnostic logging. Lines are formatted by the caller and
+ * queued in a fixed ring that a detached thread drains to stderr, so
+ * the handshake path never blocks on terminal or pipe I/O. If the
+ * ring is full the message is dropped and counted. Records longer than
+ * a slot are written synchronously, in full.
+ */
+
+#include <ctype.h>
+
+#include "gssapiP_eap.h"
+
+#define MECH_SAML_EC_LOG_LEVEL          "MECH_SAML_EC_LOG_LEVEL"
+
+#define LOG_RING_SLOTS                  128
+#define LOG_LINE_MAX                    512
+
+int gssEapLogLevel = -1;
+
+static const char *logLevelNames[] = {
+    "error",
+    "warning",
+    "notice",
+    "info",
+    "debug",
+};
+
+static struct {
+    GSSEAP_MUTEX mutex;
+#ifndef WIN32
+    pthread_cond_t cond;
+#endif
+    int async;
+    unsigned int head;                  /* next slot to fill */
+    unsigned int tail;                  /* next slot to write */
+    unsigned long dropped;
+    char lines[LOG_RING_SLOTS][LOG_LINE_MAX];
+} logRing;
+
+static GSSEAP_THREAD_ONCE logInitOnce = GSSEAP_ONCE_INITIALIZER;
+static GSSEAP_THREAD_ONCE logWriterOnce = GSSEAP_ONCE_INITIALIZER;
+
+/* Called with logRing.mutex held */
+static void
+flushLogRing(void)
+{
+    if (logRing.dropped != 0) {
+        fprintf(stderr, "mech_saml_ec: %lu log messages dropped\n",
+                logRing.dropped);
+        logRing.dropped = 0;
+    }
+
+    while (logRing.tail != logRing.head) {
+        fputs(logRing.lines[logRing.tail % LOG_RING_SLOTS], stderr);
+        logRing.tail++;
+    }
+}
+
+#ifndef WIN32
+static void *
+logWriter(void *arg GSSEAP_UNUSED)
+{
+    char line[LOG_LINE_MAX];
+    unsigned long dropped;
+
+    GSSEAP_MUTEX_LOCK(&logRing.mutex);
+
+    for (;;) {
+        while (logRing.tail == logRing.head && logRing.dropped == 0)
+            pthread_cond_wait(&logRing.cond, &logRing.mutex);
+
+        dropped = logRing.dropped;
+        logRing.dropped = 0;
+
+        if (logRing.tail != logRing.head) {
+            memcpy(line, logRing.lines[logRing.tail % LOG_RING_SLOTS],
+                   sizeof(line));
+            logRing.tail++;
+        } else {
+            line[0] = '\0';
+        }
+
+        GSSEAP_MUTEX_UNLOCK(&logRing.mutex);
+
+        if (dropped != 0)
+            fprintf(stderr, "mech_saml_ec: %lu log messages dropped\n",
+                    dropped);
+        fputs(line, stderr);
+
+        GSSEAP_MUTEX_LOCK(&logRing.mutex);
+    }
+
+    return NULL;
+}
+
+/*
+ * The writer does not survive fork(); the child logs synchronously.
+ */
+static void
+logAtForkChild(void)
+{
+    GSSEAP_MUTEX_INIT(&logRing.mutex);
+    logRing.async = 0;
+}
+#endif /* !WIN32 */
+
+static GSSEAP_ONCE_CALLBACK(startLogWriter)
+{
+#ifndef WIN32
+    pthread_t writer;
+
+    if (pthread_cond_init(&logRing.cond, NULL) == 0 &&
+        pthread_create(&writer, NULL, logWriter, NULL) == 0) {
+        pthread_detach(writer);
+        GSSEAP_MUTEX_LOCK(&logRing.mutex);
+        logRing.async = 1;
+        GSSEAP_MUTEX_UNLOCK(&logRing.mutex);
+        pthread_atfork(NULL, NULL, logAtForkChild);
+    }
+#endif
+
+    GSSEAP_ONCE_LEAVE;
+}
+
+static GSSEAP_ONCE_CALLBACK(initLog)
+{
+    const char *s;
+    int level = GSSEAP_LOG_WARNING;
+    size_t i;
+
+    GSSEAP_MUTEX_INIT(&logRing.mutex);
+
+    s = getenv(MECH_SAML_EC_LOG_LEVEL);
+    if (s != NULL) {
+        if (isdigit((unsigned char)*s)) {
+            level = atoi(s);
+        } else {
+            for (i = 0; i < sizeof(logLevelNames) / sizeof(logLevelNames[0]); i++) {
+                if (strcmp(s, logLevelNames[i]) == 0) {
+                    level = i;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (getenv("MECH_SAML_EC_DEBUG") != NULL)
+        level = GSSEAP_LOG_DEBUG;
+
+    gssEapLogLevel = level;
+
+    GSSEAP_ONCE_LEAVE;
+}
+
+int
+gssEapLogInit(void)
+{
+    GSSEAP_ONCE(&logInitOnce, initLog);
+
+    return gssEapLogLevel;
+}
+
+/*
+ * Flush whatever the writer has not yet written; called when the
+ * mechanism is unloaded or the process exits.
+ */
+void
+gssEapLogFlush(void)
+{
+    if (!logRing.async)
+        return;
+
+    GSSEAP_MUTEX_LOCK(&logRing.mutex);
+    flushLogRing();
+    GSSEAP_MUTEX_UNLOCK(&logRing.mutex);
+
+    fflush(stderr);
+}
+
+void
+gssEapLog(int level, const char *fmt, ...)
+{
+    char line[LOG_LINE_MAX], *record = line;
+    va_list ap;
+    int len;
+
+    gssEapLogInit();
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    if (len < 0)
+        return;
+
+    /*
+     * Records too long for a ring slot, such as XML dumps, are
+     * formatted into the heap and written synchronously instead.
+     */
+    if ((size_t)len >= sizeof(line)) {
+        record = GSSEAP_MALLOC(len + 2);
+        if (record != NULL) {
+            va_start(ap, fmt);
+            len = vsnprintf(record, len + 1, fmt, ap);
+            va_end(ap);
+        }
+        if (record == NULL || len < 0) {
+            /* Fall back to the truncated record */
+            if (record != NULL)
+                GSSEAP_FREE(record);
+            record = line;
+            len = sizeof(line) - 1;
+        }
+    }
+
+    if (len == 0 || record[len - 1] != '\n') {
+        if (record == line && (size_t)len == sizeof(line) - 1)
+            len--;
+        record[len++] = '\n';
+        record[len] = '\0';
+    }
+
+    if (level > GSSEAP_LOG_ERROR)
+        GSSEAP_ONCE(&logWriterOnce, startLogWriter);
+
+    GSSEAP_MUTEX_LOCK(&logRing.mutex);
+
+    if (!logRing.async || level == GSSEAP_LOG_ERROR || record != line) {
+        /* keep ordering with anything still queued */
+        flushLogRing();
+        fputs(record, stderr);
+    } else if (logRing.head - logRing.tail < LOG_RING_SLOTS) {
+        memcpy(logRing.lines[logRing.head % LOG_RING_SLOTS], line, len + 1);
+        logRing.head++;
+#ifndef WIN32
+        pthread_cond_signal(&logRing.cond);
+#endif
+    } else {
+        logRing.dropped++;
+    }
+
+    GSSEAP_MUTEX_UNLOCK(&logRing.mutex);
+
+    if (record != line)
+        GSSEAP_FREE(record);
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Leveled diagnostic logging.
+ */
+
+#ifndef _UTIL_LOG_H_
+#define _UTIL_LOG_H_ 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GSSEAP_LOG_ERROR                0
+#define GSSEAP_LOG_WARNING              1
+#define GSSEAP_LOG_NOTICE               2
+#define GSSEAP_LOG_INFO                 3
+#define GSSEAP_LOG_DEBUG                4
+
+/*
+ * Messages above GSSEAP_LOG_MAX_LEVEL are compiled out entirely;
+ * build with -DGSSEAP_LOG_MAX_LEVEL=GSSEAP_LOG_WARNING (say) to
+ * strip debug output from production builds.
+ */
+#ifndef GSSEAP_LOG_MAX_LEVEL
+#define GSSEAP_LOG_MAX_LEVEL            GSSEAP_LOG_DEBUG
+#endif
+
+/*
+ * Runtime level, taken from MECH_SAML_EC_LOG_LEVEL (a level name or
+ * number) on first use; MECH_SAML_EC_DEBUG forces GSSEAP_LOG_DEBUG.
+ * The default is GSSEAP_LOG_WARNING. Reads -1 until initialized.
+ */
+extern int gssEapLogLevel;
+
+int
+gssEapLogInit(void);
+
+#define GSSEAP_LOG_ENABLED(level)                                       \
+    ((level) <= GSSEAP_LOG_MAX_LEVEL &&                                 \
+     (level) <= (gssEapLogLevel >= 0 ? gssEapLogLevel : gssEapLogInit()))
+
+/*
+ * Formatting happens only once the level check has passed, so a
+ * disabled call site costs a single comparison. Messages are queued
+ * to a background writer; errors are written synchronously.
+ */
+#define GSSEAP_LOG(level, ...)                                          \
+    do {                                                                \
+        if (GSSEAP_LOG_ENABLED(level))                                  \
+            gssEapLog((level), __VA_ARGS__);                            \
+    } while (0)
+
+void
+gssEapLog(int level, const char *fmt, ...)
+#ifdef __GNUC__
+    __attribute__((__format__(__printf__, 2, 3)))
+#endif
+    ;
+
+/* Write out anything still queued; see gssEapFinalize() */
+void
+gssEapLogFlush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UTIL_LOG_H_ */
@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Handshake timing and outcome counters, reported to a registered
+ * sink and/or periodically dumped to a file in Prometheus text format.
+ */
+
+#include "gssapiP_eap.h"
+
+#define SAML_EC_METRICS_FILE            "SAML_EC_METRICS_FILE"
+#define SAML_EC_METRICS_INTERVAL        "SAML_EC_METRICS_INTERVAL"
+
+#define METRICS_DEFAULT_INTERVAL        10
+#define METRICS_MAX_FAILURES            32
+
+static const char *metricNames[GSSEAP_METRIC_MAX] = {
+    "saml_request",
+    "sp_request_parse",
+    "idp_connect",
+    "idp_tls",
+    "idp_transfer",
+    "idp_total",
+    "response_parse",
+    "schema_validate",
+    "decrypt",
+    "metadata_lookup",
+    "signature",
+    "attribute_resolve",
+    "verify_response",
+    "derive_key",
+};
+
+struct gss_eap_span_stats {
+    uint64_t count;
+    uint64_t sumUsec;
+    uint64_t maxUsec;
+};
+
+struct gss_eap_failure_stats {
+    int initiator;
+    OM_uint32 minor;
+    uint64_t count;
+};
+
+static struct {
+    GSSEAP_MUTEX mutex;
+    int enabled;
+    struct gss_eap_metrics_sink sink;
+    char *file;
+    time_t interval;
+    time_t nextDump;
+    struct gss_eap_span_stats spans[GSSEAP_METRIC_MAX];
+    uint64_t successes[2];
+    uint64_t otherFailures[2];      /* once the failure table is full */
+    struct gss_eap_failure_stats failures[METRICS_MAX_FAILURES];
+    size_t failureCount;
+} metrics;
+
+static GSSEAP_THREAD_ONCE metricsOnce = GSSEAP_ONCE_INITIALIZER;
+
+static GSSEAP_ONCE_CALLBACK(initMetrics)
+{
+    char *s;
+
+    GSSEAP_MUTEX_INIT(&metrics.mutex);
+
+    s = getenv(SAML_EC_METRICS_FILE);
+    if (s != NULL && *s != '\0') {
+        metrics.file = strdup(s);
+
+        s = getenv(SAML_EC_METRICS_INTERVAL);
+        metrics.interval = (s != NULL) ? atoi(s) : 0;
+        if (metrics.interval <= 0)
+            metrics.interval = METRICS_DEFAULT_INTERVAL;
+        metrics.nextDump = time(NULL) + metrics.interval;
+    }
+
+    metrics.enabled = (metrics.file != NULL);
+
+    GSSEAP_ONCE_LEAVE;
+}
+
+static uint64_t
+metricsNow(void)
+{
+#ifdef WIN32
+    return (uint64_t)GetTickCount64() * 1000;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static const char *
+sideName(int initiator)
+{
+    return initiator ? "initiator" : "acceptor";
+}
+
+/*
+ * Write the counters to a temporary file and rename it over the
+ * configured one, so readers never see a partial dump. Called with
+ * the mutex held.
+ */
+static void
+dumpMetrics(void)
+{
+    char tmpFile[MAXPATHLEN];
+    FILE *fp;
+    size_t i;
+    int side;
+
+    if (snprintf(tmpFile, sizeof(tmpFile), "%s.tmp",
+                 metrics.file) >= (int)sizeof(tmpFile))
+        return;
+
+    fp = fopen(tmpFile, "w");
+    if (fp == NULL)
+        return;
+
+    fprintf(fp, "# TYPE saml_ec_span_microseconds summary\n");
+    for (i = 0; i < GSSEAP_METRIC_MAX; i++) {
+        fprintf(fp, "saml_ec_span_microseconds_sum{span=\"%s\"} %llu\n",
+                metricNames[i], (unsigned long long)metrics.spans[i].sumUsec);
+        fprintf(fp, "saml_ec_span_microseconds_count{span=\"%s\"} %llu\n",
+                metricNames[i], (unsigned long long)metrics.spans[i].count);
+    }
+
+    fprintf(fp, "# TYPE saml_ec_span_max_microseconds gauge\n");
+    for (i = 0; i < GSSEAP_METRIC_MAX; i++) {
+        fprintf(fp, "saml_ec_span_max_microseconds{span=\"%s\"} %llu\n",
+                metricNames[i], (unsigned long long)metrics.spans[i].maxUsec);
+    }
+
+    fprintf(fp, "# TYPE saml_ec_handshakes_total counter\n");
+    for (side = 0; side < 2; side++) {
+        fprintf(fp, "saml_ec_handshakes_total{side=\"%s\",result=\"success\"} "
+                "%llu\n", sideName(side),
+                (unsigned long long)metrics.successes[side]);
+        fprintf(fp, "saml_ec_handshakes_total{side=\"%s\",result=\"failure\","
+                "minor=\"other\"} %llu\n", sideName(side),
+                (unsigned long long)metrics.otherFailures[side]);
+    }
+    for (i = 0; i < metrics.failureCount; i++) {
+        fprintf(fp, "saml_ec_handshakes_total{side=\"%s\",result=\"failure\","
+                "minor=\"%u\"} %llu\n",
+                sideName(metrics.failures[i].initiator),
+                metrics.failures[i].minor,
+                (unsigned long long)metrics.failures[i].count);
+    }
+
+    if (fclose(fp) == 0)
+        rename(tmpFile, metrics.file);
+    else
+        unlink(tmpFile);
+}
+
+uint64_t
+gssEapMetricsStart(void)
+{
+    uint64_t now;
+
+    GSSEAP_ONCE(&metricsOnce, initMetrics);
+
+    if (!metrics.enabled)
+        return 0;
+
+    now = metricsNow();
+
+    return (now != 0) ? now : 1;
+}
+
+void
+gssEapMetricsSpan(enum gss_eap_metric metric, uint64_t start)
+{
+    if (start == 0)
+        return;
+
+    gssEapMetricsAddSpan(metric, (OM_uint32)(metricsNow() - start));
+}
+
+void
+gssEapMetricsAddSpan(enum gss_eap_metric metric, OM_uint32 usec)
+{
+    struct gss_eap_span_stats *stats;
+    struct gss_eap_metrics_sink sink;
+
+    GSSEAP_ONCE(&metricsOnce, initMetrics);
+
+    if (!metrics.enabled || metric >= GSSEAP_METRIC_MAX)
+        return;
+
+    GSSEAP_MUTEX_LOCK(&metrics.mutex);
+
+    stats = &metrics.spans[metric];
+    stats->count++;
+    stats->sumUsec += usec;
+    if (usec > stats->maxUsec)
+        stats->maxUsec = usec;
+
+    sink = metrics.sink;
+
+    GSSEAP_MUTEX_UNLOCK(&metrics.mutex);
+
+    if (sink.span != NULL)
+        sink.span(sink.data, metricNames[metric], usec);
+}
+
+void
+gssEapMetricsOutcome(int initiator, OM_uint32 major, OM_uint32 minor)
+{
+    struct gss_eap_metrics_sink sink;
+    size_t i;
+    time_t now;
+
+    GSSEAP_ONCE(&metricsOnce, initMetrics);
+
+    if (!metrics.enabled || major == GSS_S_CONTINUE_NEEDED)
+        return;
+
+    initiator = !!initiator;
+
+    GSSEAP_MUTEX_LOCK(&metrics.mutex);
+
+    if (!GSS_ERROR(major)) {
+        metrics.successes[initiator]++;
+    } else {
+        for (i = 0; i < metrics.failureCount; i++) {
+            if (metrics.failures[i].initiator == initiator &&
+                metrics.failures[i].minor == minor)
+                break;
+        }
+        if (i == metrics.failureCount && i < METRICS_MAX_FAILURES) {
+            metrics.failures[i].initiator = initiator;
+            metrics.failures[i].minor = minor;
+            metrics.failures[i].count = 0;
+            metrics.failureCount++;
+        }
+        if (i < metrics.failureCount)
+            metrics.failures[i].count++;
+        else
+            metrics.otherFailures[initiator]++;
+    }
+
+    if (metrics.file != NULL) {
+        now = time(NULL);
+        if (now >= metrics.nextDump) {
+            dumpMetrics();
+            metrics.nextDump = now + metrics.interval;
+        }
+    }
+
+    sink = metrics.sink;
+
+    GSSEAP_MUTEX_UNLOCK(&metrics.mutex);
+
+    if (sink.outcome != NULL)
+        sink.outcome(sink.data, initiator, major, minor);
+}
+
+OM_uint32
+gssEapMetricsSetSink(OM_uint32 *minor,
+                     const struct gss_eap_metrics_sink *sink)
+{
+    GSSEAP_ONCE(&metricsOnce, initMetrics);
+
+    GSSEAP_MUTEX_LOCK(&metrics.mutex);
+
+    if (sink != NULL)
+        metrics.sink = *sink;
+    else
+        memset(&metrics.sink, 0, sizeof(metrics.sink));
+
+    metrics.enabled = (metrics.file != NULL ||
+                       metrics.sink.span != NULL ||
+                       metrics.sink.outcome != NULL);
+
+    GSSEAP_MUTEX_UNLOCK(&metrics.mutex);
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Handshake timing and outcome counters.
+ */
+
+#ifndef _UTIL_METRICS_H_
+#define _UTIL_METRICS_H_ 1
+
+#include <stdint.h>
+#include <gssapi/gssapi.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum gss_eap_metric {
+    GSSEAP_METRIC_SAML_REQUEST = 0,     /* getSAMLRequest2() */
+    GSSEAP_METRIC_SP_REQUEST_PARSE,     /* initiator parse of SP request */
+    GSSEAP_METRIC_IDP_CONNECT,          /* TCP connect to IdP */
+    GSSEAP_METRIC_IDP_TLS,              /* TLS handshake with IdP */
+    GSSEAP_METRIC_IDP_TRANSFER,         /* request/response transfer */
+    GSSEAP_METRIC_IDP_TOTAL,            /* sendToIdP() */
+    GSSEAP_METRIC_RESPONSE_PARSE,       /* acceptor parse of response */
+    GSSEAP_METRIC_SCHEMA_VALIDATE,
+    GSSEAP_METRIC_DECRYPT,              /* assertion extraction/decryption */
+    GSSEAP_METRIC_METADATA_LOOKUP,
+    GSSEAP_METRIC_SIGNATURE,
+    GSSEAP_METRIC_ATTRIBUTE_RESOLVE,
+    GSSEAP_METRIC_VERIFY_RESPONSE,      /* verifySAMLResponse() */
+    GSSEAP_METRIC_DERIVE_KEY,           /* gssEapDeriveRfc3961Key() */
+    GSSEAP_METRIC_MAX
+};
+
+/*
+ * Metrics are collected only if a sink was registered or the
+ * SAML_EC_METRICS_FILE environment variable names a file to which
+ * Prometheus text format is written every SAML_EC_METRICS_INTERVAL
+ * seconds (default 10). Otherwise gssEapMetricsStart() returns zero
+ * and the other calls return immediately.
+ */
+uint64_t
+gssEapMetricsStart(void);
+
+void
+gssEapMetricsSpan(enum gss_eap_metric metric, uint64_t start);
+
+void
+gssEapMetricsAddSpan(enum gss_eap_metric metric, OM_uint32 usec);
+
+void
+gssEapMetricsOutcome(int initiator, OM_uint32 major, OM_uint32 minor);
+
+struct gss_eap_metrics_sink;
+
+OM_uint32
+gssEapMetricsSetSink(OM_uint32 *minor,
+                     const struct gss_eap_metrics_sink *sink);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UTIL_METRICS_H_ */
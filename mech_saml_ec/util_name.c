@@ -58,6 +58,7 @@
  */
 
 #include "gssapiP_eap.h"
+#include "util_strmap.h"
 
 static gss_OID_desc gssEapNtEapName = {
     /* 1.3.6.1.4.1.5322.22.2.1  */
@@ -108,10 +109,15 @@ gssEapReleaseName(OM_uint32 *minor, gss_name_t *pName)
         return GSS_S_COMPLETE;
     }
 
-    gss_release_buffer(&tmpMinor, &name->username);
+    if (name->borrowed != NULL)
+        gssEapSharedBufferRelease(&name->borrowed);
+    else
+        gss_release_buffer(&tmpMinor, &name->username);
     gssEapReleaseOid(&tmpMinor, &name->mechanismUsed);
 #ifdef GSSEAP_ENABLE_ACCEPTOR
     gssEapReleaseAttrContext(&tmpMinor, name);
+    gss_release_buffer(&tmpMinor, &name->localName);
+    gssEapSAMLReleaseAttributes(&name->samlAttrs);
 #endif
 
     GSSEAP_MUTEX_DESTROY(&name->mutex);
@@ -121,21 +127,44 @@ gssEapReleaseName(OM_uint32 *minor, gss_name_t *pName)
     return GSS_S_COMPLETE;
 }
 
+/*
+ * FNV-1a of the username, which is the name's canonical form. Stored
+ * on the name whenever the username is set, so that comparisons can
+ * rule most names out at once and applications can key hash tables on
+ * it (see GSS_EAP_NAME_HASH_ATTR).
+ */
+static void
+hashName(gss_name_t name)
+{
+    const unsigned char *p = (const unsigned char *)name->username.value;
+    size_t hash = GSSEAP_STRING_HASH_INIT;
+    size_t i;
+
+    for (i = 0; i < name->username.length; i++)
+        hash = gssEapStringHashStep(hash, p[i]);
+
+    name->hash = (uint32_t)hash;
+}
+
 static OM_uint32
 importServiceName(OM_uint32 *minor,
                   const gss_buffer_t nameBuffer,
                   gss_name_t *pName)
 {
-    OM_uint32 major;
+    OM_uint32 major, tmpMinor;
     gss_name_t name;
 
     major = gssEapAllocName(minor, &name);
     if (GSS_ERROR(major))
         return major;
 
-    duplicateBuffer(minor, nameBuffer, &name->username);
-    if (GSS_ERROR(major))
+    major = duplicateBuffer(minor, nameBuffer, &name->username);
+    if (GSS_ERROR(major)) {
+        gssEapReleaseName(&tmpMinor, &name);
         return major;
+    }
+
+    hashName(name);
 
     *pName = name;
     *minor = 0;
@@ -153,16 +182,20 @@ importEapNameFlags(OM_uint32 *minor,
                    OM_uint32 importFlags,
                    gss_name_t *pName)
 {
-    OM_uint32 major;
+    OM_uint32 major, tmpMinor;
     gss_name_t name;
 
     major = gssEapAllocName(minor, &name);
     if (GSS_ERROR(major))
         return major;
 
-    duplicateBuffer(minor, nameBuffer, &name->username);
-    if (GSS_ERROR(major))
+    major = duplicateBuffer(minor, nameBuffer, &name->username);
+    if (GSS_ERROR(major)) {
+        gssEapReleaseName(&tmpMinor, &name);
         return major;
+    }
+
+    hashName(name);
 
     *pName = name;
     *minor = 0;
@@ -185,6 +218,34 @@ importUserName(OM_uint32 *minor,
     return importEapNameFlags(minor, nameBuffer, IMPORT_FLAG_DEFAULT_REALM, pName);
 }
 
+/*
+ * Make a user name whose username is the given NUL-terminated string,
+ * which must come from malloc(). The name takes it over rather than
+ * copying it, and it is freed if the name cannot be made.
+ */
+OM_uint32
+gssEapAdoptUserName(OM_uint32 *minor,
+                    char *username,
+                    gss_name_t *pName)
+{
+    OM_uint32 major;
+    gss_name_t name;
+
+    major = gssEapAllocName(minor, &name);
+    if (GSS_ERROR(major)) {
+        free(username);
+        return major;
+    }
+
+    name->username.value = username;
+    name->username.length = strlen(username);
+    hashName(name);
+
+    *pName = name;
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
 static OM_uint32
 importAnonymousName(OM_uint32 *minor,
                     const gss_buffer_t nameBuffer GSSEAP_UNUSED,
@@ -206,11 +267,16 @@ importAnonymousName(OM_uint32 *minor,
         }                               \
     } while (0)
 
-OM_uint32
-gssEapImportNameInternal(OM_uint32 *minor,
-                         const gss_buffer_t nameBuffer,
-                         gss_name_t *pName,
-                         OM_uint32 flags)
+/*
+ * If shared is set, nameBuffer must lie within it, and the name points
+ * into it instead of copying from it: see gssEapImportNameShared().
+ */
+static OM_uint32
+importNameInternal(OM_uint32 *minor,
+                   struct gss_eap_shared_buffer *shared,
+                   const gss_buffer_t nameBuffer,
+                   gss_name_t *pName,
+                   OM_uint32 flags)
 {
     OM_uint32 major, tmpMinor;
     unsigned char *p;
@@ -294,9 +360,26 @@ gssEapImportNameInternal(OM_uint32 *minor,
     buf.value = p;
     UPDATE_REMAIN(len);
 
-    major = importEapNameFlags(minor, &buf, 0, &name);
-    if (GSS_ERROR(major))
-        goto cleanup;
+    if (shared != NULL) {
+        major = gssEapAllocName(minor, &name);
+        if (GSS_ERROR(major))
+            goto cleanup;
+
+        /*
+         * NAME_LEN has been read, so slide NAME down over its last byte
+         * to NUL-terminate it in place, as copied usernames are.
+         */
+        name->username.length = buf.length;
+        name->username.value = (unsigned char *)buf.value - 1;
+        memmove(name->username.value, buf.value, buf.length);
+        ((unsigned char *)name->username.value)[buf.length] = '\0';
+        name->borrowed = gssEapSharedBufferRef(shared);
+        hashName(name);
+    } else {
+        major = importEapNameFlags(minor, &buf, 0, &name);
+        if (GSS_ERROR(major))
+            goto cleanup;
+    }
 
     name->mechanismUsed = mechanismUsed;
     mechanismUsed = GSS_C_NO_OID;
@@ -308,9 +391,20 @@ gssEapImportNameInternal(OM_uint32 *minor,
         buf.length = remain;
         buf.value = p;
 
-        major = gssEapImportAttrContext(minor, &buf, name);
-        if (GSS_ERROR(major))
-            goto cleanup;
+        major = GSS_S_UNAVAILABLE;
+        if (shared != NULL && buf.length != 0) {
+            /* Parsed on first use, if at all, but checked now */
+            major = gssEapCheckAttrContext(minor, &buf);
+            if (major == GSS_S_COMPLETE)
+                name->attrSnapshot = buf;
+            else if (major != GSS_S_UNAVAILABLE)
+                goto cleanup;
+        }
+        if (major == GSS_S_UNAVAILABLE) {
+            major = gssEapImportAttrContext(minor, &buf, name);
+            if (GSS_ERROR(major))
+                goto cleanup;
+        }
     }
 #endif
 
@@ -328,6 +422,31 @@ cleanup:
     return major;
 }
 
+OM_uint32
+gssEapImportNameInternal(OM_uint32 *minor,
+                         const gss_buffer_t nameBuffer,
+                         gss_name_t *pName,
+                         OM_uint32 flags)
+{
+    return importNameInternal(minor, NULL, nameBuffer, pName, flags);
+}
+
+/*
+ * Import a name from within a shared token copy, which the name then
+ * borrows its username and any attribute context from rather than
+ * copying them. The attribute context is parsed on first use. The
+ * copy is modified.
+ */
+OM_uint32
+gssEapImportNameShared(OM_uint32 *minor,
+                       struct gss_eap_shared_buffer *shared,
+                       const gss_buffer_t nameBuffer,
+                       gss_name_t *pName,
+                       OM_uint32 flags)
+{
+    return importNameInternal(minor, shared, nameBuffer, pName, flags);
+}
+
 static OM_uint32
 importExportName(OM_uint32 *minor,
                  const gss_buffer_t nameBuffer,
@@ -542,19 +661,41 @@ gssEapCanonicalizeName(OM_uint32 *minor,
 
     name->flags = input_name->flags;
 
-    duplicateBuffer(minor, &input_name->username, &name->username);
+    if (input_name->borrowed != NULL) {
+        name->borrowed = gssEapSharedBufferRef(input_name->borrowed);
+        name->username = input_name->username;
+    } else {
+        duplicateBuffer(minor, &input_name->username, &name->username);
 
-    if (*minor != 0) {
-        major = GSS_S_FAILURE;
-        goto cleanup;
+        if (*minor != 0) {
+            major = GSS_S_FAILURE;
+            goto cleanup;
+        }
     }
 
+    name->hash = input_name->hash;
+
 #ifdef GSSEAP_ENABLE_ACCEPTOR
     if (input_name->attrCtx != NULL) {
         major = gssEapDuplicateAttrContext(minor, input_name, name);
         if (GSS_ERROR(major))
             goto cleanup;
+    } else {
+        /*
+         * Only ever set along with borrowed; stable while the caller
+         * holds the input name's mutex.
+         */
+        name->attrSnapshot = input_name->attrSnapshot;
     }
+
+    if (input_name->localName.value != NULL) {
+        major = duplicateBuffer(minor, &input_name->localName, &name->localName);
+        if (GSS_ERROR(major))
+            goto cleanup;
+    }
+
+    if (input_name->samlAttrs != NULL)
+        name->samlAttrs = gssEapSAMLAttributesRef(input_name->samlAttrs);
 #endif
 
     *dest_name = name;
@@ -622,9 +763,11 @@ gssEapCompareName(OM_uint32 *minor,
     if (name1 == GSS_C_NO_NAME && name2 == GSS_C_NO_NAME) {
         *name_equal = 1;
     } else if (name1 != GSS_C_NO_NAME && name2 != GSS_C_NO_NAME) {
-        *name_equal = (name1->username.length == name2->username.length &&
-                      strncmp(name1->username.value, name2->username.value,
-                              name1->username.length) == 0 ) ? 1 : 0;
+        /* The hashes differ for nearly all unequal names */
+        *name_equal = (name1->hash == name2->hash &&
+                      name1->username.length == name2->username.length &&
+                      memcmp(name1->username.value, name2->username.value,
+                             name1->username.length) == 0 ) ? 1 : 0;
     }
 
     return GSS_S_COMPLETE;
@@ -110,6 +110,7 @@ gss_eap_shib_attr_provider::initWithExistingContext(const gss_eap_attr_ctx *mana
     if (shib != NULL) {
         m_attributes = duplicateAttributes(shib->getAttributes());
         m_authenticated = shib->authenticated();
+        indexAttributes();
     }
 
     m_initialized = true;
@@ -191,34 +192,50 @@ gss_eap_shib_attr_provider::initWithGssContext(const gss_eap_attr_ctx *manager,
         return false;
     }
 
+    indexAttributes();
+
     m_authenticated = true;
     m_initialized = true;
 
     return true;
 }
 
-ssize_t
-gss_eap_shib_attr_provider::getAttributeIndex(const gss_buffer_t attr) const
+/*
+ * Rebuild m_index; needed whenever m_attributes changes, as its keys
+ * point into the attributes' aliases.
+ */
+void
+gss_eap_shib_attr_provider::indexAttributes(void)
 {
-    int i = 0;
+    m_index.clear();
 
-    GSSEAP_ASSERT(m_initialized);
+    for (size_t i = 0; i < m_attributes.size(); i++) {
+        const vector<string> &aliases = m_attributes[i]->getAliases();
 
-    for (vector<Attribute *>::const_iterator a = m_attributes.begin();
-         a != m_attributes.end();
-         ++a)
-    {
-        for (vector<string>::const_iterator s = (*a)->getAliases().begin();
-             s != (*a)->getAliases().end();
+        /*
+         * Fill in the lazily serialised values now, so that readers of
+         * a context shared between duplicated names never write to it.
+         */
+        m_attributes[i]->getSerializedValues();
+
+        for (vector<string>::const_iterator s = aliases.begin();
+             s != aliases.end();
              ++s) {
-            if (attr->length == (*s).length() &&
-                memcmp((*s).c_str(), attr->value, attr->length) == 0) {
-                return i;
-            }
+            /* The first attribute with an alias wins */
+            m_index.insert(make_pair(gss_eap_string_key(s->data(), s->length()), i));
         }
     }
+}
 
-    return -1;
+ssize_t
+gss_eap_shib_attr_provider::getAttributeIndex(const gss_buffer_t attr) const
+{
+    GSSEAP_ASSERT(m_initialized);
+
+    gss_eap_string_map<size_t>::const_iterator i =
+        m_index.find(gss_eap_string_key((const char *)attr->value, attr->length));
+
+    return i != m_index.end() ? (ssize_t)i->second : -1;
 }
 
 bool
@@ -244,6 +261,7 @@ gss_eap_shib_attr_provider::setAttribute(int complete GSSEAP_UNUSED,
 
 #ifdef MECH_EAP
     m_attributes.push_back(a);
+    indexAttributes();
 #endif
     m_authenticated = false;
 
@@ -258,8 +276,11 @@ gss_eap_shib_attr_provider::deleteAttribute(const gss_buffer_t attr)
     GSSEAP_ASSERT(m_initialized);
 
     i = getAttributeIndex(attr);
-    if (i >= 0)
+    if (i >= 0) {
+        delete m_attributes[i];
         m_attributes.erase(m_attributes.begin() + i);
+        indexAttributes();
+    }
 
     m_authenticated = false;
 
@@ -291,28 +312,13 @@ gss_eap_shib_attr_provider::getAttributeTypes(gss_eap_attr_enumeration_cb addAtt
 const Attribute *
 gss_eap_shib_attr_provider::getAttribute(const gss_buffer_t attr) const
 {
-    const Attribute *ret = NULL;
+    ssize_t i;
 
     GSSEAP_ASSERT(m_initialized);
 
-    for (vector<Attribute *>::const_iterator a = m_attributes.begin();
-         a != m_attributes.end();
-         ++a)
-    {
-        for (vector<string>::const_iterator s = (*a)->getAliases().begin();
-             s != (*a)->getAliases().end();
-             ++s) {
-            if (attr->length == (*s).length() &&
-                memcmp((*s).c_str(), attr->value, attr->length) == 0) {
-                ret = *a;
-                break;
-            }
-        }
-        if (ret != NULL)
-            break;
-    }
+    i = getAttributeIndex(attr);
 
-    return ret;
+    return i >= 0 ? m_attributes[i] : NULL;
 }
 
 bool
@@ -349,13 +355,14 @@ gss_eap_shib_attr_provider::getAttribute(const gss_buffer_t attr,
 #ifdef MECH_EAP
     binaryAttr = dynamic_cast<const BinaryAttribute *>(shibAttr);
     if (binaryAttr != NULL) {
-        std::string str = binaryAttr->getValues()[*more];
+        const std::string &str = binaryAttr->getValues()[*more];
 
         valueBuf.value = (void *)str.data();
         valueBuf.length = str.size();
     } else {
 #endif
-        std::string str = shibAttr->getSerializedValues()[*more];
+        /* Serialized once by shibsp and kept with the attribute */
+        const std::string &str = shibAttr->getSerializedValues()[*more];
 
         valueBuf.value = (void *)str.c_str();
         valueBuf.length = str.length();
@@ -470,6 +477,8 @@ gss_eap_shib_attr_provider::initWithJsonObject(const gss_eap_attr_ctx *ctx,
         m_attributes.push_back(attribute);
     }
 
+    indexAttributes();
+
     m_authenticated = obj["authenticated"].integer();
     m_initialized = true;
 
@@ -477,6 +486,183 @@ gss_eap_shib_attr_provider::initWithJsonObject(const gss_eap_attr_ctx *ctx,
 }
 #endif
 
+/*
+ * Binary form of the DDF trees that Attribute::marshall() produces:
+ * name, tag, then the value, or a count and the children.
+ */
+#define DDF_TAG_EMPTY       0
+#define DDF_TAG_STRING      1
+#define DDF_TAG_INTEGER     2
+#define DDF_TAG_FLOAT       3
+#define DDF_TAG_STRUCT      4
+#define DDF_TAG_LIST        5
+
+#define DDF_MAX_DEPTH       16
+
+static void
+writeDDF(gss_eap_attr_writer &writer, DDF &ddf)
+{
+    writer.putName(ddf.name());
+
+    if (ddf.isstring()) {
+        writer.putUint8(DDF_TAG_STRING);
+        writer.putString(ddf.string() ? ddf.string() : "");
+    } else if (ddf.isint()) {
+        writer.putUint8(DDF_TAG_INTEGER);
+        writer.putUint64((uint64_t)ddf.integer());
+    } else if (ddf.isfloat()) {
+        double d = ddf.floating();
+        uint64_t bits;
+
+        memcpy(&bits, &d, sizeof(bits));
+        writer.putUint8(DDF_TAG_FLOAT);
+        writer.putUint64(bits);
+    } else if (ddf.isstruct() || ddf.islist()) {
+        size_t countOffset;
+        uint32_t count = 0;
+
+        writer.putUint8(ddf.isstruct() ? DDF_TAG_STRUCT : DDF_TAG_LIST);
+        countOffset = writer.reserveUint32();
+
+        for (DDF elem = ddf.first(); !elem.isnull(); elem = ddf.next()) {
+            writeDDF(writer, elem);
+            count++;
+        }
+
+        writer.patchUint32(countOffset, count);
+    } else {
+        writer.putUint8(DDF_TAG_EMPTY);
+    }
+}
+
+/* On failure, ddf may be partially built and must still be destroyed */
+static bool
+readDDF(gss_eap_attr_reader &reader, DDF &ddf, unsigned int depth)
+{
+    const char *name, *s;
+    unsigned char tag;
+    uint64_t value;
+    uint32_t count;
+    size_t length;
+    double d;
+
+    if (depth > DDF_MAX_DEPTH ||
+        !reader.getName(&name) || !reader.getUint8(&tag))
+        return false;
+
+    ddf = DDF(name);
+
+    switch (tag) {
+    case DDF_TAG_EMPTY:
+        break;
+    case DDF_TAG_STRING:
+        if (!reader.getString(&s, &length))
+            return false;
+        ddf.string(s);
+        break;
+    case DDF_TAG_INTEGER:
+        if (!reader.getUint64(&value))
+            return false;
+        ddf.integer((long)value);
+        break;
+    case DDF_TAG_FLOAT:
+        if (!reader.getUint64(&value))
+            return false;
+        memcpy(&d, &value, sizeof(d));
+        ddf.floating(d);
+        break;
+    case DDF_TAG_STRUCT:
+    case DDF_TAG_LIST:
+        if (!reader.getUint32(&count))
+            return false;
+        if (tag == DDF_TAG_STRUCT)
+            ddf.structure();
+        else
+            ddf.list();
+        for (uint32_t i = 0; i < count; i++) {
+            DDF elem;
+
+            if (!readDDF(reader, elem, depth + 1)) {
+                elem.destroy();
+                return false;
+            }
+            ddf.add(elem);
+        }
+        break;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+bool
+gss_eap_shib_attr_provider::binaryRepresentation(gss_eap_attr_writer &writer) const
+{
+    if (m_initialized == false)
+        return false; /* don't export incomplete context */
+
+    writer.putUint8(m_authenticated);
+    writer.putUint32(m_attributes.size());
+
+    for (vector<Attribute*>::const_iterator a = m_attributes.begin();
+         a != m_attributes.end(); ++a) {
+        DDF attr = (*a)->marshall();
+
+        try {
+            writeDDF(writer, attr);
+        } catch (exception &e) {
+            attr.destroy();
+            throw;
+        }
+        attr.destroy();
+    }
+
+    return true;
+}
+
+bool
+gss_eap_shib_attr_provider::initWithBinary(const gss_eap_attr_ctx *ctx,
+                                           gss_eap_attr_reader &reader)
+{
+    unsigned char authenticated;
+    uint32_t count;
+
+    if (!gss_eap_attr_provider::initWithBinary(ctx, reader))
+        return false;
+
+    GSSEAP_ASSERT(m_authenticated == false);
+    GSSEAP_ASSERT(m_attributes.size() == 0);
+
+    if (!reader.getUint8(&authenticated) || !reader.getUint32(&count))
+        return false;
+
+    for (uint32_t i = 0; i < count; i++) {
+        DDF attr;
+        Attribute *attribute = NULL;
+
+        if (readDDF(reader, attr, 0)) {
+            try {
+                attribute = Attribute::unmarshall(attr);
+            } catch (exception &e) {
+            }
+        }
+        attr.destroy();
+
+        if (attribute == NULL)
+            return false;
+
+        m_attributes.push_back(attribute);
+    }
+
+    indexAttributes();
+
+    m_authenticated = authenticated;
+    m_initialized = true;
+
+    return true;
+}
+
 bool
 gss_eap_shib_attr_provider::init(void)
 {
@@ -41,6 +41,8 @@
 
 #include <vector>
 
+#include "util_strmap.h"
+
 namespace shibsp {
     class Attribute;
 };
@@ -83,6 +85,9 @@ public:
                             JSONObject &obj);
     JSONObject jsonRepresentation(void) const;
 #endif
+    bool initWithBinary(const gss_eap_attr_ctx *manager,
+                        gss_eap_attr_reader &reader);
+    bool binaryRepresentation(gss_eap_attr_writer &writer) const;
 
     static bool init(void);
     static void finalize(void);
@@ -101,6 +106,7 @@ private:
     static std::vector <shibsp::Attribute *>
         duplicateAttributes(const std::vector <shibsp::Attribute *>src);
 
+    void indexAttributes(void);
     ssize_t getAttributeIndex(const gss_buffer_t attr) const;
     const shibsp::Attribute *getAttribute(const gss_buffer_t attr) const;
 
@@ -109,6 +115,8 @@ private:
     bool m_initialized;
     bool m_authenticated;
     std::vector<shibsp::Attribute *> m_attributes;
+    /* alias to index of first attribute in m_attributes with it */
+    gss_eap_string_map<size_t> m_index;
 };
 
 extern "C" {
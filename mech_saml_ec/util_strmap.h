@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Hash maps keyed by borrowed strings, so that lookups by a C string or
+ * gss_buffer_t do not have to build a std::string first. Keys point
+ * into storage owned by someone else (typically the attribute whose
+ * name they are), so a map must be cleared before that storage goes.
+ */
+
+#ifndef _UTIL_STRMAP_H_
+#define _UTIL_STRMAP_H_ 1
+
+#include <stddef.h>
+
+/*
+ * FNV-1a, a byte at a time for callers that hash while scanning. Its
+ * low 32 bits are 32-bit FNV-1a whatever the width of size_t.
+ */
+#define GSSEAP_STRING_HASH_INIT     2166136261U
+
+static inline size_t
+gssEapStringHashStep(size_t h, unsigned char c)
+{
+    return (h ^ c) * 16777619U;
+}
+
+#ifdef __cplusplus
+
+#include <cstring>
+#include <unordered_map>
+
+struct gss_eap_string_key {
+    const char *data;
+    size_t length;
+
+    gss_eap_string_key(const char *s, size_t len) : data(s), length(len) {}
+    explicit gss_eap_string_key(const char *s) : data(s), length(strlen(s)) {}
+
+    bool operator==(const gss_eap_string_key &other) const {
+        return length == other.length &&
+               memcmp(data, other.data, length) == 0;
+    }
+};
+
+struct gss_eap_string_key_hash {
+    size_t operator()(const gss_eap_string_key &key) const {
+        size_t h = GSSEAP_STRING_HASH_INIT;
+
+        for (size_t i = 0; i < key.length; i++)
+            h = gssEapStringHashStep(h, key.data[i]);
+
+        return h;
+    }
+};
+
+template <typename T>
+using gss_eap_string_map =
+    std::unordered_map<gss_eap_string_key, T, gss_eap_string_key_hash>;
+
+#endif /* __cplusplus */
+
+#endif /* _UTIL_STRMAP_H_ */
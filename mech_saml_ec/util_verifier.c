@@ -0,0 +1,968 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Client side of the saml_verifierd protocol, and the message framing
+ * it shares with the daemon. See util_verifier.h for the wire format.
+ *
+ * All threads of a process share one connection. A caller writes its
+ * request under the mutex and then either waits for its reply or, if
+ * no other thread is doing so, reads replies off the socket and hands
+ * them to their callers until its own arrives. Requests from many
+ * threads are therefore pipelined rather than serialised.
+ */
+
+#include "gssapiP_eap.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL                    0
+#endif
+
+#ifndef WIN32
+static OM_uint32
+writeAll(OM_uint32 *minor, int fd, const unsigned char *p, size_t length)
+{
+    ssize_t n;
+
+    while (length != 0) {
+        n = send(fd, p, length, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            *minor = errno;
+            return GSS_S_FAILURE;
+        }
+        p += n;
+        length -= n;
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+static OM_uint32
+readAll(OM_uint32 *minor, int fd, unsigned char *p, size_t length)
+{
+    ssize_t n;
+
+    while (length != 0) {
+        n = read(fd, p, length);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            *minor = errno;
+            return GSS_S_FAILURE;
+        } else if (n == 0) {
+            *minor = GSSEAP_TOK_TRUNC;
+            return GSS_S_FAILURE;
+        }
+        p += n;
+        length -= n;
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+OM_uint32
+gssEapVerifierWriteMsg(OM_uint32 *minor,
+                       int fd,
+                       const struct gss_eap_verifier_msg *msg)
+{
+    OM_uint32 major;
+    size_t length = VERIFIER_HEADER_LENGTH;
+    unsigned char *buf, *p;
+    uint16_t i;
+
+    for (i = 0; i < msg->count; i++) {
+        length += 4;
+        if (msg->fields[i].value != NULL)
+            length += msg->fields[i].length;
+    }
+
+    if (length > VERIFIER_MAX_MESSAGE) {
+        *minor = GSSEAP_WRONG_SIZE;
+        return GSS_S_FAILURE;
+    }
+
+    buf = GSSEAP_MALLOC(length);
+    if (buf == NULL) {
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+
+    p = buf;
+    store_uint32_be(length - VERIFIER_HEADER_LENGTH, p);
+    store_uint32_be(msg->id, p + 4);
+    p[8] = msg->op;
+    p[9] = msg->arg;
+    store_uint16_be(msg->count, p + 10);
+    p += VERIFIER_HEADER_LENGTH;
+
+    for (i = 0; i < msg->count; i++) {
+        if (msg->fields[i].value == NULL) {
+            store_uint32_be(VERIFIER_FIELD_NULL, p);
+            p += 4;
+        } else {
+            store_uint32_be(msg->fields[i].length, p);
+            memcpy(p + 4, msg->fields[i].value, msg->fields[i].length);
+            p += 4 + msg->fields[i].length;
+        }
+    }
+
+    major = writeAll(minor, fd, buf, length);
+
+    GSSEAP_FREE(buf);
+
+    return major;
+}
+
+/*
+ * Fields point into msg->data, which is NUL-terminated after each
+ * field so that they can be used as C strings.
+ */
+OM_uint32
+gssEapVerifierReadMsg(OM_uint32 *minor,
+                      int fd,
+                      struct gss_eap_verifier_msg *msg)
+{
+    OM_uint32 major;
+    unsigned char header[VERIFIER_HEADER_LENGTH];
+    uint32_t length, fieldLength;
+    unsigned char *p;
+    uint16_t i;
+
+    memset(msg, 0, sizeof(*msg));
+
+    major = readAll(minor, fd, header, sizeof(header));
+    if (GSS_ERROR(major))
+        return major;
+
+    length = load_uint32_be(header);
+    msg->id = load_uint32_be(header + 4);
+    msg->op = header[8];
+    msg->arg = header[9];
+    msg->count = load_uint16_be(header + 10);
+
+    if (length > VERIFIER_MAX_MESSAGE - VERIFIER_HEADER_LENGTH ||
+        length < 4 * (uint32_t)msg->count) {
+        *minor = GSSEAP_BAD_TOK_HEADER;
+        return GSS_S_DEFECTIVE_TOKEN;
+    }
+
+    /* Each 4-byte length prefix leaves room for the previous NUL */
+    msg->data = GSSEAP_MALLOC(length + 1);
+    msg->fields = GSSEAP_CALLOC(msg->count ? msg->count : 1,
+                                sizeof(*msg->fields));
+    if (msg->data == NULL || msg->fields == NULL) {
+        gssEapVerifierReleaseMsg(msg);
+        *minor = ENOMEM;
+        return GSS_S_FAILURE;
+    }
+
+    major = readAll(minor, fd, msg->data, length);
+    if (GSS_ERROR(major)) {
+        gssEapVerifierReleaseMsg(msg);
+        return major;
+    }
+
+    p = msg->data;
+    for (i = 0; i < msg->count; i++) {
+        if (length < 4)
+            goto defective;
+        fieldLength = load_uint32_be(p);
+        p[0] = '\0';
+        p += 4;
+        length -= 4;
+
+        if (fieldLength == VERIFIER_FIELD_NULL)
+            continue;
+        if (fieldLength > length)
+            goto defective;
+
+        msg->fields[i].value = (char *)p;
+        msg->fields[i].length = fieldLength;
+        p += fieldLength;
+        length -= fieldLength;
+    }
+
+    if (length != 0)
+        goto defective;
+    *p = '\0';
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+
+defective:
+    gssEapVerifierReleaseMsg(msg);
+    *minor = GSSEAP_BAD_TOK_HEADER;
+    return GSS_S_DEFECTIVE_TOKEN;
+}
+#endif /* !WIN32 */
+
+void
+gssEapVerifierReleaseMsg(struct gss_eap_verifier_msg *msg)
+{
+    GSSEAP_FREE(msg->fields);
+    GSSEAP_FREE(msg->data);
+    msg->fields = NULL;
+    msg->data = NULL;
+    msg->count = 0;
+}
+
+#ifndef WIN32
+int
+gssEapVerifierParseUid(const char *s, uid_t *uid)
+{
+    unsigned long value;
+    char *end;
+
+    if (s == NULL || *s < '0' || *s > '9')
+        return 0;
+
+    errno = 0;
+    value = strtoul(s, &end, 10);
+    if (errno != 0 || *end != '\0' ||
+        (unsigned long)(uid_t)value != value || (uid_t)value == (uid_t)-1)
+        return 0;
+
+    *uid = (uid_t)value;
+    return 1;
+}
+
+OM_uint32
+gssEapVerifierCheckPeer(OM_uint32 *minor, int fd, uid_t uid)
+{
+    uid_t peer;
+#if defined(SO_PEERCRED) && defined(__linux__)
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0) {
+        *minor = errno;
+        return GSS_S_FAILURE;
+    }
+    peer = cred.uid;
+#else
+    gid_t gid;
+
+    if (getpeereid(fd, &peer, &gid) != 0) {
+        *minor = errno;
+        return GSS_S_FAILURE;
+    }
+#endif
+
+    if (peer != uid) {
+        *minor = EACCES;
+        return GSS_S_FAILURE;
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+struct verifier_call {
+    uint32_t id;
+    int done;
+    OM_uint32 major;
+    OM_uint32 minor;
+    struct gss_eap_verifier_msg reply;
+    struct verifier_call *next;
+};
+
+static struct {
+    GSSEAP_MUTEX mutex;
+    pthread_cond_t cond;
+    const char *path;
+    uid_t uid;                          /* the daemon must run as */
+    int timeout;                        /* seconds per call */
+    int fd;
+    int reading;                        /* a caller is reading replies */
+    int readFd;                         /* off this fd, which it closes
+                                           if disconnected meanwhile */
+    uint32_t nextId;
+    struct verifier_call *calls;        /* awaiting replies */
+} verifier;
+
+static GSSEAP_THREAD_ONCE verifierOnce = GSSEAP_ONCE_INITIALIZER;
+
+/*
+ * Frames in flight belong to the parent; the child opens its own
+ * connection.
+ */
+static void
+verifierAtForkChild(void)
+{
+    GSSEAP_MUTEX_INIT(&verifier.mutex);
+    pthread_cond_init(&verifier.cond, NULL);
+    if (verifier.fd != -1)
+        close(verifier.fd);
+    verifier.fd = -1;
+    verifier.reading = 0;
+    verifier.calls = NULL;
+}
+
+static GSSEAP_ONCE_CALLBACK(initVerifier)
+{
+    const char *s;
+
+    GSSEAP_MUTEX_INIT(&verifier.mutex);
+    pthread_cond_init(&verifier.cond, NULL);
+    verifier.fd = -1;
+
+    s = getenv(SAML_EC_VERIFIER_SOCKET);
+    if (s != NULL && *s != '\0') {
+        verifier.path = s;
+        pthread_atfork(NULL, NULL, verifierAtForkChild);
+    }
+
+    verifier.uid = geteuid();
+    s = getenv(SAML_EC_VERIFIER_UID);
+    if (s != NULL && !gssEapVerifierParseUid(s, &verifier.uid)) {
+        /* No peer can run as this, so nothing is trusted */
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Invalid %s \"%s\"",
+                   SAML_EC_VERIFIER_UID, s);
+        verifier.uid = (uid_t)-1;
+    }
+
+    verifier.timeout = VERIFIER_DEFAULT_TIMEOUT;
+    s = getenv(SAML_EC_VERIFIER_TIMEOUT);
+    if (s != NULL) {
+        char *end;
+        long timeout;
+
+        errno = 0;
+        timeout = strtol(s, &end, 10);
+        if (errno != 0 || end == s || *end != '\0' ||
+            timeout <= 0 || timeout > 3600)
+            GSSEAP_LOG(GSSEAP_LOG_WARNING, "Ignoring invalid %s \"%s\"",
+                       SAML_EC_VERIFIER_TIMEOUT, s);
+        else
+            verifier.timeout = (int)timeout;
+    }
+
+    GSSEAP_ONCE_LEAVE;
+}
+
+int
+gssEapVerifierEnabled(void)
+{
+    GSSEAP_ONCE(&verifierOnce, initVerifier);
+
+    return verifier.path != NULL;
+}
+
+/* Called with the mutex held */
+static OM_uint32
+verifierConnect(OM_uint32 *minor)
+{
+    struct sockaddr_un sun;
+    struct timeval tv;
+    int fd;
+
+    if (verifier.fd != -1)
+        return GSS_S_COMPLETE;
+
+    if (strlen(verifier.path) >= sizeof(sun.sun_path)) {
+        *minor = ENAMETOOLONG;
+        return GSS_S_FAILURE;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, verifier.path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        *minor = errno;
+        return GSS_S_FAILURE;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0) {
+        *minor = errno;
+        close(fd);
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Unable to connect to SAML verifier at %s: %s",
+                   verifier.path, strerror(*minor));
+        return GSS_S_FAILURE;
+    }
+
+    /* Whoever answers decides who authenticated, so it must be ours */
+    if (GSS_ERROR(gssEapVerifierCheckPeer(minor, fd, verifier.uid))) {
+        GSSEAP_LOG(GSSEAP_LOG_ERROR, "Refusing SAML verifier at %s: %s",
+                   verifier.path, strerror(*minor));
+        close(fd);
+        return GSS_S_FAILURE;
+    }
+
+    /* Bounds a message stalled part way; see verifierCall() for calls */
+    tv.tv_sec = verifier.timeout;
+    tv.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    verifier.fd = fd;
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+/*
+ * Called with the mutex held. Fails every call in flight, as replies
+ * can no longer be matched to them.
+ */
+static void
+verifierDisconnect(OM_uint32 minor)
+{
+    struct verifier_call *call;
+
+    if (verifier.fd != -1) {
+        /*
+         * Wake any reader blocked on it, but leave closing it to that
+         * reader, lest the number be reused while it is in read().
+         */
+        shutdown(verifier.fd, SHUT_RDWR);
+        if (!verifier.reading || verifier.readFd != verifier.fd)
+            close(verifier.fd);
+        verifier.fd = -1;
+    }
+
+    for (call = verifier.calls; call != NULL; call = call->next) {
+        if (!call->done) {
+            call->done = 1;
+            call->major = GSS_S_FAILURE;
+            call->minor = minor;
+        }
+    }
+}
+
+static void
+verifierRemoveCall(struct verifier_call *call)
+{
+    struct verifier_call **p;
+
+    for (p = &verifier.calls; *p != NULL; p = &(*p)->next) {
+        if (*p == call) {
+            *p = call->next;
+            break;
+        }
+    }
+}
+
+/* Called with the mutex held */
+static void
+verifierTimeout(struct verifier_call *call)
+{
+    GSSEAP_LOG(GSSEAP_LOG_WARNING, "SAML verifier call %u timed out",
+               call->id);
+    call->done = 1;
+    call->major = GSS_S_FAILURE;
+    call->minor = ETIMEDOUT;
+}
+
+/* Milliseconds until deadline, at least 0 */
+static int
+verifierRemaining(const struct timespec *deadline)
+{
+    struct timespec now;
+    long long ms;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    ms = (long long)(deadline->tv_sec - now.tv_sec) * 1000 +
+         (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+    return ms > 0 ? (int)ms : 0;
+}
+
+/*
+ * Send a request and wait for the reply with the same id, reading
+ * replies for other callers meanwhile if nobody else is. Gives up
+ * after the configured timeout; a reply that arrives later is
+ * discarded.
+ */
+static OM_uint32
+verifierCall(OM_uint32 *minor,
+             struct gss_eap_verifier_msg *request,
+             struct gss_eap_verifier_msg *reply)
+{
+    OM_uint32 major, tmpMinor;
+    struct verifier_call call, *p;
+    struct gss_eap_verifier_msg msg;
+    struct timespec deadline;
+    struct pollfd pfd;
+    int fd, n;
+
+    memset(&call, 0, sizeof(call));
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += verifier.timeout;
+
+    GSSEAP_MUTEX_LOCK(&verifier.mutex);
+
+    major = verifierConnect(minor);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    call.id = request->id = ++verifier.nextId;
+
+    major = gssEapVerifierWriteMsg(minor, verifier.fd, request);
+    if (GSS_ERROR(major)) {
+        verifierDisconnect(*minor);
+        goto cleanup;
+    }
+
+    call.next = verifier.calls;
+    verifier.calls = &call;
+
+    while (!call.done) {
+        if (verifier.reading) {
+            if (pthread_cond_timedwait(&verifier.cond, &verifier.mutex,
+                                       &deadline) == ETIMEDOUT &&
+                !call.done)
+                verifierTimeout(&call);
+            continue;
+        }
+
+        if (verifier.fd == -1) {
+            /* verifierDisconnect() has failed the call already */
+            GSSEAP_ASSERT(call.done);
+            break;
+        }
+
+        verifier.reading = 1;
+        verifier.readFd = fd = verifier.fd;
+        GSSEAP_MUTEX_UNLOCK(&verifier.mutex);
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        do {
+            n = poll(&pfd, 1, verifierRemaining(&deadline));
+        } while (n < 0 && errno == EINTR);
+
+        if (n > 0)
+            major = gssEapVerifierReadMsg(&tmpMinor, fd, &msg);
+        else if (n < 0)
+            tmpMinor = errno;
+
+        GSSEAP_MUTEX_LOCK(&verifier.mutex);
+        verifier.reading = 0;
+
+        if (fd != verifier.fd) {
+            /* Disconnected while we read; see verifierDisconnect() */
+            close(fd);
+            if (n > 0 && !GSS_ERROR(major))
+                gssEapVerifierReleaseMsg(&msg);
+        } else if (n == 0) {
+            if (!call.done)
+                verifierTimeout(&call);
+        } else if (n < 0 || GSS_ERROR(major)) {
+            GSSEAP_LOG(GSSEAP_LOG_ERROR, "Lost connection to SAML verifier (%u)",
+                       tmpMinor);
+            verifierDisconnect(tmpMinor);
+        } else {
+            for (p = verifier.calls; p != NULL; p = p->next) {
+                if (p->id == msg.id && !p->done)
+                    break;
+            }
+            if (p != NULL) {
+                p->reply = msg;
+                p->major = GSS_S_COMPLETE;
+                p->done = 1;
+            } else {
+                GSSEAP_LOG(GSSEAP_LOG_WARNING, "Discarding SAML verifier reply %u",
+                           msg.id);
+                gssEapVerifierReleaseMsg(&msg);
+            }
+        }
+
+        pthread_cond_broadcast(&verifier.cond);
+    }
+
+    verifierRemoveCall(&call);
+
+    major = call.major;
+    *minor = call.minor;
+    if (!GSS_ERROR(major)) {
+        if (call.reply.op != request->op) {
+            gssEapVerifierReleaseMsg(&call.reply);
+            major = GSS_S_FAILURE;
+            *minor = GSSEAP_WRONG_TOK_ID;
+        } else {
+            *reply = call.reply;
+        }
+    }
+
+cleanup:
+    GSSEAP_MUTEX_UNLOCK(&verifier.mutex);
+
+    return major;
+}
+
+/* Copy with malloc(), to be released with free() like the SP's strings */
+static char *
+copyField(const struct gss_eap_verifier_msg *msg, uint16_t i)
+{
+    char *s;
+
+    if (i >= msg->count || msg->fields[i].value == NULL)
+        return NULL;
+
+    s = malloc(msg->fields[i].length + 1);
+    if (s != NULL) {
+        memcpy(s, msg->fields[i].value, msg->fields[i].length);
+        s[msg->fields[i].length] = '\0';
+    }
+
+    return s;
+}
+
+/*
+ * A decimal epoch field, parsed where it lies in the reply; 0, meaning
+ * none, if absent, malformed or out of range
+ */
+static time_t
+epochField(const struct gss_eap_verifier_msg *msg, uint16_t i)
+{
+    const unsigned char *p;
+    size_t n;
+    long long value = 0;
+
+    if (i >= msg->count || msg->fields[i].value == NULL ||
+        msg->fields[i].length == 0)
+        return 0;
+
+    p = (const unsigned char *)msg->fields[i].value;
+
+    for (n = 0; n < msg->fields[i].length; n++) {
+        if (p[n] < '0' || p[n] > '9' ||
+            value > (LLONG_MAX - (p[n] - '0')) / 10)
+            return 0;
+        value = value * 10 + (p[n] - '0');
+    }
+
+    if ((long long)(time_t)value != value)
+        return 0;
+
+    return (time_t)value;
+}
+#else
+int
+gssEapVerifierEnabled(void)
+{
+    return 0;
+}
+
+static OM_uint32
+verifierCall(OM_uint32 *minor,
+             struct gss_eap_verifier_msg *request GSSEAP_UNUSED,
+             struct gss_eap_verifier_msg *reply GSSEAP_UNUSED)
+{
+    *minor = ENOTSUP;
+    return GSS_S_UNAVAILABLE;
+}
+
+static char *
+copyField(const struct gss_eap_verifier_msg *msg GSSEAP_UNUSED,
+          uint16_t i GSSEAP_UNUSED)
+{
+    return NULL;
+}
+
+static time_t
+epochField(const struct gss_eap_verifier_msg *msg GSSEAP_UNUSED,
+           uint16_t i GSSEAP_UNUSED)
+{
+    return 0;
+}
+#endif /* !WIN32 */
+
+char *
+gssEapSAMLRequest(char *name, int name_len, int signatureRequested,
+                  int delegRequested, char *channelBindings)
+{
+    OM_uint32 major, minor;
+    struct gss_eap_verifier_field fields[2];
+    struct gss_eap_verifier_msg request, reply;
+    uint64_t metricsStart;
+    char *samlRequest = NULL;
+
+    if (!gssEapVerifierEnabled())
+        return getSAMLRequest2(name, name_len, signatureRequested,
+                               delegRequested, channelBindings);
+
+    metricsStart = gssEapMetricsStart();
+
+    fields[0].value = name;
+    fields[0].length = name != NULL ? name_len : 0;
+    fields[1].value = channelBindings;
+    fields[1].length = channelBindings != NULL ? strlen(channelBindings) : 0;
+
+    memset(&request, 0, sizeof(request));
+    request.op = VERIFIER_OP_SAML_REQUEST;
+    if (signatureRequested)
+        request.arg |= VERIFIER_FLAG_SIGNATURE;
+    if (delegRequested)
+        request.arg |= VERIFIER_FLAG_DELEGATION;
+    request.count = 2;
+    request.fields = fields;
+
+    major = verifierCall(&minor, &request, &reply);
+    gssEapMetricsSpan(GSSEAP_METRIC_SAML_REQUEST, metricsStart);
+    if (GSS_ERROR(major))
+        return NULL;
+
+    if (reply.arg)
+        samlRequest = copyField(&reply, 0);
+
+    gssEapVerifierReleaseMsg(&reply);
+
+    return samlRequest;
+}
+
+/*
+ * What one verification released, from the in-process SP or from
+ * saml_verifierd's reply. Duplicated names share it; the mutex
+ * serializes the SP's resolution on first use.
+ */
+struct gss_eap_saml_attr_ctx {
+    GSSEAP_MUTEX mutex;
+    unsigned int refs;
+    struct gss_eap_saml_attrs *local;
+    struct gss_eap_verifier_msg reply;
+};
+
+static struct gss_eap_saml_attr_ctx *
+allocSAMLAttributes(void)
+{
+    struct gss_eap_saml_attr_ctx *attributes;
+
+    attributes = GSSEAP_CALLOC(1, sizeof(*attributes));
+    if (attributes == NULL)
+        return NULL;
+
+    if (GSSEAP_MUTEX_INIT(&attributes->mutex) != 0) {
+        GSSEAP_FREE(attributes);
+        return NULL;
+    }
+
+    attributes->refs = 1;
+
+    return attributes;
+}
+
+struct gss_eap_saml_attr_ctx *
+gssEapSAMLAttributesRef(struct gss_eap_saml_attr_ctx *attributes)
+{
+    GSSEAP_MUTEX_LOCK(&attributes->mutex);
+    attributes->refs++;
+    GSSEAP_MUTEX_UNLOCK(&attributes->mutex);
+
+    return attributes;
+}
+
+void
+gssEapSAMLReleaseAttributes(struct gss_eap_saml_attr_ctx **pAttributes)
+{
+    struct gss_eap_saml_attr_ctx *attributes = *pAttributes;
+    unsigned int refs;
+
+    if (attributes == NULL)
+        return;
+
+    GSSEAP_MUTEX_LOCK(&attributes->mutex);
+    refs = --attributes->refs;
+    GSSEAP_MUTEX_UNLOCK(&attributes->mutex);
+
+    if (refs == 0) {
+        if (attributes->local != NULL)
+            releaseSAMLAttributes(attributes->local);
+        gssEapVerifierReleaseMsg(&attributes->reply);
+        GSSEAP_MUTEX_DESTROY(&attributes->mutex);
+        GSSEAP_FREE(attributes);
+    }
+
+    *pAttributes = NULL;
+}
+
+int
+gssEapSAMLVerify(const char *saml, int len, char **initiatorName,
+                 time_t *sessionExpiry, char **generatedKey,
+                 char **delegatedAssertions,
+                 struct gss_eap_saml_attr_ctx **attributes)
+{
+    OM_uint32 major, minor;
+    struct gss_eap_verifier_field field;
+    struct gss_eap_verifier_msg request, reply;
+    struct gss_eap_saml_attrs *local = NULL;
+    uint64_t metricsStart;
+    int result;
+
+    *attributes = NULL;
+
+    if (!gssEapVerifierEnabled()) {
+        result = verifySAMLResponse(saml, len, initiatorName, sessionExpiry,
+                                    generatedKey, delegatedAssertions,
+                                    &local);
+        if (local != NULL) {
+            *attributes = allocSAMLAttributes();
+            if (*attributes == NULL) {
+                releaseSAMLAttributes(local);
+                return 0;
+            }
+            (*attributes)->local = local;
+        }
+        return result;
+    }
+
+    metricsStart = gssEapMetricsStart();
+
+    field.value = saml;
+    field.length = len;
+
+    memset(&request, 0, sizeof(request));
+    request.op = VERIFIER_OP_VERIFY_RESPONSE;
+    request.count = 1;
+    request.fields = &field;
+
+    major = verifierCall(&minor, &request, &reply);
+    gssEapMetricsSpan(GSSEAP_METRIC_VERIFY_RESPONSE, metricsStart);
+    if (GSS_ERROR(major))
+        return 0;
+
+    *initiatorName       = copyField(&reply, 0);
+    *sessionExpiry       = epochField(&reply, 1);
+    *generatedKey        = copyField(&reply, 2);
+    *delegatedAssertions = copyField(&reply, 3);
+
+    result = reply.arg;
+
+    if (result) {
+        *attributes = allocSAMLAttributes();
+        if (*attributes == NULL)
+            result = 0;
+    }
+    if (*attributes != NULL)
+        (*attributes)->reply = reply;
+    else
+        gssEapVerifierReleaseMsg(&reply);
+
+    return result;
+}
+
+int
+gssEapSAMLAttribute(struct gss_eap_saml_attr_ctx *attributes,
+                    const char *attrib, char **value)
+{
+    const struct gss_eap_verifier_msg *verifiedAttrs;
+    uint16_t i;
+    int result = 0;
+
+    *value = NULL;
+
+    if (attributes == NULL)
+        return 0;
+
+    if (attributes->local != NULL) {
+        GSSEAP_MUTEX_LOCK(&attributes->mutex);
+        result = getSAMLAttribute(attributes->local, attrib, value);
+        GSSEAP_MUTEX_UNLOCK(&attributes->mutex);
+        return result;
+    }
+
+    verifiedAttrs = &attributes->reply;
+
+    for (i = VERIFIER_VERIFY_FIELDS; i + 1 < verifiedAttrs->count; i += 2) {
+        if (verifiedAttrs->fields[i].value != NULL &&
+            strcmp(verifiedAttrs->fields[i].value, attrib) == 0) {
+            *value = copyField(verifiedAttrs, i + 1);
+            return *value != NULL;
+        }
+    }
+
+    return 0;
+}
+
+static int
+hexDigit(unsigned char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+int
+gssEapSAMLFingerprint(struct gss_eap_saml_attr_ctx *attributes,
+                      unsigned char value[SAML_FINGERPRINT_LENGTH])
+{
+    const struct gss_eap_verifier_field *field;
+    const unsigned char *p;
+    size_t i;
+
+    if (attributes == NULL)
+        return 0;
+
+    if (attributes->local != NULL)
+        return getSAMLFingerprint(attributes->local, value);
+
+    if (attributes->reply.count < VERIFIER_VERIFY_FIELDS)
+        return 0;
+
+    field = &attributes->reply.fields[VERIFIER_VERIFY_FIELDS - 1];
+    if (field->value == NULL || field->length != 2 * SAML_FINGERPRINT_LENGTH)
+        return 0;
+
+    p = (const unsigned char *)field->value;
+
+    for (i = 0; i < SAML_FINGERPRINT_LENGTH; i++) {
+        int hi = hexDigit(p[2 * i]), lo = hexDigit(p[2 * i + 1]);
+
+        if (hi < 0 || lo < 0)
+            return 0;
+        value[i] = (unsigned char)(hi << 4 | lo);
+    }
+
+    return 1;
+}
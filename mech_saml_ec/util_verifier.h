@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * SAML request generation and response verification, either in this
+ * process or delegated to a saml_verifierd daemon over a UNIX socket.
+ */
+
+#ifndef _UTIL_VERIFIER_H_
+#define _UTIL_VERIFIER_H_ 1
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <gssapi/gssapi.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * If set, names the socket of a saml_verifierd that owns the SP
+ * runtime; otherwise SAML work is done in process.
+ */
+#define SAML_EC_VERIFIER_SOCKET         "SAML_EC_VERIFIER_SOCKET"
+
+/*
+ * The uid the daemon listening there must run as, which is checked
+ * before anything is sent to it or believed from it; the acceptor's
+ * own effective uid if unset. saml_verifierd -u is its counterpart.
+ */
+#define SAML_EC_VERIFIER_UID            "SAML_EC_VERIFIER_UID"
+
+/*
+ * Seconds a call waits for its reply before failing; a stalled daemon
+ * is then disconnected rather than holding up every acceptor thread.
+ */
+#define SAML_EC_VERIFIER_TIMEOUT        "SAML_EC_VERIFIER_TIMEOUT"
+#define VERIFIER_DEFAULT_TIMEOUT        30
+
+/*
+ * Wire format. Every message is a 12-byte header followed by count
+ * fields, all integers in network byte order:
+ *
+ *      uint32  length          bytes following the header
+ *      uint32  id              chosen by the client, echoed in the reply
+ *      uint8   op              VERIFIER_OP_xxx
+ *      uint8   arg             request flags, or reply status
+ *      uint16  count
+ *
+ * Each field is a uint32 length and that many bytes; a length of
+ * VERIFIER_FIELD_NULL stands for an absent string. A client may have
+ * any number of requests in flight on one connection; replies can
+ * arrive in any order.
+ */
+#define VERIFIER_HEADER_LENGTH          12
+#define VERIFIER_MAX_MESSAGE            (4 * 1024 * 1024)
+#define VERIFIER_FIELD_NULL             0xFFFFFFFF
+
+/*
+ * Request fields: name, channel bindings. Reply fields: SAML request;
+ * arg is 1 on success.
+ */
+#define VERIFIER_OP_SAML_REQUEST        1
+#define VERIFIER_FLAG_SIGNATURE         0x01
+#define VERIFIER_FLAG_DELEGATION        0x02
+
+/*
+ * Request fields: response token. Reply fields: the five fixed fields
+ * initiator name, session expiry (decimal seconds since the epoch),
+ * generated key, delegated assertions and fingerprint (hex), followed
+ * by pairs of attribute name and value; arg is the verification result.
+ */
+#define VERIFIER_OP_VERIFY_RESPONSE     2
+#define VERIFIER_VERIFY_FIELDS          5
+
+struct gss_eap_verifier_field {
+    const char *value;                  /* NULL if absent */
+    uint32_t length;
+};
+
+struct gss_eap_verifier_msg {
+    uint32_t id;
+    unsigned char op;
+    unsigned char arg;
+    uint16_t count;
+    struct gss_eap_verifier_field *fields;
+    unsigned char *data;                /* backs fields of a read message */
+};
+
+OM_uint32
+gssEapVerifierWriteMsg(OM_uint32 *minor,
+                       int fd,
+                       const struct gss_eap_verifier_msg *msg);
+
+OM_uint32
+gssEapVerifierReadMsg(OM_uint32 *minor,
+                      int fd,
+                      struct gss_eap_verifier_msg *msg);
+
+void
+gssEapVerifierReleaseMsg(struct gss_eap_verifier_msg *msg);
+
+#ifndef WIN32
+/* A uid in decimal; 0 if s is not one */
+int
+gssEapVerifierParseUid(const char *s, uid_t *uid);
+
+/* Fails with EACCES unless the peer of a UNIX socket runs as uid */
+OM_uint32
+gssEapVerifierCheckPeer(OM_uint32 *minor, int fd, uid_t uid);
+#endif
+
+/* Nonzero if SAML work is delegated to saml_verifierd */
+int
+gssEapVerifierEnabled(void);
+
+/*
+ * Same contracts as the in-process functions below, which they call
+ * unless SAML_EC_VERIFIER_SOCKET is set. Returned strings are freed
+ * with free().
+ */
+char *
+gssEapSAMLRequest(char *name, int name_len, int signatureRequested,
+                  int delegRequested, char *channelBindings);
+
+struct gss_eap_saml_attr_ctx;
+
+/*
+ * On success, *attributes holds what the response released; the
+ * acceptor keeps it with the initiator name (see gss_eap_saml_attr_ctx).
+ */
+int
+gssEapSAMLVerify(const char *saml, int len, char **initiatorName,
+                 time_t *sessionExpiry, char **generatedKey,
+                 char **delegatedAssertions,
+                 struct gss_eap_saml_attr_ctx **attributes);
+
+int
+gssEapSAMLAttribute(struct gss_eap_saml_attr_ctx *attributes,
+                    const char *attrib, char **value);
+
+/* A SHA-256 digest; see getSAMLFingerprint() */
+#define SAML_FINGERPRINT_LENGTH         32
+
+int
+gssEapSAMLFingerprint(struct gss_eap_saml_attr_ctx *attributes,
+                      unsigned char value[SAML_FINGERPRINT_LENGTH]);
+
+struct gss_eap_saml_attr_ctx *
+gssEapSAMLAttributesRef(struct gss_eap_saml_attr_ctx *attributes);
+
+void
+gssEapSAMLReleaseAttributes(struct gss_eap_saml_attr_ctx **pAttributes);
+
+/* SAML2XML.cpp */
+char *
+getSAMLRequest2(char *name, int name_len, int signatureRequested,
+                int deleg_requested, char *channel_bindings);
+
+struct gss_eap_saml_attrs;
+
+int
+verifySAMLResponse(const char *saml, int len, char **initiator_name,
+                   time_t *session_expiry, char **generated_key,
+                   char **delegated_assertions,
+                   struct gss_eap_saml_attrs **attributes);
+
+int
+getSAMLAttribute(struct gss_eap_saml_attrs *attributes,
+                 const char *attrib, char **value);
+
+int
+getSAMLAttributes(struct gss_eap_saml_attrs *attributes,
+                  int (*callback)(void *, const char *, const char *),
+                  void *data);
+
+int
+getSAMLFingerprint(struct gss_eap_saml_attrs *attributes,
+                   unsigned char value[SAML_FINGERPRINT_LENGTH]);
+
+unsigned long
+getSAMLGeneration(void);
+
+int
+staleSAMLServiceProvider(void);
+
+void
+releaseSAMLAttributes(struct gss_eap_saml_attrs *attributes);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _UTIL_VERIFIER_H_ */
@@ -36,6 +36,114 @@
 
 #include "gssapiP_eap.h"
 
+/*
+ * Verify a MIC token directly, rather than through the iov machinery;
+ * this makes no heap allocations once the context key schedule exists.
+ */
+OM_uint32
+gssEapVerifyMIC(OM_uint32 *minor,
+                gss_ctx_id_t ctx,
+                const gss_buffer_t message_buffer,
+                const gss_buffer_t message_token,
+                gss_qop_t *qop_state)
+{
+    OM_uint32 major = GSS_S_FAILURE;
+    krb5_error_code code;
+    krb5_context krbContext;
+    unsigned char flags;
+    unsigned char *ptr;
+    size_t cksumLength;
+    uint64_t seqnum;
+    int keyUsage;
+    int valid = FALSE;
+#ifdef HAVE_HEIMDAL_VERSION
+    krb5_crypto krbCrypto;
+#else
+    krb5_key krbKey;
+#endif
+
+    if (qop_state != NULL)
+        *qop_state = GSS_C_QOP_DEFAULT;
+
+    if (ctx->encryptionType == ENCTYPE_NULL) {
+        *minor = GSSEAP_KEY_UNAVAILABLE;
+        return GSS_S_UNAVAILABLE;
+    }
+
+    GSSEAP_KRB_INIT(&krbContext);
+
+    ptr = (unsigned char *)message_token->value;
+
+    if (message_token->length < 16) {
+        code = GSSEAP_TOK_TRUNC;
+        major = GSS_S_DEFECTIVE_TOKEN;
+        goto cleanup;
+    }
+
+    flags = rfc4121Flags(ctx, TRUE);
+
+    if ((ptr[2] & flags) != flags) {
+        code = GSSEAP_BAD_DIRECTION;
+        major = GSS_S_BAD_SIG;
+        goto cleanup;
+    }
+
+    if (load_uint16_be(ptr) != TOK_TYPE_MIC || ptr[3] != 0xFF) {
+        code = GSSEAP_BAD_WRAP_TOKEN;
+        major = GSS_S_DEFECTIVE_TOKEN;
+        goto cleanup;
+    }
+
+    seqnum = load_uint64_be(ptr + 8);
+
+#ifdef HAVE_HEIMDAL_VERSION
+    code = krbContextCrypto(krbContext, ctx, &krbCrypto);
+#else
+    code = krbContextCrypto(krbContext, ctx, &krbKey);
+#endif
+    if (code != 0)
+        goto cleanup;
+
+    code = krbCryptoLength(krbContext, KRB_CRYPTO_CONTEXT(ctx),
+                           KRB5_CRYPTO_TYPE_CHECKSUM, &cksumLength);
+    if (code != 0)
+        goto cleanup;
+
+    if (message_token->length != 16 + cksumLength) {
+        code = KRB5_BAD_MSIZE;
+        major = GSS_S_BAD_SIG;
+        goto cleanup;
+    }
+
+    keyUsage = !CTX_IS_INITIATOR(ctx)
+               ? KEY_USAGE_INITIATOR_SIGN
+               : KEY_USAGE_ACCEPTOR_SIGN;
+
+#ifdef HAVE_HEIMDAL_VERSION
+    code = gssEapChecksumMIC(krbContext, ctx->checksumType, krbCrypto,
+                             keyUsage, message_buffer, ptr, cksumLength,
+                             TRUE, &valid);
+#else
+    code = gssEapChecksumMIC(krbContext, ctx->checksumType, krbKey,
+                             keyUsage, message_buffer, ptr, cksumLength,
+                             TRUE, &valid);
+#endif
+    if (code != 0 || valid == FALSE) {
+        major = GSS_S_BAD_SIG;
+        goto cleanup;
+    }
+
+    code = sequenceCheck(minor, &ctx->seqState, seqnum);
+
+    code = 0;
+    major = GSS_S_COMPLETE;
+
+cleanup:
+    *minor = code;
+
+    return major;
+}
+
 OM_uint32 GSSAPI_CALLCONV
 gss_verify_mic(OM_uint32 *minor,
                gss_ctx_id_t ctx,
@@ -44,33 +152,25 @@ gss_verify_mic(OM_uint32 *minor,
                gss_qop_t *qop_state)
 {
     OM_uint32 major;
-    gss_iov_buffer_desc iov[3];
-    int conf_state;
 
     if (message_token->length < 16) {
         *minor = GSSEAP_TOK_TRUNC;
         return GSS_S_BAD_SIG;
     }
 
-    if (MECH_SAML_EC_DEBUG) {
-        fprintf(stdout, "MIC TOKEN TO VERIFY IS: \n");
-        printBuffer(stdout, message_token);
-    }
+    logBuffer("MIC TOKEN TO VERIFY IS", message_token);
 
     *minor = 0;
 
-    iov[0].type = GSS_IOV_BUFFER_TYPE_DATA;
-    iov[0].buffer = *message_buffer;
-
-    iov[1].type = GSS_IOV_BUFFER_TYPE_HEADER;
-    iov[1].buffer = *message_token;
+    GSSEAP_ALLOC_SCOPE_ENTER(GSSEAP_ALLOC_SCOPE_UNWRAP);
 
     GSSEAP_MUTEX_LOCK(&ctx->mutex);
 
-    major = gssEapUnwrapOrVerifyMIC(minor, ctx, &conf_state, qop_state,
-                                    iov, 2, TOK_TYPE_MIC);
+    major = gssEapVerifyMIC(minor, ctx, message_buffer, message_token,
+                            qop_state);
 
     GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
+    GSSEAP_ALLOC_SCOPE_LEAVE(!GSS_ERROR(major));
 
     return major;
 }
@@ -54,6 +54,8 @@ gss_wrap(OM_uint32 *minor,
 
     *minor = 0;
 
+    GSSEAP_ALLOC_SCOPE_ENTER(GSSEAP_ALLOC_SCOPE_WRAP);
+
     GSSEAP_MUTEX_LOCK(&ctx->mutex);
 
     if (!CTX_IS_ESTABLISHED(ctx)) {
@@ -62,14 +64,22 @@ gss_wrap(OM_uint32 *minor,
         goto cleanup;
     }
 
-    major = gssEapWrap(minor, ctx, conf_req_flag, qop_req,
-                       input_message_buffer,
-                       conf_state, output_message_buffer);
+    if (ctx->wrapChunkSize != 0 &&
+        input_message_buffer->length > ctx->wrapChunkSize) {
+        major = gssEapWrapChunked(minor, ctx, conf_req_flag, qop_req,
+                                  input_message_buffer,
+                                  conf_state, output_message_buffer);
+    } else {
+        major = gssEapWrap(minor, ctx, conf_req_flag, qop_req,
+                           input_message_buffer,
+                           conf_state, output_message_buffer);
+    }
     if (GSS_ERROR(major))
         goto cleanup;
 
 cleanup:
     GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
+    GSSEAP_ALLOC_SCOPE_LEAVE(!GSS_ERROR(major));
 
     return major;
 }
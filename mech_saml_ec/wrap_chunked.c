@@ -0,0 +1,655 @@
+/*
+ * Copyright (c) 2011, JANET(UK)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of JANET(UK) nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Message protection services: wrap large messages as a sequence of
+ * independently protected RFC 4121 wrap tokens.
+ *
+ *   TOK_ID (0x0505) | 0x0000 | chunk count | { length | wrap token }...
+ *
+ * Each chunk consumes one sequence number, so the chunks of a message
+ * can be protected and unprotected in parallel from a range reserved
+ * up front. This is only used when enabled on the context with
+ * GSS_EAP_CTX_SET_WRAP_CHUNKING.
+ */
+
+#include "gssapiP_eap.h"
+
+#define WRAP_CHUNKED_MAX_THREADS            16
+
+/* Messages shorter than this are not worth handing to the pool */
+#define WRAP_CHUNKED_INLINE_LENGTH          (256 * 1024)
+
+struct gss_eap_wrap_chunk {
+    gss_iov_buffer_desc iov[4];
+    const void *source;         /* plaintext to copy in before wrapping */
+    uint64_t seqnum;
+    int conf_state;
+    OM_uint32 major;
+    OM_uint32 minor;
+};
+
+struct gss_eap_chunk_job {
+    struct gss_eap_chunk_job *nextJob;
+    gss_ctx_id_t ctx;
+    int unwrap;
+    int conf_req_flag;
+    struct gss_eap_wrap_chunk *chunks;
+    size_t count;
+    size_t length;              /* total message length */
+    size_t next;                /* next chunk to hand out */
+    size_t done;                /* chunks processed */
+    size_t helpers;             /* pool threads working on this job */
+    size_t maxHelpers;
+};
+
+static void
+processChunk(struct gss_eap_chunk_job *job,
+             struct gss_eap_wrap_chunk *chunk)
+{
+    if (job->unwrap) {
+        /* STREAM | DATA */
+        chunk->major = gssEapUnwrapOrVerifyMICWithSeq(&chunk->minor,
+                                                      job->ctx,
+                                                      &chunk->conf_state,
+                                                      NULL,
+                                                      chunk->iov, 2,
+                                                      TOK_TYPE_WRAP,
+                                                      &chunk->seqnum);
+    } else {
+        /* HEADER | DATA | PADDING | TRAILER */
+        if (chunk->source != NULL)
+            memcpy(chunk->iov[1].buffer.value, chunk->source,
+                   chunk->iov[1].buffer.length);
+
+        chunk->major = gssEapWrapOrGetMICWithSeq(&chunk->minor,
+                                                 job->ctx,
+                                                 chunk->seqnum,
+                                                 job->conf_req_flag,
+                                                 &chunk->conf_state,
+                                                 chunk->iov, 4,
+                                                 TOK_TYPE_WRAP);
+    }
+}
+
+#ifndef WIN32
+/*
+ * Persistent worker pool shared by all contexts. Threads are started on
+ * demand, up to WRAP_CHUNKED_MAX_THREADS - 1 (the caller is always a
+ * worker for its own job), and keep their thread-local krb5 context for
+ * the life of the process. Like the log writer, the pool does not
+ * survive fork(); the child starts a new one on first use.
+ */
+static struct {
+    GSSEAP_MUTEX mutex;
+    pthread_cond_t work;                /* a job was queued */
+    pthread_cond_t done;                /* a job's last chunk completed */
+    struct gss_eap_chunk_job *jobs;
+    size_t nthreads;
+    int initialized;
+} chunkPool;
+
+static GSSEAP_THREAD_ONCE chunkPoolOnce = GSSEAP_ONCE_INITIALIZER;
+
+/* Called with chunkPool.mutex held */
+static struct gss_eap_chunk_job *
+findChunkJob(void)
+{
+    struct gss_eap_chunk_job *job;
+
+    for (job = chunkPool.jobs; job != NULL; job = job->nextJob) {
+        if (job->next < job->count && job->helpers < job->maxHelpers)
+            return job;
+    }
+
+    return NULL;
+}
+
+/*
+ * Process chunks of job until none are left to hand out. Called with
+ * chunkPool.mutex held, which is dropped around each chunk.
+ */
+static void
+drainChunkJob(struct gss_eap_chunk_job *job)
+{
+    while (job->next < job->count) {
+        struct gss_eap_wrap_chunk *chunk = &job->chunks[job->next++];
+
+        GSSEAP_MUTEX_UNLOCK(&chunkPool.mutex);
+        processChunk(job, chunk);
+        GSSEAP_MUTEX_LOCK(&chunkPool.mutex);
+
+        job->done++;
+    }
+}
+
+static void *
+chunkWorker(void *arg GSSEAP_UNUSED)
+{
+    struct gss_eap_chunk_job *job;
+
+    GSSEAP_MUTEX_LOCK(&chunkPool.mutex);
+
+    for (;;) {
+        while ((job = findChunkJob()) == NULL)
+            pthread_cond_wait(&chunkPool.work, &chunkPool.mutex);
+
+        job->helpers++;
+        drainChunkJob(job);
+        job->helpers--;
+
+        if (job->done == job->count && job->helpers == 0)
+            pthread_cond_broadcast(&chunkPool.done);
+    }
+
+    return NULL;
+}
+
+static void
+chunkPoolAtForkChild(void)
+{
+    GSSEAP_MUTEX_INIT(&chunkPool.mutex);
+    pthread_cond_init(&chunkPool.work, NULL);
+    pthread_cond_init(&chunkPool.done, NULL);
+    chunkPool.jobs = NULL;
+    chunkPool.nthreads = 0;
+}
+
+static GSSEAP_ONCE_CALLBACK(initChunkPool)
+{
+    if (GSSEAP_MUTEX_INIT(&chunkPool.mutex) == 0 &&
+        pthread_cond_init(&chunkPool.work, NULL) == 0 &&
+        pthread_cond_init(&chunkPool.done, NULL) == 0) {
+        pthread_atfork(NULL, NULL, chunkPoolAtForkChild);
+        chunkPool.initialized = 1;
+    }
+
+    GSSEAP_ONCE_LEAVE;
+}
+
+/* Called with chunkPool.mutex held */
+static void
+growChunkPool(size_t nthreads)
+{
+    while (chunkPool.nthreads < nthreads) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, NULL, chunkWorker, NULL) != 0)
+            break; /* carry on with the workers we have */
+        pthread_detach(thread);
+        chunkPool.nthreads++;
+    }
+}
+#endif /* !WIN32 */
+
+/*
+ * Process all chunks, using the calling thread and up to the context's
+ * configured number of pool threads. Short messages are processed
+ * inline. The context is only read by the workers; the caller holds
+ * its mutex throughout.
+ */
+static OM_uint32
+runChunkJob(OM_uint32 *minor, struct gss_eap_chunk_job *job)
+{
+    size_t i;
+#ifndef WIN32
+    size_t maxThreads;
+
+    maxThreads = job->ctx->wrapChunkThreads;
+    if (maxThreads == 0) {
+        long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+        maxThreads = (ncpu > 0) ? (size_t)ncpu : 1;
+    }
+    if (maxThreads > WRAP_CHUNKED_MAX_THREADS)
+        maxThreads = WRAP_CHUNKED_MAX_THREADS;
+    if (maxThreads > job->count)
+        maxThreads = job->count;
+
+    if (job->length < WRAP_CHUNKED_INLINE_LENGTH)
+        maxThreads = 1;
+    if (maxThreads > 1)
+        GSSEAP_ONCE(&chunkPoolOnce, initChunkPool);
+
+    if (maxThreads > 1 && chunkPool.initialized) {
+        struct gss_eap_chunk_job **pJob;
+
+        /* The calling thread is also a worker */
+        job->maxHelpers = maxThreads - 1;
+
+        GSSEAP_MUTEX_LOCK(&chunkPool.mutex);
+
+        growChunkPool(job->maxHelpers);
+
+        job->nextJob = chunkPool.jobs;
+        chunkPool.jobs = job;
+        if (chunkPool.nthreads != 0)
+            pthread_cond_broadcast(&chunkPool.work);
+
+        drainChunkJob(job);
+
+        while (job->done < job->count || job->helpers != 0)
+            pthread_cond_wait(&chunkPool.done, &chunkPool.mutex);
+
+        for (pJob = &chunkPool.jobs; *pJob != job; pJob = &(*pJob)->nextJob)
+            ;
+        *pJob = job->nextJob;
+
+        GSSEAP_MUTEX_UNLOCK(&chunkPool.mutex);
+    } else
+#endif /* !WIN32 */
+    {
+        for (i = 0; i < job->count; i++)
+            processChunk(job, &job->chunks[i]);
+    }
+
+    for (i = 0; i < job->count; i++) {
+        if (GSS_ERROR(job->chunks[i].major)) {
+            *minor = job->chunks[i].minor;
+            return job->chunks[i].major;
+        }
+    }
+
+    *minor = 0;
+    return GSS_S_COMPLETE;
+}
+
+static krb5_error_code
+chunkTokenLength(krb5_context krbContext,
+#ifdef HAVE_HEIMDAL_VERSION
+                 krb5_crypto krbCrypto,
+#else
+                 krb5_keyblock *key,
+#endif
+                 gss_ctx_id_t ctx,
+                 int conf_req_flag,
+                 size_t dataLen,
+                 size_t *headerLen,
+                 size_t *trailerLen)
+{
+    krb5_error_code code;
+#ifdef HAVE_HEIMDAL_VERSION
+    krb5_crypto crypto = krbCrypto;
+#else
+    krb5_keyblock *crypto = key;
+#endif
+
+    if (conf_req_flag) {
+        size_t krbHeaderLen, krbTrailerLen, krbPadLen, ec;
+
+        code = krbCryptoLength(krbContext, crypto,
+                               KRB5_CRYPTO_TYPE_HEADER, &krbHeaderLen);
+        if (code != 0)
+            return code;
+
+        code = krbPaddingLength(krbContext, crypto,
+                                dataLen + 16 /* E(Header) */, &krbPadLen);
+        if (code != 0)
+            return code;
+
+        if (krbPadLen == 0 && (ctx->gssFlags & GSS_C_DCE_STYLE)) {
+            /* Windows rejects AEAD tokens with non-zero EC */
+            code = krbBlockSize(krbContext, crypto, &ec);
+            if (code != 0)
+                return code;
+        } else
+            ec = krbPadLen;
+
+        code = krbCryptoLength(krbContext, crypto,
+                               KRB5_CRYPTO_TYPE_TRAILER, &krbTrailerLen);
+        if (code != 0)
+            return code;
+
+        *headerLen = 16 /* Header */ + krbHeaderLen;
+        *trailerLen = ec + 16 /* E(Header) */ + krbTrailerLen;
+    } else {
+        code = krbCryptoLength(krbContext, crypto,
+                               KRB5_CRYPTO_TYPE_CHECKSUM, trailerLen);
+        if (code != 0)
+            return code;
+
+        *headerLen = 16;
+    }
+
+    return 0;
+}
+
+OM_uint32
+gssEapWrapChunked(OM_uint32 *minor,
+                  gss_ctx_id_t ctx,
+                  int conf_req_flag,
+                  gss_qop_t qop_req,
+                  gss_buffer_t input_message_buffer,
+                  int *conf_state,
+                  gss_buffer_t output_message_buffer)
+{
+    OM_uint32 major = GSS_S_FAILURE, tmpMinor;
+    OM_uint32 code = 0;
+    krb5_context krbContext;
+    struct gss_eap_chunk_job job;
+    size_t chunkSize = ctx->wrapChunkSize;
+    size_t i, offset, length;
+    unsigned char *p;
+#ifdef HAVE_HEIMDAL_VERSION
+    krb5_crypto krbCrypto = NULL;
+#endif
+
+    output_message_buffer->length = 0;
+    output_message_buffer->value = NULL;
+
+    memset(&job, 0, sizeof(job));
+
+    if (qop_req != GSS_C_QOP_DEFAULT) {
+        *minor = GSSEAP_UNKNOWN_QOP;
+        return GSS_S_UNAVAILABLE;
+    }
+
+    if (ctx->encryptionType == ENCTYPE_NULL) {
+        *minor = GSSEAP_KEY_UNAVAILABLE;
+        return GSS_S_UNAVAILABLE;
+    }
+
+    GSSEAP_KRB_INIT(&krbContext);
+
+    GSSEAP_ASSERT(chunkSize != 0);
+
+    job.ctx = ctx;
+    job.conf_req_flag = conf_req_flag;
+    job.length = input_message_buffer->length;
+    job.count = (input_message_buffer->length + chunkSize - 1) / chunkSize;
+    if (job.count == 0 || job.count > 0xFFFFFFFF) {
+        major = GSS_S_FAILURE;
+        code = GSSEAP_WRONG_SIZE;
+        goto cleanup;
+    }
+
+    job.chunks = (struct gss_eap_wrap_chunk *)
+        GSSEAP_CALLOC(job.count, sizeof(*job.chunks));
+    if (job.chunks == NULL) {
+        major = GSS_S_FAILURE;
+        code = ENOMEM;
+        goto cleanup;
+    }
+
+#ifdef HAVE_HEIMDAL_VERSION
+    code = krb5_crypto_init(krbContext, &ctx->rfc3961Key, ETYPE_NULL, &krbCrypto);
+    if (code != 0) {
+        major = GSS_S_FAILURE;
+        goto cleanup;
+    }
+#endif
+
+    /* Size each chunk: HEADER | DATA | PADDING | TRAILER */
+    length = WRAP_CHUNKED_HEADER_LENGTH;
+
+    for (i = 0, offset = 0; i < job.count; i++) {
+        struct gss_eap_wrap_chunk *chunk = &job.chunks[i];
+        size_t dataLen = MIN(chunkSize, input_message_buffer->length - offset);
+
+        code = chunkTokenLength(krbContext, KRB_CRYPTO_CONTEXT(ctx), ctx,
+                                conf_req_flag, dataLen,
+                                &chunk->iov[0].buffer.length,
+                                &chunk->iov[3].buffer.length);
+        if (code != 0) {
+            major = GSS_S_FAILURE;
+            goto cleanup;
+        }
+
+        chunk->iov[0].type = GSS_IOV_BUFFER_TYPE_HEADER;
+        chunk->iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+        chunk->iov[1].buffer.length = dataLen;
+        chunk->iov[2].type = GSS_IOV_BUFFER_TYPE_PADDING;
+        chunk->iov[2].buffer.length = 0;
+        chunk->iov[3].type = GSS_IOV_BUFFER_TYPE_TRAILER;
+
+        chunk->source = (unsigned char *)input_message_buffer->value + offset;
+        chunk->seqnum = ctx->sendSeq + i;
+
+        length += 4 + chunk->iov[0].buffer.length + dataLen +
+                  chunk->iov[3].buffer.length;
+        offset += dataLen;
+    }
+
+    output_message_buffer->value = GSSEAP_MALLOC(length);
+    if (output_message_buffer->value == NULL) {
+        major = GSS_S_FAILURE;
+        code = ENOMEM;
+        goto cleanup;
+    }
+    output_message_buffer->length = length;
+
+    p = (unsigned char *)output_message_buffer->value;
+
+    store_uint16_be(TOK_TYPE_WRAP_CHUNKED, p);
+    store_uint16_be(0, p + 2);
+    store_uint32_be(job.count, p + 4);
+    p += WRAP_CHUNKED_HEADER_LENGTH;
+
+    for (i = 0; i < job.count; i++) {
+        struct gss_eap_wrap_chunk *chunk = &job.chunks[i];
+        int j;
+
+        store_uint32_be(chunk->iov[0].buffer.length +
+                        chunk->iov[1].buffer.length +
+                        chunk->iov[3].buffer.length, p);
+        p += 4;
+
+        for (j = 0; j < 4; j++) {
+            chunk->iov[j].buffer.value = p;
+            p += chunk->iov[j].buffer.length;
+        }
+    }
+
+    major = runChunkJob(&code, &job);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    ctx->sendSeq += job.count;
+
+    if (conf_state != NULL)
+        *conf_state = job.chunks[0].conf_state;
+
+    major = GSS_S_COMPLETE;
+    code = 0;
+
+cleanup:
+    if (GSS_ERROR(major))
+        gss_release_buffer(&tmpMinor, output_message_buffer);
+    if (job.chunks != NULL)
+        GSSEAP_FREE(job.chunks);
+#ifdef HAVE_HEIMDAL_VERSION
+    if (krbCrypto != NULL)
+        krb5_crypto_destroy(krbContext, krbCrypto);
+#endif
+
+    *minor = code;
+
+    return major;
+}
+
+OM_uint32
+gssEapUnwrapChunked(OM_uint32 *minor,
+                    gss_ctx_id_t ctx,
+                    gss_buffer_t input_message_buffer,
+                    gss_buffer_t output_message_buffer,
+                    int *conf_state,
+                    gss_qop_t *qop_state)
+{
+    OM_uint32 major = GSS_S_FAILURE, seqMajor = GSS_S_COMPLETE, tmpMinor;
+    OM_uint32 code = 0;
+    struct gss_eap_chunk_job job;
+    gss_buffer_desc work = GSS_C_EMPTY_BUFFER;
+    size_t i, remain, length;
+    unsigned char *p;
+    int conf_flag = TRUE;
+
+    output_message_buffer->length = 0;
+    output_message_buffer->value = NULL;
+
+    memset(&job, 0, sizeof(job));
+
+    if (qop_state != NULL)
+        *qop_state = GSS_C_QOP_DEFAULT;
+
+    p = (unsigned char *)input_message_buffer->value;
+    remain = input_message_buffer->length;
+
+    if (remain < WRAP_CHUNKED_HEADER_LENGTH ||
+        load_uint16_be(p) != TOK_TYPE_WRAP_CHUNKED ||
+        load_uint16_be(p + 2) != 0) {
+        major = GSS_S_DEFECTIVE_TOKEN;
+        code = GSSEAP_BAD_WRAP_TOKEN;
+        goto cleanup;
+    }
+
+    /*
+     * Chunks are rotated and decrypted in place, so work on a copy of
+     * the token rather than the caller's buffer. The plaintext is then
+     * compacted to the front of the copy, which becomes the output.
+     */
+    major = duplicateBuffer(&code, input_message_buffer, &work);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    p = (unsigned char *)work.value;
+
+    job.ctx = ctx;
+    job.unwrap = TRUE;
+    job.length = remain;
+    job.count = load_uint32_be(p + 4);
+
+    p += WRAP_CHUNKED_HEADER_LENGTH;
+    remain -= WRAP_CHUNKED_HEADER_LENGTH;
+
+    if (job.count == 0 || job.count > remain / 4) {
+        major = GSS_S_DEFECTIVE_TOKEN;
+        code = GSSEAP_BAD_WRAP_TOKEN;
+        goto cleanup;
+    }
+
+    job.chunks = (struct gss_eap_wrap_chunk *)
+        GSSEAP_CALLOC(job.count, sizeof(*job.chunks));
+    if (job.chunks == NULL) {
+        major = GSS_S_FAILURE;
+        code = ENOMEM;
+        goto cleanup;
+    }
+
+    /* Split into STREAM | DATA per chunk */
+    for (i = 0; i < job.count; i++) {
+        struct gss_eap_wrap_chunk *chunk = &job.chunks[i];
+        size_t tokenLen;
+
+        if (remain < 4) {
+            major = GSS_S_DEFECTIVE_TOKEN;
+            code = GSSEAP_TOK_TRUNC;
+            goto cleanup;
+        }
+
+        tokenLen = load_uint32_be(p);
+        p += 4;
+        remain -= 4;
+
+        if (tokenLen > remain) {
+            major = GSS_S_DEFECTIVE_TOKEN;
+            code = GSSEAP_TOK_TRUNC;
+            goto cleanup;
+        }
+
+        chunk->iov[0].type = GSS_IOV_BUFFER_TYPE_STREAM;
+        chunk->iov[0].buffer.value = p;
+        chunk->iov[0].buffer.length = tokenLen;
+
+        chunk->iov[1].type = GSS_IOV_BUFFER_TYPE_DATA;
+        chunk->iov[1].buffer.value = NULL;
+        chunk->iov[1].buffer.length = 0;
+
+        p += tokenLen;
+        remain -= tokenLen;
+    }
+
+    if (remain != 0) {
+        major = GSS_S_DEFECTIVE_TOKEN;
+        code = GSSEAP_BAD_WRAP_TOKEN;
+        goto cleanup;
+    }
+
+    major = runChunkJob(&code, &job);
+    if (GSS_ERROR(major))
+        goto cleanup;
+
+    /*
+     * Sequence checking must happen in order, once all chunks verified.
+     * The supplementary status of each check is merged into the result.
+     */
+    for (i = 0, length = 0, p = (unsigned char *)work.value;
+         i < job.count;
+         i++) {
+        struct gss_eap_wrap_chunk *chunk = &job.chunks[i];
+
+        seqMajor |= sequenceCheck(&tmpMinor, &ctx->seqState, chunk->seqnum);
+        if (GSS_ERROR(seqMajor)) {
+            major = seqMajor;
+            code = tmpMinor;
+            goto cleanup;
+        }
+
+        if (!chunk->conf_state)
+            conf_flag = FALSE;
+
+        /* Each chunk's plaintext lies beyond the compacted output so far */
+        memmove(p, chunk->iov[1].buffer.value, chunk->iov[1].buffer.length);
+        p += chunk->iov[1].buffer.length;
+        length += chunk->iov[1].buffer.length;
+    }
+
+    output_message_buffer->value = work.value;
+    output_message_buffer->length = length;
+    work.value = NULL;
+
+    if (conf_state != NULL)
+        *conf_state = conf_flag;
+
+    major = GSS_S_COMPLETE | seqMajor;
+    code = 0;
+
+cleanup:
+    if (GSS_ERROR(major))
+        gss_release_buffer(&tmpMinor, output_message_buffer);
+    gss_release_buffer(&tmpMinor, &work);
+    if (job.chunks != NULL)
+        GSSEAP_FREE(job.chunks);
+
+    *minor = code;
+
+    return major;
+}
@@ -80,14 +80,19 @@ rfc4121Flags(gss_ctx_id_t ctx, int receiving)
     return flags;
 }
 
+/*
+ * Does not advance the send sequence number; this lets chunked wrap
+ * protect several tokens concurrently from a reserved range.
+ */
 OM_uint32
-gssEapWrapOrGetMIC(OM_uint32 *minor,
-                   gss_ctx_id_t ctx,
-                   int conf_req_flag,
-                   int *conf_state,
-                   gss_iov_buffer_desc *iov,
-                   int iov_count,
-                   enum gss_eap_token_type toktype)
+gssEapWrapOrGetMICWithSeq(OM_uint32 *minor,
+                          gss_ctx_id_t ctx,
+                          uint64_t seqnum,
+                          int conf_req_flag,
+                          int *conf_state,
+                          gss_iov_buffer_desc *iov,
+                          int iov_count,
+                          enum gss_eap_token_type toktype)
 {
     krb5_error_code code = 0;
     gss_iov_buffer_t header;
@@ -213,7 +218,7 @@ gssEapWrapOrGetMIC(OM_uint32 *minor,
         store_uint16_be(ec, outbuf + 4);
         /* RRC */
         store_uint16_be(0, outbuf + 6);
-        store_uint64_be(ctx->sendSeq, outbuf + 8);
+        store_uint64_be(seqnum, outbuf + 8);
 
         /*
          * EC | copy of header to be encrypted, located in
@@ -236,8 +241,6 @@ gssEapWrapOrGetMIC(OM_uint32 *minor,
 
         /* RRC */
         store_uint16_be(rrc, outbuf + 6);
-
-        ctx->sendSeq++;
     } else if (toktype == TOK_TYPE_WRAP && !conf_req_flag) {
     wrap_with_checksum:
 
@@ -293,7 +296,7 @@ gssEapWrapOrGetMIC(OM_uint32 *minor,
             store_uint16_be(0xFFFF, outbuf + 4);
             store_uint16_be(0xFFFF, outbuf + 6);
         }
-        store_uint64_be(ctx->sendSeq, outbuf + 8);
+        store_uint64_be(seqnum, outbuf + 8);
 
         code = gssEapSign(krbContext, ctx->checksumType, rrc,
                           KRB_CRYPTO_CONTEXT(ctx), keyUsage,
@@ -301,8 +304,6 @@ gssEapWrapOrGetMIC(OM_uint32 *minor,
         if (code != 0)
             goto cleanup;
 
-        ctx->sendSeq++;
-
         if (toktype == TOK_TYPE_WRAP) {
             /* Fix up EC field */
             store_uint16_be(gssTrailerLen, outbuf + 4);
@@ -336,6 +337,26 @@ cleanup:
     return (code == 0) ? GSS_S_COMPLETE : GSS_S_FAILURE;
 }
 
+OM_uint32
+gssEapWrapOrGetMIC(OM_uint32 *minor,
+                   gss_ctx_id_t ctx,
+                   int conf_req_flag,
+                   int *conf_state,
+                   gss_iov_buffer_desc *iov,
+                   int iov_count,
+                   enum gss_eap_token_type toktype)
+{
+    OM_uint32 major;
+
+    major = gssEapWrapOrGetMICWithSeq(minor, ctx, ctx->sendSeq,
+                                      conf_req_flag, conf_state,
+                                      iov, iov_count, toktype);
+    if (major == GSS_S_COMPLETE)
+        ctx->sendSeq++;
+
+    return major;
+}
+
 OM_uint32 GSSAPI_CALLCONV
 gss_wrap_iov(OM_uint32 *minor,
              gss_ctx_id_t ctx,
@@ -359,6 +380,8 @@ gss_wrap_iov(OM_uint32 *minor,
 
     *minor = 0;
 
+    GSSEAP_ALLOC_SCOPE_ENTER(GSSEAP_ALLOC_SCOPE_WRAP);
+
     GSSEAP_MUTEX_LOCK(&ctx->mutex);
 
     if (!CTX_IS_ESTABLISHED(ctx)) {
@@ -374,6 +397,7 @@ gss_wrap_iov(OM_uint32 *minor,
 
 cleanup:
     GSSEAP_MUTEX_UNLOCK(&ctx->mutex);
+    GSSEAP_ALLOC_SCOPE_LEAVE(!GSS_ERROR(major));
 
     return major;
 }
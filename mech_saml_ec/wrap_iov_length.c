@@ -76,6 +76,11 @@ gssEapWrapIovLength(OM_uint32 *minor,
     return GSS_S_UNAVAILABLE;
 }
 
+/*
+ * Sizes a single RFC 4121 token, which is all gss_wrap_iov() produces:
+ * chunked wrap (GSS_EAP_CTX_SET_WRAP_CHUNKING) only applies to
+ * gss_wrap(), and gss_wrap_size_limit() accounts for its framing.
+ */
 OM_uint32 GSSAPI_CALLCONV
 gss_wrap_iov_length(OM_uint32 *minor,
                     gss_ctx_id_t ctx,
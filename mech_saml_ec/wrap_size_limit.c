@@ -36,6 +36,40 @@
 
 #include "gssapiP_eap.h"
 
+#ifdef MECH_EAP
+/*
+ * The most gss_wrap() can take with chunked wrap enabled and still
+ * produce at most outputSize bytes, given the overhead of one wrap
+ * token. Longer messages than the chunk size are wrapped as
+ *
+ *   TOK_ID | 0x0000 | chunk count | { length | wrap token }...
+ *
+ * (see wrap_chunked.c), so each chunk costs 4 + overhead bytes on top
+ * of its data, and the message WRAP_CHUNKED_HEADER_LENGTH once.
+ */
+static OM_uint32
+chunkedSizeLimit(size_t chunkSize, size_t overhead, size_t outputSize)
+{
+    size_t perChunk = 4 + overhead + chunkSize;
+    size_t avail, count, remain, limit;
+
+    /* Anything up to the chunk size is a single token */
+    if (outputSize <= overhead + chunkSize)
+        return outputSize > overhead ? outputSize - overhead : 0;
+
+    avail = outputSize - WRAP_CHUNKED_HEADER_LENGTH;
+    count = avail / perChunk;
+    remain = avail % perChunk;
+
+    limit = count * chunkSize;
+    if (remain > 4 + overhead)
+        limit += remain - 4 - overhead;
+
+    /* A single token of the chunk size still fits */
+    return limit > chunkSize ? limit : chunkSize;
+}
+#endif
+
 OM_uint32 GSSAPI_CALLCONV
 gss_wrap_size_limit(OM_uint32 *minor,
                     gss_ctx_id_t ctx,
@@ -86,10 +120,13 @@ gss_wrap_size_limit(OM_uint32 *minor,
 
     overhead = iov[0].buffer.length + iov[3].buffer.length;
 
-    if (iov[2].buffer.length == 0 && overhead < req_output_size)
-        *max_input_size = req_output_size - overhead;
-    else
+    if (iov[2].buffer.length != 0 || overhead >= req_output_size)
         *max_input_size = 0;
+    else if (ctx->wrapChunkSize != 0)
+        *max_input_size = chunkedSizeLimit(ctx->wrapChunkSize, overhead,
+                                           req_output_size);
+    else
+        *max_input_size = req_output_size - overhead;
 
 cleanup:
     GSSEAP_MUTEX_UNLOCK(&ctx->mutex);